@@ -85,6 +85,14 @@ typedef stack_t km_stack_t;
 
 typedef unsigned long int pthread_tid_t;
 
+// Guest address range mapped with the same protection, see km_gva_range_to_kma()
+typedef struct km_gva_span {
+   km_gva_t start;
+   km_gva_t end;
+   int prot;
+   uint64_t gen;   // machine.mmaps.gen the span was valid at
+} km_gva_span_t;
+
 /*
  * When a thread hits a breakpoint, or a single step operation completes, or a signal is generated,
  * a gdb event is queued by the thread and then the gdb server is woken.  The gdb server then
@@ -143,6 +151,7 @@ typedef struct km_vcpu {
    int kvm_vcpu_fd;                    // this VCPU file descriptor
    kvm_run_t* cpu_run;                 // run control region
    pthread_t vcpu_thread;              // km pthread
+   pid_t vcpu_tid;                     // host tid of vcpu_thread, 0 until the thread runs
    pthread_mutex_t thr_mtx;            // protects the three fields below
    pthread_cond_t thr_cv;              // used by vcpu_pthread to block while vcpu isn't in use
    uint16_t hypercall;                 // hypercall #
@@ -153,6 +162,8 @@ typedef struct km_vcpu {
    uint8_t in_sigsuspend;              // if true thread is running in the sigsuspend() hypercall
    uint8_t hypercall_returns_signal;   // if true a hypercall is returning a signal directly to the
                                        // caller so there is no need to setup the signal handler
+   uint8_t kick_pending;               // KM_SIGVCPUSTOP sent for a signal, not seen by the vcpu yet
+   uint8_t thr_retire;                 // parked thread should exit, see km_vcpu_thread_retire()
    //
    // When vcpu is used (i.e. not PARKED_IDLE) the field is used for stack_top.
    // PARKED_IDLE vcpus are queued in SLIST using next_idle as stack_top isn't needed
@@ -164,6 +175,13 @@ typedef struct km_vcpu {
    km_stack_t sigaltstack;             //
    km_gva_t mapself_base;              // delayed unmap address
    size_t mapself_size;                // and size
+   int sched_policy;                   // scheduling a new payload thread inherits from its
+   int sched_priority;                 // creator, see km_sched_vcpu_inherit()
+   int sched_nice;                     //
+   int sched_ioprio;                   //
+   uint64_t sched_gen;                 // km_sched_gen the above were last what vcpu_thread has at
+   struct iovec* iov;                  // UIO_MAXIOV host iovecs, see km_vcpu_iov()
+   km_gva_span_t last_span;            // last mmap span hit by km_gva_range_to_kma()
                                        //
    kvm_regs_t regs;                    // Cached register values.
    kvm_sregs_t sregs;                  // Cached segment register values.
@@ -212,6 +230,7 @@ typedef struct km_machine_init_params {
                                         // Note: if too much of it is accessed, we expect Linux
                                         // OOM killer to kick in
    char* vdev_name;   // Device name. Virtualization type is defined by ioctl after this file is open
+   int vcpu_pool;     // Number of parked vcpus with threads kept ready for clone(), 0 for none
 } km_machine_init_params_t;
 extern km_machine_init_params_t km_machine_init_params;
 
@@ -224,7 +243,10 @@ void kvm_vcpu_init_sregs(km_vcpu_t* vcpu);
 void km_start_all_vcpus(void);
 void km_start_vcpus();
 void* km_vcpu_run(km_vcpu_t* vcpu);
-int km_run_vcpu_thread(km_vcpu_t* vcpu);
+int km_run_vcpu_thread(km_vcpu_t* vcpu, km_vcpu_t* creator);
+int km_vcpu_thread_create(km_vcpu_t* vcpu);
+void km_vcpu_thread_wait(km_vcpu_t* vcpu);
+void km_vcpu_thread_retire(km_vcpu_t* vcpu);
 void km_dump_vcpu(km_vcpu_t* vcpu);
 void km_read_registers(km_vcpu_t* vcpu);
 void km_write_registers(km_vcpu_t* vcpu);
@@ -277,6 +299,7 @@ typedef struct km_mmap_cb {   // control block
    km_mmap_list_t busy;       // list of mapped regions
    pthread_mutex_t mutex;     // global map lock
    int recovery_mode;         // disable region consolidation
+   uint64_t gen;              // bumped on busy list changes, see km_guest_mmap_walk()
 } km_mmap_cb_t;
 
 // enumerate type of virtual machine
@@ -290,30 +313,33 @@ static const_string_t DEVICE_KVM = "/dev/kvm";
 static const_string_t DEVICE_KKM = "/dev/kkm";
 
 /*
- * kernel include/linux/kvm_host.h
+ * kernel include/linux/kvm_host.h. KVM_MAX_VCPUS is the most km can handle and sizes the per vcpu
+ * arrays, the actual limit is machine.vm_max_vcpus, whatever the driver allows (KVM_CAP_MAX_VCPUS).
  */
 static const int CPUID_ENTRIES = 100;   // A little padding, kernel says 80
-#define KVM_MAX_VCPUS 288
+#define KVM_MAX_VCPUS 1024
+#define KM_DEFAULT_VCPUS 288   // when the driver doesn't tell its limit
 
 /*
  * We use 36 on 512GB machine, 42 on 4TB, out of 509 KVM_USER_MEM_SLOTS slot 0 is used for pages
- * tables and some other things slot 41 is used to map the vdso and vvar pages into the payload
- * address space
- * Slot 42 is used to map code that is part of km into the guest address space.
+ * tables and some other things. The last two slots are used to map the vdso and vvar pages, and
+ * code that is part of km, into the payload address space.
  */
-#define KM_MEM_SLOTS 43
+#define KM_MEM_SLOTS 45
 
 typedef struct km_machine {
    int kvm_fd;                                // /dev/kvm file descriptor
    vm_type_t vm_type;                         // VM type kvm or kkm
    int mach_fd;                               // VM file descriptor
    size_t vm_run_size;                        // size of the run control region
+   int vm_max_vcpus;                          // VCPUs we can create, at most KVM_MAX_VCPUS
                                               //
-   pthread_mutex_t vm_vcpu_mtx;               // serialize vcpu start/stop, protects four below
+   pthread_mutex_t vm_vcpu_mtx;               // serialize vcpu start/stop, protects five below
    int vm_vcpu_run_cnt;                       // count of still running VCPUs
    int vm_vcpu_cnt;                           // count of allocated VCPUs
    km_vcpu_t* vm_vcpus[KVM_MAX_VCPUS];        // VCPUs we created
    km_vcpu_list_t vm_idle_vcpus;              // Parked vcpu ready for reuse
+   int vm_idle_cnt;                           // count of vcpus in vm_idle_vcpus
                                               //
    kvm_mem_reg_t vm_mem_regs[KM_MEM_SLOTS];   // guest physical memory regions
    km_gva_t brk;                 // program break (highest address in bottom VA, i.e. txt/data)
@@ -327,6 +353,10 @@ typedef struct km_machine {
    uint64_t guest_mid_physmem;   // first byte of the top half of PA
    int mid_mem_idx;              // idx for the last region in the bottom half of PA
    int last_mem_idx;             // idx for the last (and hidden) region in the top half of PA
+   int guest_high_gva;           // 1 if the top zone is at the top of VA space (KM_HIGH_GVA layout)
+   km_gva_t guest_mem_top_va;    // GUEST_MEM_TOP_VA for the layout in use
+   km_gva_t guest_private_va;    // GUEST_PRIVATE_MEM_START_VA for the layout in use
+   km_gpa_t guest_private_pa;    // GUEST_PRIVATE_MEM_START_GPA for the layout in use
                                  // syncronization support
    int intr_fd;                  // eventfd used to signal to listener that a vCPU stopped
    int shutdown_fd;              // eventfd to coordinate final shutdown
@@ -355,7 +385,8 @@ typedef struct km_machine {
    union {
       // KVM specific data
       struct {
-         uint8_t xsave;   // Is KVM_GET_XSAVE supported.
+         uint8_t xsave;         // Is KVM_GET_XSAVE supported.
+         uint8_t guest_xsave;   // KM_GUEST_XSAVE* for signal handlers, 0 to use KVM_GET_XSAVE
       } kvm;
       // TBD Add KKM specific data (if any).
       int dummy;
@@ -397,6 +428,8 @@ void km_vcpu_stopped(km_vcpu_t* vcpu);
 km_vcpu_t* km_vcpu_get(void);
 km_vcpu_t* km_vcpu_restore(int tid);   // Used by snapshot restore
 void km_vcpu_put(km_vcpu_t* vcpu);
+void km_vcpu_pool_start(void);
+void km_vcpu_pool_stop(void);
 int km_vcpu_set_to_run(km_vcpu_t* vcpu, km_gva_t start, uint64_t arg);
 int km_vcpu_clone_to_run(km_vcpu_t* vcpu, km_vcpu_t* new_vcpu);
 void km_vcpu_detach(km_vcpu_t* vcpu);
@@ -426,7 +459,16 @@ static inline void km_vcpu_sync_rip(km_vcpu_t* vcpu)
    vcpu->cpu_run->immediate_exit = 1;
    (void)ioctl(vcpu->kvm_vcpu_fd, KVM_RUN, NULL);
    errno = 0;   // reset EINTR from ioctl above
-   vcpu->cpu_run->immediate_exit = 0;
+   vcpu->cpu_run->immediate_exit = vcpu->kick_pending;   // don't lose a kick, see km_signal_kick()
+}
+
+/*
+ * KM_SIGVCPUSTOP landed while vcpu was in a hypercall. Checked before blocking in the host, as a
+ * kick that lands before the host syscall doesn't interrupt it.
+ */
+static inline int km_vcpu_kicked(km_vcpu_t* vcpu)
+{
+   return __atomic_load_n(&vcpu->state, __ATOMIC_ACQUIRE) == HCALL_INT;
 }
 
 extern FILE* km_log_file;
@@ -771,6 +813,12 @@ void* km_find_faulting_address(km_vcpu_t* vcpu);
 void km_x86decode(km_vcpu_t* vcpu);
 
 // km_vmdriver.c
+/*
+ * How the guest signal handler entry saves FP state, see __km_sigentry_* in km_guest_asmcode.s.
+ * Zero means KM saves and restores it with KVM_GET_XSAVE/KVM_SET_XSAVE.
+ */
+#define KM_GUEST_XSAVE 1
+#define KM_GUEST_XSAVEC 2
 int km_vmdriver_get_identity(void);
 int km_vmdriver_cpu_supported(void);
 void km_vmdriver_machine_init(void);
@@ -36,6 +36,7 @@
 #include "km_guest.h"
 #include "km_mem.h"
 #include "km_signal.h"
+#include "km_timer.h"
 
 // TODO: Need to figure out where the corefile and snapshotdefault should go.
 static char* coredump_path = "./kmcore";
@@ -519,6 +520,10 @@ static inline int km_core_write_notes(km_vcpu_t* vcpu,
    cur += ret;
    remain -= ret;
 
+   ret = km_timer_core_notes_write(cur, remain);
+   cur += ret;
+   remain -= ret;
+
    /*
     * Add KM monitor info
     */
@@ -535,7 +540,9 @@ static inline int km_core_write_notes(km_vcpu_t* vcpu,
                                 .label_length = label_sz,
                                 .description_length = description_sz,
                                 .brk = machine.brk,
-                                .tbrk = machine.tbrk};
+                                .tbrk = machine.tbrk,
+                                .guest_max_physmem = machine.guest_max_physmem,
+                                .guest_high_gva = machine.guest_high_gva};
    if (machine.vm_type == VM_TYPE_KKM) {
       monitor->monitor_type = KM_NT_MONITOR_TYPE_KKM;
    }
@@ -642,6 +649,7 @@ static inline size_t km_core_notes_length(km_vcpu_t* vcpu, const char* label, co
 
    alloclen += km_fs_core_notes_length();
    alloclen += km_sig_core_notes_length();
+   alloclen += km_timer_core_notes_length();
 
    return roundup(alloclen, KM_PAGE_SIZE);
 }
@@ -766,40 +774,6 @@ static inline void km_core_write_phdrs(km_vcpu_t* vcpu,
    }
 }
 
-/*
- * Verify that a snapshot is possible.  We only check for active interval timers
- * at this time.  We don't snapshot interval timers yet, so if there are active timers
- * snapshot is not possible.
- * Returns:
- *  0 - snapshot can proceed
- *  != 0 - snapshot not allowed
- */
-static int km_snapshot_ok(void)
-{
-   int itimer_types[] = {ITIMER_REAL, ITIMER_VIRTUAL, ITIMER_PROF};
-   int i;
-
-   for (i = 0; i < sizeof(itimer_types) / sizeof(int); i++) {
-      struct itimerval val;
-      if (getitimer(itimer_types[i], &val) < 0) {
-         km_warn("getitimer type %d failed\n", itimer_types[i]);
-         return 1;
-      }
-      if (val.it_interval.tv_sec != 0 || val.it_interval.tv_usec != 0 || val.it_value.tv_sec != 0 ||
-          val.it_value.tv_usec != 0) {
-         km_infox(KM_TRACE_COREDUMP,
-                  "can't snapshort: timer %d, it_interval %ld.%06lu, it_value %lu.%06lu",
-                  itimer_types[i],
-                  val.it_interval.tv_sec,
-                  val.it_interval.tv_usec,
-                  val.it_value.tv_sec,
-                  val.it_value.tv_usec);
-         return 1;
-      }
-   }
-   return 0;
-}
-
 /*
  * Drop a core file containing the guest image.
  */
@@ -824,10 +798,6 @@ void km_dump_core(char* core_path,
    }
    km_warnx("Write %s to '%s'", dumptype == KM_DO_SNAP ? "snapshot" : "coredump", core_path);
 
-   if (dumptype == KM_DO_SNAP && km_snapshot_ok() != 0) {
-      km_errx(1, "Can't take a snapshot, active interval timer(s)");
-   }
-
    if ((notes_buffer = (char*)calloc(1, notes_length)) == NULL) {
       km_err(2, "cannot allocate notes buffer, exiting");
    }
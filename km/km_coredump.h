@@ -49,6 +49,12 @@ typedef struct km_nt_monitor {
     */
    Elf64_Addr brk;
    Elf64_Addr tbrk;
+   /*
+    * Guest physical memory size and VA layout, see km_mem_layout_init(). Over 512GB the zones take
+    * more than one PML4 entry and the top zone moves, the snapshot only resumes with the same.
+    */
+   Elf64_Xword guest_max_physmem;
+   Elf64_Word guest_high_gva;
    /*
     * NULL terminated strings label and descrption follow
     */
@@ -181,6 +187,46 @@ typedef struct km_nt_eventfd {
 } km_nt_eventfd_t;
 #define NT_KM_EVENTFD 0x4b4d4556   // "KMEV" no null term
 
+// timerfd_create
+typedef struct km_nt_timerfd {
+   Elf64_Word size;      // Size of record
+   Elf64_Word fd;        // Open timer fd
+   Elf64_Word flags;     // timerfd_create() flags
+   Elf64_Word clockid;   // timerfd_create() clockid
+   Elf64_Xword ticks;    // expirations not read yet
+   Elf64_Xword value_sec;   // time to next expiration, 0 if disarmed
+   Elf64_Xword value_nsec;
+   Elf64_Xword interval_sec;
+   Elf64_Xword interval_nsec;
+} km_nt_timerfd_t;
+#define NT_KM_TIMERFD 0x4b4d544d   // "KMTM" no null term
+
+// signalfd
+typedef struct km_nt_signalfd {
+   Elf64_Word size;    // Size of record
+   Elf64_Word fd;      // Open signal fd
+   Elf64_Word flags;   // signalfd() flags
+   Elf64_Word pad;
+   Elf64_Xword mask;   // signals to read
+} km_nt_signalfd_t;
+#define NT_KM_SIGNALFD 0x4b4d5346   // "KMSF" no null term
+
+// timer_create() and setitimer() timers
+typedef struct km_nt_timer {
+   Elf64_Word size;        // Size of record
+   Elf64_Word id;          // timer id, or ITIMER_* for interval timers
+   Elf64_Word itimer;      // 1 for setitimer() timers
+   Elf64_Sword clockid;    // timer_create() clockid
+   Elf64_Word clock_tid;   // thread for CLOCK_THREAD_CPUTIME_ID
+   Elf64_Word notify;      // sigev_notify
+   Elf64_Word signo;       // sigev_signo
+   Elf64_Word tid;         // SIGEV_THREAD_ID target
+   Elf64_Xword value;      // sigev_value
+   Elf64_Xword remain;     // nsec to next expiration, 0 if disarmed
+   Elf64_Xword interval;   // nsec
+} km_nt_timer_t;
+#define NT_KM_TIMER 0x4b4d5054   // "KMPT" no null term
+
 /*
  * Elf note record for signal handler.
  */
@@ -36,6 +36,8 @@
 #include "km_guest.h"
 #include "km_kkm.h"
 #include "km_mem.h"
+#include "km_sched.h"
+#include "km_timer.h"
 #include "x86_cpu.h"
 
 // Set CPUID VendorId to this. 12 chars max (sans \0) to fit in 3 register: ebx,ecx,edx
@@ -89,12 +91,14 @@ void km_vcpu_fini(km_vcpu_t* vcpu, int join_thr)
          km_err(3, "closing vcpu fd");
       }
    }
-   if (join_thr) {
+   // a vcpu whose thread was never started, or was retired, has no thread to join
+   if (join_thr && vcpu->vcpu_thread != 0) {
       pthread_cancel(vcpu->vcpu_thread);
       // km_pkill(vcpu, KM_SIGVCPUSTOP);
       pthread_join(vcpu->vcpu_thread, NULL);
    }
    machine.vm_vcpus[vcpu->vcpu_id] = NULL;
+   free(vcpu->iov);
    free(vcpu);
 }
 
@@ -103,6 +107,8 @@ void km_vcpu_fini(km_vcpu_t* vcpu, int join_thr)
  */
 void km_machine_fini(void)
 {
+   km_vcpu_pool_stop();
+   km_timer_fini();
    for (int i = 0; i < KVM_MAX_VCPUS; i++) {
       km_vcpu_t* vcpu;
 
@@ -287,6 +293,44 @@ static inline int km_vmmonitor_vcpu_init(km_vcpu_t* vcpu)
    return retval;
 }
 
+/*
+ * Allocate and initialize a brand new vcpu in the next free slot. Called with vm_vcpu_mtx held.
+ * The vcpu state is PARKED_IDLE, the caller takes it from there.
+ */
+static km_vcpu_t* km_vcpu_alloc(void)
+{
+   km_vcpu_t* vcpu;
+
+   if (machine.vm_vcpu_cnt == machine.vm_max_vcpus ||
+       (vcpu = calloc(1, sizeof(km_vcpu_t))) == NULL) {
+      return NULL;
+   }
+   km_infox(KM_TRACE_VCPU, "Allocating new vcpu-%d", machine.vm_vcpu_cnt);
+   vcpu->vcpu_id = machine.vm_vcpu_cnt;
+
+   if (km_vcpu_init(vcpu) != 0) {
+      km_warnx("VCPU init failed");
+      km_vcpu_fini(vcpu, 0);
+      return NULL;
+   }
+   machine.vm_vcpu_cnt++;
+   machine.vm_vcpus[vcpu->vcpu_id] = vcpu;
+   return vcpu;
+}
+
+/*
+ * Warm pool of parked vcpus with their threads already created, so clone() only needs to set the
+ * registers and wake the thread up. The pool thread keeps the idle list topped up to .size,
+ * km_vcpu_get() pokes it when it takes a vcpu from the list. Like the rest of vcpus pool ones are
+ * never freed, they are just created ahead of time.
+ */
+static struct {
+   int size;            // target length of the idle list, 0 if there is no pool
+   int stop;            // tells the pool thread to exit
+   pthread_t thread;    // pool thread, 0 if not running
+   pthread_cond_t cv;   // wakes up the pool thread, used with vm_vcpu_mtx
+} km_vcpu_pool;
+
 /*
  * km_vcpu_get() finds vcpu slot that can be used for a new vcpu.
  * It could be previously used slot left by exited thread, or a new one. Previously used vcpus are
@@ -301,6 +345,9 @@ km_vcpu_t* km_vcpu_get(void)
    if ((vcpu = SLIST_FIRST(&machine.vm_idle_vcpus.head)) != 0) {
       km_assert(vcpu->state == PARKED_IDLE);
       SLIST_REMOVE_HEAD(&machine.vm_idle_vcpus.head, next_idle);
+      if (--machine.vm_idle_cnt < km_vcpu_pool.size) {
+         km_cond_signal(&km_vcpu_pool.cv);
+      }
       machine.vm_vcpu_run_cnt++;
       vcpu->state = STARTING;
       km_mutex_unlock(&machine.vm_vcpu_mtx);
@@ -309,28 +356,82 @@ km_vcpu_t* km_vcpu_get(void)
       return vcpu;
    }
    // no idle VCPUs, try to allocate a new one
-   if (machine.vm_vcpu_cnt == KVM_MAX_VCPUS || (vcpu = calloc(1, sizeof(km_vcpu_t))) == NULL) {
-      km_mutex_unlock(&machine.vm_vcpu_mtx);
-      return NULL;
-   }
-   km_infox(KM_TRACE_VCPU, "Allocating new vcpu-%d", machine.vm_vcpu_cnt);
-   vcpu->vcpu_id = machine.vm_vcpu_cnt;
-
-   if (km_vcpu_init(vcpu) != 0) {
+   if ((vcpu = km_vcpu_alloc()) == NULL) {
       km_mutex_unlock(&machine.vm_vcpu_mtx);
-      km_warnx("VCPU init failed");
-      km_vcpu_fini(vcpu, 0);
       return NULL;
    }
-   machine.vm_vcpu_cnt++;
    machine.vm_vcpu_run_cnt++;
    vcpu->state = STARTING;
    km_gdb_vcpu_state_init(vcpu);
-   machine.vm_vcpus[vcpu->vcpu_id] = vcpu;
    km_mutex_unlock(&machine.vm_vcpu_mtx);
    return vcpu;
 }
 
+/*
+ * Pool thread. Creates vcpus and their threads while the idle list is shorter than the pool size.
+ * KVM_CREATE_VCPU needs vm_vcpu_mtx as vcpus are numbered sequentially, the thread is created
+ * without it.
+ */
+static void* km_vcpu_pool_main(void* unused)
+{
+   km_vcpu_t* vcpu;
+
+   km_setname_np(pthread_self(), "vcpu-pool");
+   km_sched_km_thread();
+   km_mutex_lock(&machine.vm_vcpu_mtx);
+   while (km_vcpu_pool.stop == 0) {
+      if (machine.vm_idle_cnt >= km_vcpu_pool.size || (vcpu = km_vcpu_alloc()) == NULL) {
+         km_cond_wait(&km_vcpu_pool.cv, &machine.vm_vcpu_mtx);
+         continue;
+      }
+      km_mutex_unlock(&machine.vm_vcpu_mtx);
+      km_lock_vcpu_thr(vcpu);
+      int rc = km_vcpu_thread_create(vcpu);
+      km_unlock_vcpu_thr(vcpu);
+      km_mutex_lock(&machine.vm_vcpu_mtx);
+      // without a thread the vcpu is still good, km_run_vcpu_thread() will try again
+      SLIST_INSERT_HEAD(&machine.vm_idle_vcpus.head, vcpu, next_idle);
+      machine.vm_idle_cnt++;
+      if (rc != 0) {
+         km_warnx("vcpu pool: failed to create thread for vcpu-%d, error %d", vcpu->vcpu_id, -rc);
+         km_cond_wait(&km_vcpu_pool.cv, &machine.vm_vcpu_mtx);
+      }
+   }
+   km_mutex_unlock(&machine.vm_vcpu_mtx);
+   return NULL;
+}
+
+// Start the pool thread if pool is configured. Also called in the child after fork.
+void km_vcpu_pool_start(void)
+{
+   if (km_machine_init_params.vcpu_pool == 0) {
+      return;
+   }
+   km_vcpu_pool.size = km_machine_init_params.vcpu_pool;
+   km_vcpu_pool.stop = 0;
+   km_vcpu_pool.cv = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+   if (pthread_create(&km_vcpu_pool.thread, NULL, km_vcpu_pool_main, NULL) != 0) {
+      km_warn("vcpu pool: failed to create pool thread");
+      km_vcpu_pool.thread = 0;
+      km_vcpu_pool.size = 0;
+   }
+}
+
+// Stop the pool thread. Parked vcpus stay on the idle list.
+void km_vcpu_pool_stop(void)
+{
+   if (km_vcpu_pool.thread == 0) {
+      return;
+   }
+   km_mutex_lock(&machine.vm_vcpu_mtx);
+   km_vcpu_pool.stop = 1;
+   km_vcpu_pool.size = 0;
+   km_cond_signal(&km_vcpu_pool.cv);
+   km_mutex_unlock(&machine.vm_vcpu_mtx);
+   pthread_join(km_vcpu_pool.thread, NULL);
+   km_vcpu_pool.thread = 0;
+}
+
 /*
  * Gets a VCPU in a specific slot. Used by snapshot resume.
  * This is called at initialization time (single threaded)
@@ -340,7 +441,7 @@ km_vcpu_t* km_vcpu_restore(int tid)
 {
    int slot = tid - 1;
 
-   if (slot < 0 || slot >= KVM_MAX_VCPUS) {
+   if (slot < 0 || slot >= machine.vm_max_vcpus) {
       return NULL;
    }
 
@@ -394,7 +495,7 @@ km_vcpu_t* km_vcpu_fetch_by_tid(pid_t tid)
 {
    km_vcpu_t* vcpu;
 
-   if (tid > 0 && tid < KVM_MAX_VCPUS && (vcpu = machine.vm_vcpus[tid - 1]) != NULL) {
+   if (tid > 0 && tid <= KVM_MAX_VCPUS && (vcpu = machine.vm_vcpus[tid - 1]) != NULL) {
       return vcpu->state != PARKED_IDLE ? vcpu : NULL;
    }
    return NULL;
@@ -463,8 +564,10 @@ void km_vcpu_put(km_vcpu_t* vcpu)
    km_mutex_lock(&machine.vm_vcpu_mtx);
    vcpu->guest_thr = 0;
    // vcpu->stack_top = 0; Reused by slist
+   vcpu->kick_pending = 0;
    vcpu->state = PARKED_IDLE;
    SLIST_INSERT_HEAD(&machine.vm_idle_vcpus.head, vcpu, next_idle);
+   machine.vm_idle_cnt++;
    if (--machine.vm_vcpu_run_cnt == 0) {
       km_signal_machine_fini();
    }
@@ -553,6 +656,65 @@ void km_check_kernel(void)
    }
 }
 
+// APIC ID bits for n CPUs
+static int km_cpuid_bits(int n)
+{
+   int bits = 0;
+
+   while ((1 << bits) < n) {
+      bits++;
+   }
+   return bits;
+}
+
+/*
+ * CPUID topology for the CPUs the payload sees, km_sched_cpu_count(). One package with a core per
+ * CPU, and a thread per core.
+ */
+static void km_cpuid_topology(struct kvm_cpuid_entry2* entry)
+{
+   uint32_t n = km_sched_cpu_count();
+   uint32_t bits = km_cpuid_bits(n);
+
+   switch (entry->function) {
+      case 0x1:   // EBX[23:16] addressable logical processor IDs, EDX[28] HTT
+         entry->ebx = (entry->ebx & ~0xff0000) | MIN(1U << bits, 255) << 16;
+         if (n > 1) {
+            entry->edx |= 1U << 28;
+         } else {
+            entry->edx &= ~(1U << 28);
+         }
+         break;
+      case 0x4:   // EAX[31:26] core IDs in the package - 1, EAX[25:14] IDs sharing the cache - 1
+         if ((entry->eax & 0x1f) != 0) {
+            uint32_t sharing = MIN((entry->eax >> 14) & 0xfff, (1U << bits) - 1);
+            entry->eax = (entry->eax & 0x3fff) | sharing << 14 | MIN((1U << bits) - 1, 63) << 26;
+         }
+         break;
+      case 0xB:
+      case 0x1F:   // EAX[4:0] x2APIC ID shift to the next level, EBX[15:0] processors at this level
+         switch ((entry->ecx >> 8) & 0xff) {
+            case 0:   // past the last level
+               break;
+            case 1:   // SMT
+               entry->eax &= ~0x1f;
+               entry->ebx = (entry->ebx & ~0xffff) | 1;
+               break;
+            default:   // core and up
+               entry->eax = (entry->eax & ~0x1f) | bits;
+               entry->ebx = (entry->ebx & ~0xffff) | MIN(n, 0xffff);
+               break;
+         }
+         break;
+      case 0x80000008:   // ECX[7:0] cores - 1, ECX[15:12] APIC ID bits for them
+         entry->ecx = (entry->ecx & ~0xf0ff) | bits << 12 | MIN(n - 1, 255);
+         break;
+      case 0x8000001E:   // EBX[15:8] threads per core - 1
+         entry->ebx &= ~0xff00;
+         break;
+   }
+}
+
 /*
  * Initial steps setting our VM.
  *
@@ -648,9 +810,11 @@ void km_machine_setup(km_machine_init_params_t* params)
     * Intel SDM, Vol3, Table 3-8. Information Returned by CPUID.
     * Get and save max CPU supported phys memory.
     * Check for 1GB pages support
+    * Set the topology to the CPUs the payload sees
     */
    for (int i = 0; i < machine.cpuid->nent; i++) {
       struct kvm_cpuid_entry2* entry = &machine.cpuid->entries[i];
+      km_cpuid_topology(entry);
       switch (entry->function) {
          case 0xD:
             if (entry->index == 0) {
@@ -689,12 +853,17 @@ void km_machine_setup(km_machine_init_params_t* params)
             break;
       }
    }
-   if (machine.guest_max_physmem > GUEST_MAX_PHYSMEM_SUPPORTED) {
+   /*
+    * Going over GUEST_MAX_PHYSMEM_DEFAULT changes VA layout, so it's only done when explicitly
+    * asked for (see below). Remember what the hardware allows to validate the request.
+    */
+   uint64_t host_max_physmem = machine.guest_max_physmem;
+   if (machine.guest_max_physmem > GUEST_MAX_PHYSMEM_DEFAULT) {
       km_infox(KM_TRACE_MEM,
                "Scaling down guest max phys mem to %#lx from %#lx",
-               GUEST_MAX_PHYSMEM_SUPPORTED,
+               GUEST_MAX_PHYSMEM_DEFAULT,
                machine.guest_max_physmem);
-      machine.guest_max_physmem = GUEST_MAX_PHYSMEM_SUPPORTED;
+      machine.guest_max_physmem = GUEST_MAX_PHYSMEM_DEFAULT;
    }
    if (machine.pdpe1g == 0) {
       /*
@@ -704,18 +873,20 @@ void km_machine_setup(km_machine_init_params_t* params)
       km_infox(KM_TRACE_MEM,
                "KVM: 1gb pages are not supported (pdpe1g=0), setting VM max mem to 2 GiB");
       machine.guest_max_physmem = MIN(2 * GIB, machine.guest_max_physmem);
+      host_max_physmem = machine.guest_max_physmem;
    }
    if (params->guest_physmem != 0) {
-      if ((machine.vm_type == VM_TYPE_KKM) && (params->guest_physmem != GUEST_MAX_PHYSMEM_SUPPORTED)) {
+      if ((machine.vm_type == VM_TYPE_KKM) && (params->guest_physmem != GUEST_MAX_PHYSMEM_DEFAULT)) {
          km_errx(1,
                  "Only %ldGiB physical memory supported with KKM driver",
-                 GUEST_MAX_PHYSMEM_SUPPORTED / GIB);
+                 GUEST_MAX_PHYSMEM_DEFAULT / GIB);
       } else {
-         if (params->guest_physmem > machine.guest_max_physmem) {
+         uint64_t max_physmem = MIN(host_max_physmem, GUEST_MAX_PHYSMEM_SUPPORTED);
+         if (params->guest_physmem > max_physmem) {
             km_errx(1,
                     "Cannot set guest memory size to '0x%lx'. Max supported=0x%lx",
                     params->guest_physmem,
-                    machine.guest_max_physmem);
+                    max_physmem);
          }
          machine.guest_max_physmem = params->guest_physmem;
       }
@@ -32,6 +32,7 @@
 #include "km_filesys_private.h"
 #include "km_gdb.h"
 #include "km_mem.h"
+#include "km_timer.h"
 
 #define KM_VIRT_DEVICE "--virt-device="   // convenience macro
 
@@ -46,15 +47,17 @@
  * KM_EXEC_GUESTFDS=gfd:hfd,gfd:hfd,.....
  * KM_EXEC_PIDINFO=tracepid
  * KM_EXEC_GDBINFO=gdbenabled,waitatstarup
+ * KM_EXEC_ITIMERS=sec,usec,intsec,intusec,... for ITIMER_REAL, ITIMER_VIRTUAL and ITIMER_PROF
  */
-#define KM_EXEC_VARS 6
-static const int KM_EXEC_VERNUM = 2;
+#define KM_EXEC_VARS 7
+static const int KM_EXEC_VERNUM = 3;
 static char KM_EXEC_VERS[] = "KM_EXEC_VERS";
 static char KM_EXEC_VMFDS[] = "KM_EXEC_VMFDS";
 static char KM_EXEC_EVENTFDS[] = "KM_EXEC_EVENTFDS";
 static char KM_EXEC_GUESTFDS[] = "KM_EXEC_GUESTFDS";
 static char KM_EXEC_PIDINFO[] = "KM_EXEC_PIDINFO";
 static char KM_EXEC_GDBINFO[] = "KM_EXEC_GDBINFO";
+static char KM_EXEC_ITIMERS[] = "KM_EXEC_ITIMERS";
 
 typedef struct km_exec_state {
    int version;
@@ -64,6 +67,7 @@ typedef struct km_exec_state {
    int kvm_fd;
    int mach_fd;
    int kvm_vcpu_fd[KVM_MAX_VCPUS];
+   struct itimerval itimers[3];   // interval timers survive execve
    int nfdmap;
    km_file_t guestfds[0];
 } km_exec_state_t;
@@ -124,7 +128,8 @@ static char* km_exec_g2h_var(void)
  */
 static char* km_exec_vmfd_var(void)
 {
-   int bufl = sizeof(KM_EXEC_VMFDS) + 1 + (KVM_MAX_VCPUS + 2) * sizeof("xxxxx,");
+   // km fds sit above the guest ones and may take up to 7 digits
+   int bufl = sizeof(KM_EXEC_VMFDS) + 1 + (KVM_MAX_VCPUS + 2) * sizeof(",xxxxxxx");
    char* bufp = malloc(bufl);
    int bytes_avail = bufl;
    char* p = bufp;
@@ -190,6 +195,42 @@ static char* km_exec_pidinfo_var(void)
    return bufp;
 }
 
+/*
+ * Build "KM_EXEC_ITIMERS=....." environment variable, time left and interval of the interval
+ * timers. Like on Linux they stay armed across execve().
+ */
+static char* km_exec_itimers_var(void)
+{
+   int bufl = sizeof(KM_EXEC_ITIMERS) + 1 + 3 * 4 * sizeof(",xxxxxxxxxxx");
+   char* bufp = malloc(bufl);
+   int bytes_needed;
+   char* p;
+
+   if (bufp == NULL) {
+      return NULL;
+   }
+   p = bufp + snprintf(bufp, bufl, "%s=", KM_EXEC_ITIMERS);
+   for (int which = ITIMER_REAL; which <= ITIMER_PROF; which++) {
+      struct itimerval itv = {};
+
+      km_getitimer(which, &itv);
+      bytes_needed = snprintf(p,
+                              bufl - (p - bufp),
+                              "%s%ld,%ld,%ld,%ld",
+                              which == ITIMER_REAL ? "" : ",",
+                              itv.it_value.tv_sec,
+                              itv.it_value.tv_usec,
+                              itv.it_interval.tv_sec,
+                              itv.it_interval.tv_usec);
+      if (bytes_needed + 1 > bufl - (p - bufp)) {
+         free(bufp);
+         return NULL;
+      }
+      p += bytes_needed;
+   }
+   return bufp;
+}
+
 /*
  * Build "KM_EXEC_GDBINFO=...." environment variable for gdb related values that are passed to the
  * new instance of km.
@@ -290,7 +331,8 @@ char** km_exec_build_env(char** envp)
                                                 km_exec_vmfd_var,
                                                 km_exec_eventfd_var,
                                                 km_exec_pidinfo_var,
-                                                km_exec_gdbinfo_var};
+                                                km_exec_gdbinfo_var,
+                                                km_exec_itimers_var};
 
    // Add exec vars to the new env
    int j;
@@ -480,17 +522,19 @@ int km_exec_recover_kmstate(void)
    char* guestfds = getenv(KM_EXEC_GUESTFDS);
    char* pidinfo = getenv(KM_EXEC_PIDINFO);
    char* gdbinfo = getenv(KM_EXEC_GDBINFO);
+   char* itimers = getenv(KM_EXEC_ITIMERS);
    int version;
    int nfdmap;
    int n;
 
    km_infox(KM_TRACE_EXEC, "recovering km exec state, vernum: %s", vernum != NULL ? vernum : "parent");
 
-   if (vernum == NULL || vmfds == NULL || eventfds == NULL || guestfds == NULL || pidinfo == NULL) {
+   if (vernum == NULL || vmfds == NULL || eventfds == NULL || guestfds == NULL || pidinfo == NULL ||
+       itimers == NULL) {
       // If we don't have them all, then this isn't an exec().
       // And, if one is missing they all need to be missing.
       km_assert(vernum == NULL && vmfds == NULL && eventfds == NULL && guestfds == NULL &&
-                pidinfo == NULL);
+                pidinfo == NULL && itimers == NULL);
       return 0;
    }
 
@@ -504,7 +548,7 @@ int km_exec_recover_kmstate(void)
       km_infox(KM_TRACE_EXEC, "exec state verion mismatch, got %d, expect %d", version, KM_EXEC_VERNUM);
       return -1;
    }
-   if (nfdmap > MAX_OPEN_FILES - MAX_KM_FILES) {
+   if (nfdmap > KM_MAX_GUEST_FILES) {
       km_infox(KM_TRACE_EXEC, "exec stat too many open files %d", nfdmap);
       return -1;
    }
@@ -537,6 +581,25 @@ int km_exec_recover_kmstate(void)
       return -1;
    }
 
+   struct itimerval* itv = execstatep->itimers;
+   if ((n = sscanf(itimers,
+                   "%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld",
+                   &itv[0].it_value.tv_sec,
+                   &itv[0].it_value.tv_usec,
+                   &itv[0].it_interval.tv_sec,
+                   &itv[0].it_interval.tv_usec,
+                   &itv[1].it_value.tv_sec,
+                   &itv[1].it_value.tv_usec,
+                   &itv[1].it_interval.tv_sec,
+                   &itv[1].it_interval.tv_usec,
+                   &itv[2].it_value.tv_sec,
+                   &itv[2].it_value.tv_usec,
+                   &itv[2].it_interval.tv_sec,
+                   &itv[2].it_interval.tv_usec)) != 12) {
+      km_infox(KM_TRACE_EXEC, "couldn't get itimers %s, n %d", itimers, n);
+      return -1;
+   }
+
    // Get the gdb state back.  Not sure if gdb expects us to remember open gdb fd's.
    int wait_for_attach;
    n = sscanf(gdbinfo,
@@ -585,6 +648,7 @@ int km_exec_recover_kmstate(void)
    unsetenv(KM_EXEC_GUESTFDS);
    unsetenv(KM_EXEC_PIDINFO);
    unsetenv(KM_EXEC_GDBINFO);
+   unsetenv(KM_EXEC_ITIMERS);
 
    gdbstub.wait_for_attach = wait_for_attach;
    if (gdbstub.enabled != 0 && gdbstub.gdb_client_attached != 0) {
@@ -614,7 +678,7 @@ int km_exec_recover_guestfd(void)
          continue;
       }
 
-      km_file_t* file = &km_fs()->guest_files[i];
+      km_file_t* file = km_fs_file_alloc(i);
       *file = execstatep->guestfds[i];
       // Fixup a few things
       TAILQ_INIT(&file->events);
@@ -625,11 +689,27 @@ int km_exec_recover_guestfd(void)
       // Remove pointers from the source km_file_t
       execstatep->guestfds[i].name = NULL;
       execstatep->guestfds[i].sockinfo = NULL;
-      TAILQ_INIT(&execstatep->guestfds[i].events);
+      km_fs_events_init(&execstatep->guestfds[i]);
    }
    return 0;
 }
 
+// Rearm the interval timers the payload had before execve(). Called once the machine is set up.
+void km_exec_recover_itimers(void)
+{
+   if (execstatep == NULL) {
+      return;
+   }
+   for (int which = ITIMER_REAL; which <= ITIMER_PROF; which++) {
+      struct itimerval* itv = &execstatep->itimers[which];
+
+      if ((itv->it_value.tv_sec != 0 || itv->it_value.tv_usec != 0) &&
+          km_setitimer(which, itv, NULL) != 0) {
+         km_warnx("couldn't rearm interval timer %d after exec", which);
+      }
+   }
+}
+
 void km_exec_init_args(int argc, char** argv)
 {
    // Remember this in case the guest performs an execve().
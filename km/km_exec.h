@@ -27,6 +27,7 @@ char** km_exec_build_env(char** envp);
 char** km_exec_build_argv(char* filename, char** argv, char** envp);
 int km_exec_recover_kmstate(void);
 int km_exec_recover_guestfd(void);
+void km_exec_recover_itimers(void);
 void km_exec_init_args(int argc, char** argv);
 void km_exec_fini(void);
 int km_called_via_exec(void);
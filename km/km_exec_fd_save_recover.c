@@ -38,6 +38,7 @@
 #include "km_filesys_private.h"
 #include "km_gdb.h"
 #include "km_mem.h"
+#include "km_signal.h"
 
 // The types of fd's this code currently understands.
 enum km_fdtype {
@@ -45,7 +46,9 @@ enum km_fdtype {
    KM_FDTYPE_PIPE,
    KM_FDTYPE_SOCKETPAIR,
    KM_FDTYPE_SOCKET,
-   KM_FDTYPE_EVENTFD
+   KM_FDTYPE_EVENTFD,
+   KM_FDTYPE_SIGNALFD,
+   KM_FDTYPE_IO_URING
 };
 
 /*
@@ -117,8 +120,8 @@ void km_exec_fdtrace(char* tag, int fd)
       return;
    }
 
-   file = &km_fs()->guest_files[fd];
-   if (km_is_file_used(file) == 0) {
+   file = km_fs_file(fd);
+   if (file == NULL || km_is_file_used(file) == 0) {
       return;
    }
 
@@ -196,7 +199,11 @@ char* km_exec_save_fd(char* varname)
    int i;
 
    for (i = 0; i < machine.filesys->nfdmap; i++) {
-      km_file_t* file = &km_fs()->guest_files[i];
+      km_file_t* file = km_fs_file(i);
+      if (file == NULL) {
+         i |= KM_FILES_CHUNK - 1;   // never allocated, skip the whole chunk
+         continue;
+      }
       if (km_is_file_used(file) == 0) {
          continue;
       }
@@ -215,7 +222,21 @@ char* km_exec_save_fd(char* varname)
 
       // Build an entry for this open fd
       more_env_value = NULL;
-      if (file->how == KM_FILE_HOW_EVENTFD) {   // event fd
+      if (file->how == KM_FILE_HOW_SIGNALFD) {   // signalfd, the host side is an eventfd
+         if (asprintf(&more_env_value,
+                      "{%x,%d,%x,%lx}",
+                      KM_FDTYPE_SIGNALFD,
+                      i,
+                      file->flags,
+                      km_signalfd_getmask(i)) == -1) {
+            km_warn("failed save info for signalfd %d", i);
+         }
+      } else if (file->how == KM_FILE_HOW_IO_URING) {
+         // The rings are gone with the address space, the exec'ed km closes it
+         if (asprintf(&more_env_value, "{%x,%d}", KM_FDTYPE_IO_URING, i) == -1) {
+            km_warn("failed save info for io_uring %d", i);
+         }
+      } else if (file->how == KM_FILE_HOW_EVENTFD) {   // event fd
          if (asprintf(&more_env_value, "{%x,%d,%x", KM_FDTYPE_EVENTFD, i, file->flags) == -1) {
             km_warn("failed save info for %s", file->name);
          }
@@ -312,14 +333,10 @@ char* km_exec_save_fd(char* varname)
 static void km_fs_destroy_fd(int fd)
 {
    km_file_t* file;
-   km_fs_event_t* eventp;
 
    km_exec_get_file_pointer(fd, &file, NULL);
 
-   while ((eventp = TAILQ_FIRST(&file->events)) != NULL) {
-      TAILQ_REMOVE(&file->events, eventp, link);
-      free(eventp);
-   }
+   km_fs_events_free(file);
 
    free(file->sockinfo);
    file->sockinfo = NULL;
@@ -334,7 +351,7 @@ static int km_exec_restore_file(int fd, int how, int flags, int index)
    km_file_t* file;
 
    km_exec_get_file_pointer(fd, &file, NULL);
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
 
    km_assert(km_is_file_used(file) == 0);
    km_set_file_used(file, 1);
@@ -374,7 +391,7 @@ static int km_exec_restore_eventfd(int fd, int flags)
 {
    km_file_t* file;
    km_exec_get_file_pointer(fd, &file, NULL);
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
 
    km_assert(km_is_file_used(file) == 0);
    km_set_file_used(file, 1);
@@ -396,7 +413,7 @@ static int km_exec_restore_pipe(int fd, int how, int flags, unsigned long ofd)
 {
    km_file_t* file;
    km_exec_get_file_pointer(fd, &file, NULL);
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
 
    km_set_file_used(file, 1);
    file->how = how;
@@ -413,6 +430,32 @@ static int km_exec_restore_pipe(int fd, int how, int flags, unsigned long ofd)
    return 0;
 }
 
+static int km_exec_restore_signalfd(int fd, int flags, km_sigset_t mask)
+{
+   km_file_t* file;
+   km_exec_get_file_pointer(fd, &file, NULL);
+   km_fs_events_init(file);
+
+   km_assert(km_is_file_used(file) == 0);
+   km_set_file_used(file, 1);
+   file->how = KM_FILE_HOW_SIGNALFD;
+   file->flags = flags;
+   file->ofd = -1;
+   file->ops = NULL;
+   file->sockinfo = NULL;
+
+   file->name = strdup("anon_inode:[signalfd]");
+   if (file->name == NULL) {
+      km_fs_destroy_fd(fd);
+      return -1;
+   }
+   if (km_signalfd_setmask(NULL, fd, mask) < 0) {
+      km_fs_destroy_fd(fd);
+      return -1;
+   }
+   return 0;
+}
+
 /*
  * Some socket properties can be queried with getsockopt().  For those, there is no
  * need for exec to propagate them to the child.  The child can just get them using
@@ -455,7 +498,7 @@ static int km_exec_restore_socketpair(int fd, int how, int ofd)
 {
    km_file_t* file;
    km_exec_get_file_pointer(fd, &file, NULL);
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
 
    km_set_file_used(file, 1);
    file->how = how;
@@ -490,7 +533,7 @@ km_exec_restore_socket(int fd, int how, int state, int backlog, int ofd, km_fd_s
 {
    km_file_t* file;
    km_exec_get_file_pointer(fd, &file, NULL);
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
 
    km_set_file_used(file, 1);
    file->how = how;
@@ -529,6 +572,7 @@ int km_exec_restore_fd(char* env_value)
    int ofd;
    int backlog;
    int state;
+   km_sigset_t mask;
 
    while (*p != 0) {
       int tag;
@@ -632,16 +676,11 @@ int km_exec_restore_fd(char* env_value)
                   return -1;
                }
                q++;
-               km_fs_event_t* eventp;
-               eventp = malloc(sizeof(km_fs_event_t));
-               if (eventp == NULL) {
+               struct epoll_event event = {.events = events, .data.u64 = data};
+               if (km_fs_event_insert(file, fd, &event) != 0) {
                   km_fs_destroy_fd(fd);
                   return -1;
                }
-               eventp->fd = fd;
-               eventp->event.events = events;
-               eventp->event.data.u64 = data;
-               TAILQ_INSERT_TAIL(&file->events, eventp, link);
             }
             if (*q != '}') {
                return -1;
@@ -650,6 +689,25 @@ int km_exec_restore_fd(char* env_value)
             p = q;
             break;
 
+         case KM_FDTYPE_SIGNALFD:
+            // {5,7,80800,4000}
+            if (sscanf(q, "%d,%x,%lx}", &fd, &flags, &mask) != 3) {
+               return -1;
+            }
+            if (km_exec_restore_signalfd(fd, flags, mask) < 0) {
+               km_infox(KM_TRACE_EXEC, "Unable to restore signalfd %d", fd);
+               return -1;
+            }
+            break;
+
+         case KM_FDTYPE_IO_URING:
+            // {6,8}, as if it was close on exec
+            if (sscanf(q, "%d}", &fd) != 1) {
+               return -1;
+            }
+            close(fd);
+            break;
+
          default:
             km_infox(KM_TRACE_EXEC, "Unknown fd tag 0x%x", tag);
             return -1;
@@ -24,6 +24,7 @@
  * file descriptors (for example KVM/KKM control fd's).
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -32,13 +33,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/un.h>
@@ -49,17 +57,82 @@
 #include "km_exec.h"
 #include "km_filesys.h"
 #include "km_filesys_private.h"
+#include "km_idle.h"
+#include "km_io_uring.h"
 #include "km_mem.h"
+#include "km_sched.h"
 #include "km_signal.h"
 #include "km_snapshot.h"
 #include "km_syscall.h"
 
-static const int KM_GDB_LISTEN = MAX_OPEN_FILES - MAX_KM_FILES;
-static const int KM_GDB_ACCEPT = MAX_OPEN_FILES - MAX_KM_FILES + 1;
-static const int KM_MGM_LISTEN = MAX_OPEN_FILES - MAX_KM_FILES + 2;
-static const int KM_MGM_ACCEPT = MAX_OPEN_FILES - MAX_KM_FILES + 3;
-const int KM_LOGGING = MAX_OPEN_FILES - MAX_KM_FILES + 4;
-static const int KM_START_FDS = MAX_OPEN_FILES - MAX_KM_FILES + 5;
+#ifndef TFD_IOC_SET_TICKS
+#define TFD_IOC_SET_TICKS _IOW('T', 0, uint64_t)
+#endif
+
+/*
+ * Guest fds have the same numbers in the guest and in km, so km own fds live right above the guest
+ * fd range: guest fds are [0, km_fd_base), km fds are [km_fd_base, km_fd_base + km_nfiles).
+ * These are offsets of the fixed km fds from km_fd_base, the rest (eventfds, kvm, vcpus) go from
+ * KM_START_FDS up.
+ */
+enum { KM_GDB_LISTEN, KM_GDB_ACCEPT, KM_MGM_LISTEN, KM_MGM_ACCEPT, KM_LOGGING, KM_START_FDS };
+
+static int km_fd_base;         // first km fd, also the size of guest fd range
+static int km_nfiles;          // size of km fd range, at most MAX_KM_FILES
+static rlim_t km_nofile_cur;   // RLIMIT_NOFILE soft limit km started with
+
+/*
+ * The guest fd range is sized by the hard RLIMIT_NOFILE, capped by KM_MAX_GUEST_FILES. km soft
+ * limit is raised to the capped hard one so km fds fit above the guest range. Guest soft limit is virtual
+ * and starts where km soft limit was, see km_fs_prlimit64(). km takes no more than a quarter of the
+ * fds unless that's below room for KM_DEFAULT_VCPUS, with a very low hard limit that means fewer
+ * vcpus, see km_fs_max_vcpus().
+ */
+static int km_fs_fd_base(void)
+{
+   struct rlimit lim;
+
+   if (km_fd_base != 0) {
+      return km_fd_base;
+   }
+   if (getrlimit(RLIMIT_NOFILE, &lim) < 0) {
+      km_err(1, "getrlimit(RLIMIT_NOFILE)");
+   }
+   km_nofile_cur = lim.rlim_cur;
+   rlim_t nofile = MIN(lim.rlim_max, (rlim_t)KM_MAX_GUEST_FILES + MAX_KM_FILES);
+   if (nofile < lim.rlim_max) {
+      km_infox(KM_TRACE_FILESYS, "RLIMIT_NOFILE %ld, guest gets %ld", lim.rlim_max, nofile);
+   }
+   km_nfiles = MIN(MAX_KM_FILES, nofile / 4);
+   // but not fewer than the KM_DEFAULT_VCPUS km always had room for, as long as the guest gets more
+   int min_nfiles = KM_DEFAULT_VCPUS + MAX_KM_FILES - KVM_MAX_VCPUS;
+   if (km_nfiles < min_nfiles && nofile >= 2 * min_nfiles) {
+      km_nfiles = min_nfiles;
+   }
+   if (km_nfiles <= MAX_KM_FILES - KVM_MAX_VCPUS) {
+      km_errx(1, "RLIMIT_NOFILE %ld is too low", lim.rlim_max);
+   }
+   if (lim.rlim_cur < nofile) {   // hard limit stays as is for whatever the payload execs
+      lim.rlim_cur = nofile;
+      if (setrlimit(RLIMIT_NOFILE, &lim) < 0) {
+         km_err(1, "setrlimit(RLIMIT_NOFILE, %ld)", lim.rlim_cur);
+      }
+   }
+   km_fd_base = nofile - km_nfiles;
+   return km_fd_base;
+}
+
+// Number of vcpu fds that fit in km fd range
+int km_fs_max_vcpus(void)
+{
+   km_fs_fd_base();
+   return km_nfiles - (MAX_KM_FILES - KVM_MAX_VCPUS);
+}
+
+int km_fs_logging_fd(void)
+{
+   return km_fs_fd_base() + KM_LOGGING;
+}
 
 static char proc_pid_fd[128];
 static char proc_pid_exe[128];
@@ -72,6 +145,28 @@ static char* km_my_exec;   // my executable per /proc/self/exe to check with in
 static int km_fs_g2h_filename(const char* name, char* buf, size_t bufsz, km_file_ops_t** ops);
 static int km_fs_g2h_readlink(const char* name, char* buf, size_t bufsz);
 
+/*
+ * Returns km_file_t for guest fd, allocating the table chunk for it if needed.
+ */
+km_file_t* km_fs_file_alloc(int fd)
+{
+   km_file_t* file;
+
+   km_assert(fd >= 0 && fd < km_fs()->nfdmap);
+   if ((file = km_fs_file(fd)) != NULL) {
+      return file;
+   }
+   km_mutex_lock(&km_fs()->mutex);
+   if ((file = km_fs_file(fd)) == NULL) {
+      km_file_t* chunk = calloc(KM_FILES_CHUNK, sizeof(km_file_t));
+      km_assert(chunk != NULL);
+      __atomic_store_n(&km_fs()->guest_files[fd >> KM_FILES_CHUNK_SHIFT], chunk, __ATOMIC_RELEASE);
+      file = &chunk[fd & (KM_FILES_CHUNK - 1)];
+   }
+   km_mutex_unlock(&km_fs()->mutex);
+   return file;
+}
+
 /*
  * Tells whether a file is inuse or not.
  */
@@ -108,10 +203,19 @@ char* km_get_nonfile_name(int hostfd)
  */
 int km_add_guest_fd_internal(km_vcpu_t* vcpu, int host_fd, char* name, int flags, int how, km_file_ops_t* ops)
 {
-   km_assert(host_fd >= 0 && host_fd < km_fs()->nfdmap);
+   km_assert(host_fd >= 0);
+   /*
+    * Past the guest soft limit. The host one is higher to fit km fds, and if those have gaps the
+    * host may even hand out an fd in km range.
+    */
+   if (host_fd >= km_fs()->nofile.rlim_cur) {
+      close(host_fd);
+      return -EMFILE;
+   }
+   km_file_t* file = km_fs_file_alloc(host_fd);
    int available = 0;
    int taken = 1;
-   if (__atomic_compare_exchange_n(&km_fs()->guest_files[host_fd].inuse,
+   if (__atomic_compare_exchange_n(&file->inuse,
                                    &available,
                                    taken,
                                    0,
@@ -119,12 +223,12 @@ int km_add_guest_fd_internal(km_vcpu_t* vcpu, int host_fd, char* name, int flags
                                    __ATOMIC_SEQ_CST) == 0) {
       km_errx(0, "file slot %d is taken unexpectedly", host_fd);
    }
-   km_file_t* file = &km_fs()->guest_files[host_fd];
    file->ops = ops;
    file->how = how;
    file->ofd = -1;
    file->sockinfo = NULL;
-   TAILQ_INIT(&file->events);
+   file->ioring = NULL;
+   km_fs_events_init(file);
    if (name == NULL) {
       file->name = km_get_nonfile_name(host_fd);
    } else {
@@ -141,8 +245,8 @@ int km_add_guest_fd(km_vcpu_t* vcpu, int host_fd, char* name, int flags, km_file
 
 static inline void km_connect_files(km_vcpu_t* vcpu, int guestfd[2])
 {
-   km_fs()->guest_files[guestfd[0]].ofd = guestfd[1];
-   km_fs()->guest_files[guestfd[1]].ofd = guestfd[0];
+   km_fs_file(guestfd[0])->ofd = guestfd[1];
+   km_fs_file(guestfd[1])->ofd = guestfd[0];
 }
 
 static inline int km_add_socket_fd(
@@ -153,7 +257,7 @@ static inline int km_add_socket_fd(
       km_fd_socket_t sockval = {.domain = domain, .type = type, .protocol = protocol};
       km_fd_socket_t* sockinfo = calloc(1, sizeof(km_fd_socket_t));
       *sockinfo = sockval;
-      km_fs()->guest_files[ret].sockinfo = sockinfo;
+      km_fs_file(ret)->sockinfo = sockinfo;
    }
    return ret;
 }
@@ -163,7 +267,7 @@ km_dup_socket_fd(km_vcpu_t* vcpu, int hostfd, char* name, int flags, km_fd_socke
 {
    int ret = km_add_guest_fd_internal(vcpu, hostfd, name, flags, how, NULL);
    if (ret >= 0) {
-      km_file_t* file = &km_fs()->guest_files[ret];
+      km_file_t* file = km_fs_file(ret);
       km_assert(file->sockinfo == NULL);
       file->sockinfo = malloc(sizeof(km_fd_socket_t));
       km_assert(file->sockinfo != NULL);
@@ -182,8 +286,18 @@ km_dup_socket_fd(km_vcpu_t* vcpu, int hostfd, char* name, int flags, km_fd_socke
 static inline void del_guest_fd(km_vcpu_t* vcpu, int fd)
 {
    km_assert(fd >= 0 && fd < km_fs()->nfdmap);
-   km_file_t* file = &km_fs()->guest_files[fd];
+   km_file_t* file = km_fs_file(fd);
    km_assert(km_is_file_used(file) != 0);
+   if (file->how == KM_FILE_HOW_SIGNALFD) {
+      km_signalfd_close(fd);
+   }
+   if (file->how == KM_FILE_HOW_IO_URING) {
+      km_io_uring_close(fd);
+   }
+   if (file->error != 0) {
+      file->error = 0;
+      __atomic_sub_fetch(&km_fs()->nerrors, 1, __ATOMIC_RELEASE);
+   }
    if (__atomic_exchange_n(&file->inuse, 0, __ATOMIC_SEQ_CST) != 0) {
       file->ops = NULL;
       if (file->name != NULL) {
@@ -195,13 +309,9 @@ static inline void del_guest_fd(km_vcpu_t* vcpu, int fd)
       free(file->sockinfo);
       file->sockinfo = NULL;
    }
-   km_fs_event_t* eventp;
-   while ((eventp = TAILQ_FIRST(&file->events)) != NULL) {
-      TAILQ_REMOVE(&file->events, eventp, link);
-      free(eventp);
-   }
+   km_fs_events_free(file);
    if (file->ofd != -1) {
-      km_file_t* other = &km_fs()->guest_files[file->ofd];
+      km_file_t* other = km_fs_file(file->ofd);
       file->ofd = -1;
       /*
        * We don't actually have a hold on other, so only do the update other->ofd
@@ -211,17 +321,75 @@ static inline void del_guest_fd(km_vcpu_t* vcpu, int fd)
    }
 }
 
+/*
+ * Adds 'hostfd', a host dup of guest 'fd', to the guest as a copy of 'fd', including the km side
+ * state of emulated files. Used by dup(), dup2(), dup3() and fcntl(F_DUPFD).
+ */
+static int
+km_dup_guest_fd(km_vcpu_t* vcpu, int fd, int hostfd, char* name, int flags, km_file_ops_t* ops)
+{
+   km_file_t* file = km_fs_file(fd);
+   int ret;
+
+   if (file->sockinfo != NULL) {
+      return km_dup_socket_fd(vcpu, hostfd, name, flags, file->sockinfo, file->how);
+   }
+   if ((ret = km_add_guest_fd_internal(vcpu, hostfd, name, flags, file->how, ops)) < 0) {
+      return ret;
+   }
+   if (file->how == KM_FILE_HOW_IO_URING) {
+      km_io_uring_dup(fd, ret);
+   } else if (file->how == KM_FILE_HOW_SIGNALFD) {
+      int rc = km_signalfd_dup(fd, ret);
+      if (rc != 0) {
+         del_guest_fd(vcpu, ret);
+         close(ret);
+         return rc;
+      }
+   }
+   return ret;
+}
+
+/*
+ * Both ends of a pipe or socketpair have to make it into the guest fd table, or neither. Returns 0
+ * or -EMFILE.
+ */
+static inline int km_check_fd_pair(km_vcpu_t* vcpu, int guestfd[2])
+{
+   if (guestfd[0] >= 0 && guestfd[1] >= 0) {
+      return 0;
+   }
+   for (int i = 0; i < 2; i++) {
+      if (guestfd[i] >= 0) {
+         del_guest_fd(vcpu, guestfd[i]);
+         close(guestfd[i]);
+      }
+   }
+   return -EMFILE;
+}
+
 static inline int km_guestfd_error(km_vcpu_t* vcpu, int fd)
 {
-   return km_fs()->guest_files[fd].error;
+   return km_fs_file(fd)->error;
+}
+
+/*
+ * Returns non-zero if any guest fd has a km level error (file->error, only set by snapshot
+ * recovery). When there are none, which is almost always, poll, select and epoll_wait skip looking
+ * at the individual fds.
+ */
+static inline int km_fs_any_error(void)
+{
+   return __atomic_load_n(&km_fs()->nerrors, __ATOMIC_ACQUIRE) != 0;
 }
 
 char* km_guestfd_name(km_vcpu_t* vcpu, int fd)
 {
-   if (fd < 0 || fd >= km_fs()->nfdmap) {
+   km_file_t* file;
+   if (fd < 0 || fd >= km_fs()->nfdmap || (file = km_fs_file(fd)) == NULL) {
       return NULL;
    }
-   return km_fs()->guest_files[fd].name;
+   return file->name;
 }
 
 /*
@@ -230,10 +398,11 @@ char* km_guestfd_name(km_vcpu_t* vcpu, int fd)
  */
 int km_fs_h2g_fd(int hostfd)
 {
-   if (hostfd < 0 || hostfd >= km_fs()->nfdmap) {
+   km_file_t* file;
+   if (hostfd < 0 || hostfd >= km_fs()->nfdmap || (file = km_fs_file(hostfd)) == NULL) {
       return -ENOENT;
    }
-   if (__atomic_load_n(&km_fs()->guest_files[hostfd].inuse, __ATOMIC_SEQ_CST) == 0) {
+   if (__atomic_load_n(&file->inuse, __ATOMIC_SEQ_CST) == 0) {
       return -ENOENT;
    }
    return hostfd;
@@ -244,14 +413,15 @@ int km_fs_h2g_fd(int hostfd)
  */
 int km_fs_g2h_fd(int fd, km_file_ops_t** ops)
 {
-   if (fd < 0 || fd >= km_fs()->nfdmap) {
+   km_file_t* file;
+   if (fd < 0 || fd >= km_fs()->nfdmap || (file = km_fs_file(fd)) == NULL) {
       return -1;
    }
-   if (__atomic_load_n(&km_fs()->guest_files[fd].inuse, __ATOMIC_SEQ_CST) == 0) {
+   if (__atomic_load_n(&file->inuse, __ATOMIC_SEQ_CST) == 0) {
       return -1;
    }
    if (ops != NULL) {
-      *ops = km_fs()->guest_files[fd].ops;
+      *ops = file->ops;
    }
    return fd;
 }
@@ -408,7 +578,13 @@ uint64_t km_fs_prw(km_vcpu_t* vcpu, int scall, int fd, void* buf, size_t count,
    if (ret != 0) {
       return ret;
    }
-   if (ops != NULL && ops->read_g2h != NULL && (scall == SYS_read || scall == SYS_pread64)) {
+   if (km_fs_file(fd)->how == KM_FILE_HOW_SIGNALFD) {
+      // host side is an eventfd that only tells readiness
+      if (scall != SYS_read) {
+         return scall == SYS_pread64 ? -ESPIPE : -EINVAL;
+      }
+      ret = km_signalfd_read(vcpu, fd, buf, count);
+   } else if (ops != NULL && ops->read_g2h != NULL && (scall == SYS_read || scall == SYS_pread64)) {
       if (scall == SYS_pread64 && offset != 0) {
          km_warnx("unsupported %s", km_hc_name_get(scall));
          return -EINVAL;
@@ -420,12 +596,47 @@ uint64_t km_fs_prw(km_vcpu_t* vcpu, int scall, int fd, void* buf, size_t count,
    return ret;
 }
 
+/*
+ * Host iovec array of UIO_MAXIOV entries for vectored I/O hypercalls on 'vcpu'. Allocated on the
+ * first use and kept with the vcpu, so translating guest iovecs needs neither the (small) vcpu
+ * thread stack nor malloc. Returns NULL if out of memory.
+ */
+struct iovec* km_vcpu_iov(km_vcpu_t* vcpu)
+{
+   if (vcpu->iov == NULL) {
+      vcpu->iov = malloc(UIO_MAXIOV * sizeof(struct iovec));
+   }
+   return vcpu->iov;
+}
+
+/*
+ * Translate 'iovcnt' guest iovecs at 'guest_iov' into host 'iov'. The iovec array has to be
+ * readable, and each buffer mapped in full with 'prot'. Returns 0 or -EFAULT.
+ */
+int km_iov_g2h(km_vcpu_t* vcpu, km_gva_t guest_iov, size_t iovcnt, int prot, struct iovec* iov)
+{
+   struct iovec* giov =
+       km_gva_range_to_kma(vcpu, guest_iov, iovcnt * sizeof(struct iovec), PROT_READ);
+
+   if (giov == NULL && iovcnt != 0) {
+      return -EFAULT;
+   }
+   for (size_t i = 0; i < iovcnt; i++) {
+      iov[i].iov_len = giov[i].iov_len;
+      iov[i].iov_base = km_gva_range_to_kma(vcpu, (km_gva_t)giov[i].iov_base, iov[i].iov_len, prot);
+      if (iov[i].iov_base == NULL && iov[i].iov_len != 0) {
+         return -EFAULT;
+      }
+   }
+   return 0;
+}
+
 // ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
 // ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
 // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
 // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
 uint64_t
-km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* guest_iov, size_t iovcnt, off_t offset)
+km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, km_gva_t guest_iov, int iovcnt, off_t offset)
 {
    int host_fd;
    km_file_ops_t* ops;
@@ -440,17 +651,21 @@ km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* guest_iov, si
       km_warnx("unsupported %s", km_hc_name_get(scall));
       return -EINVAL;
    }
-   // ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
-   // ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
-   // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
-   // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
-   //
-   // need to convert not only the address of iov,
-   // but also pointers to individual buffers in it
-   struct iovec iov[iovcnt];
-   for (int i = 0; i < iovcnt; i++) {
-      iov[i].iov_base = km_gva_to_kma((long)guest_iov[i].iov_base);
-      iov[i].iov_len = guest_iov[i].iov_len;
+   if (km_fs_file(fd)->how == KM_FILE_HOW_SIGNALFD) {
+      km_warnx("unsupported %s on signalfd", km_hc_name_get(scall));
+      return -EINVAL;
+   }
+   // need to convert not only the address of iov, but also pointers to individual buffers in it
+   if (iovcnt < 0 || iovcnt > UIO_MAXIOV) {
+      return -EINVAL;
+   }
+   struct iovec* iov = km_vcpu_iov(vcpu);
+   if (iov == NULL) {
+      return -ENOMEM;
+   }
+   int prot = scall == SYS_readv || scall == SYS_preadv ? PROT_WRITE : PROT_READ;
+   if ((ret = km_iov_g2h(vcpu, guest_iov, iovcnt, prot, iov)) != 0) {
+      return ret;
    }
    ret = __syscall_4(scall, host_fd, (uintptr_t)iov, iovcnt, offset);
    return ret;
@@ -495,22 +710,8 @@ uint64_t km_fs_fcntl(km_vcpu_t* vcpu, int fd, int cmd, uint64_t arg)
    ret = __syscall_3(SYS_fcntl, host_fd, cmd, farg);
    if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC) {
       if (ret >= 0) {
-         km_file_t* file = &km_fs()->guest_files[fd];
-         if (file->sockinfo != NULL) {
-            ret = km_dup_socket_fd(vcpu,
-                                   ret,
-                                   km_guestfd_name(vcpu, fd),
-                                   (cmd == F_DUPFD) ? 0 : O_CLOEXEC,
-                                   file->sockinfo,
-                                   file->how);
-         } else {
-            ret = km_add_guest_fd_internal(vcpu,
-                                           ret,
-                                           km_guestfd_name(vcpu, fd),
-                                           (cmd == F_DUPFD) ? 0 : O_CLOEXEC,
-                                           file->how,
-                                           ops);
-         }
+         ret = km_dup_guest_fd(
+             vcpu, fd, ret, km_guestfd_name(vcpu, fd), (cmd == F_DUPFD) ? 0 : O_CLOEXEC, ops);
       }
    }
    return ret;
@@ -797,6 +998,67 @@ uint64_t km_fs_fdatasync(km_vcpu_t* vcpu, int fd)
    return ret;
 }
 
+// int fallocate(int fd, int mode, off_t offset, off_t len);
+uint64_t km_fs_fallocate(km_vcpu_t* vcpu, int fd, int mode, off_t offset, off_t len)
+{
+   int host_fd;
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, fd);
+   if (ret != 0) {
+      return ret;
+   }
+   ret = __syscall_4(SYS_fallocate, host_fd, mode, offset, len);
+   return ret;
+}
+
+// int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+uint64_t km_fs_fadvise64(km_vcpu_t* vcpu, int fd, off_t offset, off_t len, int advice)
+{
+   int host_fd;
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, fd);
+   if (ret != 0) {
+      return ret;
+   }
+   ret = __syscall_4(SYS_fadvise64, host_fd, offset, len, advice);
+   return ret;
+}
+
+// ssize_t readahead(int fd, off64_t offset, size_t count);
+uint64_t km_fs_readahead(km_vcpu_t* vcpu, int fd, off_t offset, size_t count)
+{
+   int host_fd;
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, fd);
+   if (ret != 0) {
+      return ret;
+   }
+   ret = __syscall_3(SYS_readahead, host_fd, offset, count);
+   return ret;
+}
+
+// int sync_file_range(int fd, off64_t offset, off64_t nbytes, unsigned int flags);
+uint64_t
+km_fs_sync_file_range(km_vcpu_t* vcpu, int fd, off_t offset, off_t nbytes, unsigned int flags)
+{
+   int host_fd;
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, fd);
+   if (ret != 0) {
+      return ret;
+   }
+   ret = __syscall_4(SYS_sync_file_range, host_fd, offset, nbytes, flags);
+   return ret;
+}
+
 // int mkdir(const char *path, mode_t mode);
 uint64_t km_fs_mkdir(km_vcpu_t* vcpu, char* pathname, mode_t mode)
 {
@@ -1136,12 +1398,7 @@ uint64_t km_fs_dup(km_vcpu_t* vcpu, int fd)
    km_assert(name != NULL);
    ret = __syscall_1(SYS_dup, host_fd);
    if (ret >= 0) {
-      km_file_t* file = &km_fs()->guest_files[host_fd];
-      if (file->sockinfo != NULL) {
-         ret = km_dup_socket_fd(vcpu, ret, name, 0, file->sockinfo, file->how);
-      } else {
-         ret = km_add_guest_fd_internal(vcpu, ret, name, 0, file->how, ops);
-      }
+      ret = km_dup_guest_fd(vcpu, host_fd, ret, name, 0, ops);
    }
    km_infox(KM_TRACE_FILESYS, "dup(%d) - %d", fd, ret);
    return ret;
@@ -1156,7 +1413,7 @@ uint64_t km_fs_dup3(km_vcpu_t* vcpu, int fd, int newfd, int flags)
    if ((flags & ~O_CLOEXEC) != 0) {
       return -EINVAL;
    }
-   if (newfd < 0 || newfd >= km_fs()->nfdmap) {
+   if (newfd < 0 || newfd >= km_fs()->nofile.rlim_cur) {
       return -EBADF;
    }
 
@@ -1175,16 +1432,10 @@ uint64_t km_fs_dup3(km_vcpu_t* vcpu, int fd, int newfd, int flags)
    km_assert(name != NULL);
    ret = __syscall_3(SYS_dup3, host_fd, newfd, flags);
    if (ret >= 0) {
-      if (km_is_file_used(&km_fs()->guest_files[ret]) != 0) {
+      if (km_is_file_used(km_fs_file_alloc(ret)) != 0) {
          del_guest_fd(vcpu, ret);
       }
-
-      km_file_t* file = &km_fs()->guest_files[host_fd];
-      if (file->sockinfo != NULL) {
-         ret = km_dup_socket_fd(vcpu, ret, name, flags, file->sockinfo, file->how);
-      } else {
-         ret = km_add_guest_fd(vcpu, ret, name, flags, ops);
-      }
+      ret = km_dup_guest_fd(vcpu, host_fd, ret, name, flags, ops);
    }
    km_infox(KM_TRACE_FILESYS, "dup3(%d, %d, 0x%x) - %d", fd, newfd, flags, ret);
    return ret;
@@ -1209,6 +1460,9 @@ uint64_t km_fs_pipe(km_vcpu_t* vcpu, int pipefd[2])
           km_add_guest_fd_internal(vcpu, host_pipefd[0], NULL, O_RDONLY, KM_FILE_HOW_PIPE_0, NULL);
       pipefd[1] =
           km_add_guest_fd_internal(vcpu, host_pipefd[1], NULL, O_WRONLY, KM_FILE_HOW_PIPE_1, NULL);
+      if ((ret = km_check_fd_pair(vcpu, pipefd)) != 0) {
+         return ret;
+      }
       km_connect_files(vcpu, pipefd);
       km_infox(KM_TRACE_FILESYS, "pipefd's %d %d", pipefd[0], pipefd[1]);
    }
@@ -1225,6 +1479,9 @@ uint64_t km_fs_pipe2(km_vcpu_t* vcpu, int pipefd[2], int flags)
           km_add_guest_fd_internal(vcpu, host_pipefd[0], NULL, flags | O_RDONLY, KM_FILE_HOW_PIPE_0, NULL);
       pipefd[1] =
           km_add_guest_fd_internal(vcpu, host_pipefd[1], NULL, flags | O_WRONLY, KM_FILE_HOW_PIPE_1, NULL);
+      if ((ret = km_check_fd_pair(vcpu, pipefd)) != 0) {
+         return ret;
+      }
       km_connect_files(vcpu, pipefd);
       km_infox(KM_TRACE_FILESYS, "pipefd's %d %d", pipefd[0], pipefd[1]);
    }
@@ -1241,6 +1498,103 @@ uint64_t km_fs_eventfd2(km_vcpu_t* vcpu, int initval, int flags)
    return ret;
 }
 
+// int memfd_create(const char* name, unsigned int flags);
+uint64_t km_fs_memfd_create(km_vcpu_t* vcpu, char* name, unsigned int flags)
+{
+   int ret = __syscall_2(SYS_memfd_create, (uintptr_t)name, flags);
+   if (ret >= 0) {
+      // name comes from the host, "/memfd:<name> (deleted)"
+      int oflags = O_RDWR | ((flags & MFD_CLOEXEC) != 0 ? O_CLOEXEC : 0);
+      ret = km_add_guest_fd_internal(vcpu, ret, NULL, oflags, KM_FILE_HOW_OPEN, NULL);
+   }
+   return ret;
+}
+
+// int timerfd_create(int clockid, int flags);
+uint64_t km_fs_timerfd_create(km_vcpu_t* vcpu, int clockid, int flags)
+{
+   int ret = __syscall_2(SYS_timerfd_create, clockid, flags);
+   if (ret >= 0) {
+      ret = km_add_guest_fd_internal(vcpu, ret, NULL, flags, KM_FILE_HOW_TIMERFD, NULL);
+   }
+   return ret;
+}
+
+// int timerfd_settime(int fd, int flags, const struct itimerspec* new, struct itimerspec* old);
+uint64_t km_fs_timerfd_settime(km_vcpu_t* vcpu,
+                               int fd,
+                               int flags,
+                               struct itimerspec* new_value,
+                               struct itimerspec* old_value)
+{
+   int host_fd;
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, fd);
+   if (ret != 0) {
+      return ret;
+   }
+   return __syscall_4(SYS_timerfd_settime,
+                      host_fd,
+                      flags,
+                      (uintptr_t)new_value,
+                      (uintptr_t)old_value);
+}
+
+// int timerfd_gettime(int fd, struct itimerspec* curr_value);
+uint64_t km_fs_timerfd_gettime(km_vcpu_t* vcpu, int fd, struct itimerspec* curr_value)
+{
+   int host_fd;
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, fd);
+   if (ret != 0) {
+      return ret;
+   }
+   return __syscall_2(SYS_timerfd_gettime, host_fd, (uintptr_t)curr_value);
+}
+
+/*
+ * int signalfd4(int fd, const sigset_t* mask, size_t sizemask, int flags);
+ * Guest signals are in km queues, so the host side of signalfd is an eventfd used for readiness
+ * only, see km_signalfd_read().
+ */
+uint64_t km_fs_signalfd4(km_vcpu_t* vcpu, int fd, km_sigset_t* mask, size_t sizemask, int flags)
+{
+   int ret;
+
+   if (sizemask != sizeof(km_sigset_t) || (flags & ~(SFD_CLOEXEC | SFD_NONBLOCK)) != 0) {
+      return -EINVAL;
+   }
+   if (fd != -1) {
+      if (km_fs_g2h_fd(fd, NULL) < 0) {
+         return -EBADF;
+      }
+      if (km_fs_file(fd)->how != KM_FILE_HOW_SIGNALFD) {
+         return -EINVAL;
+      }
+      return km_signalfd_setmask(vcpu, fd, *mask) < 0 ? -ENOMEM : fd;
+   }
+   // SFD_* are the same as EFD_*
+   if ((ret = __syscall_2(SYS_eventfd2, 0, flags)) < 0) {
+      return ret;
+   }
+   ret = km_add_guest_fd_internal(vcpu,
+                                  ret,
+                                  "anon_inode:[signalfd]",
+                                  flags,
+                                  KM_FILE_HOW_SIGNALFD,
+                                  NULL);
+   if (ret >= 0 && km_signalfd_setmask(vcpu, ret, *mask) < 0) {
+      del_guest_fd(vcpu, ret);
+      close(ret);
+      ret = -ENOMEM;
+   }
+   return ret;
+}
+
 // int socket(int domain, int type, int protocol);
 uint64_t km_fs_socket(km_vcpu_t* vcpu, int domain, int type, int protocol)
 {
@@ -1283,6 +1637,36 @@ km_fs_setsockopt(km_vcpu_t* vcpu, int sockfd, int level, int optname, void* optv
    return ret;
 }
 
+// translate file descriptors sent in SCM_RIGHTS, if any
+static void km_fs_msg_send_fds(struct msghdr* msg)
+{
+   for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+      if (cmsg->cmsg_type == SCM_RIGHTS) {
+         int guest_fd = *(int*)CMSG_DATA(cmsg);
+         int host_fd = km_fs_g2h_fd(guest_fd, NULL);
+         *(int*)CMSG_DATA(cmsg) = host_fd;
+         km_infox(KM_TRACE_FILESYS, "send guest fd %d as host %d\n", guest_fd, host_fd);
+      }
+   }
+}
+
+// receive file descriptors from SCM_RIGHTS, if any
+static void km_fs_msg_recv_fds(km_vcpu_t* vcpu, struct msghdr* msg, int flag)
+{
+   for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+      if (cmsg->cmsg_type == SCM_RIGHTS) {
+         int host_fd = *(int*)CMSG_DATA(cmsg);
+         int guest_fd =
+             km_add_guest_fd_internal(vcpu, host_fd, NULL, flag, KM_FILE_HOW_RECVMSG, NULL);
+         if (guest_fd < 0) {
+            msg->msg_flags |= MSG_CTRUNC;   // that's what Linux does when out of fds
+         }
+         *(int*)CMSG_DATA(cmsg) = guest_fd;
+         km_infox(KM_TRACE_FILESYS, "received host fd %d as guest %d\n", host_fd, guest_fd);
+      }
+   }
+}
+
 // ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
 // ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags);
 uint64_t km_fs_sendrecvmsg(km_vcpu_t* vcpu, int scall, int sockfd, struct msghdr* msg, int flag)
@@ -1296,27 +1680,44 @@ uint64_t km_fs_sendrecvmsg(km_vcpu_t* vcpu, int scall, int sockfd, struct msghdr
       return ret;
    }
    if (scall == SYS_sendmsg) {
-      // translate sent file descriptors if any
-      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
-         if (cmsg->cmsg_type == SCM_RIGHTS) {
-            int guest_fd = *(int*)CMSG_DATA(cmsg);
-            int host_fd = km_fs_g2h_fd(guest_fd, NULL);
-            *(int*)CMSG_DATA(cmsg) = host_fd;
-            km_infox(KM_TRACE_FILESYS, "send guest fd %d as host %d\n", guest_fd, host_fd);
-         }
-      }
+      km_fs_msg_send_fds(msg);
    }
    ret = __syscall_3(scall, host_sockfd, (uintptr_t)msg, flag);
    if (scall == SYS_recvmsg) {
-      // receive file descriptors if any
-      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
-         if (cmsg->cmsg_type == SCM_RIGHTS) {
-            int host_fd = *(int*)CMSG_DATA(cmsg);
-            int guest_fd =
-                km_add_guest_fd_internal(vcpu, host_fd, NULL, flag, KM_FILE_HOW_RECVMSG, NULL);
-            *(int*)CMSG_DATA(cmsg) = guest_fd;
-            km_infox(KM_TRACE_FILESYS, "received host fd %d as guest %d\n", host_fd, guest_fd);
-         }
+      km_fs_msg_recv_fds(vcpu, msg, flag);
+   }
+   return ret;
+}
+
+// int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+// int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+//              struct timespec *timeout);
+uint64_t km_fs_sendrecvmmsg(km_vcpu_t* vcpu,
+                            int scall,
+                            int sockfd,
+                            struct mmsghdr* msgvec,
+                            unsigned int vlen,
+                            int flag,
+                            struct timespec* timeout)
+{
+   int host_sockfd;
+   if ((host_sockfd = km_fs_g2h_fd(sockfd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, sockfd);
+   if (ret != 0) {
+      return ret;
+   }
+   if (scall == SYS_sendmmsg) {
+      for (int i = 0; i < vlen; i++) {
+         km_fs_msg_send_fds(&msgvec[i].msg_hdr);
+      }
+   }
+   ret = __syscall_5(scall, host_sockfd, (uintptr_t)msgvec, vlen, flag, (uintptr_t)timeout);
+   if (scall == SYS_recvmmsg) {
+      // only the first ret messages were filled in
+      for (int i = 0; i < ret; i++) {
+         km_fs_msg_recv_fds(vcpu, &msgvec[i].msg_hdr, flag);
       }
    }
    return ret;
@@ -1384,26 +1785,117 @@ uint64_t km_fs_copy_file_range(
    return ret;
 }
 
-// int getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
-// int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
-uint64_t
-km_fs_get_sock_peer_name(km_vcpu_t* vcpu, int hc, int sockfd, struct sockaddr* addr, socklen_t* addrlen)
+/*
+ * Check guest fd used as one end of splice(), tee() or vmsplice(). 'out' is non-zero for the end
+ * data goes to. Ends of pipe() pipes have to be used in the direction they were opened for, files
+ * synthesized by km (/proc and such) cannot be spliced. Sets *is_pipe if fd is known to be a pipe.
+ * Returns host fd or negative errno.
+ */
+static int km_fs_splice_fd(km_vcpu_t* vcpu, int fd, int out, int* is_pipe)
 {
-   int host_sockfd;
-   if ((host_sockfd = km_fs_g2h_fd(sockfd, NULL)) < 0) {
+   int host_fd;
+   km_file_ops_t* ops;
+   if ((host_fd = km_fs_g2h_fd(fd, &ops)) < 0) {
       return -EBADF;
    }
-   int ret = km_guestfd_error(vcpu, sockfd);
+   int ret = km_guestfd_error(vcpu, fd);
    if (ret != 0) {
       return ret;
    }
-   ret = __syscall_3(hc, host_sockfd, (uintptr_t)addr, (uintptr_t)addrlen);
-   return ret;
+   if (ops != NULL && ops->read_g2h != NULL) {
+      km_warnx("bad fd in splice");
+      return -EINVAL;
+   }
+   int how = km_fs_file(fd)->how;
+   if ((how == KM_FILE_HOW_PIPE_0 && out != 0) || (how == KM_FILE_HOW_PIPE_1 && out == 0)) {
+      return -EBADF;
+   }
+   *is_pipe = how == KM_FILE_HOW_PIPE_0 || how == KM_FILE_HOW_PIPE_1;
+   return host_fd;
 }
 
-// int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
-uint64_t km_fs_bind(km_vcpu_t* vcpu, int sockfd, struct sockaddr* addr, socklen_t addrlen)
-{
+// ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+// unsigned int flags);
+uint64_t km_fs_splice(
+    km_vcpu_t* vcpu, int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len, unsigned int flags)
+{
+   int in_pipe, out_pipe;
+   int host_infd, host_outfd;
+   if ((host_infd = km_fs_splice_fd(vcpu, fd_in, 0, &in_pipe)) < 0) {
+      return host_infd;
+   }
+   if ((host_outfd = km_fs_splice_fd(vcpu, fd_out, 1, &out_pipe)) < 0) {
+      return host_outfd;
+   }
+   if ((in_pipe != 0 && off_in != NULL) || (out_pipe != 0 && off_out != NULL)) {
+      return -ESPIPE;
+   }
+   return __syscall_6(SYS_splice,
+                      host_infd,
+                      (uintptr_t)off_in,
+                      host_outfd,
+                      (uintptr_t)off_out,
+                      len,
+                      flags);
+}
+
+// ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+uint64_t km_fs_tee(km_vcpu_t* vcpu, int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+   int in_pipe, out_pipe;
+   int host_infd, host_outfd;
+   if ((host_infd = km_fs_splice_fd(vcpu, fd_in, 0, &in_pipe)) < 0) {
+      return host_infd;
+   }
+   if ((host_outfd = km_fs_splice_fd(vcpu, fd_out, 1, &out_pipe)) < 0) {
+      return host_outfd;
+   }
+   return __syscall_4(SYS_tee, host_infd, host_outfd, len, flags);
+}
+
+// ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs, unsigned int flags);
+uint64_t
+km_fs_vmsplice(km_vcpu_t* vcpu, int fd, struct iovec* iov, size_t nr_segs, unsigned int flags)
+{
+   int is_pipe;
+   int host_fd;
+   int how;
+
+   if ((host_fd = km_fs_g2h_fd(fd, NULL)) < 0) {
+      return -EBADF;
+   }
+   // direction depends on which end of the pipe fd is, so check against the one fd is opened for
+   how = km_fs_file(fd)->how;
+   if ((host_fd = km_fs_splice_fd(vcpu, fd, how != KM_FILE_HOW_PIPE_0, &is_pipe)) < 0) {
+      return host_fd;
+   }
+   /*
+    * Never gift guest memory pages to the pipe, they are part of KVM memory slots and have to stay
+    * where they are.
+    */
+   return __syscall_4(SYS_vmsplice, host_fd, (uintptr_t)iov, nr_segs, flags & ~SPLICE_F_GIFT);
+}
+
+// int getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+// int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+uint64_t
+km_fs_get_sock_peer_name(km_vcpu_t* vcpu, int hc, int sockfd, struct sockaddr* addr, socklen_t* addrlen)
+{
+   int host_sockfd;
+   if ((host_sockfd = km_fs_g2h_fd(sockfd, NULL)) < 0) {
+      return -EBADF;
+   }
+   int ret = km_guestfd_error(vcpu, sockfd);
+   if (ret != 0) {
+      return ret;
+   }
+   ret = __syscall_3(hc, host_sockfd, (uintptr_t)addr, (uintptr_t)addrlen);
+   return ret;
+}
+
+// int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+uint64_t km_fs_bind(km_vcpu_t* vcpu, int sockfd, struct sockaddr* addr, socklen_t addrlen)
+{
    int host_sockfd;
    if ((host_sockfd = km_fs_g2h_fd(sockfd, NULL)) < 0) {
       return -EBADF;
@@ -1414,7 +1906,7 @@ uint64_t km_fs_bind(km_vcpu_t* vcpu, int sockfd, struct sockaddr* addr, socklen_
    }
    ret = __syscall_3(SYS_bind, host_sockfd, (uintptr_t)addr, addrlen);
    if (ret == 0) {
-      km_fd_socket_t* sock = km_fs()->guest_files[sockfd].sockinfo;
+      km_fd_socket_t* sock = km_fs_file(sockfd)->sockinfo;
       sock->addrlen = addrlen;
       memcpy(sock->addr, addr, addrlen);
       sock->state = KM_SOCK_STATE_BIND;
@@ -1435,7 +1927,7 @@ uint64_t km_fs_listen(km_vcpu_t* vcpu, int sockfd, int backlog)
    }
    ret = __syscall_2(SYS_listen, host_sockfd, backlog);
    if (ret == 0) {
-      km_fd_socket_t* sock = km_fs()->guest_files[sockfd].sockinfo;
+      km_fd_socket_t* sock = km_fs_file(sockfd)->sockinfo;
       sock->state = KM_SOCK_STATE_LISTEN;
       sock->backlog = backlog;
    }
@@ -1457,14 +1949,13 @@ uint64_t km_fs_accept(km_vcpu_t* vcpu, int sockfd, struct sockaddr* addr, sockle
    if (hostfd < 0) {
       return hostfd;
    }
-   km_fd_socket_t* lsock = km_fs()->guest_files[sockfd].sockinfo;
+   km_fd_socket_t* lsock = km_fs_file(sockfd)->sockinfo;
    int guestfd =
        km_add_socket_fd(vcpu, hostfd, NULL, 0, lsock->domain, lsock->type, lsock->protocol, KM_FILE_HOW_ACCEPT);
    if (guestfd < 0) {
-      close(hostfd);
-      return -ENOMEM;
+      return guestfd;   // hostfd is closed already
    }
-   km_fd_socket_t* sock = km_fs()->guest_files[guestfd].sockinfo;
+   km_fd_socket_t* sock = km_fs_file(guestfd)->sockinfo;
    sock->state = KM_SOCK_STATE_ACCEPT;
    return guestfd;
 }
@@ -1482,7 +1973,7 @@ uint64_t km_fs_connect(km_vcpu_t* vcpu, int sockfd, struct sockaddr* addr, sockl
    }
    ret = __syscall_3(SYS_connect, host_sockfd, (uintptr_t)addr, (uintptr_t)addrlen);
    if (ret >= 0) {
-      km_fd_socket_t* sock = km_fs()->guest_files[sockfd].sockinfo;
+      km_fd_socket_t* sock = km_fs_file(sockfd)->sockinfo;
       sock->state = KM_SOCK_STATE_CONNECT;
    }
    return ret;
@@ -1498,6 +1989,9 @@ uint64_t km_fs_socketpair(km_vcpu_t* vcpu, int domain, int type, int protocol, i
           km_add_socket_fd(vcpu, host_sv[0], NULL, 0, domain, type, protocol, KM_FILE_HOW_SOCKETPAIR0);
       sv[1] =
           km_add_socket_fd(vcpu, host_sv[1], NULL, 0, domain, type, protocol, KM_FILE_HOW_SOCKETPAIR1);
+      if ((ret = km_check_fd_pair(vcpu, sv)) != 0) {
+         return ret;
+      }
       km_connect_files(vcpu, sv);
    }
    return ret;
@@ -1517,7 +2011,7 @@ km_fs_accept4(km_vcpu_t* vcpu, int sockfd, struct sockaddr* addr, socklen_t* add
    }
    ret = __syscall_4(SYS_accept4, host_sockfd, (uintptr_t)addr, (uintptr_t)addrlen, flags);
    if (ret >= 0) {
-      km_fd_socket_t* sock = km_fs()->guest_files[sockfd].sockinfo;
+      km_fd_socket_t* sock = km_fs_file(sockfd)->sockinfo;
       ret = km_add_socket_fd(vcpu, ret, NULL, 0, sock->domain, sock->type, sock->protocol, KM_FILE_HOW_ACCEPT);
    }
    return ret;
@@ -1566,13 +2060,21 @@ uint64_t km_fs_recvfrom(
 // returns 1 if the have a KM level error on a fd in a select set.
 static int km_fs_select_error(km_vcpu_t* vcpu, int nfds, fd_set* fds)
 {
+   const int nbits = 8 * sizeof(__FDS_BITS(fds)[0]);
+
    if (fds == NULL) {
       return 0;
    }
-   for (int i = 0; i < nfds; i++) {
-      if (FD_ISSET(i, fds)) {
-         km_file_t* file = &km_fs()->guest_files[i];
-         if (km_is_file_used(file) != 0 && file->error != 0) {
+   nfds = MIN(nfds, km_fs()->nfdmap);
+   // only look at the fds that are set, a word at a time
+   for (int w = 0; w * nbits < nfds; w++) {
+      for (unsigned long bits = __FDS_BITS(fds)[w]; bits != 0; bits &= bits - 1) {
+         int i = w * nbits + __builtin_ctzl(bits);
+         if (i >= nfds) {
+            break;
+         }
+         km_file_t* file = km_fs_file(i);
+         if (file != NULL && km_is_file_used(file) != 0 && file->error != 0) {
             FD_ZERO(fds);
             FD_SET(i, fds);
             return 1;
@@ -1585,6 +2087,9 @@ static int km_fs_select_error(km_vcpu_t* vcpu, int nfds, fd_set* fds)
 static int
 km_fs_check_select_errors(km_vcpu_t* vcpu, int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds)
 {
+   if (km_fs_any_error() == 0) {
+      return 0;
+   }
    if (km_fs_select_error(vcpu, nfds, exceptfds) != 0) {
       FD_ZERO(readfds);
       FD_ZERO(writefds);
@@ -1652,30 +2157,197 @@ uint64_t km_fs_select(km_vcpu_t* vcpu,
    return select(nfds, readfds, writefds, exceptfds, timeout);
 }
 
-// int poll(struct pollfd *fds, nfds_t nfds, int timeout);
-uint64_t km_fs_poll(km_vcpu_t* vcpu, struct pollfd* fds, nfds_t nfds, int timeout)
+/*
+ * revents km has to report for 'pfd' itself, or 0 to leave it to the host. Past the guest range the
+ * host fd with the same number is km's own, so that is POLLNVAL. fds with a km level error get
+ * POLLERR | POLLHUP. Closed fds in the guest range are closed on the host too and get POLLNVAL from
+ * there, negative fds are ignored.
+ */
+static inline short km_fs_poll_revents(struct pollfd* pfd, int errors)
 {
-   for (int i = 0; i < nfds; i++) {
-      if (km_fs_g2h_fd(fds[i].fd, NULL) < 0) {
-         return -EBADF;
+   km_file_t* file;
+
+   if (pfd->fd < 0) {
+      return 0;
+   }
+   if (pfd->fd >= km_fs()->nfdmap) {
+      return POLLNVAL;
+   }
+   if (errors != 0 && (file = km_fs_file(pfd->fd)) != NULL && km_is_file_used(file) != 0 &&
+       file->error != 0) {
+      return POLLERR | POLLHUP;
+   }
+   return 0;
+}
+
+/*
+ * poll() and ppoll(). Guest and host fds are the same, so normally the guest array goes to the host
+ * as is. If km has to answer for some fds (see km_fs_poll_revents()) these are already ready, so
+ * the rest is polled without waiting on a copy with those fds hidden.
+ */
+static int km_fs_do_poll(km_vcpu_t* vcpu,
+                         struct pollfd* fds,
+                         nfds_t nfds,
+                         struct timespec* tmo_p,
+                         const km_sigset_t* sigmask)
+{
+   int nfdmap = km_fs()->nfdmap;
+   int errors = km_fs_any_error();
+   nfds_t i;
+
+   if (nfds > km_fs()->nofile.rlim_cur) {
+      return -EINVAL;
+   }
+   for (i = 0; i < nfds; i++) {
+      if (fds[i].fd >= nfdmap || (errors != 0 && km_fs_poll_revents(&fds[i], errors) != 0)) {
+         break;
       }
-      int ret = km_guestfd_error(vcpu, i);
-      if (ret != 0) {
-         fds[i].revents = POLLERR;
-         return ret;
+   }
+   if (i == nfds) {
+      return __syscall_5(SYS_ppoll,
+                         (uintptr_t)fds,
+                         nfds,
+                         (uintptr_t)tmo_p,
+                         (uintptr_t)sigmask,
+                         sizeof(km_sigset_t));
+   }
+
+   struct pollfd* hfds = malloc(nfds * sizeof(struct pollfd));
+   struct timespec nowait = {};
+   int ret;
+
+   if (hfds == NULL) {
+      return -ENOMEM;
+   }
+   for (i = 0; i < nfds; i++) {
+      hfds[i] = fds[i];
+      if (km_fs_poll_revents(&fds[i], errors) != 0) {
+         hfds[i].fd = -1;
+      }
+   }
+   if ((ret = __syscall_5(SYS_ppoll, (uintptr_t)hfds, nfds, (uintptr_t)&nowait, 0, 0)) >= 0) {
+      ret = 0;
+      for (i = 0; i < nfds; i++) {
+         short revents = km_fs_poll_revents(&fds[i], errors);
+         if ((fds[i].revents = revents != 0 ? revents : hfds[i].revents) != 0) {
+            ret++;
+         }
       }
    }
-   int ret = __syscall_3(SYS_poll, (uintptr_t)fds, nfds, timeout);
+   free(hfds);
+   return ret;
+}
+
+// int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+uint64_t km_fs_poll(km_vcpu_t* vcpu, struct pollfd* fds, nfds_t nfds, int timeout)
+{
+   struct timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000};
+
+   return km_fs_do_poll(vcpu, fds, nfds, timeout < 0 ? NULL : &ts, NULL);
+}
+
+// int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
+//  const sigset_t *sigmask, size_t sigsetsize);
+uint64_t km_fs_ppoll(km_vcpu_t* vcpu,
+                     struct pollfd* fds,
+                     nfds_t nfds,
+                     struct timespec* tmo_p,
+                     const sigset_t* sigmask,
+                     size_t sigsetsize)
+{
+   if (sigmask != NULL && sigsetsize != sizeof(km_sigset_t)) {
+      return -EINVAL;
+   }
+   // Account for sigmask changes in vcpu, like pselect6
+   km_sigset_t oldset;
+   if (sigmask != NULL) {
+      oldset = vcpu->sigmask;
+      vcpu->sigmask = *(km_sigset_t*)sigmask;
+   }
+   int ret = km_fs_do_poll(vcpu, fds, nfds, tmo_p, (km_sigset_t*)sigmask);
+   if (sigmask != NULL) {
+      vcpu->sigmask = oldset;
+   }
    return ret;
 }
 
 /*
  * epoll handling
+ *
+ * Every registration on a guest epoll fd is mirrored in a km_fs_event_t so epoll fds can be
+ * saved and recreated for exec and snapshots. Event loops re-arm (EPOLL_CTL_MOD) and remove
+ * thousands of fds on each iteration, so events are hashed by fd, and come from a pool rather
+ * than malloc.
  */
-static inline km_fs_event_t* km_fs_event_find(km_vcpu_t* vcpu, km_file_t* file, int fd)
+#define KM_FS_EVENT_HASH_MIN 16
+#define KM_FS_EVENT_POOL_BATCH 256
+
+static km_fs_event_t* km_fs_event_pool;   // free events, linked via hnext
+static pthread_mutex_t km_fs_event_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static km_fs_event_t* km_fs_event_alloc(void)
+{
+   km_fs_event_t* event;
+
+   km_mutex_lock(&km_fs_event_pool_mutex);
+   if (km_fs_event_pool == NULL) {
+      km_fs_event_t* batch = calloc(KM_FS_EVENT_POOL_BATCH, sizeof(km_fs_event_t));
+      if (batch == NULL) {
+         km_mutex_unlock(&km_fs_event_pool_mutex);
+         return NULL;
+      }
+      for (int i = 0; i < KM_FS_EVENT_POOL_BATCH - 1; i++) {
+         batch[i].hnext = &batch[i + 1];
+      }
+      km_fs_event_pool = batch;
+   }
+   event = km_fs_event_pool;
+   km_fs_event_pool = event->hnext;
+   km_mutex_unlock(&km_fs_event_pool_mutex);
+   event->hnext = NULL;
+   return event;
+}
+
+static void km_fs_event_release(km_fs_event_t* event)
+{
+   km_mutex_lock(&km_fs_event_pool_mutex);
+   event->hnext = km_fs_event_pool;
+   km_fs_event_pool = event;
+   km_mutex_unlock(&km_fs_event_pool_mutex);
+}
+
+static inline km_fs_event_t** km_fs_event_bucket(km_file_t* file, int fd)
+{
+   return &file->evhash[fd & file->evmask];
+}
+
+// Double the hash table so there is at least one bucket per event. Returns 0 or -1 on ENOMEM.
+static int km_fs_event_rehash(km_file_t* file)
 {
+   int nbuckets = file->evhash == NULL ? KM_FS_EVENT_HASH_MIN : (file->evmask + 1) * 2;
+   km_fs_event_t** evhash = calloc(nbuckets, sizeof(km_fs_event_t*));
    km_fs_event_t* event;
+
+   if (evhash == NULL) {
+      return -1;
+   }
+   free(file->evhash);
+   file->evhash = evhash;
+   file->evmask = nbuckets - 1;
    TAILQ_FOREACH (event, &file->events, link) {
+      km_fs_event_t** bucket = km_fs_event_bucket(file, event->fd);
+      event->hnext = *bucket;
+      *bucket = event;
+   }
+   return 0;
+}
+
+static inline km_fs_event_t* km_fs_event_find(km_vcpu_t* vcpu, km_file_t* file, int fd)
+{
+   if (file->evhash == NULL) {
+      return NULL;
+   }
+   for (km_fs_event_t* event = *km_fs_event_bucket(file, fd); event != NULL; event = event->hnext) {
       if (event->fd == fd) {
          return event;
       }
@@ -1683,14 +2355,51 @@ static inline km_fs_event_t* km_fs_event_find(km_vcpu_t* vcpu, km_file_t* file,
    return NULL;
 }
 
+/*
+ * Adds event for fd to epoll fd file, at the end of the events list. Also used to rebuild epoll
+ * fds state on exec and snapshot recovery. Returns 0 or -1 on ENOMEM.
+ */
+int km_fs_event_insert(km_file_t* file, int fd, struct epoll_event* event)
+{
+   km_fs_event_t* fevent;
+
+   if (file->nevents >= (file->evhash == NULL ? 0 : file->evmask + 1) &&
+       km_fs_event_rehash(file) != 0) {
+      return -1;
+   }
+   if ((fevent = km_fs_event_alloc()) == NULL) {
+      return -1;
+   }
+   fevent->fd = fd;
+   fevent->event = *event;
+   TAILQ_INSERT_TAIL(&file->events, fevent, link);
+   km_fs_event_t** bucket = km_fs_event_bucket(file, fd);
+   fevent->hnext = *bucket;
+   *bucket = fevent;
+   file->nevents++;
+   return 0;
+}
+
+// Drops all events of epoll fd file.
+void km_fs_events_free(km_file_t* file)
+{
+   km_fs_event_t* event;
+
+   while ((event = TAILQ_FIRST(&file->events)) != NULL) {
+      TAILQ_REMOVE(&file->events, event, link);
+      km_fs_event_release(event);
+   }
+   free(file->evhash);
+   km_fs_events_init(file);
+}
+
 static inline void
 km_fs_event_add(km_vcpu_t* vcpu, km_file_t* file, int guestfd, struct epoll_event* event)
 {
    km_assert(km_fs_event_find(vcpu, file, guestfd) == NULL);
-   km_fs_event_t eval = {.fd = guestfd, .event = *event};
-   km_fs_event_t* fevent = (km_fs_event_t*)calloc(1, sizeof(km_fs_event_t));
-   *fevent = eval;
-   TAILQ_INSERT_TAIL(&file->events, fevent, link);
+   if (km_fs_event_insert(file, guestfd, event) != 0) {
+      km_errx(1, "no memory for epoll event, fd %d", guestfd);
+   }
 }
 
 static inline void
@@ -1704,10 +2413,17 @@ km_fs_event_mod(km_vcpu_t* vcpu, km_file_t* file, int guestfd, struct epoll_even
 static inline void
 km_fs_event_del(km_vcpu_t* vcpu, km_file_t* file, int guestfd, struct epoll_event* event)
 {
-   km_fs_event_t* fevent = km_fs_event_find(vcpu, file, guestfd);
+   km_assert(file->evhash != NULL);
+   km_fs_event_t** prev = km_fs_event_bucket(file, guestfd);
+   while (*prev != NULL && (*prev)->fd != guestfd) {
+      prev = &(*prev)->hnext;
+   }
+   km_fs_event_t* fevent = *prev;
    km_assert(fevent != NULL);
+   *prev = fevent->hnext;
    TAILQ_REMOVE(&file->events, fevent, link);
-   free(fevent);
+   file->nevents--;
+   km_fs_event_release(fevent);
 }
 
 // int epoll_create1(int flags);
@@ -1732,7 +2448,7 @@ uint64_t km_fs_epoll_ctl(km_vcpu_t* vcpu, int epfd, int op, int fd, struct epoll
    }
    int ret = __syscall_4(SYS_epoll_ctl, host_epfd, op, host_fd, (uintptr_t)event);
    if (ret == 0) {
-      km_file_t* file = &km_fs()->guest_files[epfd];
+      km_file_t* file = km_fs_file(epfd);
       switch (op) {
          case EPOLL_CTL_ADD:
             km_fs_event_add(vcpu, file, fd, event);
@@ -1754,7 +2470,7 @@ km_fs_event_check_errors(km_vcpu_t* vcpu, km_file_t* file, struct epoll_event* e
    km_fs_event_t* event;
    int errors = 0;
    TAILQ_FOREACH (event, &file->events, link) {
-      km_file_t* efile = &km_fs()->guest_files[event->fd];
+      km_file_t* efile = km_fs_file(event->fd);
       if (km_is_file_used(efile) != 0 && efile->error != 0) {
          events[errors].events = EPOLLERR | EPOLLHUP;
          events[errors].data = event->event.data;
@@ -1766,19 +2482,64 @@ km_fs_event_check_errors(km_vcpu_t* vcpu, km_file_t* file, struct epoll_event* e
    return errors;
 }
 
-// int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
-uint64_t
-km_fs_epoll_wait(km_vcpu_t* vcpu, int epfd, struct epoll_event* events, int maxevents, int timeout)
+/*
+ * epoll_wait(), epoll_pwait() and epoll_pwait2(), 'hc' is the host syscall to use and 'timeout' its
+ * argument. Registered fds with a km level error are reported as EPOLLERR | EPOLLHUP without
+ * asking the host.
+ */
+static int km_fs_do_epoll_wait(km_vcpu_t* vcpu,
+                               int hc,
+                               int epfd,
+                               struct epoll_event* events,
+                               int maxevents,
+                               uint64_t timeout,
+                               const sigset_t* sigmask,
+                               size_t sigsetsize)
 {
    int host_epfd;
+   int ret;
+
    if ((host_epfd = km_fs_g2h_fd(epfd, NULL)) < 0) {
       return -EBADF;
    }
-
-   int ret = __syscall_4(SYS_epoll_wait, host_epfd, (uintptr_t)events, maxevents, timeout);
+   if (sigmask != NULL && sigsetsize != sizeof(km_sigset_t)) {
+      return -EINVAL;
+   }
+   if (maxevents > 0 && km_fs_any_error() != 0 &&
+       (ret = km_fs_event_check_errors(vcpu, km_fs_file(epfd), events, maxevents)) > 0) {
+      return ret;
+   }
+   if (km_idle_poll_ns != 0 && maxevents > 0 &&
+       (ret = km_idle_epoll_poll(vcpu, hc, host_epfd, events, maxevents, timeout)) != 0) {
+      return ret;
+   }
+   // Account for sigmask changes in vcpu, like pselect6
+   km_sigset_t oldset;
+   if (sigmask != NULL) {
+      oldset = vcpu->sigmask;
+      vcpu->sigmask = *(km_sigset_t*)sigmask;
+   }
+   // a kick that came in since the hypercall started wouldn't interrupt the host wait
+   if (km_vcpu_kicked(vcpu) != 0) {
+      ret = -EINTR;
+   } else {
+      ret = __syscall_6(
+          hc, host_epfd, (uintptr_t)events, maxevents, timeout, (uintptr_t)sigmask, sigsetsize);
+   }
+   if (sigmask != NULL) {
+      vcpu->sigmask = oldset;
+   }
    return ret;
 }
 
+// int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+uint64_t
+km_fs_epoll_wait(km_vcpu_t* vcpu, int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+   return km_fs_do_epoll_wait(
+       vcpu, SYS_epoll_pwait, epfd, events, maxevents, timeout, NULL, sizeof(km_sigset_t));
+}
+
 // int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout,
 //  const sigset_t *sigmask);
 uint64_t km_fs_epoll_pwait(km_vcpu_t* vcpu,
@@ -1789,19 +2550,22 @@ uint64_t km_fs_epoll_pwait(km_vcpu_t* vcpu,
                            const sigset_t* sigmask,
                            int sigsetsize)
 {
-   int host_epfd;
-   if ((host_epfd = km_fs_g2h_fd(epfd, NULL)) < 0) {
-      return -EBADF;
-   }
+   return km_fs_do_epoll_wait(
+       vcpu, SYS_epoll_pwait, epfd, events, maxevents, timeout, sigmask, sigsetsize);
+}
 
-   int ret = __syscall_6(SYS_epoll_pwait,
-                         host_epfd,
-                         (uintptr_t)events,
-                         maxevents,
-                         timeout,
-                         (uintptr_t)sigmask,
-                         sigsetsize);
-   return ret;
+// int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents,
+//  const struct timespec *timeout, const sigset_t *sigmask, size_t sigsetsize);
+uint64_t km_fs_epoll_pwait2(km_vcpu_t* vcpu,
+                            int epfd,
+                            struct epoll_event* events,
+                            int maxevents,
+                            struct timespec* timeout,
+                            const sigset_t* sigmask,
+                            size_t sigsetsize)
+{
+   return km_fs_do_epoll_wait(
+       vcpu, SYS_epoll_pwait2, epfd, events, maxevents, (uintptr_t)timeout, sigmask, sigsetsize);
 }
 
 // int prlimit(pid_t pid, int resource, const struct rlimit *new_limit, struct rlimit *old_limit);
@@ -1821,20 +2585,27 @@ uint64_t km_fs_prlimit64(km_vcpu_t* vcpu,
     *       RLIMIT_SIGPENDING - Maximum number of pending signals.
     *       RLIMIT_STACK - maximum size of process stack.
     */
-   struct rlimit tmp;
-   if (resource == RLIMIT_NOFILE && new_limit != NULL) {
-      if (new_limit->rlim_cur > km_fs()->nfdmap) {
-         return -EPERM;
+   if (resource == RLIMIT_NOFILE && (pid == 0 || pid == machine.pid)) {
+      /*
+       * Guest RLIMIT_NOFILE is virtual, km itself runs with the soft limit raised to fit km fds
+       * above the guest range. The hard limit is the size of the guest range.
+       */
+      struct rlimit cur = km_fs()->nofile;
+      if (new_limit != NULL) {
+         if (new_limit->rlim_cur > new_limit->rlim_max) {
+            return -EINVAL;
+         }
+         if (new_limit->rlim_max > km_fs()->nofile.rlim_max) {
+            return -EPERM;
+         }
+         km_fs()->nofile = *new_limit;
       }
-      tmp.rlim_cur += MAX_KM_FILES;
-      tmp = *new_limit;
-      new_limit = &tmp;
-   }
-   int ret = __syscall_4(SYS_prlimit64, pid, resource, (uintptr_t)new_limit, (uintptr_t)old_limit);
-   if (resource == RLIMIT_NOFILE && old_limit != NULL) {
-      old_limit->rlim_cur -= MAX_KM_FILES;
+      if (old_limit != NULL) {
+         *old_limit = cur;
+      }
+      return 0;
    }
-   return ret;
+   return __syscall_4(SYS_prlimit64, pid, resource, (uintptr_t)new_limit, (uintptr_t)old_limit);
 }
 
 // Helper function to return the number of bytes in a pipe or connection
@@ -1851,14 +2622,19 @@ size_t km_fs_core_notes_length()
 {
    size_t ret = 0;
    for (int i = 0; i < km_fs()->nfdmap; i++) {
-      km_file_t* file = &km_fs()->guest_files[i];
+      km_file_t* file = km_fs_file(i);
+      if (file == NULL) {
+         i |= KM_FILES_CHUNK - 1;   // never allocated, skip the whole chunk
+         continue;
+      }
       if (km_is_file_used(file) != 0) {
          if (file->how == KM_FILE_HOW_EVENTFD) {
-            ret += km_note_header_size(KM_NT_NAME) + sizeof(km_nt_eventfd_t);
-            km_fs_event_t* ptr;
-            TAILQ_FOREACH (ptr, &file->events, link) {
-               ret += sizeof(km_nt_event_t);
-            }
+            ret += km_note_header_size(KM_NT_NAME) + sizeof(km_nt_eventfd_t) +
+                   file->nevents * sizeof(km_nt_event_t);
+         } else if (file->how == KM_FILE_HOW_TIMERFD) {
+            ret += km_note_header_size(KM_NT_NAME) + sizeof(km_nt_timerfd_t);
+         } else if (file->how == KM_FILE_HOW_SIGNALFD) {
+            ret += km_note_header_size(KM_NT_NAME) + sizeof(km_nt_signalfd_t);
          } else if (file->sockinfo == NULL) {
             ret += km_note_header_size(KM_NT_NAME) + sizeof(km_nt_file_t) +
                    km_nt_file_padded_size(file->name);
@@ -1968,11 +2744,7 @@ static inline size_t fs_core_write_eventfd(char* buf, size_t length, km_file_t*
    char* cur = buf;
    size_t remain = length;
    km_fs_event_t* event;
-   int nevent = 0;
-
-   TAILQ_FOREACH (event, &file->events, link) {
-      nevent++;
-   }
+   int nevent = file->nevents;
 
    km_infox(KM_TRACE_SNAPSHOT, "fd=%d %s nevent=%d", fd, file->name, nevent);
 
@@ -2021,17 +2793,97 @@ static inline size_t fs_core_write_eventfd(char* buf, size_t length, km_file_t*
    return cur - buf;
 }
 
+/*
+ * clockid and expirations that were not read yet are only visible in fdinfo. A timer armed with
+ * TFD_TIMER_ABSTIME is saved, and recovered, relative to the time of the snapshot.
+ */
+static inline size_t fs_core_write_timerfd(char* buf, size_t length, km_file_t* file, int fd)
+{
+   char* cur = buf;
+   char line[128];
+   int clockid = CLOCK_MONOTONIC;
+   unsigned long long ticks = 0;
+   struct itimerspec its = {};
+   FILE* fp;
+
+   snprintf(line, sizeof(line), "/proc/self/fdinfo/%d", fd);
+   if ((fp = fopen(line, "r")) == NULL) {
+      km_warn("timerfd %d: cannot open %s - ignore", fd, line);
+   } else {
+      while (fgets(line, sizeof(line), fp) != NULL) {
+         if (sscanf(line, "clockid: %d", &clockid) != 1) {
+            sscanf(line, "ticks: %llu", &ticks);
+         }
+      }
+      fclose(fp);
+   }
+   if (timerfd_gettime(fd, &its) < 0) {
+      km_warn("timerfd_gettime failed fd=%d - ignore", fd);
+   }
+   km_infox(KM_TRACE_SNAPSHOT,
+            "fd=%d clockid=%d ticks=%lld value=%ld.%09ld interval=%ld.%09ld",
+            fd,
+            clockid,
+            ticks,
+            its.it_value.tv_sec,
+            its.it_value.tv_nsec,
+            its.it_interval.tv_sec,
+            its.it_interval.tv_nsec);
+
+   cur += km_add_note_header(cur, length, KM_NT_NAME, NT_KM_TIMERFD, sizeof(km_nt_timerfd_t));
+   km_nt_timerfd_t* fnote = (km_nt_timerfd_t*)cur;
+   *fnote = (km_nt_timerfd_t){
+       .size = sizeof(km_nt_timerfd_t),
+       .fd = fd,
+       .flags = file->flags,
+       .clockid = clockid,
+       .ticks = ticks,
+       .value_sec = its.it_value.tv_sec,
+       .value_nsec = its.it_value.tv_nsec,
+       .interval_sec = its.it_interval.tv_sec,
+       .interval_nsec = its.it_interval.tv_nsec,
+   };
+   cur += sizeof(km_nt_timerfd_t);
+   return cur - buf;
+}
+
+// Pending signals are not in the snapshot, only the mask
+static inline size_t fs_core_write_signalfd(char* buf, size_t length, km_file_t* file, int fd)
+{
+   char* cur = buf;
+
+   km_infox(KM_TRACE_SNAPSHOT, "fd=%d mask=0x%lx", fd, km_signalfd_getmask(fd));
+   cur += km_add_note_header(cur, length, KM_NT_NAME, NT_KM_SIGNALFD, sizeof(km_nt_signalfd_t));
+   km_nt_signalfd_t* fnote = (km_nt_signalfd_t*)cur;
+   *fnote = (km_nt_signalfd_t){
+       .size = sizeof(km_nt_signalfd_t),
+       .fd = fd,
+       .flags = file->flags,
+       .mask = km_signalfd_getmask(fd),
+   };
+   cur += sizeof(km_nt_signalfd_t);
+   return cur - buf;
+}
+
 size_t km_fs_core_notes_write(char* buf, size_t length)
 {
    char* cur = buf;
    size_t remain = length;
 
    for (int i = 0; i < km_fs()->nfdmap; i++) {
-      km_file_t* file = &km_fs()->guest_files[i];
+      km_file_t* file = km_fs_file(i);
+      if (file == NULL) {
+         i |= KM_FILES_CHUNK - 1;   // never allocated, skip the whole chunk
+         continue;
+      }
       if (km_is_file_used(file) != 0) {
          size_t sz = 0;
          if (file->how == KM_FILE_HOW_EVENTFD) {
             sz = fs_core_write_eventfd(cur, remain, file, i);
+         } else if (file->how == KM_FILE_HOW_TIMERFD) {
+            sz = fs_core_write_timerfd(cur, remain, file, i);
+         } else if (file->how == KM_FILE_HOW_SIGNALFD) {
+            sz = fs_core_write_signalfd(cur, remain, file, i);
          } else if (file->sockinfo == NULL) {
             sz = fs_core_write_nonsocket(cur, remain, file, i);
          } else {
@@ -2046,8 +2898,6 @@ size_t km_fs_core_notes_write(char* buf, size_t length)
 
 static inline void km_fs_recover_fd(int guestfd, int hostfd, int flags, char* name, int ofd, int how)
 {
-   km_file_t* file = &km_fs()->guest_files[guestfd];
-
    if (guestfd < 0) {
       close(hostfd);
       return;
@@ -2060,12 +2910,13 @@ static inline void km_fs_recover_fd(int guestfd, int hostfd, int flags, char* na
       close(hostfd);
    }
 
+   km_file_t* file = km_fs_file_alloc(guestfd);
    km_set_file_used(file, 1);
    file->how = how;
    file->flags = flags;
    file->name = name;
    file->ofd = ofd;
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
    km_infox(KM_TRACE_SNAPSHOT,
             "guestfd=%d hostfd=%d flags=0x%x name=%s ofd=%d how=%d",
             guestfd,
@@ -2109,7 +2960,7 @@ static inline int km_fs_recover_fdpair(int guestfd[2], int hostfd[2], int how[2]
 
 static inline int km_fs_recover_pipe(km_nt_file_t* nt_file, char* name)
 {
-   km_file_t* file = &km_fs()->guest_files[nt_file->fd];
+   km_file_t* file = km_fs_file_alloc(nt_file->fd);
    if (km_is_file_used(file) != 0) {
       // Filled in by other side
       km_assert(file->ofd == nt_file->data);
@@ -2149,7 +3000,7 @@ static inline int km_fs_recover_socket(km_nt_socket_t* nt_sock, struct sockaddr*
       return -1;
    }
 
-   km_file_t* file = &km_fs()->guest_files[nt_sock->fd];
+   km_file_t* file = km_fs_file_alloc(nt_sock->fd);
    km_assert(km_is_file_used(file) == 0);
 
    int host_fd = socket(nt_sock->domain, nt_sock->type, nt_sock->protocol);
@@ -2181,13 +3032,14 @@ static inline int km_fs_recover_socket_error(km_nt_socket_t* nt_sock)
       km_warn("socket fd %d invalid", nt_sock->fd);
       return -1;
    }
-   km_file_t* file = &km_fs()->guest_files[nt_sock->fd];
+   km_file_t* file = km_fs_file_alloc(nt_sock->fd);
    *file = (km_file_t){.inuse = 1,
                        .how = nt_sock->how,
                        .name = strdup("socket error"),
                        .ofd = nt_sock->other,
                        .error = -ECONNRESET};
-   TAILQ_INIT(&file->events);
+   km_fs_events_init(file);
+   __atomic_add_fetch(&km_fs()->nerrors, 1, __ATOMIC_RELEASE);
    return 0;
 }
 
@@ -2313,30 +3165,793 @@ static int proc_cmdline_open(const char* name, char* buf, size_t bufsz)
    return snprintf(buf, bufsz, "%s%s", PROC_SELF, name + proc_pid_length);
 }
 
-static int proc_self_getdents32(int fd, /* struct linux_dirent* */ void* buf, size_t buf_sz)
+/*
+ * Read of a /proc file generated by km, 'len' bytes at 'content'. The host fd is the real file,
+ * only its offset is used, so sequential reads and lseek(0) work as usual.
+ */
+static int proc_gen_read(int fd, char* buf, size_t buf_sz, const char* content, size_t len)
 {
-   struct linux_dirent {
-      unsigned long d_ino;     /* Inode number */
-      unsigned long d_off;     /* Offset to next linux_dirent */
-      unsigned short d_reclen; /* Length of this linux_dirent */
-      char d_name[];           /* Filename (null-terminated) */
-                               /* length is actually (d_reclen - 2 -
-                                  offsetof(struct linux_dirent, d_name)) */
-      /*
-      char           pad;       // Zero padding byte
-      char           d_type;    // File type (only since Linux
-                                // 2.6.4); offset is (d_reclen - 1)
-      */
-   };
-   int ret = __syscall_3(SYS_getdents, fd, (uint64_t)buf, buf_sz);
-   struct linux_dirent* e;
-   for (off64_t offset = 0; offset < ret; offset += e->d_reclen) {
-      e = (struct linux_dirent*)(buf + offset);
-      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
-         continue;
-      }
-      uint64_t fdno;
-      if (sscanf(e->d_name, "%lu", &fdno) != 1 || fdno >= MAX_OPEN_FILES - MAX_KM_FILES) {
+   off_t pos = lseek(fd, 0, SEEK_CUR);
+
+   if (pos < 0) {
+      return -errno;
+   }
+   if (pos >= len) {
+      return 0;
+   }
+   size_t count = MIN(buf_sz, len - pos);
+   memcpy(buf, content + pos, count);
+   if (lseek(fd, pos + count, SEEK_SET) < 0) {
+      return -errno;
+   }
+   return count;
+}
+
+// Guest comm, the payload file name cut to TASK_COMM_LEN - 1 like the kernel does
+static void proc_guest_comm(char* comm, size_t comm_sz)
+{
+   const char* name = km_guest.km_filename != NULL ? km_guest.km_filename : "";
+   const char* slash = strrchr(name, '/');
+   snprintf(comm, MIN(comm_sz, 16), "%s", slash != NULL ? slash + 1 : name);
+}
+
+// Payload memory layout from its PT_LOAD segments, as in /proc/self/stat
+typedef struct proc_layout {
+   km_gva_t start_code;
+   km_gva_t end_code;
+   km_gva_t start_data;
+   km_gva_t end_data;
+   km_gva_t start_brk;
+   km_gva_t base;   // lowest segment address
+} proc_layout_t;
+
+static void proc_guest_layout(proc_layout_t* l)
+{
+   *l = (proc_layout_t){.start_code = -1, .start_data = -1, .base = -1};
+   for (int i = 0; i < km_guest.km_ehdr.e_phnum; i++) {
+      Elf64_Phdr* phdr = &km_guest.km_phdr[i];
+      if (phdr->p_type != PT_LOAD) {
+         continue;
+      }
+      km_gva_t start = phdr->p_vaddr + km_guest.km_load_adjust;
+      km_gva_t end = start + phdr->p_filesz;
+      if ((phdr->p_flags & PF_X) != 0) {
+         l->start_code = MIN(l->start_code, start);
+         l->end_code = MAX(l->end_code, end);
+      } else {
+         l->start_data = MIN(l->start_data, start);
+         l->end_data = MAX(l->end_data, end);
+      }
+      l->start_brk = MAX(l->start_brk, roundup(start + phdr->p_memsz, KM_PAGE_SIZE));
+      l->base = MIN(l->base, rounddown(start, KM_PAGE_SIZE));
+   }
+   if (l->start_code == -1) {
+      l->start_code = 0;
+   }
+   if (l->start_data == -1) {
+      l->start_data = 0;
+   }
+}
+
+// Guest virtual size: the payload up to brk, and mmaps. km reserves the whole guest VA on the host.
+static size_t proc_guest_vsize(proc_layout_t* l)
+{
+   return (l->base < machine.brk ? machine.brk - l->base : 0) + km_guest_mmap_size();
+}
+
+// A guest address range as shown in /proc/self/maps
+typedef struct proc_region {
+   km_gva_t start;
+   km_gva_t end;
+   int prot;
+   int shared;         // MAP_SHARED
+   int file;           // backed by a file, as opposed to anonymous memory
+   int monitor;        // km pages mapped into the guest, [vdso] and such
+   off_t offset;       // into the file
+   const char* name;   // file name, [tag], or NULL
+   size_t resident;    // pages, see proc_guest_rss()
+} proc_region_t;
+
+typedef void (*proc_region_fn)(proc_region_t* r, void* arg);
+
+static inline int proc_elf_prot(Elf64_Word p_flags)
+{
+   return ((p_flags & PF_R) != 0 ? PROT_READ : 0) | ((p_flags & PF_W) != 0 ? PROT_WRITE : 0) |
+          ((p_flags & PF_X) != 0 ? PROT_EXEC : 0);
+}
+
+// PT_LOAD segments of 'payload' rounded to pages. Returns the end of the last one.
+static km_gva_t proc_elf_regions(km_payload_t* payload, km_gva_t end, proc_region_fn fn, void* arg)
+{
+   for (int i = 0; i < payload->km_ehdr.e_phnum; i++) {
+      Elf64_Phdr* phdr = &payload->km_phdr[i];
+      if (phdr->p_type != PT_LOAD) {
+         continue;
+      }
+      km_gva_t start = phdr->p_vaddr + payload->km_load_adjust;
+      proc_region_t r = {.start = MAX(rounddown(start, KM_PAGE_SIZE), end),
+                         .end = roundup(start + phdr->p_memsz, KM_PAGE_SIZE),
+                         .prot = proc_elf_prot(phdr->p_flags),
+                         .file = 1,
+                         .offset = rounddown(phdr->p_offset, KM_PAGE_SIZE),
+                         .name = payload->km_filename};
+      if (r.start < r.end) {   // segments sharing a page are shown once, as the kernel does
+         fn(&r, arg);
+         end = r.end;
+      }
+   }
+   return end;
+}
+
+typedef struct proc_walk {
+   proc_region_fn fn;
+   void* arg;
+} proc_walk_t;
+
+static void proc_mmap_region(km_mmap_reg_t* reg, void* arg)
+{
+   proc_walk_t* walk = arg;
+   int monitor = reg->km_flags.km_mmap_part_of_monitor;
+   proc_region_t r = {.start = reg->start,
+                      .end = reg->start + reg->size,
+                      .prot = reg->protection,
+                      .shared = (reg->flags & MAP_SHARED) != 0,
+                      .file = reg->filename != NULL && monitor == 0,
+                      .monitor = monitor,
+                      .offset = reg->filename != NULL && monitor == 0 ? reg->offset : 0,
+                      .name = reg->filename};
+   walk->fn(&r, walk->arg);
+}
+
+// Guest regions copied out, so that stat() and mincore() on them run without mmaps lock
+typedef struct proc_regions {
+   proc_region_t* r;
+   size_t cnt;
+   size_t size;
+   int enomem;   // an append failed, the list is incomplete
+} proc_regions_t;
+
+static void proc_regions_add(proc_region_t* r, void* arg)
+{
+   proc_regions_t* regs = arg;
+
+   if (regs->cnt == regs->size) {
+      size_t size = MAX(regs->size * 2, 64);
+      proc_region_t* new = realloc(regs->r, size * sizeof(proc_region_t));
+      if (new == NULL) {
+         regs->enomem = 1;
+         return;
+      }
+      regs->r = new;
+      regs->size = size;
+   }
+   proc_region_t* copy = &regs->r[regs->cnt];
+   *copy = *r;
+   if (r->name != NULL && (copy->name = strdup(r->name)) == NULL) {
+      regs->enomem = 1;
+      return;
+   }
+   regs->cnt++;
+}
+
+static void proc_regions_free(proc_regions_t* regs)
+{
+   for (size_t i = 0; i < regs->cnt; i++) {
+      free((char*)regs->r[i].name);
+   }
+   free(regs->r);
+   *regs = (proc_regions_t){};
+}
+
+/*
+ * Copies guest memory regions to 'regs' in address order: payload and dynamic linker segments, the
+ * heap, then mmaps. Only the copy of mmaps is done with mmaps lock held. Returns the mmaps
+ * generation, see km_guest_mmap_walk().
+ */
+static uint64_t proc_guest_regions(proc_regions_t* regs)
+{
+   km_gva_t end = proc_elf_regions(&km_guest, 0, proc_regions_add, regs);
+   if (km_dynlinker.km_filename != NULL) {
+      end = proc_elf_regions(&km_dynlinker, end, proc_regions_add, regs);
+   }
+   if (end != 0 && roundup(machine.brk, KM_PAGE_SIZE) > end) {
+      proc_region_t heap = {.start = end,
+                            .end = roundup(machine.brk, KM_PAGE_SIZE),
+                            .prot = PROT_READ | PROT_WRITE,
+                            .name = "[heap]"};
+      proc_regions_add(&heap, regs);
+   }
+   proc_walk_t walk = {.fn = proc_regions_add, .arg = regs};
+   return km_guest_mmap_walk(proc_mmap_region, &walk);
+}
+
+static int proc_region_same(proc_region_t* a, proc_region_t* b)
+{
+   if (a->start != b->start || a->end != b->end || a->prot != b->prot || a->shared != b->shared ||
+       a->file != b->file || a->monitor != b->monitor || a->offset != b->offset) {
+      return 0;
+   }
+   if (a->name == NULL || b->name == NULL) {
+      return a->name == b->name;
+   }
+   return strcmp(a->name, b->name) == 0;
+}
+
+// Guest resident set in pages, from mincore() on the km memory backing the guest
+typedef struct proc_rss {
+   size_t anon;
+   size_t file;
+   size_t shmem;
+   size_t data;      // private writable pages, resident or not
+   km_gva_t start;   // lowest and highest guest address mapped
+   km_gva_t end;
+} proc_rss_t;
+
+static size_t proc_resident_pages(km_gva_t start, km_gva_t end)
+{
+   unsigned char vec[1024];
+   size_t pages = 0;
+
+   for (km_gva_t va = start; va < end; va += sizeof(vec) * KM_PAGE_SIZE) {
+      size_t len = MIN(end - va, sizeof(vec) * KM_PAGE_SIZE);
+      if (mincore(km_gva_to_kma_nocheck(va), len, vec) != 0) {
+         continue;   // not backed on the host (yet), so not resident
+      }
+      for (size_t i = 0; i < len / KM_PAGE_SIZE; i++) {
+         pages += vec[i] & 1;
+      }
+   }
+   return pages;
+}
+
+static void proc_rss_region(proc_rss_t* rss, proc_region_t* r)
+{
+   rss->start = MIN(rss->start, r->start);
+   rss->end = MAX(rss->end, r->end);
+   if (r->monitor != 0) {
+      return;
+   }
+   if (r->file != 0) {
+      rss->file += r->resident;
+   } else if (r->shared != 0) {
+      rss->shmem += r->resident;
+   } else {
+      rss->anon += r->resident;
+   }
+   if (r->shared == 0 && (r->prot & PROT_WRITE) != 0) {
+      rss->data += (r->end - r->start) / KM_PAGE_SIZE;
+   }
+}
+
+/*
+ * The resident set is a mincore() walk of all of guest memory, too much for every read of files
+ * that get polled. It is kept for up to PROC_RSS_NSEC. When mmaps or brk change before that, only
+ * the regions that changed are walked again, the others keep their resident pages.
+ */
+#define PROC_RSS_NSEC (100 * 1000 * 1000UL)
+
+static struct {
+   pthread_mutex_t mutex;
+   int valid;
+   uint64_t gen;   // km_guest_mmap_gen() rss was made at
+   km_gva_t brk;
+   uint64_t time;         // CLOCK_MONOTONIC_COARSE nsec of the oldest resident pages count
+   proc_regions_t regs;   // the regions rss was made of, with their resident pages
+   proc_rss_t rss;
+} proc_rss_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static void proc_guest_rss(proc_rss_t* rss)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   uint64_t now = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+   km_mutex_lock(&proc_rss_cache.mutex);
+   int fresh = proc_rss_cache.valid != 0 && now - proc_rss_cache.time < PROC_RSS_NSEC;
+   if (fresh == 0 || proc_rss_cache.gen != km_guest_mmap_gen() ||
+       proc_rss_cache.brk != machine.brk) {
+      proc_regions_t regs = {};
+      proc_regions_t* old = &proc_rss_cache.regs;
+      size_t j = 0;
+
+      proc_rss_cache.brk = machine.brk;
+      proc_rss_cache.gen = proc_guest_regions(&regs);
+      proc_rss_cache.rss = (proc_rss_t){.start = -1};
+      for (size_t i = 0; i < regs.cnt; i++) {
+         proc_region_t* r = &regs.r[i];
+
+         // both lists are in address order
+         while (fresh != 0 && j < old->cnt && old->r[j].start < r->start) {
+            j++;
+         }
+         if (fresh != 0 && j < old->cnt && proc_region_same(&old->r[j], r) != 0) {
+            r->resident = old->r[j].resident;
+         } else if (r->monitor == 0) {
+            r->resident = proc_resident_pages(r->start, r->end);
+         }
+         proc_rss_region(&proc_rss_cache.rss, r);
+      }
+      proc_regions_free(old);
+      *old = regs;
+      if (fresh == 0) {
+         proc_rss_cache.time = now;
+      }
+      proc_rss_cache.valid = regs.enomem == 0;
+   }
+   *rss = proc_rss_cache.rss;
+   km_mutex_unlock(&proc_rss_cache.mutex);
+}
+
+static inline size_t proc_rss_pages(proc_rss_t* rss)
+{
+   return rss->anon + rss->file + rss->shmem;
+}
+
+/*
+ * Called on the read of /proc/self/stat. Name, parent, threads, size, rss and layout are the guest
+ * ones. Stack, argument and environment addresses aren't kept for the guest and read as 0, the
+ * same as the kernel shows to processes that can't ptrace the target.
+ */
+static int proc_stat_read(int fd, char* buf, size_t buf_sz)
+{
+   char host[1024];
+   char out[1024];
+   char comm[16];
+   proc_layout_t l;
+   proc_rss_t rss;
+   int n;
+
+   if ((n = pread(fd, host, sizeof(host) - 1, 0)) < 0) {
+      return -errno;
+   }
+   host[n] = 0;
+   char* rest = strrchr(host, ')');   // comm can have spaces and parens in it
+   if (rest == NULL || rest[1] != ' ') {
+      return -EIO;
+   }
+   proc_guest_comm(comm, sizeof(comm));
+   proc_guest_layout(&l);
+   proc_guest_rss(&rss);
+   size_t len = snprintf(out, sizeof(out), "%d (%s)", machine.pid, comm);
+   char* save;
+   int field = 3;
+   for (char* f = strtok_r(rest + 2, " \n", &save); f != NULL && len < sizeof(out);
+        f = strtok_r(NULL, " \n", &save), field++) {
+      uint64_t v;
+      switch (field) {
+         case 4:
+            v = machine.ppid;
+            break;
+         case 20:
+            v = km_vcpu_run_cnt();
+            break;
+         case 23:
+            v = proc_guest_vsize(&l);
+            break;
+         case 24:
+            v = proc_rss_pages(&rss);
+            break;
+         case 26:
+            v = l.start_code;
+            break;
+         case 27:
+            v = l.end_code;
+            break;
+         case 45:
+            v = l.start_data;
+            break;
+         case 46:
+            v = l.end_data;
+            break;
+         case 47:
+            v = l.start_brk;
+            break;
+         case 28:   // startstack
+         case 48:   // arg_start, arg_end, env_start, env_end
+         case 49:
+         case 50:
+         case 51:
+            v = 0;
+            break;
+         default:
+            len += snprintf(out + len, sizeof(out) - len, " %s", f);
+            continue;
+      }
+      len += snprintf(out + len, sizeof(out) - len, " %lu", v);
+   }
+   if (len < sizeof(out)) {
+      len += snprintf(out + len, sizeof(out) - len, "\n");
+   }
+   return proc_gen_read(fd, buf, buf_sz, out, MIN(len, sizeof(out) - 1));
+}
+
+// Raises '*peak' to 'val' if it is lower, returns the new peak
+static size_t proc_peak(size_t* peak, size_t val)
+{
+   size_t cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+   while (cur < val &&
+          __atomic_compare_exchange_n(
+              peak, &cur, val, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0) {
+   }
+   return MAX(cur, val);
+}
+
+/*
+ * Called on the read of /proc/self/status. Name, parent, threads, virtual size and memory use are
+ * the guest ones, the rest is from the host.
+ */
+static int proc_status_read(int fd, char* buf, size_t buf_sz)
+{
+   static size_t vm_peak;
+   static size_t vm_hwm;
+   char host[4096];
+   char out[4096];
+   char comm[16];
+   proc_layout_t l;
+   proc_rss_t rss;
+   int n;
+
+   if ((n = pread(fd, host, sizeof(host) - 1, 0)) < 0) {
+      return -errno;
+   }
+   host[n] = 0;
+   proc_guest_comm(comm, sizeof(comm));
+   proc_guest_layout(&l);
+   proc_guest_rss(&rss);
+   size_t vsize = proc_guest_vsize(&l) / 1024;
+   size_t peak = proc_peak(&vm_peak, vsize);
+   size_t kb = KM_PAGE_SIZE / 1024;
+   size_t rss_kb = proc_rss_pages(&rss) * kb;
+   size_t hwm = proc_peak(&vm_hwm, rss_kb);
+
+   size_t len = 0;
+   char* next;
+   for (char* line = host; *line != 0 && len < sizeof(out); line = next) {
+      next = strchrnul(line, '\n');
+      if (*next != 0) {
+         next++;
+      }
+      if (strncmp(line, "Name:", 5) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "Name:\t%s\n", comm);
+      } else if (strncmp(line, "PPid:", 5) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "PPid:\t%d\n", machine.ppid);
+      } else if (strncmp(line, "Threads:", 8) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "Threads:\t%d\n", km_vcpu_run_cnt());
+      } else if (strncmp(line, "VmPeak:", 7) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "VmPeak:\t%8lu kB\n", peak);
+      } else if (strncmp(line, "VmSize:", 7) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "VmSize:\t%8lu kB\n", vsize);
+      } else if (strncmp(line, "VmHWM:", 6) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "VmHWM:\t%8lu kB\n", hwm);
+      } else if (strncmp(line, "VmRSS:", 6) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "VmRSS:\t%8lu kB\n", rss_kb);
+      } else if (strncmp(line, "RssAnon:", 8) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "RssAnon:\t%8lu kB\n", rss.anon * kb);
+      } else if (strncmp(line, "RssFile:", 8) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "RssFile:\t%8lu kB\n", rss.file * kb);
+      } else if (strncmp(line, "RssShmem:", 9) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "RssShmem:\t%8lu kB\n", rss.shmem * kb);
+      } else if (strncmp(line, "VmData:", 7) == 0) {
+         len += snprintf(out + len, sizeof(out) - len, "VmData:\t%8lu kB\n", rss.data * kb);
+      } else if (strncmp(line, "Cpus_allowed", 12) == 0 &&
+                 (n = km_sched_status_line(out + len, sizeof(out) - len, line)) > 0) {
+         len += n;
+      } else {
+         len += snprintf(out + len, sizeof(out) - len, "%.*s", (int)(next - line), line);
+      }
+   }
+   return proc_gen_read(fd, buf, buf_sz, out, MIN(len, sizeof(out) - 1));
+}
+
+// Growing buffer for /proc text generated by km
+typedef struct proc_text {
+   char* buf;
+   size_t len;
+   size_t size;
+   int enomem;   // an append failed, the text is incomplete
+} proc_text_t;
+
+static void __attribute__((format(printf, 2, 3)))
+proc_text_printf(proc_text_t* t, const char* fmt, ...)
+{
+   va_list ap;
+
+   for (;;) {
+      va_start(ap, fmt);
+      int n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+      va_end(ap);
+      if (t->len + n < t->size) {
+         t->len += n;
+         return;
+      }
+      size_t size = MAX(MAX(t->size * 2, t->len + n + 1), 4096);
+      char* buf = realloc(t->buf, size);
+      if (buf == NULL) {
+         t->enomem = 1;
+         return;
+      }
+      t->buf = buf;
+      t->size = size;
+   }
+}
+
+/*
+ * Guest /proc/self/maps text. It only depends on mmaps and brk, so it is kept and regenerated
+ * only when either one changed since the last read. Polling maps costs a copy.
+ */
+static struct {
+   pthread_mutex_t mutex;
+   int valid;
+   uint64_t gen;   // km_guest_mmap_gen() the text was made at
+   km_gva_t brk;
+   proc_text_t text;
+} proc_maps = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// One /proc/self/maps line, same layout as fs/proc/task_mmu.c show_map_vma()
+static void proc_maps_region(proc_text_t* t, proc_region_t* r, struct stat* st)
+{
+   char prefix[128];
+
+   snprintf(prefix,
+            sizeof(prefix),
+            "%08lx-%08lx %c%c%c%c %08lx %02x:%02x %lu ",
+            r->start,
+            r->end,
+            (r->prot & PROT_READ) != 0 ? 'r' : '-',
+            (r->prot & PROT_WRITE) != 0 ? 'w' : '-',
+            (r->prot & PROT_EXEC) != 0 ? 'x' : '-',
+            r->shared != 0 ? 's' : 'p',
+            r->offset,
+            major(st->st_dev),
+            minor(st->st_dev),
+            st->st_ino);
+   if (r->name == NULL) {
+      proc_text_printf(t, "%s\n", prefix);
+   } else {
+      proc_text_printf(t, "%-72s %s\n", prefix, r->name);
+   }
+}
+
+static int proc_maps_read(int fd, char* buf, size_t buf_sz)
+{
+   int ret;
+
+   km_mutex_lock(&proc_maps.mutex);
+   if (proc_maps.valid == 0 || proc_maps.gen != km_guest_mmap_gen() ||
+       proc_maps.brk != machine.brk) {
+      proc_regions_t regs = {};
+      struct stat st = {};
+
+      proc_maps.text.len = 0;
+      proc_maps.text.enomem = 0;
+      proc_maps.brk = machine.brk;
+      proc_maps.gen = proc_guest_regions(&regs);
+      for (size_t i = 0; i < regs.cnt; i++) {
+         proc_region_t* r = &regs.r[i];
+         proc_region_t* prev = i > 0 ? &regs.r[i - 1] : NULL;
+
+         // segments of the same file usually come one after the other, stat() it once
+         if (r->file == 0) {
+            st = (struct stat){};
+         } else if ((prev == NULL || prev->file == 0 || strcmp(prev->name, r->name) != 0) &&
+                    stat(r->name, &st) != 0) {
+            st = (struct stat){};
+         }
+         proc_maps_region(&proc_maps.text, r, &st);
+      }
+      proc_maps.valid = proc_maps.text.enomem == 0 && regs.enomem == 0;
+      proc_regions_free(&regs);
+   }
+   if (proc_maps.valid != 0) {
+      ret = proc_gen_read(fd, buf, buf_sz, proc_maps.text.buf, proc_maps.text.len);
+   } else {
+      ret = -ENOMEM;
+   }
+   km_mutex_unlock(&proc_maps.mutex);
+   return ret;
+}
+
+/*
+ * Called on the read of /proc/self/smaps_rollup. mincore() doesn't tell clean from dirty, so file
+ * pages are reported clean and the rest dirty. Nothing is shared or swapped as far as the guest is
+ * concerned.
+ */
+static int proc_smaps_rollup_read(int fd, char* buf, size_t buf_sz)
+{
+   char out[2048];
+   char prefix[128];
+   proc_rss_t rss;
+
+   proc_guest_rss(&rss);
+   size_t kb = KM_PAGE_SIZE / 1024;
+   size_t anon = rss.anon * kb, file = rss.file * kb, shmem = rss.shmem * kb;
+   snprintf(prefix, sizeof(prefix), "%08lx-%08lx ---p 00000000 00:00 0 ", rss.start, rss.end);
+   size_t len = snprintf(out,
+                         sizeof(out),
+                         "%-72s [rollup]\n"
+                         "Rss:            %8lu kB\n"
+                         "Pss:            %8lu kB\n"
+                         "Pss_Anon:       %8lu kB\n"
+                         "Pss_File:       %8lu kB\n"
+                         "Pss_Shmem:      %8lu kB\n"
+                         "Shared_Clean:   %8lu kB\n"
+                         "Shared_Dirty:   %8lu kB\n"
+                         "Private_Clean:  %8lu kB\n"
+                         "Private_Dirty:  %8lu kB\n"
+                         "Referenced:     %8lu kB\n"
+                         "Anonymous:      %8lu kB\n"
+                         "LazyFree:       %8lu kB\n"
+                         "AnonHugePages:  %8lu kB\n"
+                         "ShmemPmdMapped: %8lu kB\n"
+                         "FilePmdMapped:  %8lu kB\n"
+                         "Shared_Hugetlb: %8lu kB\n"
+                         "Private_Hugetlb:%8lu kB\n"
+                         "Swap:           %8lu kB\n"
+                         "SwapPss:        %8lu kB\n"
+                         "Locked:         %8lu kB\n",
+                         prefix,
+                         anon + file + shmem,
+                         anon + file + shmem,
+                         anon,
+                         file,
+                         shmem,
+                         0UL,
+                         0UL,
+                         file,
+                         anon + shmem,
+                         anon + file + shmem,
+                         anon,
+                         0UL,
+                         0UL,
+                         0UL,
+                         0UL,
+                         0UL,
+                         0UL,
+                         0UL,
+                         0UL,
+                         0UL);
+   return proc_gen_read(fd, buf, buf_sz, out, MIN(len, sizeof(out) - 1));
+}
+
+// Called on the read of /proc/self/statm: size resident shared text lib data dt, in pages
+static int proc_statm_read(int fd, char* buf, size_t buf_sz)
+{
+   char out[256];
+   proc_layout_t l;
+   proc_rss_t rss;
+
+   proc_guest_layout(&l);
+   proc_guest_rss(&rss);
+   size_t text = roundup(l.end_code, KM_PAGE_SIZE) - rounddown(l.start_code, KM_PAGE_SIZE);
+   size_t len = snprintf(out,
+                         sizeof(out),
+                         "%lu %lu %lu %lu 0 %lu 0\n",
+                         proc_guest_vsize(&l) / KM_PAGE_SIZE,
+                         proc_rss_pages(&rss),
+                         rss.file + rss.shmem,
+                         text / KM_PAGE_SIZE,
+                         rss.data);
+   return proc_gen_read(fd, buf, buf_sz, out, MIN(len, sizeof(out) - 1));
+}
+
+/*
+ * Guest /proc/cpuinfo, only the CPUs the payload sees (see km_sched.c) with "siblings" and
+ * "cpu cores" to match. Made on the first read, what changes after that is just "cpu MHz".
+ */
+static struct {
+   pthread_mutex_t mutex;
+   int valid;
+   proc_text_t text;
+} proc_cpuinfo = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static void proc_cpuinfo_make(int fd, proc_text_t* t)
+{
+   char* host = NULL;
+   size_t len = 0;
+   size_t size = 0;
+   int visible = 1;
+   int n;
+
+   // No size for /proc files, read until done
+   do {
+      if (size - len < 4096) {
+         char* more = realloc(host, size + 64 * 1024);
+         if (more == NULL) {
+            n = -1;
+            break;
+         }
+         host = more;
+         size += 64 * 1024;
+      }
+      if ((n = pread(fd, host + len, size - len - 1, len)) > 0) {
+         len += n;
+      }
+   } while (n > 0);
+   if (n < 0) {
+      t->enomem = 1;
+      free(host);
+      return;
+   }
+   host[len] = '\0';
+
+   char* next;
+   for (char* line = host; *line != '\0'; line = next) {
+      next = strchrnul(line, '\n');
+      if (*next != '\0') {
+         next++;
+      }
+      if (strncmp(line, "processor", 9) == 0) {
+         const char* colon = strchr(line, ':');
+         visible = colon != NULL && km_sched_cpu_visible(atoi(colon + 1)) != 0;
+      }
+      if (visible == 0) {
+         continue;
+      }
+      if (strncmp(line, "siblings", 8) == 0) {
+         proc_text_printf(t, "siblings\t: %d\n", km_sched_cpu_count());
+      } else if (strncmp(line, "cpu cores", 9) == 0) {
+         proc_text_printf(t, "cpu cores\t: %d\n", km_sched_cpu_count());
+      } else {
+         proc_text_printf(t, "%.*s", (int)(next - line), line);
+      }
+   }
+   free(host);
+}
+
+// Called on the read of /proc/cpuinfo
+static int proc_cpuinfo_read(int fd, char* buf, size_t buf_sz)
+{
+   int ret;
+
+   km_mutex_lock(&proc_cpuinfo.mutex);
+   if (proc_cpuinfo.valid == 0) {
+      proc_cpuinfo.text.len = 0;
+      proc_cpuinfo.text.enomem = 0;
+      proc_cpuinfo_make(fd, &proc_cpuinfo.text);
+      proc_cpuinfo.valid = proc_cpuinfo.text.enomem == 0;
+   }
+   if (proc_cpuinfo.valid != 0) {
+      ret = proc_gen_read(fd, buf, buf_sz, proc_cpuinfo.text.buf, proc_cpuinfo.text.len);
+   } else {
+      ret = -ENOMEM;
+   }
+   km_mutex_unlock(&proc_cpuinfo.mutex);
+   return ret;
+}
+
+// Called on the read of /sys/devices/system/cpu/{online,possible,present}
+static int sys_cpu_list_read(int fd, char* buf, size_t buf_sz)
+{
+   char out[8192];
+   size_t len = km_sched_cpu_list(out, sizeof(out));
+
+   return proc_gen_read(fd, buf, buf_sz, out, MIN(len, sizeof(out) - 1));
+}
+
+static int proc_self_getdents32(int fd, /* struct linux_dirent* */ void* buf, size_t buf_sz)
+{
+   struct linux_dirent {
+      unsigned long d_ino;     /* Inode number */
+      unsigned long d_off;     /* Offset to next linux_dirent */
+      unsigned short d_reclen; /* Length of this linux_dirent */
+      char d_name[];           /* Filename (null-terminated) */
+                               /* length is actually (d_reclen - 2 -
+                                  offsetof(struct linux_dirent, d_name)) */
+      /*
+      char           pad;       // Zero padding byte
+      char           d_type;    // File type (only since Linux
+                                // 2.6.4); offset is (d_reclen - 1)
+      */
+   };
+   int ret = __syscall_3(SYS_getdents, fd, (uint64_t)buf, buf_sz);
+   struct linux_dirent* e;
+   for (off64_t offset = 0; offset < ret; offset += e->d_reclen) {
+      e = (struct linux_dirent*)(buf + offset);
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+         continue;
+      }
+      uint64_t fdno;
+      if (sscanf(e->d_name, "%lu", &fdno) != 1 || fdno >= km_fs()->nfdmap) {
          // Stop before getting into the km area of the fd space
          return offset;
       }
@@ -2361,7 +3976,7 @@ static int proc_self_getdents(int fd, /* struct linux_dirent64* */ void* buf, si
          continue;
       }
       ino64_t ino;
-      if (sscanf(e->d_name, "%lu", &ino) != 1 || ino >= MAX_OPEN_FILES - MAX_KM_FILES) {
+      if (sscanf(e->d_name, "%lu", &ino) != 1 || ino >= km_fs()->nfdmap) {
          return offset;
       }
    }
@@ -2369,15 +3984,17 @@ static int proc_self_getdents(int fd, /* struct linux_dirent64* */ void* buf, si
 }
 
 /*
- * Table of pathnames to watch for and process specially. The patterns are processed by
- * km_fs_filename_init(), first by applying PID for /proc/%u pattern, then compile the pattern
- * into regex, to match pathname on filepaths ops like open, stat, readlink... Regular files
- * won't match, all of the file system ops are regular. If the name matches, some of the ops
- * might need to be done specially, eg /proc/self/sched content needs to be modified for read, or
- * /proc/self/fd getdents. ops is vector of these ops as well as name matching for open and
- * readlink. If name matches on open the returned ops is stored in fd translation structure
- * (km_file_t). When guest to host fd ctranslation is done the ops is also returned, and function
- * pointers used to alter the functionality of file system ops.
+ * Table of pathnames to watch for and process specially. km_fs_filename_init() compiles the
+ * patterns into a trie (see below) to match pathname on filepaths ops like open, stat,
+ * readlink... Regular files won't match, all of the file system ops are regular. If the name
+ * matches, some of the ops might need to be done specially, eg /proc/self/sched content needs to
+ * be modified for read, or /proc/self/fd getdents. ops is vector of these ops as well as name
+ * matching for open and readlink. If name matches on open the returned ops is stored in fd
+ * translation structure (km_file_t). When guest to host fd ctranslation is done the ops is also
+ * returned, and function pointers used to alter the functionality of file system ops.
+ *
+ * km_exec_fd_save_recover.c passes ops across exec as line numbers in this table, new entries go
+ * at the end.
  */
 static km_filename_table_t km_filename_table[] = {
     {
@@ -2420,6 +4037,62 @@ static km_filename_table_t km_filename_table[] = {
         .pattern = "^/proc/%u/cmdline$",
         .ops = {.open_g2h = proc_cmdline_open},
     },
+    {
+        .pattern = "^/proc/self/stat$",
+        .ops = {.read_g2h = proc_stat_read},
+    },
+    {
+        .pattern = "^/proc/self/status$",
+        .ops = {.read_g2h = proc_status_read},
+    },
+    {
+        .pattern = "^/proc/%u/stat$",
+        .ops = {.read_g2h = proc_stat_read},
+    },
+    {
+        .pattern = "^/proc/%u/status$",
+        .ops = {.read_g2h = proc_status_read},
+    },
+    {
+        .pattern = "^/proc/self/maps$",
+        .ops = {.read_g2h = proc_maps_read},
+    },
+    {
+        .pattern = "^/proc/self/smaps_rollup$",
+        .ops = {.read_g2h = proc_smaps_rollup_read},
+    },
+    {
+        .pattern = "^/proc/self/statm$",
+        .ops = {.read_g2h = proc_statm_read},
+    },
+    {
+        .pattern = "^/proc/%u/maps$",
+        .ops = {.read_g2h = proc_maps_read},
+    },
+    {
+        .pattern = "^/proc/%u/smaps_rollup$",
+        .ops = {.read_g2h = proc_smaps_rollup_read},
+    },
+    {
+        .pattern = "^/proc/%u/statm$",
+        .ops = {.read_g2h = proc_statm_read},
+    },
+    {
+        .pattern = "^/proc/cpuinfo$",
+        .ops = {.read_g2h = proc_cpuinfo_read},
+    },
+    {
+        .pattern = "^/sys/devices/system/cpu/online$",
+        .ops = {.read_g2h = sys_cpu_list_read},
+    },
+    {
+        .pattern = "^/sys/devices/system/cpu/possible$",
+        .ops = {.read_g2h = sys_cpu_list_read},
+    },
+    {
+        .pattern = "^/sys/devices/system/cpu/present$",
+        .ops = {.read_g2h = sys_cpu_list_read},
+    },
     {},
 };
 
@@ -2444,11 +4117,112 @@ km_file_ops_t* km_file_ops(int i)
 }
 
 /*
- * For now every entry in the table starts with "/proc". Most files wont match, so we check for
- * "/proc" first.
+ * The patterns in km_filename_table are compiled into a trie, and a name is matched by walking it
+ * once, instead of running every regex on it. Patterns are anchored with ^ and $, and besides
+ * literal characters can only have "%u" for the payload pid and "[[:digit:]]+" for a run of
+ * digits. "%u" is compared with machine.pid at match time, so it is right after fork() too.
  */
-static const_string_t km_filename_prefix = "/proc";
-static const int km_filename_prefix_sz = 5;
+static const_string_t KM_FN_DIGITS = "[[:digit:]]+";
+
+typedef enum { KM_FN_EDGE_CHAR, KM_FN_EDGE_DIGITS, KM_FN_EDGE_PID } km_fn_edge_t;
+
+typedef struct km_fn_node {
+   struct km_fn_node* child;     // first child
+   struct km_fn_node* sibling;   // next child of the same parent
+   km_fn_edge_t edge;            // how to get here from the parent
+   char c;                       // for KM_FN_EDGE_CHAR
+   int line;                     // km_filename_table line of the pattern ending here, or -1
+} km_fn_node_t;
+
+static km_fn_node_t km_fn_root = {.line = -1};
+
+static inline int km_fn_node_digit(km_fn_node_t* n)
+{
+   return n->edge != KM_FN_EDGE_CHAR || isdigit(n->c) != 0;
+}
+
+static void km_fs_filename_add(const char* pattern, int line)
+{
+   km_fn_node_t* node = &km_fn_root;
+   const char* p = pattern + 1;
+
+   km_assert(*pattern == '^');
+   while (*p != '$') {
+      km_fn_node_t key = {.edge = KM_FN_EDGE_CHAR, .c = *p, .line = -1};
+      km_fn_node_t* next;
+
+      km_assert(*p != 0);
+      if (strncmp(p, KM_FN_DIGITS, strlen(KM_FN_DIGITS)) == 0) {
+         key = (km_fn_node_t){.edge = KM_FN_EDGE_DIGITS, .line = -1};
+         p += strlen(KM_FN_DIGITS);
+      } else if (strncmp(p, "%u", 2) == 0) {
+         key = (km_fn_node_t){.edge = KM_FN_EDGE_PID, .line = -1};
+         p += 2;
+      } else {
+         p++;
+      }
+      for (next = node->child; next != NULL; next = next->sibling) {
+         if (next->edge == key.edge && next->c == key.c) {
+            break;
+         }
+         // two ways to take a digit would need backtracking
+         km_assert(km_fn_node_digit(next) == 0 || km_fn_node_digit(&key) == 0);
+      }
+      if (next == NULL) {
+         if ((next = malloc(sizeof(*next))) == NULL) {
+            km_err(1, "filename trie alloc failed, exiting...");
+         }
+         *next = key;
+         next->sibling = node->child;
+         node->child = next;
+      }
+      node = next;
+   }
+   km_assert(p[1] == 0 && node->line == -1);
+   node->line = line;
+}
+
+// Returns km_filename_table line matching 'name', or -1
+static int km_fs_filename_match(const char* name)
+{
+   km_fn_node_t* node = &km_fn_root;
+   const char* p = name;
+
+   while (*p != 0) {
+      km_fn_node_t* next;
+      for (next = node->child; next != NULL; next = next->sibling) {
+         if (next->edge == KM_FN_EDGE_CHAR) {
+            if (next->c == *p) {
+               p++;
+               break;
+            }
+         } else if (isdigit(*p) != 0) {
+            char* end;
+            unsigned long v = strtoul(p, &end, 10);
+            if (next->edge == KM_FN_EDGE_DIGITS || (*p != '0' && v == machine.pid)) {
+               p = end;
+               break;
+            }
+         }
+      }
+      if (next == NULL) {
+         return -1;
+      }
+      node = next;
+   }
+   return node->line;
+}
+
+static void km_fs_filename_free(km_fn_node_t* node)
+{
+   while (node != NULL) {
+      km_fn_node_t* sibling = node->sibling;
+      km_fs_filename_free(node->child);
+      free(node);
+      node = sibling;
+   }
+}
+
 /*
  * Check and translate if necessary the guest into host view of the file name, for example
  * "/proc/...", as needs to be done for open and friends (stat ...)
@@ -2462,29 +4236,23 @@ static const int km_filename_prefix_sz = 5;
  */
 static int km_fs_g2h_filename(const char* name, char* buf, size_t bufsz, km_file_ops_t** ops)
 {
-   if (strncmp(km_filename_prefix, name, km_filename_prefix_sz) != 0) {
+   int line = km_fs_filename_match(name);
+
+   if (line < 0) {   // no match, regular file
       if (ops != NULL) {
          *ops = NULL;
       }
       return 0;
    }
-   for (km_filename_table_t* t = km_filename_table; t->pattern != NULL; t++) {
-      if (regexec(&t->regex, name, 0, NULL, 0) == 0) {
-         if (ops != NULL) {
-            *ops = &t->ops;
-         }
-         if (t->ops.open_g2h != NULL) {
-            return t->ops.open_g2h(name, buf, bufsz);
-         }
-         strncpy(buf, name, bufsz);
-         return 1;
-      }
-   }
-   // no match, regular file
+   km_filename_table_t* t = &km_filename_table[line];
    if (ops != NULL) {
-      *ops = NULL;
+      *ops = &t->ops;
    }
-   return 0;
+   if (t->ops.open_g2h != NULL) {
+      return t->ops.open_g2h(name, buf, bufsz);
+   }
+   snprintf(buf, bufsz, "%s", name);
+   return 1;
 }
 
 /*
@@ -2495,18 +4263,15 @@ static int km_fs_g2h_filename(const char* name, char* buf, size_t bufsz, km_file
  */
 static int km_fs_g2h_readlink(const char* name, char* buf, size_t bufsz)
 {
-   if (strncmp(km_filename_prefix, name, km_filename_prefix_sz) != 0) {
+   int line = km_fs_filename_match(name);
+
+   if (line < 0) {
       return 0;
    }
-   for (km_filename_table_t* t = km_filename_table; t->pattern != NULL; t++) {
-      if (regexec(&t->regex, name, 0, NULL, 0) == 0) {
-         if (t->ops.readlink_g2h == NULL) {
-            return -ENOENT;
-         }
-         return t->ops.readlink_g2h(name, buf, bufsz);
-      }
+   if (km_filename_table[line].ops.readlink_g2h == NULL) {
+      return -ENOENT;
    }
-   return 0;
+   return km_filename_table[line].ops.readlink_g2h(name, buf, bufsz);
 }
 
 /*
@@ -2515,17 +4280,7 @@ static int km_fs_g2h_readlink(const char* name, char* buf, size_t bufsz)
 static void km_fs_filename_init(void)
 {
    for (km_filename_table_t* t = km_filename_table; t->pattern != NULL; t++) {
-      if (strncmp(t->pattern + 1, PROC_PID, strlen(PROC_PID)) == 0) {   // +1 to skip ^
-         char pat[128];
-         snprintf(pat, sizeof(pat), t->pattern, machine.pid);
-         if (regcomp(&t->regex, pat, REG_EXTENDED | REG_NOSUB) != 0) {
-            km_err(1, "filename regcomp failed, exiting...");
-         }
-      } else {
-         if (regcomp(&t->regex, t->pattern, REG_EXTENDED | REG_NOSUB) != 0) {
-            km_err(1, "filename regcomp failed, exiting...");
-         }
-      }
+      km_fs_filename_add(t->pattern, t - km_filename_table);
    }
    if ((km_my_exec = realpath(PROC_SELF_EXE, NULL)) == NULL) {
       km_err(1, "realpath /proc/self/exe failed");
@@ -2534,32 +4289,29 @@ static void km_fs_filename_init(void)
 
 static void km_fs_filename_fini(void)
 {
-   for (km_filename_table_t* t = km_filename_table; t->pattern != NULL; t++) {
-      regfree(&t->regex);
-   }
+   km_fs_filename_free(km_fn_root.child);
+   km_fn_root.child = NULL;
    free(km_my_exec);
 }
 
 int km_fs_init(void)
 {
-   struct rlimit lim;
-
-   if (getrlimit(RLIMIT_NOFILE, &lim) < 0) {
-      return -errno;
-   }
+   int nfdmap = km_fs_fd_base();
 
    machine.filesys = calloc(1, sizeof(km_filesys_t));
-   lim.rlim_cur = MAX_OPEN_FILES - MAX_KM_FILES;   // Limit max open files. TODO: config
-
-   km_infox(KM_TRACE_FILESYS, "lim.rlim_cur=%ld", lim.rlim_cur);
-   km_fs()->nfdmap = lim.rlim_cur;
-   km_fs()->guest_files = calloc(lim.rlim_cur, sizeof(km_file_t));
+   km_fs()->nfdmap = nfdmap;
+   km_fs()->nofile.rlim_cur = MIN(km_nofile_cur, nfdmap);
+   km_fs()->nofile.rlim_max = nfdmap;
+   km_infox(KM_TRACE_FILESYS, "nfdmap=%d nofile=%ld", nfdmap, km_fs()->nofile.rlim_cur);
+   km_fs()->guest_files =
+       calloc(roundup(nfdmap, KM_FILES_CHUNK) / KM_FILES_CHUNK, sizeof(km_file_t*));
    km_assert(km_fs()->guest_files != NULL);
+   km_fs()->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
 
    if (km_exec_recover_guestfd() != 0) {
       // parent invocation - setup guest std file streams.
       for (int i = 0; i < 3; i++) {
-         km_file_t* file = &km_fs()->guest_files[i];
+         km_file_t* file = km_fs_file_alloc(i);
          km_assert(km_is_file_used(file) == 0);
          km_set_file_used(file, 1);
          file->ofd = -1;
@@ -2605,14 +4357,21 @@ void km_fs_fini(void)
       return;
    }
    if (km_fs()->guest_files != NULL) {
-      for (int i = 0; i < km_fs()->nfdmap; i++) {
-         km_file_t* file = &km_fs()->guest_files[i];
-         if (file->name != NULL) {
-            free(file->name);
+      for (int c = 0; c < roundup(km_fs()->nfdmap, KM_FILES_CHUNK) / KM_FILES_CHUNK; c++) {
+         km_file_t* chunk = km_fs()->guest_files[c];
+         if (chunk == NULL) {
+            continue;
          }
-         if (file->sockinfo != NULL) {
-            free(file->sockinfo);
+         for (int i = 0; i < KM_FILES_CHUNK; i++) {
+            km_file_t* file = &chunk[i];
+            if (file->name != NULL) {
+               free(file->name);
+            }
+            if (file->sockinfo != NULL) {
+               free(file->sockinfo);
+            }
          }
+         free(chunk);
       }
       free(km_fs()->guest_files);
    }
@@ -2630,20 +4389,23 @@ void km_filesys_internal_fd_reset()
    internal_fd = KM_START_FDS;
 }
 
-// dup internal fd to km private area
+// dup internal fd to km private area. km_fd is offset in km fd range, or -1 for the next free one.
 static int km_internal_fd(int fd, int km_fd)
 {
    if (fd < 0) {
       return fd;
    }
+   int base = km_fs_fd_base();
    int newfd;
    if (km_fd == -1) {
-      newfd = dup2(fd, __atomic_fetch_add(&internal_fd, 1, __ATOMIC_SEQ_CST));
-      km_assert(newfd >= 0 && newfd < MAX_OPEN_FILES);
+      int next = __atomic_fetch_add(&internal_fd, 1, __ATOMIC_SEQ_CST);
+      km_assert(next < km_nfiles);
+      newfd = dup2(fd, base + next);
+      km_assert(newfd >= 0);
    } else {
-      newfd = dup2(fd, km_fd);
+      newfd = dup2(fd, base + km_fd);
    }
-   if (newfd >= MAX_OPEN_FILES - MAX_KM_FILES) {
+   if (newfd >= base) {
       close(fd);
    }
    return newfd;
@@ -2720,7 +4482,7 @@ void km_redirect_msgs(const char* name)
    if (name != NULL) {
       if (strcmp(name, "stderr") == 0) {
          // If they ask, let them log to stderr no matter what.  Mostly useful for the bats tests.
-         fd = dup2(2, KM_LOGGING);
+         fd = dup2(2, km_fs_logging_fd());
       } else if (strcmp(name, "none") == 0) {
          // We need to be able to test having no logging at all.  km could run in a container
          // with read only filesystems and we may not be able to use stderr either.
@@ -2729,7 +4491,7 @@ void km_redirect_msgs(const char* name)
          return;
       } else {
          fd1 = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-         fd = dup2(fd1, KM_LOGGING);
+         fd = dup2(fd1, km_fs_logging_fd());
          close(fd1);
       }
    } else {
@@ -2750,7 +4512,7 @@ void km_redirect_msgs(const char* name)
             return;
          } else {
             // stderr is not a pipeline the parent process could be waiting on
-            fd = dup2(2, KM_LOGGING);
+            fd = dup2(2, km_fs_logging_fd());
          }
       } else {
          // we don't know what stderr is.
@@ -2762,7 +4524,7 @@ void km_redirect_msgs(const char* name)
          return;
       }
    }
-   km_assert(fd == KM_LOGGING);
+   km_assert(fd == km_fs_logging_fd());
 
    if ((km_log_file = fdopen(fd, "w")) == NULL) {
       km_err(1, "Failed to redirect km log");
@@ -2777,8 +4539,8 @@ void km_redirect_msgs_after_exec(void)
 {
    struct stat statb;
 
-   if (fstat(KM_LOGGING, &statb) == 0) {
-      if ((km_log_file = fdopen(KM_LOGGING, "w")) == NULL) {
+   if (fstat(km_fs_logging_fd(), &statb) == 0) {
+      if ((km_log_file = fdopen(km_fs_logging_fd(), "w")) == NULL) {
          km_err(1, "Failed to redirect km log");
       }
       setlinebuf(km_log_file);
@@ -2834,7 +4596,7 @@ static int km_fs_recover_socketpair(km_nt_socket_t* nt_sock)
             nt_sock->type,
             nt_sock->protocol);
 
-   if (km_is_file_used(&km_fs()->guest_files[nt_sock->fd]) != 0) {
+   if (km_is_file_used(km_fs_file_alloc(nt_sock->fd)) != 0) {
       return 0;
    }
 
@@ -2930,6 +4692,82 @@ static int km_fs_recover_open_socket(char* ptr, size_t length)
    return 0;
 }
 
+static int km_fs_recover_timerfd(char* ptr, size_t length)
+{
+   km_nt_timerfd_t* nt_timerfd = (km_nt_timerfd_t*)ptr;
+
+   km_infox(KM_TRACE_SNAPSHOT, "TIMERFD fd=%d", nt_timerfd->fd);
+   if (nt_timerfd->size != sizeof(km_nt_timerfd_t)) {
+      km_warnx("nt_km_timerfd_t size mismatch - old snapshot?");
+      return -1;
+   }
+   if (nt_timerfd->fd < 0 || nt_timerfd->fd >= machine.filesys->nfdmap) {
+      km_warnx("cannot recover invalid timer fd %d", nt_timerfd->fd);
+      return -1;
+   }
+   if (km_is_file_used(km_fs_file_alloc(nt_timerfd->fd)) != 0) {
+      km_errx(2, "file %d in use", nt_timerfd->fd);
+   }
+
+   int hostfd = timerfd_create(nt_timerfd->clockid, nt_timerfd->flags);
+   if (hostfd < 0) {
+      km_warn("timerfd_create failed");
+      return -1;
+   }
+   struct itimerspec its = {
+       .it_value = {.tv_sec = nt_timerfd->value_sec, .tv_nsec = nt_timerfd->value_nsec},
+       .it_interval = {.tv_sec = nt_timerfd->interval_sec, .tv_nsec = nt_timerfd->interval_nsec},
+   };
+   if (timerfd_settime(hostfd, 0, &its, NULL) < 0) {
+      km_warn("timerfd_settime for fd=%d failed", nt_timerfd->fd);
+      close(hostfd);
+      return -1;
+   }
+   // Needs CONFIG_CHECKPOINT_RESTORE. Without it expirations are lost, but the timer still runs.
+   uint64_t ticks = nt_timerfd->ticks;
+   if (ticks != 0 && ioctl(hostfd, TFD_IOC_SET_TICKS, &ticks) < 0) {
+      km_warn("timerfd fd=%d: cannot restore %ld expirations", nt_timerfd->fd, ticks);
+   }
+   km_fs_recover_fd(nt_timerfd->fd,
+                    hostfd,
+                    nt_timerfd->flags,
+                    km_get_nonfile_name(hostfd),
+                    -1,
+                    KM_FILE_HOW_TIMERFD);
+   return 0;
+}
+
+static int km_fs_recover_signalfd(char* ptr, size_t length)
+{
+   km_nt_signalfd_t* nt_signalfd = (km_nt_signalfd_t*)ptr;
+
+   km_infox(KM_TRACE_SNAPSHOT, "SIGNALFD fd=%d", nt_signalfd->fd);
+   if (nt_signalfd->size != sizeof(km_nt_signalfd_t)) {
+      km_warnx("nt_km_signalfd_t size mismatch - old snapshot?");
+      return -1;
+   }
+   if (nt_signalfd->fd < 0 || nt_signalfd->fd >= machine.filesys->nfdmap) {
+      km_warnx("cannot recover invalid signal fd %d", nt_signalfd->fd);
+      return -1;
+   }
+   if (km_is_file_used(km_fs_file_alloc(nt_signalfd->fd)) != 0) {
+      km_errx(2, "file %d in use", nt_signalfd->fd);
+   }
+
+   int hostfd = eventfd(0, nt_signalfd->flags);
+   if (hostfd < 0) {
+      km_warn("eventfd failed");
+      return -1;
+   }
+   km_fs_recover_fd(nt_signalfd->fd,
+                    hostfd,
+                    nt_signalfd->flags,
+                    strdup("anon_inode:[signalfd]"),
+                    -1,
+                    KM_FILE_HOW_SIGNALFD);
+   return km_signalfd_setmask(NULL, nt_signalfd->fd, nt_signalfd->mask);
+}
+
 static int km_fs_recover_eventfd(char* ptr, size_t length)
 {
    char* cur = ptr;
@@ -2946,7 +4784,7 @@ static int km_fs_recover_eventfd(char* ptr, size_t length)
       return -1;
    }
 
-   km_file_t* file = &km_fs()->guest_files[nt_eventfd->fd];
+   km_file_t* file = km_fs_file_alloc(nt_eventfd->fd);
    if (km_is_file_used(file) != 0) {
       km_errx(2, "file %d in use. %s", nt_eventfd->fd, file->name);
    }
@@ -2970,11 +4808,10 @@ static int km_fs_recover_eventfd(char* ptr, size_t length)
          return -1;
       }
 
-      km_fs_event_t* event = calloc(1, sizeof(km_fs_event_t));
-      event->fd = nt_event->fd;
-      event->event.events = nt_event->event;
-      event->event.data.u64 = nt_event->data;
-      TAILQ_INSERT_TAIL(&file->events, event, link);
+      if (km_fs_event_insert(file, nt_event->fd, &ev) != 0) {
+         km_warnx("no memory for monitored fd=%d", nt_event->fd);
+         return -1;
+      }
       cur += sizeof(km_nt_event_t);
    }
 
@@ -2989,6 +4826,13 @@ int km_fs_recover(char* notebuf, size_t notesize)
    if (km_snapshot_notes_apply(notebuf, notesize, NT_KM_SOCKET, km_fs_recover_open_socket) < 0) {
       km_errx(2, "recover open files failed");
    }
+   // before epoll fds, these can be monitored by them
+   if (km_snapshot_notes_apply(notebuf, notesize, NT_KM_TIMERFD, km_fs_recover_timerfd) < 0) {
+      km_errx(2, "recover open files failed");
+   }
+   if (km_snapshot_notes_apply(notebuf, notesize, NT_KM_SIGNALFD, km_fs_recover_signalfd) < 0) {
+      km_errx(2, "recover open files failed");
+   }
    if (km_snapshot_notes_apply(notebuf, notesize, NT_KM_EVENTFD, km_fs_recover_eventfd) < 0) {
       km_errx(2, "recover open files failed");
    }
@@ -46,7 +46,11 @@
 #include "km_mem.h"
 #include "km_syscall.h"
 
-static const int MAX_OPEN_FILES = 1024;
+/*
+ * Guest fds cap, whatever RLIMIT_NOFILE is. km fds sit right above the guest ones, so the host fd
+ * table is sized by the hard limit, up to this.
+ */
+static const int KM_MAX_GUEST_FILES = 1024 * 1024;
 static const int MAX_KM_FILES = KVM_MAX_VCPUS + 2 + 2 + 2 + 2 + 1;   // eventfds, kvm, gdb, snap, log
 
 // types for file names conversion
@@ -68,7 +72,6 @@ typedef struct {
 typedef struct {
    const char* const pattern;
    km_file_ops_t ops;
-   regex_t regex;
 } km_filename_table_t;
 
 int km_filename_table_line(km_file_ops_t* o);
@@ -86,6 +89,7 @@ int km_fs_max_guestfd();
 int km_add_guest_fd(km_vcpu_t* vcpu, int host_fd, char* name, int flags, km_file_ops_t* ops);
 char* km_guestfd_name(km_vcpu_t* vcpu, int fd);
 int km_fs_init(void);
+int km_fs_max_vcpus(void);
 void km_fs_fini(void);
 int km_fs_at(int dirfd, const char* const pathname);
 // int open(char *pathname, int flags, mode_t mode)
@@ -109,7 +113,9 @@ uint64_t km_fs_prw(km_vcpu_t* vcpu, int scall, int fd, void* buf, size_t count,
 // ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
 // ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset);
 uint64_t
-km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, const struct iovec* guest_iov, size_t iovcnt, off_t offset);
+km_fs_prwv(km_vcpu_t* vcpu, int scall, int fd, km_gva_t guest_iov, int iovcnt, off_t offset);
+struct iovec* km_vcpu_iov(km_vcpu_t* vcpu);
+int km_iov_g2h(km_vcpu_t* vcpu, km_gva_t guest_iov, size_t iovcnt, int prot, struct iovec* iov);
 // int ioctl(int fd, unsigned long request, void *arg);
 uint64_t km_fs_ioctl(km_vcpu_t* vcpu, int fd, unsigned long request, void* arg);
 // int fcntl(int fd, int cmd, ... /* arg */ );
@@ -161,6 +167,15 @@ uint64_t km_fs_ftruncate(km_vcpu_t* vcpu, int fd, off_t length);
 uint64_t km_fs_fsync(km_vcpu_t* vcpu, int fd);
 // int fdatasync(int fd);
 uint64_t km_fs_fdatasync(km_vcpu_t* vcpu, int fd);
+// int fallocate(int fd, int mode, off_t offset, off_t len);
+uint64_t km_fs_fallocate(km_vcpu_t* vcpu, int fd, int mode, off_t offset, off_t len);
+// int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+uint64_t km_fs_fadvise64(km_vcpu_t* vcpu, int fd, off_t offset, off_t len, int advice);
+// ssize_t readahead(int fd, off64_t offset, size_t count);
+uint64_t km_fs_readahead(km_vcpu_t* vcpu, int fd, off_t offset, size_t count);
+// int sync_file_range(int fd, off64_t offset, off64_t nbytes, unsigned int flags);
+uint64_t
+km_fs_sync_file_range(km_vcpu_t* vcpu, int fd, off_t offset, off_t nbytes, unsigned int flags);
 // int mkdir(const char *path, mode_t mode);
 uint64_t km_fs_mkdir(km_vcpu_t* vcpu, char* pathname, mode_t mode);
 // int rmdir(const char *path, mode_t mode);
@@ -196,6 +211,17 @@ uint64_t km_fs_pipe(km_vcpu_t* vcpu, int pipefd[2]);
 uint64_t km_fs_pipe2(km_vcpu_t* vcpu, int pipefd[2], int flags);
 // int eventfd2(unsigned int initval, int flags);
 uint64_t km_fs_eventfd2(km_vcpu_t* vcpu, int initval, int flags);
+// int memfd_create(const char* name, unsigned int flags);
+uint64_t km_fs_memfd_create(km_vcpu_t* vcpu, char* name, unsigned int flags);
+// int timerfd_create(int clockid, int flags);
+uint64_t km_fs_timerfd_create(km_vcpu_t* vcpu, int clockid, int flags);
+uint64_t km_fs_timerfd_settime(km_vcpu_t* vcpu,
+                               int fd,
+                               int flags,
+                               struct itimerspec* new_value,
+                               struct itimerspec* old_value);
+uint64_t km_fs_timerfd_gettime(km_vcpu_t* vcpu, int fd, struct itimerspec* curr_value);
+uint64_t km_fs_signalfd4(km_vcpu_t* vcpu, int fd, km_sigset_t* mask, size_t sizemask, int flags);
 // int socket(int domain, int type, int protocol);
 uint64_t km_fs_socket(km_vcpu_t* vcpu, int domain, int type, int protocol);
 // int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
@@ -207,12 +233,31 @@ km_fs_setsockopt(km_vcpu_t* vcpu, int sockfd, int level, int optname, void* optv
 // ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
 // ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags);
 uint64_t km_fs_sendrecvmsg(km_vcpu_t* vcpu, int scall, int sockfd, struct msghdr* msg, int flag);
+// int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+// int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+//              struct timespec *timeout);
+uint64_t km_fs_sendrecvmmsg(km_vcpu_t* vcpu,
+                            int scall,
+                            int sockfd,
+                            struct mmsghdr* msgvec,
+                            unsigned int vlen,
+                            int flag,
+                            struct timespec* timeout);
 // ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 uint64_t km_fs_sendfile(km_vcpu_t* vcpu, int out_fd, int in_fd, off_t* offset, size_t count);
 // ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, loff_t *off_out, size_t len,
 // unsigned int flags);
 uint64_t km_fs_copy_file_range(
     km_vcpu_t* vcpu, int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len, unsigned int flags);
+// ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+// unsigned int flags);
+uint64_t km_fs_splice(
+    km_vcpu_t* vcpu, int fd_in, off_t* off_in, int fd_out, off_t* off_out, size_t len, unsigned int flags);
+// ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+uint64_t km_fs_tee(km_vcpu_t* vcpu, int fd_in, int fd_out, size_t len, unsigned int flags);
+// ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs, unsigned int flags);
+uint64_t
+km_fs_vmsplice(km_vcpu_t* vcpu, int fd, struct iovec* iov, size_t nr_segs, unsigned int flags);
 // int getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 // int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 uint64_t
@@ -270,6 +315,14 @@ uint64_t km_fs_select(km_vcpu_t* vcpu,
                       struct timeval* timeout);
 // int poll(struct pollfd *fds, nfds_t nfds, int timeout);
 uint64_t km_fs_poll(km_vcpu_t* vcpu, struct pollfd* fds, nfds_t nfds, int timeout);
+// int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
+//  const sigset_t *sigmask, size_t sigsetsize);
+uint64_t km_fs_ppoll(km_vcpu_t* vcpu,
+                     struct pollfd* fds,
+                     nfds_t nfds,
+                     struct timespec* tmo_p,
+                     const sigset_t* sigmask,
+                     size_t sigsetsize);
 // int epoll_create1(int flags);
 uint64_t km_fs_epoll_create1(km_vcpu_t* vcpu, int flags);
 // int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
@@ -286,6 +339,15 @@ uint64_t km_fs_epoll_pwait(km_vcpu_t* vcpu,
                            int timeout,
                            const sigset_t* sigmask,
                            int sigsetsize);
+// int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents,
+//  const struct timespec *timeout, const sigset_t *sigmask, size_t sigsetsize);
+uint64_t km_fs_epoll_pwait2(km_vcpu_t* vcpu,
+                            int epfd,
+                            struct epoll_event* events,
+                            int maxevents,
+                            struct timespec* timeout,
+                            const sigset_t* sigmask,
+                            size_t sigsetsize);
 // int prlimit(pid_t pid, int resource, const struct rlimit *new_limit, struct rlimit *old_limit);
 uint64_t km_fs_prlimit64(km_vcpu_t* vcpu,
                          pid_t pid,
@@ -40,9 +40,13 @@ typedef struct km_fd_socket {
 #define KM_SOCK_STATE_ACCEPT 3
 #define KM_SOCK_STATE_CONNECT 4
 
-// Description of an event associated with an eventfd.
+/*
+ * Description of an event associated with an epoll fd. Events are kept on the epoll fd file's
+ * events list in registration order and hashed by fd for lookups on EPOLL_CTL_MOD/DEL.
+ */
 typedef struct km_fs_event {
    TAILQ_ENTRY(km_fs_event) link;
+   struct km_fs_event* hnext;   // hash chain, or free list when not in use
    int fd;
    struct epoll_event event;
 } km_fs_event_t;
@@ -58,6 +62,10 @@ typedef struct km_file {
    char* name;           // the name opened to yield the guest fd
    km_fd_socket_t* sockinfo;                           // For sockets
    TAILQ_HEAD(km_fs_event_head, km_fs_event) events;   // for epoll_create fd's
+   km_fs_event_t** evhash;                             // events hashed by fd, evmask + 1 buckets
+   int evmask;
+   int nevents;
+   struct km_io_uring* ioring;   // io_uring_setup() state
 } km_file_t;
 
 // Valid values for the how field in km_file_t
@@ -71,11 +79,24 @@ typedef struct km_file {
 #define KM_FILE_HOW_SOCKETPAIR1 7
 #define KM_FILE_HOW_RECVMSG 8
 #define KM_FILE_HOW_EVENTFD 9 /* eventfd() */
+#define KM_FILE_HOW_TIMERFD 10  /* timerfd_create() */
+#define KM_FILE_HOW_SIGNALFD 11 /* signalfd(), host side is eventfd */
+#define KM_FILE_HOW_IO_URING 12 /* io_uring_setup() */
+
+/*
+ * The guest file table is allocated in chunks of KM_FILES_CHUNK entries when the first fd in the
+ * chunk range is added, so a large RLIMIT_NOFILE costs only the chunk pointers.
+ */
+#define KM_FILES_CHUNK_SHIFT 10
+#define KM_FILES_CHUNK (1 << KM_FILES_CHUNK_SHIFT)
 
 // machine.filesys points to a km_filesys_t structure.
 typedef struct km_filesys {
-   int nfdmap;               // size of file descriptor maps
-   km_file_t* guest_files;   // Indexed by guestfd
+   int nfdmap;                // size of file descriptor maps
+   struct rlimit nofile;      // guest view of RLIMIT_NOFILE, rlim_max is nfdmap
+   km_file_t** guest_files;   // chunks of km_file_t, indexed by guestfd
+   pthread_mutex_t mutex;     // serializes chunk allocation
+   int nerrors;               // fds with km level error set, see km_fs_any_error()
 } km_filesys_t;
 
 static const_string_t stdin_name = "[stdin]";
@@ -87,6 +108,30 @@ static inline km_filesys_t* km_fs()
    return machine.filesys;
 }
 
+/*
+ * Returns km_file_t for guest fd or NULL if its chunk was never allocated, i.e. the fd was never
+ * used. fd has to be in [0, nfdmap). No locks, chunks are only freed in km_fs_fini().
+ */
+static inline km_file_t* km_fs_file(int fd)
+{
+   km_file_t* chunk =
+       __atomic_load_n(&km_fs()->guest_files[fd >> KM_FILES_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+   return chunk == NULL ? NULL : &chunk[fd & (KM_FILES_CHUNK - 1)];
+}
+
+static inline void km_fs_events_init(km_file_t* file)
+{
+   TAILQ_INIT(&file->events);
+   file->evhash = NULL;
+   file->evmask = 0;
+   file->nevents = 0;
+}
+
+km_file_t* km_fs_file_alloc(int fd);
+int km_add_guest_fd_internal(
+    km_vcpu_t* vcpu, int host_fd, char* name, int flags, int how, km_file_ops_t* ops);
+int km_fs_event_insert(km_file_t* file, int fd, struct epoll_event* event);
+void km_fs_events_free(km_file_t* file);
 int km_is_file_used(km_file_t* file);
 void km_set_file_used(km_file_t* file, int val);
 
@@ -29,8 +29,11 @@
 #include "km_filesys.h"
 #include "km_fork.h"
 #include "km_gdb.h"
+#include "km_guest.h"
+#include "km_io_uring.h"
 #include "km_kkm.h"
 #include "km_mem.h"
+#include "km_timer.h"
 
 /*
  * fork() or clone() state from the parent process thread that needs to be present in the thread in
@@ -77,10 +80,15 @@ static void km_fork_setup_child_vmstate(sigset_t* formermask)
    km_infox(KM_TRACE_FORK, "begin");
 
    km_filesys_internal_fd_reset();
+   // Threads asleep in futex waits were the parent's
+   memset(km_futex_buckets, 0, sizeof(km_futex_buckets));
+   // Timers aren't inherited, and the parent's timer thread isn't here
+   km_timer_fork_reset();
    // Reinit some fields in machine.  We do not want a structure assignment here.
    machine.vm_vcpu_cnt = 0;
    machine.vm_vcpu_run_cnt = 0;
    SLIST_INIT(&machine.vm_idle_vcpus.head);
+   machine.vm_idle_cnt = 0;
    machine.vm_vcpu_mtx = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
    machine.brk_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
    machine.signal_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
@@ -189,7 +197,8 @@ static void km_fork_remove_parent_vmstate(void)
       machine.intr_fd = -1;
    }
 
-   // We preserve the hostfd <--> guestfd maps in the child
+   // We preserve the hostfd <--> guestfd maps in the child, but not io_uring rings
+   km_io_uring_fork_child();
 }
 
 /*
@@ -960,7 +960,7 @@ static void km_exit_reason_to_string(km_vcpu_t* vcpu, char* reason, size_t reaso
 // Form and send thread list ('m<thread_ids>' packet) to gdb
 static void send_threads_list(void)
 {
-   char obuf[BUFMAX] = "m";   // max thread is 288 (currently) so BUFMAX (16K) is more than enough
+   char obuf[BUFMAX] = "m";   // at most KVM_MAX_VCPUS (1024) ids, BUFMAX (16K) is enough
 
    km_vcpu_apply_all(add_thread_id, obuf);
    obuf[strlen(obuf) - 1] = '\0';   // strip trailing comma
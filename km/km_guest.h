@@ -30,6 +30,21 @@
 // Changes in this macro should be reflected in the declaration of km_hcargs in km_guest_asmcode.s
 #define HC_ARGS_INDEX(vcpu_id) ((vcpu_id) * (CACHE_LINE_LENGTH / BYTES_PER_POINTER))
 
+/*
+ * Futex hash bucket, shared with the guest side of futex() in __km_syscall_handler. KM counts the
+ * threads asleep in a host futex wait on the futexes hashing here, so the guest can skip private
+ * FUTEX_WAKE when there are none. spins is the guest's adaptive spin limit for FUTEX_WAIT.
+ * Changes here should be reflected in km_guest.asmh and km_futex_buckets in km_guest_asmcode.s
+ */
+#define KM_FUTEX_BUCKET_BITS 10
+#define KM_FUTEX_HASH 0x9e3779b97f4a7c15UL
+#define KM_FUTEX_REQUEUED 0x80000000U   // requeue target, waiters no longer tracked
+
+typedef struct km_futex_bucket {
+   uint32_t waiters;
+   uint32_t spins;
+} km_futex_bucket_t;
+
 /*
  * Definition of symbols defined in the .km_guest_{test,data} sections.
  *
@@ -44,9 +59,16 @@ extern uint8_t km_guest_data_start;
 extern void* __km_interrupt_table[];
 extern uint8_t km_guest_data_rw_start;
 extern km_hc_args_t* km_hcargs[HC_ARGS_INDEX(KVM_MAX_VCPUS)];
+extern km_futex_bucket_t km_futex_buckets[1 << KM_FUTEX_BUCKET_BITS];
+extern uint32_t km_futex_spin_max;
 extern uint8_t __km_handle_interrupt;
 extern uint8_t __km_syscall_handler;
+extern uint8_t __km_futex_load;
+extern uint8_t __km_futex_fault;
 extern uint8_t __km_sigreturn;
+extern uint8_t __km_sigentry_xsave;
+extern uint8_t __km_sigentry_xsavec;
+extern uint8_t __km_sigrestore;
 extern uint8_t km_guest_end;
 
 /*
@@ -62,4 +84,9 @@ static inline km_gva_t km_guest_kma_to_gva(km_kma_t km_guest_addr)
    return gva;
 }
 
+static inline km_futex_bucket_t* km_futex_bucket(km_gva_t uaddr)
+{
+   return &km_futex_buckets[(uaddr * KM_FUTEX_HASH) >> (64 - KM_FUTEX_BUCKET_BITS)];
+}
+
 #endif /* !defined(__KM_GUEST_H__) */
@@ -32,6 +32,105 @@ __km_sigreturn:
     .global __km_sigreturn
     mov $15, %rax
     syscall
+
+/*
+ * Signal handler entry for when the guest saves FP state itself, instead of KM doing
+ * KVM_GET_XSAVE. KM sets rbx to the 64 byte aligned save area in the signal frame, rax to the
+ * handler and r11 to the ucontext, as rdx is taken by the xsave feature mask. The handler returns
+ * through the usual restorer and rt_sigreturn.
+ */
+.macro sigentry name, insn
+    .align 16
+__km_sigentry_\name :
+    .type __km_sigentry_\name, @function
+    .global __km_sigentry_\name
+    mov %rax, %r10
+    mov $-1, %eax
+    mov $-1, %edx
+    \insn (%rbx)
+    mov %r11, %rdx
+    jmp *%r10
+.endm
+
+sigentry xsave, xsave64
+sigentry xsavec, xsavec64
+
+/*
+ * rt_sigreturn that didn't come through __km_rt_sigreturn (a hypercall made directly) comes here
+ * to restore FP state saved by __km_sigentry_*. KM has restored all the other registers, except
+ * for rbx, rdx, rax and rip which are on the stack right below the red zone of the stack we are
+ * returning to. rbx points to the save area, edx:eax is all ones.
+ */
+    .align 16
+__km_sigrestore:
+    .type __km_sigrestore, @function
+    .global __km_sigrestore
+    xrstor64 (%rbx)
+    pop %rbx
+    pop %rdx
+    pop %rax
+    ret $RED_ZONE
+
+/*
+ * rt_sigreturn from __km_syscall_handler. arg1 is the signal frame, right above the hypercall args.
+ * For frames with FP state saved by __km_sigentry_* KM only restores its own state and comes back
+ * here, and we restore the registers from the frame, so neither way needs a register ioctl.
+ * Otherwise KM sets all the registers itself and we never get past the out.
+ * rbx, rax, rflags and rip go below the red zone of the stack we are returning to, as in
+ * __km_sigrestore.
+ */
+    .align 16
+__km_rt_sigreturn:
+    .type __km_rt_sigreturn, @function
+    lea (HCARG_SIZE - BYTES_PER_UINT64)(%rsp), %rdi  # restorer ret popped return_addr
+    sub $HCARG_SIZE, %rsp
+    mov %rdi, hc_arg1(%rsp)
+    mov %rsp, %gs:0
+
+    mov $(KM_HCALL_PORT_BASE | SYS_rt_sigreturn), %dx
+    out %eax, (%dx)
+
+    mov %rdi, %rbx
+    mov $-1, %eax
+    mov $-1, %edx
+    mov sf_fpstate(%rbx), %rcx
+    xrstor64 (%rcx)
+
+    push sf_rip(%rbx)
+    push sf_rflags(%rbx)
+    andq $0x3C7FD7, (%rsp)
+    push sf_rax(%rbx)
+    push sf_rbx(%rbx)
+    push sf_rcx(%rbx)
+    mov sf_rdx(%rbx), %rdx
+    mov sf_rsi(%rbx), %rsi
+    mov sf_rdi(%rbx), %rdi
+    mov sf_rbp(%rbx), %rbp
+    mov sf_r8(%rbx), %r8
+    mov sf_r9(%rbx), %r9
+    mov sf_r10(%rbx), %r10
+    mov sf_r11(%rbx), %r11
+    mov sf_r12(%rbx), %r12
+    mov sf_r13(%rbx), %r13
+    mov sf_r14(%rbx), %r14
+    mov sf_r15(%rbx), %r15
+
+    mov sf_rsp(%rbx), %rbx
+    sub $(RED_ZONE + SIGRESTORE_SCRATCH), %rbx
+    pop %rcx
+    pop %rax
+    mov %rax, (%rbx)
+    pop %rax
+    mov %rax, 8(%rbx)
+    pop %rax
+    mov %rax, 16(%rbx)
+    pop %rax
+    mov %rax, 24(%rbx)
+    mov %rbx, %rsp
+    pop %rbx
+    pop %rax
+    popfq
+    ret $RED_ZONE
 /*
  * Trampoline for x86 exception and interrupt handling. IDT entries point here.
  */
@@ -130,6 +229,22 @@ __km_interrupt_table:
 km_hcargs:
     .space KVM_MAX_VCPUS * CACHE_LINE_LENGTH, 0
 
+/*
+ * Futex hash buckets shared by the guest side of futex() below and KM, km_futex_bucket_t in
+ * km_guest.h.
+ */
+    .align 64
+    .type km_futex_buckets, @object
+    .global km_futex_buckets
+km_futex_buckets:
+    .space (1 << KM_FUTEX_BUCKET_BITS) * FUTEX_BUCKET_SIZE, 0
+
+// Most FUTEX_WAIT spins before going to KM, set by km_idle_init()
+    .type km_futex_spin_max, @object
+    .global km_futex_spin_max
+km_futex_spin_max:
+    .long KM_FUTEX_SPIN_MAX
+
 /*
  * SYSCALL handling. This function converts a syscall into
  * the coresponding KM Hypercall.
@@ -150,6 +265,11 @@ km_hcargs:
     .type __km_syscall_handler, @function
     .global __km_syscall_handler
 __km_syscall_handler:
+    cmp $SYS_futex, %eax
+    je __km_futex
+    cmp $SYS_rt_sigreturn, %eax
+    je __km_rt_sigreturn
+.Lsyscall_hcall:
     // create a km_hcall_t on the stack.
     push %r9    # arg6
     push %r8    # arg5
@@ -178,3 +298,98 @@ __km_syscall_handler:
      * We don't change PL or RFLAGS so we can just jump back.
      */
     jmp *%rcx
+
+/*
+ * Guest side of futex(), to stay out of KM when we can.
+ * FUTEX_WAIT spins on the futex word for a while before going to KM to sleep. The spin limit
+ * adapts per hash bucket, toward the number of spins it took for the word to change, up to
+ * km_futex_spin_max.
+ * Private FUTEX_WAKE returns 0 without a hypercall when the bucket waiter count, which KM keeps
+ * around the host futex wait, says nobody is asleep. Over-counting only costs a hypercall, so
+ * collisions don't matter. The hash must match km_futex_bucket() in km_guest.h.
+ * A fault on the futex word load in the spin goes to __km_futex_fault, see km_handle_interrupt().
+ */
+__km_futex:
+    push %rcx
+    push %rbx
+    mov %rdi, %rax          # bucket index = hash of uaddr
+    mov $KM_FUTEX_HASH, %rbx
+    imul %rbx, %rax
+    shr $(64 - KM_FUTEX_BUCKET_BITS), %rax
+    lea km_futex_buckets(%rip), %rbx
+    lea (%rbx,%rax,FUTEX_BUCKET_SIZE), %rbx
+    mov %esi, %ecx
+    and $~FUTEX_PRIVATE_FLAG, %ecx
+    cmp $FUTEX_WAKE, %ecx
+    je .Lfutex_wake
+    cmp $FUTEX_WAKE_BITSET, %ecx
+    je .Lfutex_wake
+    cmp $FUTEX_WAIT, %ecx
+    je .Lfutex_wait
+    cmp $FUTEX_WAIT_BITSET, %ecx
+    je .Lfutex_wait
+.Lfutex_hcall:
+    pop %rbx
+    pop %rcx
+    mov $SYS_futex, %eax
+    jmp .Lsyscall_hcall
+
+.Lfutex_wake:
+    test $FUTEX_PRIVATE_FLAG, %esi
+    jz .Lfutex_hcall        # shared futex waiters may be in other processes
+    lock orq $0, (%rsp)     # caller's store to the futex word before we look at the waiters
+    cmpl $0, futex_waiters(%rbx)
+    jne .Lfutex_hcall
+    xor %eax, %eax          # nobody woken
+    jmp .Lfutex_return
+
+.Lfutex_wait:
+    test $3, %dil
+    jnz .Lfutex_hcall       # misaligned, KM returns EINVAL
+    push %r8
+    push %r9
+    mov futex_spins(%rbx), %r9d
+    lea KM_FUTEX_SPIN_MIN(%r9,%r9), %r8
+    mov km_futex_spin_max(%rip), %ecx
+    cmp %rcx, %r8
+    jbe 1f
+    mov %rcx, %r8
+1:  xor %ecx, %ecx
+    .global __km_futex_load
+__km_futex_load:
+2:  cmp (%rdi), %edx
+    jne 3f
+    pause
+    inc %ecx
+    cmp %r8d, %ecx
+    jb 2b
+    mov %r9d, %ecx          # gave up, spin 1/8 less next time
+    shr $3, %ecx
+    sub %ecx, %r9d
+    mov %r9d, futex_spins(%rbx)
+    pop %r9
+    pop %r8
+    jmp .Lfutex_hcall
+3:  sub %r9d, %ecx          # word changed, move 1/8 of the way to the spins it took
+    sar $3, %ecx
+    add %ecx, %r9d
+    mov %r9d, futex_spins(%rbx)
+    pop %r9
+    pop %r8
+    mov $-EAGAIN, %rax
+    jmp .Lfutex_return
+
+// Futex word isn't mapped, let KM do the whole thing and return EFAULT
+    .global __km_futex_fault
+__km_futex_fault:
+    pop %r9
+    pop %r8
+    jmp .Lfutex_hcall
+
+.Lfutex_return:
+    pop %rbx
+    pop %rcx
+    andq $0x3C7FD7, %r11    # restore the flag register
+    push %r11
+    popfq
+    jmp *%rcx
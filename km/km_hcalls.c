@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <setjmp.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
@@ -26,6 +27,7 @@
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/times.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <asm/prctl.h>
@@ -39,10 +41,14 @@
 #include "km_fork.h"
 #include "km_guest.h"
 #include "km_hcalls.h"
+#include "km_idle.h"
+#include "km_io_uring.h"
 #include "km_mem.h"
+#include "km_sched.h"
 #include "km_signal.h"
 #include "km_snapshot.h"
 #include "km_syscall.h"
+#include "km_timer.h"
 
 /*
  * User space (km) implementation of hypercalls.
@@ -145,13 +151,12 @@ static km_hc_ret_t prw_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    // ssize_t write(int fd, const void *buf, size_t count);
    // ssize_t pread(int fd, void *buf, size_t count, off_t offset);
    // ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset);
-   // arg->hc_ret = __syscall_4(hc, arg->arg1, km_gva_to_kml(arg->arg2), arg->arg3, arg->arg4);
-   void* buf = km_gva_to_kma(arg->arg2);
+   int prot = hc == SYS_read || hc == SYS_pread64 ? PROT_WRITE : PROT_READ;
+   void* buf = km_gva_range_to_kma(vcpu, arg->arg2, arg->arg3, prot);
    if (buf == NULL && arg->arg3 != 0) {
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
-   // arg->hc_ret = km_fs_prw(vcpu, hc, arg->arg1, km_gva_to_kma(arg->arg2), arg->arg3, arg->arg4);
    arg->hc_ret = km_fs_prw(vcpu, hc, arg->arg1, buf, arg->arg3, arg->arg4);
    return HC_CONTINUE;
 }
@@ -161,12 +166,7 @@ static km_hc_ret_t prw_hcall(void* vcpu, int hc, km_hc_args_t* arg)
  */
 static km_hc_ret_t prwv_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   void* buf = km_gva_to_kma(arg->arg2);
-   if (buf == NULL) {
-      arg->hc_ret = -EFAULT;
-      return HC_CONTINUE;
-   }
-   arg->hc_ret = km_fs_prwv(vcpu, hc, arg->arg1, buf, arg->arg3, arg->arg4);
+   arg->hc_ret = km_fs_prwv(vcpu, hc, arg->arg1, arg->arg2, arg->arg3, arg->arg4);
    return HC_CONTINUE;
 }
 
@@ -260,6 +260,28 @@ static km_hc_ret_t setsockopt_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+/*
+ * Translate guest msghdr at msg_kma to msg, using iov for msg_iovlen host iovecs mapped with
+ * 'prot'. msg_name and msg_control are optional. Returns 0 or -EFAULT.
+ */
+static int km_msghdr_g2h(
+    km_vcpu_t* vcpu, int prot, struct msghdr* msg_kma, struct msghdr* msg, struct iovec* iov)
+{
+   int ret;
+
+   msg->msg_name = km_gva_to_kma((uint64_t)msg_kma->msg_name);   // optional
+   msg->msg_namelen = msg_kma->msg_namelen;
+   msg->msg_iovlen = msg_kma->msg_iovlen;
+   if ((ret = km_iov_g2h(vcpu, (km_gva_t)msg_kma->msg_iov, msg->msg_iovlen, prot, iov)) != 0) {
+      return ret;
+   }
+   msg->msg_iov = iov;
+   msg->msg_control = km_gva_to_kma((uint64_t)msg_kma->msg_control);   // optional
+   msg->msg_controllen = msg_kma->msg_controllen;
+   msg->msg_flags = msg_kma->msg_flags;
+   return 0;
+}
+
 static km_hc_ret_t sendrecvmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
@@ -271,24 +293,19 @@ static km_hc_ret_t sendrecvmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
-   msg.msg_name = km_gva_to_kma((uint64_t)msg_kma->msg_name);   // optional
-   msg.msg_namelen = msg_kma->msg_namelen;
-   msg.msg_iovlen = msg_kma->msg_iovlen;
-   struct iovec iov[msg.msg_iovlen];
-   for (int i = 0; i < msg.msg_iovlen; i++) {
-      struct iovec* iov_kma;
-
-      if ((iov_kma = km_gva_to_kma((uint64_t)msg_kma->msg_iov)) == NULL) {
-         arg->hc_ret = -EFAULT;
-         return HC_CONTINUE;
-      }
-      iov[i].iov_base = km_gva_to_kma((uint64_t)iov_kma[i].iov_base);
-      iov[i].iov_len = iov_kma[i].iov_len;
+   if (msg_kma->msg_iovlen > UIO_MAXIOV) {
+      arg->hc_ret = -EMSGSIZE;
+      return HC_CONTINUE;
+   }
+   struct iovec* iov = km_vcpu_iov(vcpu);
+   if (iov == NULL) {
+      arg->hc_ret = -ENOMEM;
+      return HC_CONTINUE;
+   }
+   int prot = hc == SYS_recvmsg ? PROT_WRITE : PROT_READ;
+   if ((arg->hc_ret = km_msghdr_g2h(vcpu, prot, msg_kma, &msg, iov)) != 0) {
+      return HC_CONTINUE;
    }
-   msg.msg_iov = iov;
-   msg.msg_control = km_gva_to_kma((uint64_t)msg_kma->msg_control);   // optional
-   msg.msg_controllen = msg_kma->msg_controllen;
-   msg.msg_flags = msg_kma->msg_flags;
    arg->hc_ret = km_fs_sendrecvmsg(vcpu, hc, arg->arg1, &msg, arg->arg3);
    if (hc == SYS_recvmsg) {
       msg_kma->msg_namelen = msg.msg_namelen;
@@ -298,6 +315,138 @@ static km_hc_ret_t sendrecvmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+/*
+ * sendmmsg/recvmmsg. Guest messages are translated in batches of up to KM_MMSG_BATCH messages and
+ * UIO_MAXIOV iovecs in the vcpu iovec array, each batch is a single host syscall.
+ * recvmmsg timeout covers the whole call, so later batches get what is left of it. The host only
+ * checks the timeout after a message arrives, so once the first batch got some later ones don't
+ * block. As on Linux, what is left of the timeout is written back.
+ */
+static const int KM_MMSG_BATCH = 64;
+
+// What is left until 'deadline' into 'left', tv_sec is negative once it has passed
+static void km_mmsg_timeout_left(struct timespec* deadline, struct timespec* left)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   left->tv_sec = deadline->tv_sec - now.tv_sec;
+   if ((left->tv_nsec = deadline->tv_nsec - now.tv_nsec) < 0) {
+      left->tv_sec--;
+      left->tv_nsec += 1000000000L;
+   }
+}
+
+static km_hc_ret_t sendrecvmmsg_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+   // int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+   //              struct timespec *timeout);
+   unsigned int vlen = MIN(arg->arg3, UIO_MAXIOV);   // Linux silently caps vlen the same way
+   struct mmsghdr* msgvec_kma = km_gva_to_kma(arg->arg2);
+   struct timespec* timeout_kma = NULL;
+   struct timespec* timeout = NULL;
+   struct timespec left, deadline;
+   int flags = arg->arg4;
+
+   if (vlen > 0 && (msgvec_kma == NULL ||
+                    km_gva_to_kma(arg->arg2 + vlen * sizeof(struct mmsghdr) - 1) == NULL)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   if (hc == SYS_recvmmsg && arg->arg5 != 0 && (timeout_kma = km_gva_to_kma(arg->arg5)) == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   if (vlen == 0) {
+      arg->hc_ret = km_fs_sendrecvmmsg(vcpu, hc, arg->arg1, NULL, 0, flags, timeout_kma);
+      return HC_CONTINUE;
+   }
+   struct iovec* iov = km_vcpu_iov(vcpu);
+   if (iov == NULL) {
+      arg->hc_ret = -ENOMEM;
+      return HC_CONTINUE;
+   }
+
+   if (timeout_kma != NULL) {
+      left = *timeout_kma;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += left.tv_sec;
+      if ((deadline.tv_nsec += left.tv_nsec) >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+      }
+      timeout = &left;
+   }
+   struct mmsghdr msgvec[KM_MMSG_BATCH];
+   int done = 0;
+   int ret = 0;
+   while (done < vlen) {
+      int niov = 0;
+      int n;
+
+      for (n = 0; n < KM_MMSG_BATCH && done + n < vlen; n++) {
+         struct msghdr* msg_kma = &msgvec_kma[done + n].msg_hdr;
+
+         if (niov + msg_kma->msg_iovlen > UIO_MAXIOV) {
+            if (n == 0) {
+               ret = -EMSGSIZE;
+            }
+            break;   // next batch
+         }
+         int prot = hc == SYS_recvmmsg ? PROT_WRITE : PROT_READ;
+         if ((ret = km_msghdr_g2h(vcpu, prot, msg_kma, &msgvec[n].msg_hdr, iov + niov)) != 0) {
+            if (n > 0) {
+               ret = 0;   // send the good ones, the error is reported on the next round
+            }
+            break;
+         }
+         msgvec[n].msg_len = 0;
+         niov += msg_kma->msg_iovlen;
+      }
+      if (ret == 0) {
+         ret = km_fs_sendrecvmmsg(vcpu, hc, arg->arg1, msgvec, n, flags, timeout);
+      }
+      if (ret < 0) {
+         break;
+      }
+      for (int i = 0; i < ret; i++) {
+         struct mmsghdr* mmsg_kma = &msgvec_kma[done + i];
+
+         mmsg_kma->msg_len = msgvec[i].msg_len;
+         if (hc == SYS_recvmmsg) {
+            mmsg_kma->msg_hdr.msg_namelen = msgvec[i].msg_hdr.msg_namelen;
+            mmsg_kma->msg_hdr.msg_controllen = msgvec[i].msg_hdr.msg_controllen;
+            mmsg_kma->msg_hdr.msg_flags = msgvec[i].msg_hdr.msg_flags;
+         }
+      }
+      done += ret;
+      if (ret < n) {
+         break;
+      }
+      if (hc == SYS_recvmmsg && (flags & MSG_WAITFORONE) != 0) {
+         flags |= MSG_DONTWAIT;   // got one, don't block for the rest
+      }
+      if (timeout != NULL) {
+         km_mmsg_timeout_left(&deadline, &left);
+         if (left.tv_sec < 0) {
+            break;   // timed out, return what we've got
+         }
+         flags |= MSG_DONTWAIT;
+      }
+   }
+   if (timeout_kma != NULL) {
+      km_mmsg_timeout_left(&deadline, &left);
+      if (left.tv_sec < 0) {
+         left = (struct timespec){};
+      }
+      *timeout_kma = left;
+   }
+   // Like Linux, an error is only reported if no message was transferred
+   arg->hc_ret = done > 0 ? done : ret;
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t sendfile_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
@@ -328,6 +477,50 @@ static km_hc_ret_t copy_file_range_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+static km_hc_ret_t splice_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+   // unsigned int flags);
+   off_t* off_in = NULL;
+   off_t* off_out = NULL;
+
+   if ((arg->arg2 != 0 && (off_in = km_gva_to_kma(arg->arg2)) == NULL) ||
+       (arg->arg4 != 0 && (off_out = km_gva_to_kma(arg->arg4)) == NULL)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_fs_splice(vcpu, arg->arg1, off_in, arg->arg3, off_out, arg->arg5, arg->arg6);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t tee_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+   arg->hc_ret = km_fs_tee(vcpu, arg->arg1, arg->arg2, arg->arg3, arg->arg4);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t vmsplice_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs, unsigned int flags);
+   size_t nr_segs = arg->arg3;
+
+   if (nr_segs > UIO_MAXIOV) {
+      arg->hc_ret = -EINVAL;
+      return HC_CONTINUE;
+   }
+   struct iovec* iov = km_vcpu_iov(vcpu);
+   if (iov == NULL) {
+      arg->hc_ret = -ENOMEM;
+      return HC_CONTINUE;
+   }
+   if ((arg->hc_ret = km_iov_g2h(vcpu, arg->arg2, nr_segs, PROT_READ, iov)) != 0) {
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_fs_vmsplice(vcpu, arg->arg1, iov, nr_segs, arg->arg4);
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t ioctl_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int ioctl(int fd, unsigned long request, void *arg);
@@ -471,6 +664,7 @@ static km_hc_ret_t futex_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    int op = arg->arg2;
    uint64_t timeout_or_val2;
+   km_futex_bucket_t* waiting = NULL;
 
    // int futex(int *uaddr, int futex_op, int val,
    //   const struct timespec *timeout,   /* or: uint32_t val2 */
@@ -478,10 +672,27 @@ static km_hc_ret_t futex_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    switch (op & 0xf) {
       case FUTEX_WAIT:
       case FUTEX_WAIT_BITSET:
-      case FUTEX_LOCK_PI:
+         if (km_idle_poll_ns != 0 &&
+             (arg->hc_ret = km_idle_futex_poll(vcpu, arg->arg1, arg->arg3)) != 0) {
+            return HC_CONTINUE;
+         }
+         // fall through
       case FUTEX_WAIT_REQUEUE_PI:
+         // counted before the kernel looks at the futex word, see __km_futex
+         waiting = km_futex_bucket(arg->arg1);
+         __atomic_add_fetch(&waiting->waiters, 1, __ATOMIC_SEQ_CST);
+         // fall through
+      case FUTEX_LOCK_PI:
          timeout_or_val2 = km_gva_to_kml(arg->arg4);
          break;
+      case FUTEX_REQUEUE:
+      case FUTEX_CMP_REQUEUE:
+      case FUTEX_CMP_REQUEUE_PI:
+         // requeued waiters are counted on uaddr, so always wake uaddr2 the slow way from now on
+         __atomic_or_fetch(&km_futex_bucket(arg->arg5)->waiters,
+                           KM_FUTEX_REQUEUED,
+                           __ATOMIC_SEQ_CST);
+         // fall through
       default:
          timeout_or_val2 = arg->arg4;
          break;
@@ -493,6 +704,9 @@ static km_hc_ret_t futex_hcall(void* vcpu, int hc, km_hc_args_t* arg)
                              timeout_or_val2,
                              km_gva_to_kml(arg->arg5),
                              arg->arg6);
+   if (waiting != NULL) {
+      __atomic_sub_fetch(&waiting->waiters, 1, __ATOMIC_SEQ_CST);
+   }
    return HC_CONTINUE;
 }
 
@@ -770,6 +984,34 @@ static km_hc_ret_t fdatasync_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+static km_hc_ret_t fallocate_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int fallocate(int fd, int mode, off_t offset, off_t len);
+   arg->hc_ret = km_fs_fallocate(vcpu, arg->arg1, arg->arg2, arg->arg3, arg->arg4);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t fadvise64_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+   arg->hc_ret = km_fs_fadvise64(vcpu, arg->arg1, arg->arg2, arg->arg3, arg->arg4);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t readahead_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // ssize_t readahead(int fd, off64_t offset, size_t count);
+   arg->hc_ret = km_fs_readahead(vcpu, arg->arg1, arg->arg2, arg->arg3);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t sync_file_range_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int sync_file_range(int fd, off64_t offset, off64_t nbytes, unsigned int flags);
+   arg->hc_ret = km_fs_sync_file_range(vcpu, arg->arg1, arg->arg2, arg->arg3, arg->arg4);
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t mkdir_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int mkdir(const char *path, mode_t mode);
@@ -875,9 +1117,14 @@ static km_hc_ret_t sendto_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
    //                const struct sockaddr *dest_addr, socklen_t addrlen);
+   void* buf = km_gva_range_to_kma(vcpu, arg->arg2, arg->arg3, PROT_READ);
+   if (buf == NULL && arg->arg3 != 0) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
    arg->hc_ret = km_fs_sendto(vcpu,
                               arg->arg1,
-                              km_gva_to_kma(arg->arg2),
+                              buf,
                               arg->arg3,
                               arg->arg4,
                               km_gva_to_kma(arg->arg5),
@@ -999,6 +1246,23 @@ static km_hc_ret_t poll_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+static km_hc_ret_t ppoll_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
+   //           const sigset_t *sigmask, size_t sigsetsize);
+   // NULL is a legal value for tmo_p and sigmask
+   void* fds = km_gva_to_kma(arg->arg1);
+   void* tmo_p = km_gva_to_kma(arg->arg3);
+   void* sigmask = km_gva_to_kma(arg->arg4);
+   if ((fds == NULL && arg->arg2 != 0) || (tmo_p == NULL && arg->arg3 != 0) ||
+       (sigmask == NULL && arg->arg4 != 0)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_fs_ppoll(vcpu, fds, arg->arg2, tmo_p, sigmask, arg->arg5);
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t accept4_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int accept4(int sockfd, struct sockaddr *addr,
@@ -1023,7 +1287,7 @@ static km_hc_ret_t recvfrom_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    // ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
    //                  struct sockaddr *srcaddr, socklen_t *addrlen);
    // srcaddr and addrlen are optional
-   void* buf = km_gva_to_kma(arg->arg2);
+   void* buf = km_gva_range_to_kma(vcpu, arg->arg2, arg->arg3, PROT_WRITE);
    void* srcaddr = km_gva_to_kma(arg->arg5);
    void* addrlen = km_gva_to_kma(arg->arg6);
    if (buf == NULL) {
@@ -1134,7 +1398,7 @@ static km_hc_ret_t rt_sigaction_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 
 static km_hc_ret_t rt_sigreturn_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
-   km_rt_sigreturn(vcpu);   // don't care about arg or return code.
+   km_rt_sigreturn(vcpu, arg);   // don't care about return code.
    return HC_CONTINUE;
 }
 
@@ -1270,6 +1534,23 @@ static km_hc_ret_t epoll_pwait_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+static km_hc_ret_t epoll_pwait2_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int epoll_pwait2(int epfd, struct epoll_event *events, int maxevents, const struct timespec
+   // *timeout, const sigset_t *sigmask, size_t sigsetsize);
+   void* events = km_gva_to_kma(arg->arg2);
+   void* timeout = km_gva_to_kma(arg->arg4);
+   void* sigmask = km_gva_to_kma(arg->arg5);
+   if (events == NULL || (timeout == NULL && arg->arg4 != 0) ||
+       (sigmask == NULL && arg->arg5 != 0)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret =
+       km_fs_epoll_pwait2(vcpu, arg->arg1, events, arg->arg3, timeout, sigmask, arg->arg6);
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t pipe_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int pipe2(int pipefd[2], int flags);
@@ -1301,6 +1582,92 @@ static km_hc_ret_t eventfd2_hcall(void* vcpu, int hc, km_hc_args_t* arg)
    return HC_CONTINUE;
 }
 
+static km_hc_ret_t timerfd_create_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int timerfd_create(int clockid, int flags);
+   arg->hc_ret = km_fs_timerfd_create(vcpu, arg->arg1, arg->arg2);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t timerfd_settime_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int timerfd_settime(int fd, int flags, const struct itimerspec* new, struct itimerspec* old);
+   struct itimerspec* new_value = km_gva_to_kma(arg->arg3);
+   struct itimerspec* old_value = NULL;
+   if (new_value == NULL || (arg->arg4 != 0 && (old_value = km_gva_to_kma(arg->arg4)) == NULL)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_fs_timerfd_settime(vcpu, arg->arg1, arg->arg2, new_value, old_value);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t timerfd_gettime_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int timerfd_gettime(int fd, struct itimerspec* curr_value);
+   struct itimerspec* curr_value = km_gva_to_kma(arg->arg2);
+   if (curr_value == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_fs_timerfd_gettime(vcpu, arg->arg1, curr_value);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t io_uring_setup_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int io_uring_setup(u32 entries, struct io_uring_params* p);
+   struct io_uring_params* p = km_gva_to_kma(arg->arg2);
+   if (p == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_io_uring_setup(vcpu, arg->arg1, p);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t io_uring_enter_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int io_uring_enter(unsigned int fd, u32 to_submit, u32 min_complete, u32 flags,
+   //  const void* arg, size_t argsz);
+   arg->hc_ret =
+       km_io_uring_enter(vcpu, arg->arg1, arg->arg2, arg->arg3, arg->arg4, arg->arg5, arg->arg6);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t io_uring_register_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int io_uring_register(unsigned int fd, unsigned int opcode, void* arg, unsigned int nr_args);
+   arg->hc_ret = km_io_uring_register(vcpu, arg->arg1, arg->arg2, arg->arg3, arg->arg4);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t memfd_create_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int memfd_create(const char* name, unsigned int flags);
+   char* name = km_gva_to_kma(arg->arg1);
+   if (name == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_fs_memfd_create(vcpu, name, arg->arg2);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t signalfd_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int signalfd(int fd, const sigset_t* mask, size_t sizemask);
+   // int signalfd4(int fd, const sigset_t* mask, size_t sizemask, int flags);
+   km_sigset_t* mask = km_gva_to_kma(arg->arg2);
+   if (mask == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   int flags = hc == SYS_signalfd4 ? arg->arg4 : 0;
+   arg->hc_ret = km_fs_signalfd4(vcpu, arg->arg1, mask, arg->arg3, flags);
+   return HC_CONTINUE;
+}
+
 static km_hc_ret_t prlimit64_hcall(void* vcpu, int hc, km_hc_args_t* arg)
 {
    // int prlimit(pid_t pid, int resource, const struct rlimit *new_limit, struct rlimit
@@ -1480,7 +1847,7 @@ static km_hc_ret_t sched_getaffinity_hcall(void* vcpu, int hc, km_hc_args_t* arg
 {
    // int sched_getaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask);
    km_infox(KM_TRACE_SCHED, "(0x%lx, 0x%lx, 0x%lx)", arg->arg1, arg->arg2, arg->arg3);
-   arg->hc_ret = __syscall_3(hc, arg->arg1, arg->arg2, km_gva_to_kml(arg->arg3));
+   arg->hc_ret = km_sched_getaffinity(vcpu, arg->arg1, arg->arg2, arg->arg3);
    return HC_CONTINUE;
 }
 
@@ -1488,8 +1855,50 @@ static km_hc_ret_t sched_setaffinity_hcall(void* vcpu, int hc, km_hc_args_t* arg
 {
    // int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask);
    km_infox(KM_TRACE_SCHED, "(0x%lx, 0x%lx, 0x%lx)", arg->arg1, arg->arg2, arg->arg3);
-   km_warnx("Unsupported");
-   arg->hc_ret = -ENOTSUP;
+   arg->hc_ret = km_sched_setaffinity(vcpu, arg->arg1, arg->arg2, arg->arg3);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t sched_pid_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int sched_getscheduler(pid_t pid);
+   // int sched_setparam(pid_t pid, const struct sched_param *param);
+   // int sched_getparam(pid_t pid, struct sched_param *param);
+   // int sched_rr_get_interval(pid_t pid, struct timespec *tp);
+   km_infox(KM_TRACE_SCHED, "%s(0x%lx, 0x%lx)", km_hc_name_get(hc), arg->arg1, arg->arg2);
+   arg->hc_ret = km_sched_pid_syscall(vcpu, hc, arg->arg1, km_gva_to_kml(arg->arg2), 0);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t sched_setscheduler_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
+   km_infox(KM_TRACE_SCHED, "(0x%lx, 0x%lx, 0x%lx)", arg->arg1, arg->arg2, arg->arg3);
+   arg->hc_ret = km_sched_pid_syscall(vcpu, hc, arg->arg1, arg->arg2, km_gva_to_kml(arg->arg3));
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t sched_get_priority_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int sched_get_priority_max(int policy);
+   // int sched_get_priority_min(int policy);
+   arg->hc_ret = __syscall_1(hc, arg->arg1);
+   return HC_CONTINUE;
+}
+
+static km_hc_ret_t sched_prio_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   // int getpriority(int which, id_t who);
+   // int setpriority(int which, id_t who, int prio);
+   // int ioprio_get(int which, int who);
+   // int ioprio_set(int which, int who, int ioprio);
+   km_infox(KM_TRACE_SCHED,
+            "%s(0x%lx, 0x%lx, 0x%lx)",
+            km_hc_name_get(hc),
+            arg->arg1,
+            arg->arg2,
+            arg->arg3);
+   arg->hc_ret = km_sched_prio_syscall(vcpu, hc, arg->arg1, arg->arg2, arg->arg3);
    return HC_CONTINUE;
 }
 
@@ -1600,24 +2009,30 @@ static int do_exec(char* filename, char** argv, char** envp)
       return -errno;
    }
 
+   // No new vcpus while their fds are passed on, see km_exec_vmfd_var()
+   km_vcpu_pool_stop();
    // Add some km state to the environment.
    if ((newenv = km_exec_build_env(envp)) == NULL) {
+      km_vcpu_pool_start();
       return -ENOMEM;
    }
 
    // Build argv line with km program and args before the payload's args.
    if ((newargv = km_exec_build_argv(filename, argv, envp)) == NULL) {
       free(newenv);
+      km_vcpu_pool_start();
       return -ENOEXEC;
    }
 
    // Start km again with the new payload program
    execve(km_get_self_name(), newargv, newenv);
    // If we are here, execve() failed.  So we need to cleanup.
+   ret = -errno;
    km_info(KM_TRACE_HC, "execve failed");
    free(newargv);
    free(newenv);
-   return -errno;
+   km_vcpu_pool_start();
+   return ret;
 }
 
 /*
@@ -1841,7 +2256,7 @@ static km_hc_ret_t setitimer_hcall(void* vcpu, int hc, km_hc_args_t* arg)
          return HC_CONTINUE;
       }
    }
-   arg->hc_ret = setitimer(arg->arg1, new, old);
+   arg->hc_ret = km_setitimer(arg->arg1, new, old);
    return HC_CONTINUE;
 }
 
@@ -1855,7 +2270,83 @@ static km_hc_ret_t getitimer_hcall(void* vcpu, int hc, km_hc_args_t* arg)
       arg->hc_ret = -EFAULT;
       return HC_CONTINUE;
    }
-   arg->hc_ret = getitimer(arg->arg1, curr);
+   arg->hc_ret = km_getitimer(arg->arg1, curr);
+   return HC_CONTINUE;
+}
+
+/*
+ * unsigned int alarm(unsigned int seconds);
+ */
+static km_hc_ret_t alarm_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   arg->hc_ret = km_alarm(arg->arg1);
+   return HC_CONTINUE;
+}
+
+/*
+ * int timer_create(clockid_t clockid, struct sigevent* sevp, timer_t* timerid);
+ */
+static km_hc_ret_t timer_create_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   km_sigevent_t* sevp = NULL;
+   int* timerid = km_gva_to_kma(arg->arg3);
+   if (timerid == NULL || (arg->arg2 != 0 && (sevp = km_gva_to_kma(arg->arg2)) == NULL)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_timer_create(vcpu, arg->arg1, sevp, timerid);
+   return HC_CONTINUE;
+}
+
+/*
+ * int timer_settime(timer_t timerid, int flags, const struct itimerspec* new_value,
+ *                   struct itimerspec* old_value);
+ */
+static km_hc_ret_t timer_settime_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   struct itimerspec* old = NULL;
+   struct itimerspec* new = km_gva_to_kma(arg->arg3);
+   if (arg->arg3 == 0) {
+      arg->hc_ret = -EINVAL;
+      return HC_CONTINUE;
+   }
+   if (new == NULL || (arg->arg4 != 0 && (old = km_gva_to_kma(arg->arg4)) == NULL)) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_timer_settime(arg->arg1, arg->arg2, new, old);
+   return HC_CONTINUE;
+}
+
+/*
+ * int timer_gettime(timer_t timerid, struct itimerspec* curr_value);
+ */
+static km_hc_ret_t timer_gettime_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   struct itimerspec* curr = km_gva_to_kma(arg->arg2);
+   if (curr == NULL) {
+      arg->hc_ret = -EFAULT;
+      return HC_CONTINUE;
+   }
+   arg->hc_ret = km_timer_gettime(arg->arg1, curr);
+   return HC_CONTINUE;
+}
+
+/*
+ * int timer_getoverrun(timer_t timerid);
+ */
+static km_hc_ret_t timer_getoverrun_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   arg->hc_ret = km_timer_getoverrun(arg->arg1);
+   return HC_CONTINUE;
+}
+
+/*
+ * int timer_delete(timer_t timerid);
+ */
+static km_hc_ret_t timer_delete_hcall(void* vcpu, int hc, km_hc_args_t* arg)
+{
+   arg->hc_ret = km_timer_delete(arg->arg1);
    return HC_CONTINUE;
 }
 
@@ -2018,8 +2509,13 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_setsockopt] = setsockopt_hcall,
     [SYS_sendmsg] = sendrecvmsg_hcall,
     [SYS_recvmsg] = sendrecvmsg_hcall,
+    [SYS_sendmmsg] = sendrecvmmsg_hcall,
+    [SYS_recvmmsg] = sendrecvmmsg_hcall,
     [SYS_sendfile] = sendfile_hcall,
     [SYS_copy_file_range] = copy_file_range_hcall,
+    [SYS_splice] = splice_hcall,
+    [SYS_tee] = tee_hcall,
+    [SYS_vmsplice] = vmsplice_hcall,
     [SYS_ioctl] = ioctl_hcall,
     [SYS_fcntl] = fcntl_hcall,
     [SYS_stat] = stat_hcall,
@@ -2072,6 +2568,10 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_ftruncate] = ftruncate_hcall,
     [SYS_fsync] = fsync_hcall,
     [SYS_fdatasync] = fdatasync_hcall,
+    [SYS_fallocate] = fallocate_hcall,
+    [SYS_fadvise64] = fadvise64_hcall,
+    [SYS_readahead] = readahead_hcall,
+    [SYS_sync_file_range] = sync_file_range_hcall,
     [SYS_select] = select_hcall,
     [SYS_pselect6] = pselect6_hcall,
     [SYS_pause] = pause_hcall,
@@ -2081,6 +2581,7 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_getsockname] = get_sock_peer_name_hcall,
     [SYS_getpeername] = get_sock_peer_name_hcall,
     [SYS_poll] = poll_hcall,
+    [SYS_ppoll] = ppoll_hcall,
     [SYS_accept4] = accept4_hcall,
     [SYS_recvfrom] = recvfrom_hcall,
     [SYS_epoll_create1] = epoll1_create_hcall,
@@ -2088,6 +2589,7 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_epoll_ctl] = epoll_ctl_hcall,
     [SYS_epoll_wait] = epoll_wait_hcall,
     [SYS_epoll_pwait] = epoll_pwait_hcall,
+    [SYS_epoll_pwait2] = epoll_pwait2_hcall,
     [SYS_access] = access_hcall,
     [SYS_faccessat] = faccessat_hcall,
     [SYS_dup] = dup_hcall,
@@ -2096,6 +2598,15 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_pipe] = pipe_hcall,
     [SYS_pipe2] = pipe2_hcall,
     [SYS_eventfd2] = eventfd2_hcall,
+    [SYS_timerfd_create] = timerfd_create_hcall,
+    [SYS_timerfd_settime] = timerfd_settime_hcall,
+    [SYS_timerfd_gettime] = timerfd_gettime_hcall,
+    [SYS_memfd_create] = memfd_create_hcall,
+    [SYS_io_uring_setup] = io_uring_setup_hcall,
+    [SYS_io_uring_enter] = io_uring_enter_hcall,
+    [SYS_io_uring_register] = io_uring_register_hcall,
+    [SYS_signalfd] = signalfd_hcall,
+    [SYS_signalfd4] = signalfd_hcall,
     [SYS_prlimit64] = prlimit64_hcall,
 
     [SYS_rt_sigprocmask] = rt_sigprocmask_hcall,
@@ -2127,7 +2638,17 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
     [SYS_getpgid] = getpgid_hcall,
 
     [SYS_sched_yield] = sched_yield_hcall,
-    [SYS_setpriority] = dummy_hcall,
+    [SYS_getpriority] = sched_prio_hcall,
+    [SYS_setpriority] = sched_prio_hcall,
+    [SYS_ioprio_get] = sched_prio_hcall,
+    [SYS_ioprio_set] = sched_prio_hcall,
+    [SYS_sched_setscheduler] = sched_setscheduler_hcall,
+    [SYS_sched_getscheduler] = sched_pid_hcall,
+    [SYS_sched_setparam] = sched_pid_hcall,
+    [SYS_sched_getparam] = sched_pid_hcall,
+    [SYS_sched_rr_get_interval] = sched_pid_hcall,
+    [SYS_sched_get_priority_max] = sched_get_priority_hcall,
+    [SYS_sched_get_priority_min] = sched_get_priority_hcall,
     [SYS_sched_getaffinity] = sched_getaffinity_hcall,
     [SYS_sched_setaffinity] = sched_setaffinity_hcall,
     [SYS_prctl] = dummy_hcall,
@@ -2158,6 +2679,12 @@ const km_hcall_fn_t km_hcalls_table[KM_MAX_HCALL] = {
 
     [SYS_setitimer] = setitimer_hcall,
     [SYS_getitimer] = getitimer_hcall,
+    [SYS_alarm] = alarm_hcall,
+    [SYS_timer_create] = timer_create_hcall,
+    [SYS_timer_settime] = timer_settime_hcall,
+    [SYS_timer_gettime] = timer_gettime_hcall,
+    [SYS_timer_getoverrun] = timer_getoverrun_hcall,
+    [SYS_timer_delete] = timer_delete_hcall,
     [SYS_statfs] = statfs_hcall,
     [SYS_fstatfs] = fstatfs_hcall,
 
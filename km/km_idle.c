@@ -0,0 +1,177 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * How idle payload threads wait.
+ *
+ * A payload thread with nothing to do sits in a futex() or epoll_wait() hypercall, asleep in the
+ * host. Waking it up is a host scheduler wakeup, which is most of the latency of a request/response
+ * exchange between threads. --idle picks a policy:
+ *
+ * - balanced (default): the guest side of futex() spins a little before the hypercall, see
+ *   __km_futex.
+ * - latency: the guest spins longer, and futex waits and epoll waits that would block poll in km
+ *   for up to km_idle_poll_ns before going to sleep in the host. Costs CPU time on every wait.
+ * - power: no spinning or polling, idle threads go to sleep right away.
+ *
+ * --idle-poll-ns overrides the polling window of the policy.
+ *
+ * Note vcpus never halt here, payload threads block in hypercalls, so KVM halt polling
+ * (KVM_CAP_HALT_POLL) doesn't come into play. Polling in km is what takes its place.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "km.h"
+#include "km_guest.h"
+#include "km_idle.h"
+#include "km_mem.h"
+#include "km_syscall.h"
+
+typedef enum {
+   KM_IDLE_BALANCED = 0,
+   KM_IDLE_LATENCY,
+   KM_IDLE_POWER,
+} km_idle_policy_t;
+
+static const struct {
+   const char* name;
+   uint32_t spin_max;   // guest FUTEX_WAIT spins, 0 to keep the built in one
+   uint64_t poll_ns;    // km polling window
+} km_idle_policies[] = {
+    [KM_IDLE_BALANCED] = {"balanced", 0, 0},
+    [KM_IDLE_LATENCY] = {"latency", 4096, 50000},
+    [KM_IDLE_POWER] = {"power", 1, 0},
+};
+
+#define KM_IDLE_POLL_BATCH 64   // futex word checks between looking at the clock
+
+uint64_t km_idle_poll_ns;
+static km_idle_policy_t km_idle_policy = KM_IDLE_BALANCED;
+static int64_t km_idle_poll_ns_given = -1;   // --idle-poll-ns
+
+int km_idle_parse_policy(const char* name)
+{
+   for (int i = 0; i < sizeof(km_idle_policies) / sizeof(km_idle_policies[0]); i++) {
+      if (strcmp(name, km_idle_policies[i].name) == 0) {
+         km_idle_policy = i;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+int km_idle_parse_poll_ns(const char* ns)
+{
+   char* ep;
+
+   km_idle_poll_ns_given = strtol(ns, &ep, 0);
+   if (*ns == '\0' || *ep != '\0' || km_idle_poll_ns_given < 0) {
+      return -1;
+   }
+   return 0;
+}
+
+void km_idle_init(void)
+{
+   if (km_idle_policies[km_idle_policy].spin_max != 0) {
+      km_futex_spin_max = km_idle_policies[km_idle_policy].spin_max;
+   }
+   km_idle_poll_ns = km_idle_policies[km_idle_policy].poll_ns;
+   if (km_idle_poll_ns_given >= 0) {
+      km_idle_poll_ns = km_idle_poll_ns_given;
+   }
+   km_infox(KM_TRACE_SCHED,
+            "idle policy %s, guest spins %u, poll %ld ns",
+            km_idle_policies[km_idle_policy].name,
+            km_futex_spin_max,
+            km_idle_poll_ns);
+}
+
+static inline uint64_t km_idle_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * FUTEX_WAIT on uaddr for val. Returns -EAGAIN if the word changed within km_idle_poll_ns, -EINTR
+ * if vcpu was kicked for a signal meanwhile, the host wait would miss that kick. 0 if neither, or
+ * we can't tell, the host is left to deal with it.
+ */
+int km_idle_futex_poll(km_vcpu_t* vcpu, km_gva_t uaddr, uint32_t val)
+{
+   volatile uint32_t* word;
+   uint64_t deadline;
+
+   if ((uaddr & 3) != 0 || (word = km_gva_to_kma(uaddr)) == NULL) {
+      return 0;
+   }
+   deadline = km_idle_now() + km_idle_poll_ns;
+   do {
+      for (int i = 0; i < KM_IDLE_POLL_BATCH; i++) {
+         if (*word != val) {
+            return -EAGAIN;
+         }
+         __builtin_ia32_pause();
+      }
+      if (km_vcpu_kicked(vcpu) != 0) {
+         return -EINTR;
+      }
+   } while (km_idle_now() < deadline);
+   return 0;
+}
+
+/*
+ * epoll wait that is about to go to the host, 'hc' and 'timeout' as in km_fs_do_epoll_wait(). If
+ * it would block, poll epfd for up to km_idle_poll_ns, or until vcpu is kicked for a signal.
+ * Returns what the wait should, or 0 to go ahead and wait.
+ */
+int km_idle_epoll_poll(km_vcpu_t* vcpu,
+                       int hc,
+                       int host_epfd,
+                       struct epoll_event* events,
+                       int maxevents,
+                       uint64_t timeout)
+{
+   uint64_t deadline;
+   int ret;
+
+   if (hc == SYS_epoll_pwait2) {
+      struct timespec* ts = (struct timespec*)timeout;
+      if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec == 0) {
+         return 0;
+      }
+   } else if ((int)timeout == 0) {
+      return 0;
+   }
+   deadline = km_idle_now() + km_idle_poll_ns;
+   do {
+      if ((ret = __syscall_4(SYS_epoll_wait, host_epfd, (uintptr_t)events, maxevents, 0)) != 0) {
+         return ret;
+      }
+      if (km_vcpu_kicked(vcpu) != 0) {
+         return -EINTR;
+      }
+   } while (km_idle_now() < deadline);
+   return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KM_IDLE_H__
+#define __KM_IDLE_H__
+
+#include <sys/epoll.h>
+
+#include "km.h"
+
+extern uint64_t km_idle_poll_ns;
+
+int km_idle_parse_policy(const char* name);
+int km_idle_parse_poll_ns(const char* ns);
+void km_idle_init(void);
+int km_idle_futex_poll(km_vcpu_t* vcpu, km_gva_t uaddr, uint32_t val);
+int km_idle_epoll_poll(km_vcpu_t* vcpu,
+                       int hc,
+                       int host_epfd,
+                       struct epoll_event* events,
+                       int maxevents,
+                       uint64_t timeout);
+
+#endif /* !defined(__KM_IDLE_H__) */
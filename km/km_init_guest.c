@@ -38,6 +38,7 @@
 #include "km_guest.h"
 #include "km_mem.h"
 #include "km_proc.h"
+#include "km_sched.h"
 #include "km_syscall.h"
 #include "x86_cpu.h"
 
@@ -225,27 +226,76 @@ km_gva_t km_init_main(km_vcpu_t* vcpu, int argc, char* const argv[], int envc, c
    return stack_top;   // argv in the guest
 }
 
+/*
+ * Create host thread for a new vcpu. The thread waits on thr_cv until vcpu state is HYPERCALL, the
+ * caller holds thr_mtx so vcpu_thread is set by the time the thread looks at it.
+ */
+int km_vcpu_thread_create(km_vcpu_t* vcpu)
+{
+   pthread_attr_t att;
+   int rc;
+
+   km_attr_init(&att);
+   km_attr_setstacksize(&att, 16 * KM_PAGE_SIZE);
+   if ((rc = -pthread_create(&vcpu->vcpu_thread, &att, (void* (*)(void*))km_vcpu_run, vcpu)) != 0) {
+      vcpu->vcpu_thread = 0;
+   }
+   km_attr_destroy(&att);
+   return rc;
+}
+
+/*
+ * Parked vcpu thread waits until its vcpu is given a payload thread (state is HYPERCALL), or exits
+ * if it is retired. Called with thr_mtx held.
+ */
+void km_vcpu_thread_wait(km_vcpu_t* vcpu)
+{
+   while (vcpu->state != HYPERCALL) {
+      if (vcpu->thr_retire != 0) {
+         km_unlock_vcpu_thr(vcpu);
+         pthread_exit(NULL);
+      }
+      km_cond_wait(&vcpu->thr_cv, &vcpu->thr_mtx);
+   }
+}
+
+/*
+ * The parked thread of vcpu can't be made to look like a new thread of the creator, see
+ * km_sched_vcpu_reset(). Make it exit, so a new one is created.
+ */
+void km_vcpu_thread_retire(km_vcpu_t* vcpu)
+{
+   km_lock_vcpu_thr(vcpu);
+   vcpu->thr_retire = 1;
+   km_cond_signal(&vcpu->thr_cv);
+   km_unlock_vcpu_thr(vcpu);
+   pthread_join(vcpu->vcpu_thread, NULL);
+   vcpu->thr_retire = 0;
+   vcpu->vcpu_thread = 0;
+   vcpu->vcpu_tid = 0;
+}
+
 /*
  * vcpu was obtained by km_vcpu_get(), state is STARTING. The registers and memory is fully prepared
  * to go. We need to create a thread if this is brand new vcpu, or signal the thread if it is reused
- * vcpu. Setting state to HYPERCALL signals the thread to start running.
+ * vcpu. Setting state to HYPERCALL signals the thread to start running. creator is the vcpu of the
+ * calling thread, NULL on a km thread.
  */
-int km_run_vcpu_thread(km_vcpu_t* vcpu)
+int km_run_vcpu_thread(km_vcpu_t* vcpu, km_vcpu_t* creator)
 {
    int rc = 0;
 
+   if (vcpu->vcpu_thread != 0 && km_sched_vcpu_reset(vcpu, creator) != 0) {
+      km_vcpu_thread_retire(vcpu);
+   }
    if (vcpu->vcpu_thread == 0) {
-      pthread_attr_t att;
-
-      km_attr_init(&att);
-      km_attr_setstacksize(&att, 16 * KM_PAGE_SIZE);
+      km_sched_vcpu_inherit(vcpu, creator);
       km_lock_vcpu_thr(vcpu);
       vcpu->state = HYPERCALL;
-      if ((rc = -pthread_create(&vcpu->vcpu_thread, &att, (void* (*)(void*))km_vcpu_run, vcpu)) != 0) {
+      if ((rc = km_vcpu_thread_create(vcpu)) != 0) {
          vcpu->state = STARTING;
       }
       km_unlock_vcpu_thr(vcpu);
-      km_attr_destroy(&att);
    } else {
       km_lock_vcpu_thr(vcpu);
       vcpu->state = HYPERCALL;
@@ -254,6 +304,8 @@ int km_run_vcpu_thread(km_vcpu_t* vcpu)
    }
    if (rc != 0) {
       km_info(KM_TRACE_VCPU, "run_vcpu_thread: failed activating vcpu thread");
+   } else {
+      km_sched_vcpu_start(vcpu);
    }
    return rc;
 }
@@ -264,9 +316,7 @@ void km_vcpu_stopped(km_vcpu_t* vcpu)
    km_exit(vcpu);   // release user space thread list lock, do delayed stack unmap
    km_vcpu_put(vcpu);
 
-   while (vcpu->state != HYPERCALL) {
-      km_cond_wait(&vcpu->thr_cv, &vcpu->thr_mtx);
-   }
+   km_vcpu_thread_wait(vcpu);
    km_unlock_vcpu_thr(vcpu);
 }
 
@@ -321,7 +371,7 @@ int km_clone(km_vcpu_t* vcpu,
             new_vcpu->vcpu_id,
             new_vcpu->regs.rip,
             new_vcpu->regs.rsp);
-   if (km_run_vcpu_thread(new_vcpu) < 0) {
+   if (km_run_vcpu_thread(new_vcpu, vcpu) < 0) {
       km_vcpu_put(new_vcpu);
       return -EAGAIN;
    }
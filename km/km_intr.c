@@ -178,9 +178,18 @@ void km_handle_interrupt(km_vcpu_t* vcpu)
    vcpu->regs.rsp = iframe->rsp;
    vcpu->sregs.cs.base = iframe->cs;
    vcpu->sregs.ss.base = iframe->ss;
+   // bad futex word in the guest side of futex(), it takes the hypercall which returns EFAULT
+   int futex_fault = (enumber == X86_INTR_PF || enumber == X86_INTR_GP) &&
+                     vcpu->regs.rip == km_guest_kma_to_gva(&__km_futex_load);
+   if (futex_fault != 0) {
+      vcpu->regs.rip = km_guest_kma_to_gva(&__km_futex_fault);
+   }
    km_write_registers(vcpu);
    km_write_sregisters(vcpu);
    km_write_xcrs(vcpu);
+   if (futex_fault != 0) {
+      return;
+   }
 
    /*
     * map processor exceptions to signals in accordance with Table 3.1 from AMD64 ABI
@@ -0,0 +1,871 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Guest io_uring.
+ *
+ * Each guest ring is a host ring. SQEs carry guest addresses, so the guest never sees the host SQ
+ * ring and SQE array. Instead mmap() of IORING_OFF_SQ_RING and IORING_OFF_SQES gives the guest
+ * private memory laid out the same way, and io_uring_enter() copies newly queued guest SQEs into
+ * the host ring, validating fds and translating guest addresses on the way. One enter carries any
+ * number of I/Os.
+ *
+ * Completions carry no addresses, so the CQ ring is the host one mapped into the guest like any
+ * other file mapping, and the guest reaps completions without exits. IORING_FEAT_SINGLE_MMAP is
+ * cleared so the guest maps the CQ ring on its own.
+ *
+ * The CQ ring mapping also covers the host SQ head, tail and array. Host SQEs that the kernel
+ * consumed are reset to IORING_OP_NOP, so whatever the guest does to those can only resubmit NOPs.
+ *
+ * Only ops with known layouts are allowed. Ops that create or close fds or take paths would bypass
+ * the guest fd table and path translation, and sendmsg/recvmsg write back through the msghdr after
+ * submission. These complete with -EINVAL.
+ *
+ * close() on one vcpu can race with io_uring_enter() on another, so hypercalls hold a reference on
+ * the ring, and the last one to let go frees it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "km.h"
+#include "km_filesys.h"
+#include "km_filesys_private.h"
+#include "km_io_uring.h"
+#include "km_mem.h"
+#include "km_syscall.h"
+
+// SQPOLL would read SQEs behind our back, SQE128 changes the SQE layout, TASKRUN_FLAG is a flag in
+// the SQ ring which the guest only sees at enter time.
+#define KM_IO_URING_SETUP_FLAGS                                                                    \
+   (IORING_SETUP_IOPOLL | IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_ATTACH_WQ |      \
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQE32 |                     \
+    IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN)
+
+typedef struct km_io_uring {
+   int refcnt;                       // guest fd plus hypercalls using the ring, km_io_uring_mutex
+   pthread_mutex_t lock;             // guest to host SQ copy
+   struct io_uring_params params;    // host ring geometry
+   size_t sq_ring_size;              // SQ ring size, same for host and guest
+   void* sq_ring;                    // host SQ ring, mapped in km only
+   struct io_uring_sqe* sqes;        // host SQE array, mapped in km only
+   unsigned* khead;                  // in sq_ring
+   unsigned* ktail;                  // in sq_ring
+   unsigned* kflags;                 // in sq_ring
+   unsigned* karray;                 // in sq_ring
+   unsigned sq_tail;                 // our copy of host tail
+   unsigned sq_clean;                // host SQEs before this are reset to NOP
+   km_gva_t gsq_ring;                // guest SQ ring
+   km_gva_t gsqes;                   // guest SQE array
+   unsigned ghead;                   // guest SQ head, only we move it
+   struct iovec** iov;               // translated iovecs per host SQE, for READV/WRITEV
+   unsigned* iov_cnt;                // size of iov[i]
+} km_io_uring_t;
+
+// Ops we know how to translate, for IORING_REGISTER_PROBE. Keep in sync with km_io_uring_sqe_g2h()
+static const uint8_t km_io_uring_ops[IORING_OP_LAST] = {
+    [IORING_OP_NOP] = 1,
+    [IORING_OP_READV] = 1,
+    [IORING_OP_WRITEV] = 1,
+    [IORING_OP_FSYNC] = 1,
+    [IORING_OP_READ_FIXED] = 1,
+    [IORING_OP_WRITE_FIXED] = 1,
+    [IORING_OP_POLL_ADD] = 1,
+    [IORING_OP_POLL_REMOVE] = 1,
+    [IORING_OP_SYNC_FILE_RANGE] = 1,
+    [IORING_OP_TIMEOUT] = 1,
+    [IORING_OP_TIMEOUT_REMOVE] = 1,
+    [IORING_OP_ASYNC_CANCEL] = 1,
+    [IORING_OP_LINK_TIMEOUT] = 1,
+    [IORING_OP_CONNECT] = 1,
+    [IORING_OP_FALLOCATE] = 1,
+    [IORING_OP_READ] = 1,
+    [IORING_OP_WRITE] = 1,
+    [IORING_OP_FADVISE] = 1,
+    [IORING_OP_SEND] = 1,
+    [IORING_OP_RECV] = 1,
+    [IORING_OP_SPLICE] = 1,
+    [IORING_OP_PROVIDE_BUFFERS] = 1,
+    [IORING_OP_REMOVE_BUFFERS] = 1,
+    [IORING_OP_TEE] = 1,
+    [IORING_OP_SHUTDOWN] = 1,
+};
+
+/*
+ * Translates guest range [gva, gva + len) to km address. Returns NULL if any part of it is not
+ * guest memory, or if it isn't contiguous in km (spans the gap between brk and tbrk).
+ */
+static inline void* km_io_uring_g2h(uint64_t gva, size_t len)
+{
+   return km_gva_to_kma_range(gva, len);
+}
+
+static pthread_mutex_t km_io_uring_mutex = PTHREAD_MUTEX_INITIALIZER;   // file->ioring, refcnt
+
+// Ring for guest 'fd' with a reference held, or NULL. Drop it with km_io_uring_put().
+static km_io_uring_t* km_io_uring_get(int fd)
+{
+   km_io_uring_t* ring = NULL;
+   km_file_t* file;
+
+   if (km_fs_g2h_fd(fd, NULL) < 0 || (file = km_fs_file(fd))->how != KM_FILE_HOW_IO_URING) {
+      return NULL;
+   }
+   pthread_mutex_lock(&km_io_uring_mutex);
+   if ((ring = file->ioring) != NULL) {
+      ring->refcnt++;
+   }
+   pthread_mutex_unlock(&km_io_uring_mutex);
+   return ring;
+}
+
+// Error for guest 'fd' without a ring, io_uring fds in a fork child have none
+static int km_io_uring_no_ring(int fd)
+{
+   if (km_fs_g2h_fd(fd, NULL) < 0) {
+      return -EBADF;
+   }
+   return km_fs_file(fd)->how == KM_FILE_HOW_IO_URING ? -EBADFD : -EOPNOTSUPP;
+}
+
+// Unless registered with the ring (IOSQE_FIXED_FILE) fds are guest fds and must be plain host ones
+static int km_io_uring_fd_ok(int fd, int fixed)
+{
+   km_file_ops_t* ops;
+
+   if (fixed != 0) {
+      return 0;
+   }
+   if (km_fs_g2h_fd(fd, &ops) < 0) {
+      return -EBADF;
+   }
+   // emulated files, and signalfd which is an eventfd on the host side
+   if (ops != NULL || km_fs_file(fd)->how == KM_FILE_HOW_SIGNALFD) {
+      return -EINVAL;
+   }
+   return 0;
+}
+
+static inline int km_io_uring_buf_g2h(__u64* addr, size_t len)
+{
+   void* kma = km_io_uring_g2h(*addr, len);
+   if (kma == NULL && len != 0) {
+      return -EFAULT;
+   }
+   *addr = (uintptr_t)kma;
+   return 0;
+}
+
+/*
+ * Translate the iovec array for READV/WRITEV in host SQE 'slot'. The host array lives until the
+ * slot is reused, the kernel only needs it until submission (IORING_FEAT_SUBMIT_STABLE).
+ */
+static int km_io_uring_iov_g2h(km_io_uring_t* ring, unsigned slot, struct io_uring_sqe* sqe)
+{
+   unsigned cnt = sqe->len;
+   struct iovec* giov;
+
+   if (cnt > UIO_MAXIOV) {
+      return -EINVAL;
+   }
+   if ((giov = km_io_uring_g2h(sqe->addr, cnt * sizeof(struct iovec))) == NULL && cnt != 0) {
+      return -EFAULT;
+   }
+   if (cnt > ring->iov_cnt[slot]) {
+      struct iovec* iov = realloc(ring->iov[slot], cnt * sizeof(struct iovec));
+      if (iov == NULL) {
+         return -ENOMEM;
+      }
+      ring->iov[slot] = iov;
+      ring->iov_cnt[slot] = cnt;
+   }
+   struct iovec* iov = ring->iov[slot];
+   for (unsigned i = 0; i < cnt; i++) {
+      iov[i].iov_len = giov[i].iov_len;
+      if ((sqe->flags & IOSQE_BUFFER_SELECT) != 0) {
+         iov[i].iov_base = NULL;   // buffer comes from the group, only the length is used
+         continue;
+      }
+      iov[i].iov_base = km_io_uring_g2h((uintptr_t)giov[i].iov_base, iov[i].iov_len);
+      if (iov[i].iov_base == NULL && iov[i].iov_len != 0) {
+         return -EFAULT;
+      }
+   }
+   sqe->addr = (uintptr_t)iov;
+   return 0;
+}
+
+/*
+ * Validate fds and translate guest addresses in 'sqe', a copy of guest SQE already in host 'slot'.
+ * Returns 0 or -errno.
+ */
+static int km_io_uring_sqe_g2h(km_io_uring_t* ring, unsigned slot, struct io_uring_sqe* sqe)
+{
+   int fixed = (sqe->flags & IOSQE_FIXED_FILE) != 0;
+   int ret;
+
+   switch (sqe->opcode) {
+      case IORING_OP_NOP:
+      case IORING_OP_POLL_REMOVE:
+      case IORING_OP_ASYNC_CANCEL:
+      case IORING_OP_REMOVE_BUFFERS:
+         return 0;   // addr, if any, is user_data of another request
+
+      case IORING_OP_TIMEOUT_REMOVE:
+         if ((sqe->timeout_flags & IORING_TIMEOUT_UPDATE_MASK) != 0) {
+            return km_io_uring_buf_g2h(&sqe->addr2, sizeof(struct __kernel_timespec));
+         }
+         return 0;
+
+      case IORING_OP_TIMEOUT:
+      case IORING_OP_LINK_TIMEOUT:
+         return km_io_uring_buf_g2h(&sqe->addr, sizeof(struct __kernel_timespec));
+
+      case IORING_OP_PROVIDE_BUFFERS:   // fd is the number of buffers, len is the size of each
+         if (sqe->fd <= 0) {
+            return -EINVAL;
+         }
+         return km_io_uring_buf_g2h(&sqe->addr, (size_t)sqe->len * sqe->fd);
+
+      case IORING_OP_FSYNC:
+      case IORING_OP_FALLOCATE:
+      case IORING_OP_FADVISE:
+      case IORING_OP_SYNC_FILE_RANGE:
+      case IORING_OP_POLL_ADD:
+      case IORING_OP_SHUTDOWN:
+         return km_io_uring_fd_ok(sqe->fd, fixed);
+
+      case IORING_OP_READV:
+      case IORING_OP_WRITEV:
+         if ((ret = km_io_uring_fd_ok(sqe->fd, fixed)) != 0) {
+            return ret;
+         }
+         return km_io_uring_iov_g2h(ring, slot, sqe);
+
+      case IORING_OP_READ:
+      case IORING_OP_RECV:
+         if ((ret = km_io_uring_fd_ok(sqe->fd, fixed)) != 0) {
+            return ret;
+         }
+         if ((sqe->flags & IOSQE_BUFFER_SELECT) != 0) {
+            sqe->addr = 0;   // buffer comes from the group
+            return 0;
+         }
+         return km_io_uring_buf_g2h(&sqe->addr, sqe->len);
+
+      case IORING_OP_WRITE:
+      case IORING_OP_SEND:
+      case IORING_OP_READ_FIXED:
+      case IORING_OP_WRITE_FIXED:
+         if ((ret = km_io_uring_fd_ok(sqe->fd, fixed)) != 0) {
+            return ret;
+         }
+         return km_io_uring_buf_g2h(&sqe->addr, sqe->len);
+
+      case IORING_OP_CONNECT:   // addr2 is the address length
+         if ((ret = km_io_uring_fd_ok(sqe->fd, fixed)) != 0) {
+            return ret;
+         }
+         return km_io_uring_buf_g2h(&sqe->addr, sqe->addr2);
+
+      case IORING_OP_SPLICE:
+      case IORING_OP_TEE:
+         if ((ret = km_io_uring_fd_ok(sqe->fd, fixed)) != 0) {
+            return ret;
+         }
+         return km_io_uring_fd_ok(sqe->splice_fd_in,
+                                  (sqe->splice_flags & SPLICE_F_FD_IN_FIXED) != 0);
+
+      default:
+         return -EINVAL;
+   }
+}
+
+/*
+ * Replace 'sqe' with one the kernel fails with 'err', so the guest gets a CQE with the same
+ * user_data and the link it is part of is broken, like for any other failed request.
+ */
+static void km_io_uring_sqe_fail(struct io_uring_sqe* sqe, int err)
+{
+   __u64 user_data = sqe->user_data;
+   __u8 flags = sqe->flags & (IOSQE_IO_DRAIN | IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->user_data = user_data;
+   sqe->flags = flags;
+   switch (err) {
+      case -EBADF:
+         sqe->opcode = IORING_OP_FSYNC;
+         sqe->fd = -1;
+         break;
+      case -EFAULT:   // timespec at NULL
+         sqe->opcode = IORING_OP_TIMEOUT;
+         sqe->len = 1;
+         break;
+      default:
+         sqe->opcode = IORING_OP_LAST;   // -EINVAL
+         break;
+   }
+}
+
+/*
+ * Move up to 'to_submit' SQEs queued by the guest into the host SQ ring. Returns the number moved,
+ * including ones replaced by km_io_uring_sqe_fail(). Called with ring->lock held.
+ */
+static unsigned km_io_uring_submit(km_io_uring_t* ring, unsigned to_submit)
+{
+   struct io_uring_params* p = &ring->params;
+   unsigned mask = p->sq_entries - 1;
+   char* gsq;
+   struct io_uring_sqe* gsqes;
+
+   // not mapped (yet or any more), there is nothing the guest could have queued
+   if (ring->gsq_ring == 0 || (gsq = km_io_uring_g2h(ring->gsq_ring, ring->sq_ring_size)) == NULL ||
+       ring->gsqes == 0 ||
+       (gsqes = km_io_uring_g2h(ring->gsqes, p->sq_entries * sizeof(*gsqes))) == NULL) {
+      return 0;
+   }
+   unsigned* garray = (unsigned*)(gsq + p->sq_off.array);
+   unsigned gtail = __atomic_load_n((unsigned*)(gsq + p->sq_off.tail), __ATOMIC_ACQUIRE);
+   unsigned room = p->sq_entries - MIN(ring->sq_tail - ring->sq_clean, p->sq_entries);
+   unsigned n = MIN(MIN(gtail - ring->ghead, to_submit), room);
+   unsigned submitted = 0;
+
+   for (unsigned i = 0; i < n; i++) {
+      unsigned gidx = __atomic_load_n(&garray[ring->ghead++ & mask], __ATOMIC_RELAXED);
+      if (gidx >= p->sq_entries) {
+         __atomic_add_fetch((unsigned*)(gsq + p->sq_off.dropped), 1, __ATOMIC_RELAXED);
+         continue;
+      }
+      unsigned slot = ring->sq_tail & mask;
+      struct io_uring_sqe* sqe = &ring->sqes[slot];
+      int ret;
+
+      memcpy(sqe, &gsqes[gidx], sizeof(*sqe));
+      if ((ret = km_io_uring_sqe_g2h(ring, slot, sqe)) != 0) {
+         km_infox(KM_TRACE_FILESYS, "io_uring sqe op %d: %d", gsqes[gidx].opcode, ret);
+         km_io_uring_sqe_fail(sqe, ret);
+      }
+      ring->karray[slot] = slot;
+      ring->sq_tail++;
+      submitted++;
+   }
+   __atomic_store_n(ring->ktail, ring->sq_tail, __ATOMIC_RELEASE);
+   __atomic_store_n((unsigned*)(gsq + p->sq_off.head), ring->ghead, __ATOMIC_RELEASE);
+   return submitted;
+}
+
+/*
+ * After io_uring_enter(): reset host SQEs the kernel consumed to NOP and pass SQ ring flags
+ * (IORING_SQ_CQ_OVERFLOW) on to the guest. Called with ring->lock held.
+ */
+static void km_io_uring_sync(km_io_uring_t* ring)
+{
+   struct io_uring_params* p = &ring->params;
+   unsigned khead = __atomic_load_n(ring->khead, __ATOMIC_ACQUIRE);
+   char* gsq;
+
+   // the guest can write host head through the CQ ring mapping, don't go past what we queued
+   for (unsigned n = MIN(khead - ring->sq_clean, ring->sq_tail - ring->sq_clean); n > 0; n--) {
+      memset(&ring->sqes[ring->sq_clean++ & (p->sq_entries - 1)], 0, sizeof(struct io_uring_sqe));
+   }
+   if (ring->gsq_ring != 0 && (gsq = km_io_uring_g2h(ring->gsq_ring, ring->sq_ring_size)) != NULL) {
+      __atomic_store_n((unsigned*)(gsq + p->sq_off.flags),
+                       __atomic_load_n(ring->kflags, __ATOMIC_RELAXED),
+                       __ATOMIC_RELEASE);
+   }
+}
+
+static void km_io_uring_free(km_io_uring_t* ring)
+{
+   if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+      // nothing left in the host ring can point to the iovecs freed below
+      memset(ring->sqes, 0, ring->params.sq_entries * sizeof(struct io_uring_sqe));
+      munmap(ring->sqes, ring->params.sq_entries * sizeof(struct io_uring_sqe));
+   }
+   if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+   }
+   if (ring->iov != NULL) {
+      for (unsigned i = 0; i < ring->params.sq_entries; i++) {
+         free(ring->iov[i]);
+      }
+      free(ring->iov);
+   }
+   free(ring->iov_cnt);
+   pthread_mutex_destroy(&ring->lock);
+   free(ring);
+}
+
+static void km_io_uring_put(km_io_uring_t* ring)
+{
+   int last;
+
+   pthread_mutex_lock(&km_io_uring_mutex);
+   last = --ring->refcnt == 0;
+   pthread_mutex_unlock(&km_io_uring_mutex);
+   if (last != 0) {
+      km_io_uring_free(ring);
+   }
+}
+
+// Guest 'fd' is going away, drop its reference
+void km_io_uring_close(int fd)
+{
+   km_file_t* file = km_fs_file(fd);
+   km_io_uring_t* ring;
+
+   pthread_mutex_lock(&km_io_uring_mutex);
+   ring = file->ioring;
+   file->ioring = NULL;
+   pthread_mutex_unlock(&km_io_uring_mutex);
+   if (ring != NULL) {
+      km_io_uring_put(ring);
+   }
+}
+
+// Guest 'newfd' is a dup of 'fd', share the ring
+void km_io_uring_dup(int fd, int newfd)
+{
+   km_io_uring_t* ring = km_io_uring_get(fd);
+
+   pthread_mutex_lock(&km_io_uring_mutex);
+   km_fs_file(newfd)->ioring = ring;   // the reference we got is newfd's now
+   pthread_mutex_unlock(&km_io_uring_mutex);
+}
+
+/*
+ * In a fork child. The host ring is shared with the parent, and so are the SQ ring and SQEs mapped
+ * in km, but not our copy of the SQ tail. Both submitting would corrupt the ring, so the child's
+ * io_uring fds are left without a ring, and enter and register fail on them with EBADFD. The shared
+ * memory is only unmapped here, not reset like km_io_uring_free() does. Other km threads are gone,
+ * and whatever locks they held with them.
+ */
+void km_io_uring_fork_child(void)
+{
+   pthread_mutex_init(&km_io_uring_mutex, NULL);
+   for (int i = 0; i < machine.filesys->nfdmap; i++) {
+      km_file_t* file = km_fs_file(i);
+      km_io_uring_t* ring;
+
+      if (file == NULL) {
+         i |= KM_FILES_CHUNK - 1;   // never allocated, skip the whole chunk
+         continue;
+      }
+      if (km_is_file_used(file) == 0 || file->how != KM_FILE_HOW_IO_URING ||
+          (ring = file->ioring) == NULL) {
+         continue;
+      }
+      file->ioring = NULL;
+      if (--ring->refcnt > 0) {
+         continue;
+      }
+      munmap(ring->sqes, ring->params.sq_entries * sizeof(struct io_uring_sqe));
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      ring->sqes = NULL;
+      ring->sq_ring = NULL;
+      pthread_mutex_init(&ring->lock, NULL);
+      km_io_uring_free(ring);
+   }
+}
+
+// int io_uring_setup(u32 entries, struct io_uring_params* p);
+uint64_t km_io_uring_setup(km_vcpu_t* vcpu, unsigned int entries, struct io_uring_params* p)
+{
+   struct io_uring_params params = *p;
+   km_io_uring_t* ring;
+   int fd;
+
+   if ((params.flags & ~KM_IO_URING_SETUP_FLAGS) != 0) {
+      return -EINVAL;
+   }
+   if ((params.flags & IORING_SETUP_ATTACH_WQ) != 0) {
+      if ((ring = km_io_uring_get(params.wq_fd)) == NULL) {
+         return -EINVAL;
+      }
+      km_io_uring_put(ring);
+   }
+   if ((fd = __syscall_2(SYS_io_uring_setup, entries, (uintptr_t)&params)) < 0) {
+      return fd;
+   }
+   // translated iovecs only need to be stable until submission
+   if ((params.features & IORING_FEAT_SUBMIT_STABLE) == 0) {
+      close(fd);
+      return -ENOSYS;
+   }
+   if ((ring = calloc(1, sizeof(*ring))) == NULL) {
+      close(fd);
+      return -ENOMEM;
+   }
+   pthread_mutex_init(&ring->lock, NULL);
+   ring->refcnt = 1;
+   ring->params = params;
+   ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   ring->sq_ring = mmap(NULL,
+                        ring->sq_ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        fd,
+                        IORING_OFF_SQ_RING);
+   ring->sqes = mmap(NULL,
+                     params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     fd,
+                     IORING_OFF_SQES);
+   ring->iov = calloc(params.sq_entries, sizeof(struct iovec*));
+   ring->iov_cnt = calloc(params.sq_entries, sizeof(unsigned));
+   if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED || ring->iov == NULL ||
+       ring->iov_cnt == NULL) {
+      km_warn("io_uring ring setup failed");
+      km_io_uring_free(ring);
+      close(fd);
+      return -ENOMEM;
+   }
+   ring->khead = ring->sq_ring + params.sq_off.head;
+   ring->ktail = ring->sq_ring + params.sq_off.tail;
+   ring->kflags = ring->sq_ring + params.sq_off.flags;
+   ring->karray = ring->sq_ring + params.sq_off.array;
+   ring->sq_tail = ring->sq_clean = *ring->ktail;
+
+   fd = km_add_guest_fd_internal(vcpu, fd, NULL, O_RDWR | O_CLOEXEC, KM_FILE_HOW_IO_URING, NULL);
+   if (fd < 0) {
+      km_io_uring_free(ring);
+      return fd;
+   }
+   pthread_mutex_lock(&km_io_uring_mutex);
+   km_fs_file(fd)->ioring = ring;
+   pthread_mutex_unlock(&km_io_uring_mutex);
+   params.features &= ~IORING_FEAT_SINGLE_MMAP;   // SQ ring is ours, CQ ring is mapped on its own
+   *p = params;
+   return fd;
+}
+
+/*
+ * The guest mapping of IORING_OFF_SQ_RING and IORING_OFF_SQES is private memory laid out like the
+ * host ring. The rest goes to the host.
+ */
+int km_io_uring_mmap_emulated(int fd, off_t offset)
+{
+   km_io_uring_t* ring;
+
+   if ((offset != IORING_OFF_SQ_RING && offset != IORING_OFF_SQES) ||
+       (ring = km_io_uring_get(fd)) == NULL) {
+      return 0;
+   }
+   km_io_uring_put(ring);
+   return 1;
+}
+
+km_gva_t km_io_uring_mmap(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset)
+{
+   km_io_uring_t* ring = km_io_uring_get(fd);
+   struct io_uring_params* p;
+
+   if (ring == NULL) {   // closed since km_io_uring_mmap_emulated()
+      return -EBADF;
+   }
+   p = &ring->params;
+   if (size < (offset == IORING_OFF_SQ_RING ? ring->sq_ring_size
+                                            : p->sq_entries * sizeof(struct io_uring_sqe))) {
+      km_io_uring_put(ring);
+      return -EINVAL;
+   }
+   gva = km_guest_mmap(gva, size, prot, (flags & ~MAP_TYPE) | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (km_syscall_ok(gva) < 0) {
+      km_io_uring_put(ring);
+      return gva;
+   }
+   pthread_mutex_lock(&ring->lock);
+   if (offset == IORING_OFF_SQES) {
+      ring->gsqes = gva;
+   } else {
+      char* gsq = km_gva_to_kma_nocheck(gva);
+      *(unsigned*)(gsq + p->sq_off.ring_mask) = p->sq_entries - 1;
+      *(unsigned*)(gsq + p->sq_off.ring_entries) = p->sq_entries;
+      *(unsigned*)(gsq + p->sq_off.head) = ring->ghead;
+      *(unsigned*)(gsq + p->sq_off.tail) = ring->ghead;
+      ring->gsq_ring = gva;
+   }
+   pthread_mutex_unlock(&ring->lock);
+   km_io_uring_put(ring);
+   return gva;
+}
+
+static int km_io_uring_enter_ring(km_vcpu_t* vcpu,
+                                  km_io_uring_t* ring,
+                                  int fd,
+                                  unsigned int to_submit,
+                                  unsigned int min_complete,
+                                  unsigned int flags,
+                                  km_gva_t arg,
+                                  size_t argsz)
+{
+   struct io_uring_getevents_arg ext;
+   km_sigset_t* sigmask = NULL;
+   void* host_arg = NULL;
+   size_t host_argsz = 0;
+
+   if ((flags & IORING_ENTER_REGISTERED_RING) != 0) {
+      return -EINVAL;
+   }
+   /*
+    * The signal mask is the guest one, applied to vcpu like pselect6 does. The host thread keeps
+    * its own.
+    */
+   if ((flags & IORING_ENTER_EXT_ARG) != 0) {
+      struct io_uring_getevents_arg* garg;
+
+      if (argsz != sizeof(ext)) {
+         return -EINVAL;
+      }
+      if ((garg = km_io_uring_g2h(arg, argsz)) == NULL) {
+         return -EFAULT;
+      }
+      ext = *garg;
+      if (ext.ts != 0 &&
+          (ext.ts = (uintptr_t)km_io_uring_g2h(ext.ts, sizeof(struct __kernel_timespec))) == 0) {
+         return -EFAULT;
+      }
+      if (ext.sigmask != 0) {
+         if (ext.sigmask_sz != sizeof(km_sigset_t)) {
+            return -EINVAL;
+         }
+         if ((sigmask = km_io_uring_g2h(ext.sigmask, sizeof(km_sigset_t))) == NULL) {
+            return -EFAULT;
+         }
+      }
+      ext.sigmask = 0;
+      ext.sigmask_sz = 0;
+      host_arg = &ext;
+      host_argsz = sizeof(ext);
+   } else if (arg != 0) {
+      if (argsz != sizeof(km_sigset_t)) {
+         return -EINVAL;
+      }
+      if ((sigmask = km_io_uring_g2h(arg, argsz)) == NULL) {
+         return -EFAULT;
+      }
+   }
+
+   unsigned submitted = 0;
+   unsigned pending;
+   pthread_mutex_lock(&ring->lock);
+   if (to_submit > 0) {
+      submitted = km_io_uring_submit(ring, to_submit);
+   }
+   // everything queued so far, some may have been left over by an earlier enter that failed
+   pending = ring->sq_tail - MIN(__atomic_load_n(ring->khead, __ATOMIC_ACQUIRE), ring->sq_tail);
+   pthread_mutex_unlock(&ring->lock);
+
+   km_sigset_t oldset;
+   if (sigmask != NULL) {
+      oldset = vcpu->sigmask;
+      vcpu->sigmask = *sigmask;
+   }
+   int ret = __syscall_6(
+       SYS_io_uring_enter, fd, pending, min_complete, flags, (uintptr_t)host_arg, host_argsz);
+   if (sigmask != NULL) {
+      vcpu->sigmask = oldset;
+   }
+
+   pthread_mutex_lock(&ring->lock);
+   km_io_uring_sync(ring);
+   pthread_mutex_unlock(&ring->lock);
+   // the kernel may have picked up SQEs queued by other threads too, only report ours
+   if (ret > (int)submitted) {
+      ret = submitted;
+   }
+   return ret;
+}
+
+// int io_uring_enter(unsigned int fd, u32 to_submit, u32 min_complete, u32 flags, const void* arg,
+//  size_t argsz);
+uint64_t km_io_uring_enter(km_vcpu_t* vcpu,
+                           int fd,
+                           unsigned int to_submit,
+                           unsigned int min_complete,
+                           unsigned int flags,
+                           km_gva_t arg,
+                           size_t argsz)
+{
+   km_io_uring_t* ring = km_io_uring_get(fd);
+   int ret;
+
+   if (ring == NULL) {
+      return km_io_uring_no_ring(fd);
+   }
+   ret = km_io_uring_enter_ring(vcpu, ring, fd, to_submit, min_complete, flags, arg, argsz);
+   km_io_uring_put(ring);
+   return ret;
+}
+
+// Copy and validate 'nr' guest fds, -1 is allowed for sparse file sets. Returns 0 or -errno.
+static int km_io_uring_fds_g2h(int* fds, km_gva_t gva, unsigned nr)
+{
+   int* gfds = km_io_uring_g2h(gva, nr * sizeof(int));
+   if (gfds == NULL) {
+      return -EFAULT;
+   }
+   for (unsigned i = 0; i < nr; i++) {
+      if ((fds[i] = gfds[i]) != -1 && km_io_uring_fd_ok(fds[i], 0) != 0) {
+         return -EBADF;
+      }
+   }
+   return 0;
+}
+
+// int io_uring_register(unsigned int fd, unsigned int opcode, void* arg, unsigned int nr_args);
+uint64_t km_io_uring_register(
+    km_vcpu_t* vcpu, int fd, unsigned int opcode, km_gva_t arg, unsigned int nr_args)
+{
+   km_io_uring_t* ring;
+   void* host_arg = NULL;
+   void* tofree = NULL;
+   int efd;
+   int ret;
+
+   // register doesn't touch our side of the ring, just check that it is one
+   if ((ring = km_io_uring_get(fd)) == NULL) {
+      return km_io_uring_no_ring(fd);
+   }
+   km_io_uring_put(ring);
+   switch (opcode) {
+      case IORING_UNREGISTER_BUFFERS:
+      case IORING_UNREGISTER_FILES:
+      case IORING_UNREGISTER_EVENTFD:
+         if (arg != 0) {
+            return -EINVAL;
+         }
+         break;
+
+      case IORING_REGISTER_BUFFERS: {
+         struct iovec* giov = km_io_uring_g2h(arg, nr_args * sizeof(struct iovec));
+         struct iovec* iov;
+
+         if (nr_args == 0 || nr_args > (1 << 14)) {   // IORING_MAX_REG_BUFFERS
+            return -EINVAL;
+         }
+         if (giov == NULL) {
+            return -EFAULT;
+         }
+         if ((tofree = iov = malloc(nr_args * sizeof(struct iovec))) == NULL) {
+            return -ENOMEM;
+         }
+         for (unsigned i = 0; i < nr_args; i++) {
+            iov[i].iov_len = giov[i].iov_len;
+            if ((iov[i].iov_base = km_io_uring_g2h((uintptr_t)giov[i].iov_base, iov[i].iov_len)) ==
+                    NULL &&
+                iov[i].iov_len != 0) {
+               free(tofree);
+               return -EFAULT;
+            }
+         }
+         host_arg = iov;
+         break;
+      }
+
+      case IORING_REGISTER_FILES:
+         if (nr_args == 0 || nr_args > km_fs_max_guestfd()) {
+            return nr_args == 0 ? -EINVAL : -EMFILE;
+         }
+         if ((tofree = host_arg = malloc(nr_args * sizeof(int))) == NULL) {
+            return -ENOMEM;
+         }
+         if ((ret = km_io_uring_fds_g2h(host_arg, arg, nr_args)) != 0) {
+            free(tofree);
+            return ret;
+         }
+         break;
+
+      case IORING_REGISTER_FILES_UPDATE: {
+         struct io_uring_files_update* gup = km_io_uring_g2h(arg, sizeof(*gup));
+         struct io_uring_files_update* up;
+
+         if (gup == NULL) {
+            return -EFAULT;
+         }
+         if (nr_args > km_fs_max_guestfd()) {
+            return -EINVAL;
+         }
+         if ((tofree = up = malloc(sizeof(*up) + nr_args * sizeof(int))) == NULL) {
+            return -ENOMEM;
+         }
+         *up = *gup;
+         if ((ret = km_io_uring_fds_g2h((int*)(up + 1), up->fds, nr_args)) != 0) {
+            free(tofree);
+            return ret;
+         }
+         up->fds = (uintptr_t)(up + 1);
+         host_arg = up;
+         break;
+      }
+
+      case IORING_REGISTER_EVENTFD:
+      case IORING_REGISTER_EVENTFD_ASYNC:
+         if (nr_args != 1) {
+            return -EINVAL;
+         }
+         if ((ret = km_io_uring_fds_g2h(&efd, arg, 1)) != 0) {
+            return ret;
+         }
+         host_arg = &efd;
+         break;
+
+      case IORING_REGISTER_PROBE: {
+         struct io_uring_probe* probe = km_io_uring_g2h(
+             arg, sizeof(struct io_uring_probe) + nr_args * sizeof(struct io_uring_probe_op));
+         if (probe == NULL) {
+            return -EFAULT;
+         }
+         ret = __syscall_4(SYS_io_uring_register, fd, opcode, (uintptr_t)probe, nr_args);
+         if (ret != 0) {
+            return ret;
+         }
+         // Don't advertise ops that would fail with -EINVAL
+         for (unsigned i = 0; i < MIN(nr_args, probe->ops_len); i++) {
+            unsigned op = probe->ops[i].op;
+            if (op >= IORING_OP_LAST || km_io_uring_ops[op] == 0) {
+               probe->ops[i].flags &= ~IO_URING_OP_SUPPORTED;
+            }
+         }
+         return 0;
+      }
+
+      case IORING_REGISTER_IOWQ_MAX_WORKERS:
+         if (nr_args != 2) {
+            return -EINVAL;
+         }
+         if ((host_arg = km_io_uring_g2h(arg, 2 * sizeof(unsigned))) == NULL) {
+            return -EFAULT;
+         }
+         break;
+
+      default:
+         return -EINVAL;
+   }
+   ret = __syscall_4(SYS_io_uring_register, fd, opcode, (uintptr_t)host_arg, nr_args);
+   free(tofree);
+   return ret;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KM_IO_URING_H__
+#define __KM_IO_URING_H__
+
+#include <linux/io_uring.h>
+#include "km.h"
+
+struct km_io_uring;
+
+// int io_uring_setup(u32 entries, struct io_uring_params* p);
+uint64_t km_io_uring_setup(km_vcpu_t* vcpu, unsigned int entries, struct io_uring_params* p);
+// int io_uring_enter(unsigned int fd, u32 to_submit, u32 min_complete, u32 flags, const void* arg,
+//  size_t argsz);
+uint64_t km_io_uring_enter(km_vcpu_t* vcpu,
+                           int fd,
+                           unsigned int to_submit,
+                           unsigned int min_complete,
+                           unsigned int flags,
+                           km_gva_t arg,
+                           size_t argsz);
+// int io_uring_register(unsigned int fd, unsigned int opcode, void* arg, unsigned int nr_args);
+uint64_t km_io_uring_register(
+    km_vcpu_t* vcpu, int fd, unsigned int opcode, km_gva_t arg, unsigned int nr_args);
+
+int km_io_uring_mmap_emulated(int fd, off_t offset);
+km_gva_t km_io_uring_mmap(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset);
+void km_io_uring_close(int fd);
+void km_io_uring_dup(int fd, int newfd);
+void km_io_uring_fork_child(void);
+
+#endif /* !defined(__KM_IO_URING_H__) */
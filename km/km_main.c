@@ -37,8 +37,10 @@
 #include "km_filesys.h"
 #include "km_fork.h"
 #include "km_gdb.h"
+#include "km_idle.h"
 #include "km_management.h"
 #include "km_mem.h"
+#include "km_sched.h"
 #include "km_signal.h"
 #include "km_snapshot.h"
 
@@ -51,7 +53,8 @@ extern int vcpu_dump;
  * Logging and printing.
  *
  * We separate km file descriptors from payload file descriptors. The former are in the separate
- * range, upper MAX_KM_FILES, guest fds have the same numerical value in the guest and in km.
+ * range above the guest fds (sized by RLIMIT_NOFILE), guest fds have the same numerical value in
+ * the guest and in km.
  *
  * Standard err()/warn() functions are not used any more (other than in parsing argvs). The
  * stdout/stderr in km are closed after argvs parsing is done, so printf() and such will not work.
@@ -93,9 +96,22 @@ static inline void usage()
 "\t--coredump=file_name                - File name for coredump\n"
 "\t--snapshot=file_name                - File name for snapshot\n"
 "\t--kill-unimpl-hcall                 - Kill guest in unimplemented hypercall.\n"
+"\t--share-text                        - Map read-only payload segments directly from the file,\n"
+"\t                                      sharing them between all instances running the same file\n"
+"\t--vcpu-pool=count                   - Keep 'count' parked vcpus with threads ready for new payload threads\n"
+"\t--cpuset=list                       - Run km threads only on host CPUs in 'list', like 0-3,8\n"
+"\t--pin-vcpus                         - Pin each vcpu thread to its own CPU, round robin\n"
+"\t--pin-km-threads=list               - Run km threads that don't run the payload (main, timer,\n"
+"\t                                      management, vcpu pool) only on host CPUs in 'list'\n"
+"\t--cpus=count                        - Payload sees at most 'count' CPUs. Default is what the cpuset\n"
+"\t                                      and the cgroup CPU quota (cpu.max) allow\n"
+"\t--idle=latency|balanced|power       - How idle payload threads wait: poll for low wakeup latency,\n"
+"\t                                      a little spinning (default), or go to sleep right away\n"
+"\t--idle-poll-ns=ns                   - Poll this long in blocking futex and epoll waits before sleeping\n"
 "\n"
 "\tOverride auto detection:\n"
 "\t--membus-width=size (-Psize)        - Set guest physical memory bus size in bits, i.e. 32 means 4GiB, 33 8GiB, 34 16GiB, etc.\n"
+"\t                                      Default is up to 39 (512GiB), up to 42 (4TiB) if explicitly set\n"
 "\t--enable-1g-pages                   - Force enable 1G pages support (default). Assumes hardware support\n"
 "\t--disable-1g-pages                  - Force disable 1G pages support\n"
 "\t--virt-device=<file-name>  (-Ffile) - Use provided file-name for virtualization device\n"
@@ -151,6 +167,7 @@ static char* mgtpipe = NULL;
 static int log_to_fd = -1;
 extern int set_cpu_vendor_id;
 extern int kill_unimpl_hcall;
+extern int km_share_text;
 extern char* km_interp;
 
 struct option km_cmd_long_options[] = {
@@ -179,6 +196,14 @@ struct option km_cmd_long_options[] = {
     {"output-data", required_argument, 0, 'O'},
     {"mgtpipe", required_argument, 0, 'm'},
     {"kill-unimpl-scall", no_argument, &(kill_unimpl_hcall), KM_FLAG_FORCE_ENABLE},
+    {"share-text", no_argument, &km_share_text, 1},
+    {"vcpu-pool", required_argument, 0, 'W'},
+    {"cpuset", required_argument, 0, 'c'},
+    {"pin-vcpus", no_argument, &km_pin_vcpus, 1},
+    {"pin-km-threads", required_argument, 0, 'T'},
+    {"cpus", required_argument, 0, 'n'},
+    {"idle", required_argument, 0, 'i'},
+    {"idle-poll-ns", required_argument, 0, 'N'},
 
     {0, 0, 0, 0},
 };
@@ -439,6 +464,45 @@ km_parse_args(int argc, char* argv[], int* argc_p, char** argv_p[], int* envc_p,
          case 'F':
             km_machine_init_params.vdev_name = strdup(optarg);
             break;
+         case 'W':
+            ep = NULL;
+            km_machine_init_params.vcpu_pool = strtol(optarg, &ep, 0);
+            if (ep == NULL || *ep != '\0' || km_machine_init_params.vcpu_pool < 0 ||
+                km_machine_init_params.vcpu_pool > KVM_MAX_VCPUS) {
+               km_warnx("Wrong vcpu pool size '%s'", optarg);
+               usage();
+            }
+            break;
+         case 'c':
+            if (km_sched_parse_cpuset(optarg) < 0) {
+               km_warnx("Wrong CPU list '%s'", optarg);
+               usage();
+            }
+            break;
+         case 'T':
+            if (km_sched_parse_km_threads(optarg) < 0) {
+               km_warnx("Wrong CPU list '%s'", optarg);
+               usage();
+            }
+            break;
+         case 'n':
+            if (km_sched_parse_cpus(optarg) < 0) {
+               km_warnx("Wrong CPU count '%s'", optarg);
+               usage();
+            }
+            break;
+         case 'i':
+            if (km_idle_parse_policy(optarg) < 0) {
+               km_warnx("Wrong idle policy '%s'", optarg);
+               usage();
+            }
+            break;
+         case 'N':
+            if (km_idle_parse_poll_ns(optarg) < 0) {
+               km_warnx("Wrong idle poll time '%s'", optarg);
+               usage();
+            }
+            break;
          case 's':
             km_set_snapshot_path(optarg);
             break;
@@ -606,8 +670,11 @@ int main(int argc, char* argv[])
       usage();
    }
 
+   km_sched_init();
+   km_idle_init();
    km_hcalls_init();
    km_machine_init(&km_machine_init_params);
+   km_exec_recover_itimers();
    km_exec_fini();   // calls to km_called_via_exec() not valid beyond this point!
 
    km_mgt_init(mgtpipe);
@@ -680,6 +747,7 @@ int main(int argc, char* argv[])
    km_close_stdio(log_to_fd);
 
    km_start_vcpus();
+   km_sched_km_thread();
 
    if (km_gdb_is_enabled() != 0) {
       km_gdb_main_loop(vcpu);
@@ -29,6 +29,7 @@
 #include "km_coredump.h"
 #include "km_filesys.h"
 #include "km_management.h"
+#include "km_sched.h"
 #include "km_snapshot.h"
 
 static int sock = -1;
@@ -38,6 +39,7 @@ int kill_thread = 0;
 
 static void* mgt_main(void* arg)
 {
+   km_sched_km_thread();
    if (listen(sock, 1) < 0) {
       km_warn("listen");
       return NULL;
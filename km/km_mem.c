@@ -50,7 +50,8 @@
  *
  * When using kvm driver
  * - We are forced to stay within width of the CPU physical memory bus. We determine that by analyzing
- * CPUID and store in machine.guest_max_physmem. Currently the code only supports up to 512GB.
+ * CPUID and store in machine.guest_max_physmem. By default we use up to 512GB, larger sizes up to
+ * GUEST_MAX_PHYSMEM_SUPPORTED need to be asked for explicitly (-P).
  *
  * When using kkm driver
  * - fixed 512GB of memory is supported.
@@ -61,11 +62,13 @@
  * This maps to RSV_MEM_START. When making changes make sure not to exceed RSV_MEM_SIZE.
  */
 #define PT_ENTRIES (512)
+// PML4 entries (i.e. PDPT pages) per zone, GUEST_MAX_PHYSMEM_SUPPORTED / PML4E_REGION
+#define PML4E_ZONE_ENTRIES (8)
 typedef struct page_tables {
    x86_pml4e_t pml4[PT_ENTRIES];
-   x86_pdpte_t pdpt0[PT_ENTRIES];
-   x86_pdpte_t pdpt1[PT_ENTRIES];
-   x86_pdpte_t pdpt2[PT_ENTRIES];
+   x86_pdpte_t pdpt0[PT_ENTRIES * PML4E_ZONE_ENTRIES];   // bottom zone, contiguous pages
+   x86_pdpte_t pdpt1[PT_ENTRIES];                        // km private area
+   x86_pdpte_t pdpt2[PT_ENTRIES * PML4E_ZONE_ENTRIES];   // top zone, KM_HIGH_GVA layout only
    x86_pde_4k_t pd0[PT_ENTRIES];
    x86_pde_4k_t pd1[PT_ENTRIES];
    x86_pde_4k_t pd2[PT_ENTRIES];
@@ -147,14 +150,16 @@ static void pte_set(x86_pte_4k_t* pte, uint64_t addr)
  * address) of this region is machine.tbrk.
  *
  * Total amount of guest virtual memory (bottom region + top region) is currently limited to
- * 'guest_max_physical_mem-4MB' (i.e. 512GB-4MB).
+ * 'guest_max_physical_mem-4MB' (i.e. 512GB-4MB by default).
  *
  * Virtual to physical is essentially 1:1
  *
- * There are two possible layouts. If KM_HIGH_GVA is defined, the top region virtual addresses are
- * equal to physical_addresses + GUEST_VA_OFFSET. The low is one to one GVA == PVA.
+ * There are two possible layouts, chosen at startup by km_mem_layout_init(). With the KM_HIGH_GVA
+ * layout, the top region virtual addresses are equal to physical_addresses + GUEST_VA_OFFSET. The
+ * low is one to one GVA == PVA. This is the layout for guest_max_physmem over 512GB, or always if
+ * KM_HIGH_GVA is defined at build time.
  *
- * If KM_HIGH_GVA is *not* defined, both regions have GVA == PVA.
+ * With the low layout both regions have GVA == PVA (for 512GB of physical memory).
  *
  * We use 2MB pages for the first and last GB of virtual space, and 1GB pages for the rest.
  *
@@ -170,12 +175,13 @@ static void pte_set(x86_pte_4k_t* pte, uint64_t addr)
  * Initially there is no memory allocated, then it expands with brk (left to right in the picture
  * below) or with mmap (right to left).
  *
- * If we ever go over the 512GB limit there will be a need for more pdpt pages. The first entry
- * points to the pd page that covers the first GB.
+ * Over 512GB each zone needs more pml4 entries, #0 to #N-1 and #256-N to #255, each with its own
+ * pdpt page. The pdpt pages of a zone are contiguous (pdpt0 and pdpt2 in page_tables_t), so
+ * PDPTE_SLOT() is simply the 1GB slot number from the beginning of the zone. The first entry
+ * points to the pd page that covers the first GB. The km private area is then moved to #128
+ * (64TB) to stay clear of both zones.
  *
- * The picture illustrates layout with the constants values as set.
- * The code below is a little more flexible, allowing one or two pdpt pages and
- * pml4 entries, as well as variable locations in pdpt table
+ * The picture illustrates layout with the constants values as set for 512GB.
  *
  * // clang-format off
  *
@@ -206,12 +212,9 @@ static void pte_set(x86_pte_4k_t* pte, uint64_t addr)
  * memory starts at 2MB and ends at 512GB-2MB. Initially there is no memory allocated, then it
  * expands with brk (left to right in the picture below) or with mmap (right to left).
  *
- * If we ever go over the 512GB limit there will be a need for more pdpt pages. The first entry
- * points to the pd page that covers the first GB.
+ * The low layout is not used over 512GB, as the km private area is at 512GB.
  *
  * The picture illustrates layout with the constants values as set.
- * The code below is a little more flexible, allowing one or two pdpt pages and
- * pml4 entries, as well as variable locations in pdpt table
  *
  * // clang-format off
  *
@@ -259,12 +262,34 @@ static inline int PDE_SLOT(km_gva_t __addr)
 }
 
 /*
- * Slot number for 1G chunk in PDPT table for gva '_addr'
- * Logically:  (__addr % PML4E_REGION) / PDPTE_REGION
+ * Slot number for 1G chunk in the PDPT pages of the zone for gva '_addr'. The zone PDPT pages are
+ * contiguous, the top zone ones start from GUEST_VA_OFFSET rounded down to PML4E_REGION.
+ * Logically:  (__addr - zone_base) / PDPTE_REGION
+ * For the low layout zone_base is 0, so this is (__addr % PML4E_REGION) / PDPTE_REGION.
  */
 static inline int PDPTE_SLOT(km_gva_t __addr)
 {
-   return ((__addr)&0x7ffffffffful) >> 30;
+   if (__addr >= GUEST_VA_OFFSET) {
+      __addr -= rounddown(GUEST_VA_OFFSET, PML4E_REGION);
+   }
+   return __addr >> 30;
+}
+
+/*
+ * Slot number in PML4 table for gva '_addr'
+ */
+static inline int PML4E_SLOT(km_gva_t __addr)
+{
+   return (__addr >> 39) & 0x1ff;
+}
+
+/*
+ * PDPT pages for upper (top zone) or bottom VA
+ */
+static inline x86_pdpte_1g_t* km_pdpt_zone(int upper_va)
+{
+   page_tables_t* pt = km_page_table();
+   return (x86_pdpte_1g_t*)((upper_va != 0 && machine.guest_high_gva != 0) ? pt->pdpt2 : pt->pdpt0);
 }
 
 /*
@@ -417,35 +442,47 @@ static void init_pml4(km_kma_t mem)
    page_tables_t* pt = mem;
    page_tables_t* pt_phys = (page_tables_t*)(uint64_t)RSV_MEM_START;
 
-   // The code assumes that a single PML4 slot can cover all available physical memory.
-   km_assert(machine.guest_max_physmem <= PML4E_REGION);
+   km_assert(sizeof(page_tables_t) <= RSV_MEM_SIZE);
+   // The code assumes that PML4E_ZONE_ENTRIES slots can cover all available physical memory.
+   km_assert(machine.guest_max_physmem <= PML4E_ZONE_ENTRIES * PML4E_REGION);
    // The code assumes that PA and VA are aligned within PDE table (which covers PDPTE_REGION)
    km_assert(GUEST_VA_OFFSET % PDPTE_REGION == 0);
+   // Private area needs a PML4 slot of its own between the zones, we use the first slot in its PDPT
+   km_assert(GUEST_PRIVATE_MEM_START_VA % PML4E_REGION == 0);
+   km_assert(GUEST_PRIVATE_MEM_START_VA >= GUEST_MEM_ZONE_SIZE_VA);
+   km_assert(GUEST_PRIVATE_MEM_START_VA >= GUEST_MEM_TOP_VA + GUEST_MEM_START_VA ||
+             GUEST_PRIVATE_MEM_START_VA + PML4E_REGION <= rounddown(GUEST_VA_OFFSET, PML4E_REGION));
 
    // initialize all page table entries
    memset(pt, 0, sizeof(page_tables_t));
 
-   // covers 0 to 512GB - 1
-   pml4e_set(&pt->pml4[0], (uint64_t)pt_phys->pdpt0);
+   // bottom zone, covers 0 to guest_max_physmem - 1
+   for (idx = 0; idx == 0 || idx < GUEST_MEM_ZONE_SIZE_VA / PML4E_REGION; idx++) {
+      pml4e_set(&pt->pml4[idx], (uint64_t)(pt_phys->pdpt0 + idx * PT_ENTRIES));
+   }
    pdpte_set(&pt->pdpt0[0], (uint64_t)pt_phys->pd0);
 
-   // covers 512GB to 1TB - 1
-   idx = GUEST_PRIVATE_MEM_START_VA / PML4E_REGION;
+   // private area, 512GB to 1TB - 1 (or 64TB to 64.5TB - 1)
+   idx = PML4E_SLOT(GUEST_PRIVATE_MEM_START_VA);
    pml4e_set(&pt->pml4[idx], (uint64_t)pt_phys->pdpt1);
    pdpte_set(&pt->pdpt1[0], (uint64_t)pt_phys->pd1);
    idx = PDE_SLOT(GUEST_VVAR_VDSO_BASE_VA);
    pde_4k_set(&pt->pd1[idx], (uint64_t)pt_phys->pt1);
-#ifdef KM_HIGH_GVA
-   // 128TB - 512GB to 128TB
-   idx = (GUEST_MEM_TOP_VA - 1) / PML4E_REGION;
-   pml4e_set(&pt->pml4[idx], (uint64_t)pt_phys->pdpt2);
-#endif
-   idx = PDE_SLOT(GUEST_MEM_TOP_VA);
-#ifdef KM_HIGH_GVA
-   pdpte_set(&pt->pdpt2[idx], (uint64_t)pt_phys->pd2);
-#else
-   pdpte_set(&pt->pdpt0[idx], (uint64_t)pt_phys->pd2);
-#endif
+
+   if (machine.guest_high_gva != 0) {
+      // top zone, 128TB - guest_max_physmem to 128TB
+      km_gva_t va = rounddown(GUEST_VA_OFFSET, PML4E_REGION);
+      for (int i = 0; va < GUEST_MEM_TOP_VA; i++, va += PML4E_REGION) {
+         pml4e_set(&pt->pml4[PML4E_SLOT(va)], (uint64_t)(pt_phys->pdpt2 + i * PT_ENTRIES));
+      }
+   }
+   // last GB of the top zone is in 2MB pages
+   idx = PDPTE_SLOT(GUEST_MEM_TOP_VA);
+   if (machine.guest_high_gva != 0) {
+      pdpte_set(&pt->pdpt2[idx], (uint64_t)pt_phys->pd2);
+   } else {
+      pdpte_set(&pt->pdpt0[idx], (uint64_t)pt_phys->pd2);
+   }
 }
 
 static void* km_guest_page_malloc(km_gva_t gpa_hint, size_t size, int prot)
@@ -500,14 +537,18 @@ void km_mem_init(km_machine_init_params_t* params)
    if (ioctl(machine.mach_fd, KVM_SET_IDENTITY_MAP_ADDR, &idmap) < 0) {
       km_err(1, "KVM: set identity map addr failed");
    }
+   km_mem_layout_init();
+   km_infox(KM_TRACE_MEM,
+            "physmem 0x%lx %s layout, top VA 0x%lx private VA 0x%lx",
+            machine.guest_max_physmem,
+            machine.guest_high_gva != 0 ? "high" : "low",
+            GUEST_MEM_TOP_VA,
+            GUEST_PRIVATE_MEM_START_VA);
+   km_assert(machine.last_mem_idx < KM_RSRV_VDSOSLOT);
    init_pml4((km_kma_t)reg->userspace_addr);
 
    machine.brk = GUEST_MEM_START_VA;
    machine.tbrk = GUEST_MEM_TOP_VA;
-   machine.guest_mid_physmem = machine.guest_max_physmem >> 1;
-   machine.mid_mem_idx = MEM_IDX(machine.guest_mid_physmem - 1);
-   // Place for the last 2MB of PA. We do not allocate it to make memregs mirrored
-   machine.last_mem_idx = (machine.mid_mem_idx << 1) + 1;
    km_guest_mmap_init();
 
    // Add the [vvar] and [vdso] pages from km into the physical and virtual address space for the payload
@@ -534,7 +575,7 @@ static inline void fixup_bottom_page_tables(km_gva_t old_brk, km_gva_t new_brk)
 {
    page_tables_t* pt = km_page_table();
    x86_pde_2m_t* pde = (x86_pde_2m_t*)pt->pd0;
-   x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
+   x86_pdpte_1g_t* pdpe = km_pdpt_zone(0);
    int old_2m_slot = PDE_SLOT(old_brk);
    int new_2m_slot = PDE_SLOT(new_brk);
    int old_1g_slot = PDPTE_SLOT(old_brk);
@@ -589,11 +630,7 @@ static inline void fixup_top_page_tables(km_gva_t old_brk, km_gva_t new_brk)
 {
    page_tables_t* pt = km_page_table();
    x86_pde_2m_t* pde = (x86_pde_2m_t*)pt->pd2;
-#ifdef KM_HIGH_GVA
-   x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt2;
-#else
-   x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
-#endif
+   x86_pdpte_1g_t* pdpe = km_pdpt_zone(1);
    int old_2m_slot = PDE_SLOT(old_brk);
    int new_2m_slot = PDE_SLOT(new_brk);
    int old_1g_slot = PDPTE_SLOT(old_brk);
@@ -661,11 +698,7 @@ static void set_pml4_hierarchy(kvm_mem_reg_t* reg, int upper_va)
       }
    } else {
       km_assert(machine.pdpe1g != 0);
-#ifdef KM_HIGH_GVA
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)(upper_va ? pt->pdpt2 : pt->pdpt0);
-#else
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
-#endif
+      x86_pdpte_1g_t* pdpe = km_pdpt_zone(upper_va);
       uint64_t gva = upper_va ? gpa_to_upper_gva(base) : base;
       for (uint64_t addr = gva; addr < gva + size; addr += PDPTE_REGION, base += PDPTE_REGION) {
          pdpte_1g_set(pdpe + PDPTE_SLOT(addr), base);
@@ -688,11 +721,7 @@ static void clear_pml4_hierarchy(kvm_mem_reg_t* reg, int upper_va)
       }
    } else {
       km_assert(machine.pdpe1g != 0);   // no 1GB pages support
-#ifdef KM_HIGH_GVA
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)(upper_va ? pt->pdpt2 : pt->pdpt0);
-#else
-      x86_pdpte_1g_t* pdpe = (x86_pdpte_1g_t*)pt->pdpt0;
-#endif
+      x86_pdpte_1g_t* pdpe = km_pdpt_zone(upper_va);
       uint64_t gva = upper_va ? gpa_to_upper_gva(base) : base;
       for (uint64_t addr = gva; addr < gva + size; addr += PDPTE_REGION, base += PDPTE_REGION) {
          pdpe[PDPTE_SLOT(addr)] = (x86_pdpte_1g_t){0};
@@ -700,38 +729,6 @@ static void clear_pml4_hierarchy(kvm_mem_reg_t* reg, int upper_va)
    }
 }
 
-/*
- * Allocate memory 'size' and configure it as mem region 'idx', supporting
- * VA at from idx->guest_phys_addr + va_offset.
- *
- * Return 0 for success and -errno for errors
- */
-static int km_alloc_region(int idx, size_t size, int upper_va)
-{
-   void* ptr;
-   kvm_mem_reg_t* reg = &machine.vm_mem_regs[idx];
-   km_gva_t base = memreg_base(idx);
-
-   km_assert(reg->memory_size == 0 && reg->userspace_addr == 0);
-   km_assert(machine.pdpe1g || (base < GIB || base >= machine.guest_max_physmem - GIB));
-   if ((ptr = km_guest_page_malloc(base, size, PROT_NONE)) == NULL) {
-      return -ENOMEM;
-   }
-   reg->userspace_addr = (typeof(reg->userspace_addr))ptr;
-   reg->slot = idx;
-   reg->guest_phys_addr = base;
-   reg->memory_size = size;
-   reg->flags = 0;
-   if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
-      km_warn("KVM: failed to plug memory region %d", idx);
-      km_guest_page_free(base, size);
-      memset(reg, 0, sizeof(*reg));
-      return -errno;
-   }
-   set_pml4_hierarchy(reg, upper_va);
-   return 0;
-}
-
 static void km_free_region(int idx, int upper_va)
 {
    kvm_mem_reg_t* reg = &machine.vm_mem_regs[idx];
@@ -754,6 +751,89 @@ static inline int km_region_allocated(int idx)
    return (reg->userspace_addr != 0);
 }
 
+/*
+ * Allocate and plug memory regions [first, last] in one pass, supporting VA at
+ * idx->guest_phys_addr (or the upper VA alias if upper_va is set).
+ *
+ * Large brk/tbrk moves (e.g. a big heap reserved at payload startup) cross many memregs. Instead of
+ * doing mmap + KVM_SET_USER_MEMORY_REGION + page table update for each region in turn, we
+ * compute the whole layout first: regions not yet allocated by the other side are backed with a
+ * single mmap, each of them is registered with KVM, and only when all slots are in place the guest
+ * page tables are updated for the complete range. On failure nothing is left behind, so the caller
+ * doesn't need to unwind partially grown state.
+ *
+ * Return 0 for success and -errno for errors
+ */
+static int km_alloc_regions(int first, int last, int upper_va)
+{
+   int lo = -1, hi = -1;
+   int idx;
+   int ret = 0;
+
+   km_assert(first <= last);
+   // Regions already populated by the other side (brk vs tbrk) can only be at the edge of the range
+   for (idx = first; idx <= last; idx++) {
+      if (km_region_allocated(idx) == 0) {
+         if (lo < 0) {
+            lo = idx;
+         }
+         km_assert(hi < 0 || hi == idx - 1);
+         hi = idx;
+      }
+   }
+   if (lo >= 0) {
+      km_gva_t base = memreg_base(lo);
+      size_t size = memreg_top(hi) - base;
+
+      km_infox(KM_TRACE_MEM,
+               "regions %d-%d gpa 0x%lx size 0x%lx upper %d",
+               lo,
+               hi,
+               base,
+               size,
+               upper_va);
+      if (km_guest_page_malloc(base, size, PROT_NONE) == NULL) {
+         return -ENOMEM;
+      }
+      for (idx = lo; idx <= hi; idx++) {
+         kvm_mem_reg_t* reg = &machine.vm_mem_regs[idx];
+         km_gva_t reg_base = memreg_base(idx);
+
+         km_assert(reg->memory_size == 0);
+         km_assert(machine.pdpe1g ||
+                   (reg_base < GIB || reg_base >= machine.guest_max_physmem - GIB));
+         reg->userspace_addr = (typeof(reg->userspace_addr))(KM_USER_MEM_BASE + reg_base);
+         reg->slot = idx;
+         reg->guest_phys_addr = reg_base;
+         reg->memory_size = memreg_size(idx);
+         reg->flags = 0;
+         if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
+            ret = -errno;
+            km_warn("KVM: failed to plug memory region %d", idx);
+            memset(reg, 0, sizeof(*reg));
+            break;
+         }
+      }
+      if (ret != 0) {
+         while (--idx >= lo) {
+            kvm_mem_reg_t* reg = &machine.vm_mem_regs[idx];
+
+            reg->memory_size = 0;
+            if (ioctl(machine.mach_fd, KVM_SET_USER_MEMORY_REGION, reg) < 0) {
+               km_err(1, "KVM: failed to unplug memory region %d", idx);
+            }
+            memset(reg, 0, sizeof(*reg));
+         }
+         km_guest_page_free(base, size);
+         return ret;
+      }
+   }
+   for (idx = first; idx <= last; idx++) {
+      set_pml4_hierarchy(&machine.vm_mem_regs[idx], upper_va);
+   }
+   return 0;
+}
+
 /*
  * brk() call implementation.
  *
@@ -778,20 +858,21 @@ km_gva_t km_mem_brk(km_gva_t brk)
    }
 
    idx = gva_to_memreg_idx(machine.brk - 1);
-   for (km_gva_t m_brk = MIN(brk, memreg_top(idx)); m_brk < brk; m_brk = MIN(brk, memreg_top(idx))) {
-      /* Move to the next memreg. Allocate if required. */
-      idx++;
-      if (km_region_allocated(idx)) {
-         /*
-          * the slot is already populated which means the tbrk side allocated it.
-          * Still need to establish virtual to physical page mapping on this side.
-          */
-         set_pml4_hierarchy(&machine.vm_mem_regs[idx], 0);
-      } else if (km_alloc_region(idx, memreg_size(idx), 0) != 0) {
-         idx--;
+   int new_idx = idx;
+   for (km_gva_t m_brk = MIN(brk, memreg_top(new_idx)); m_brk < brk;
+        m_brk = MIN(brk, memreg_top(new_idx))) {
+      new_idx++;
+   }
+   if (new_idx > idx) {
+      /*
+       * Populate all memregs up to new_idx at once. Slots already populated by the tbrk side only
+       * need virtual to physical page mapping established on this side.
+       */
+      if (km_alloc_regions(idx + 1, new_idx, 0) != 0) {
          brk = machine.brk;
          error = ENOMEM;
-         break;
+      } else {
+         idx = new_idx;
       }
    }
    int tbrk_idx = gva_to_memreg_idx(machine.tbrk);
@@ -839,21 +920,18 @@ km_gva_t km_mem_tbrk(km_gva_t tbrk)
    }
 
    idx = gva_to_memreg_idx(machine.tbrk);
-   for (km_gva_t m_brk = MAX(tbrk, gpa_to_upper_gva(memreg_base(idx))); m_brk > tbrk;
-        m_brk = MAX(tbrk, gpa_to_upper_gva(memreg_base(idx)))) {
-      /* Move to the next memreg. Allocate if required. */
-      idx--;
-      if (km_region_allocated(idx)) {
-         /*
-          * the slot is already populated which means the brk side allocated it.
-          * Still need to establish virtual to physical page mapping on this side.
-          */
-         set_pml4_hierarchy(&machine.vm_mem_regs[idx], 1);
-      } else if (km_alloc_region(idx, memreg_size(idx), 1) != 0) {
-         idx++;
+   int new_idx = idx;
+   for (km_gva_t m_brk = MAX(tbrk, gpa_to_upper_gva(memreg_base(new_idx))); m_brk > tbrk;
+        m_brk = MAX(tbrk, gpa_to_upper_gva(memreg_base(new_idx)))) {
+      new_idx--;
+   }
+   if (new_idx < idx) {
+      // Same as brk above, slots populated by the brk side only get the upper VA mapping
+      if (km_alloc_regions(new_idx, idx - 1, 1) != 0) {
          tbrk = machine.tbrk;
          error = ENOMEM;
-         break;
+      } else {
+         idx = new_idx;
       }
    }
    int brk_idx = gva_to_memreg_idx(machine.brk - 1);
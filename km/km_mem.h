@@ -49,23 +49,37 @@ static inline uint64_t RSV_GUEST_PA(uint64_t x)
 
 // Special slots in machine.vm_mem_regs[]
 static const int KM_RSRV_MEMSLOT = 0;
-static const int KM_RSRV_VDSOSLOT = 41;
-static const int KM_RSRV_KMGUESTMEM_SLOT = 42;
+static const int KM_RSRV_VDSOSLOT = KM_MEM_SLOTS - 2;
+static const int KM_RSRV_KMGUESTMEM_SLOT = KM_MEM_SLOTS - 1;
 
 static const km_gva_t GUEST_MEM_START_VA = 2 * MIB;
-static const km_gva_t GUEST_PRIVATE_MEM_START_VA = 512 * GIB;
-// ceiling for guest virt. address. 2MB shift down to make it aligned on GB with physical address
-#ifdef KM_HIGH_GVA
-static const km_gva_t GUEST_MEM_TOP_VA = 128 * 1024 * GIB - GUEST_MEM_START_VA;
-#else
-static const km_gva_t GUEST_MEM_TOP_VA = (512 * GIB - GUEST_MEM_START_VA);
-#endif
 
-static const km_gva_t GUEST_VVAR_VDSO_BASE_VA = GUEST_PRIVATE_MEM_START_VA;
-static const km_gpa_t GUEST_VVAR_VDSO_BASE_GPA = 0x7ffff00000;
+/*
+ * There are two virtual memory layouts, see "Virtual Memory layout:" in km_mem.c. The low one keeps
+ * all guest VA under 1TB and is used for up to 512GB of physical memory, which fits in one PML4
+ * entry per zone. The high one (KM_HIGH_GVA) puts the top zone at the end of 47 bit VA and is used
+ * for larger machines, or always if KM_HIGH_GVA is defined at build time.
+ *
+ * ceiling for guest virt. address. 2MB shift down to make it aligned on GB with physical address
+ */
+static const km_gva_t GUEST_LOW_MEM_TOP_VA = 512 * GIB - 2 * MIB;
+static const km_gva_t GUEST_HIGH_MEM_TOP_VA = 128 * 1024 * GIB - 2 * MIB;
+#define GUEST_MEM_TOP_VA (machine.guest_mem_top_va)
+
+// km private area ([vvar], [vdso], km_guest code), out of both zones. VA is 512GB aligned
+static const km_gva_t GUEST_LOW_PRIVATE_MEM_START_VA = 512 * GIB;
+static const km_gva_t GUEST_HIGH_PRIVATE_MEM_START_VA = 64 * 1024 * GIB;
+#define GUEST_PRIVATE_MEM_START_VA (machine.guest_private_va)
+
+// Physical address of the private area is in the never allocated last 2MB of PA.
+static const km_gpa_t GUEST_LOW_PRIVATE_MEM_START_GPA = 0x7ffff00000;
+#define GUEST_PRIVATE_MEM_START_GPA (machine.guest_private_pa)
 
-static const km_gva_t GUEST_KMGUESTMEM_BASE_VA = GUEST_PRIVATE_MEM_START_VA + (32 * KIB);
-static const km_gpa_t GUEST_KMGUESTMEM_BASE_GPA = 0x7ffff08000;
+#define GUEST_VVAR_VDSO_BASE_VA (GUEST_PRIVATE_MEM_START_VA)
+#define GUEST_VVAR_VDSO_BASE_GPA (GUEST_PRIVATE_MEM_START_GPA)
+
+#define GUEST_KMGUESTMEM_BASE_VA (GUEST_PRIVATE_MEM_START_VA + (32 * KIB))
+#define GUEST_KMGUESTMEM_BASE_GPA (GUEST_PRIVATE_MEM_START_GPA + (32 * KIB))
 
 /*
  * There are 2 "zones" of VAs, one on the bottom and one on the top. The bottom has pva == gva, the
@@ -75,8 +89,13 @@ static const km_gpa_t GUEST_KMGUESTMEM_BASE_GPA = 0x7ffff08000;
 
 #define GUEST_VA_OFFSET (GUEST_MEM_TOP_VA + GUEST_MEM_START_VA - GUEST_MEM_ZONE_SIZE_VA)
 
-// We currently only have code with 1 PML4 entry per "zone", so we can't support more than that
-static const uint64_t GUEST_MAX_PHYSMEM_SUPPORTED = 512 * GIB;
+// Physical memory we use unless asked for more. One PML4 entry per zone, low layout.
+static const uint64_t GUEST_MAX_PHYSMEM_DEFAULT = 512 * GIB;
+/*
+ * Max physical memory. Limited by PDPT pages we reserve per zone (see page_tables_t in km_mem.c),
+ * and by memreg indexes which need to stay below KM_RSRV_VDSOSLOT.
+ */
+static const uint64_t GUEST_MAX_PHYSMEM_SUPPORTED = 4 * 1024 * GIB;
 
 /*
  * See "Virtual memory layout:" in km_cpu_init.c for details.
@@ -215,6 +234,32 @@ static inline uint64_t memreg_size(int idx)
    return MIB << (machine.last_mem_idx - idx);
 }
 
+/*
+ * Set up memory layout and memreg geometry for machine.guest_max_physmem. Needs to be called before
+ * any of the GUEST_* layout macros or memreg_*() is used.
+ */
+static inline void km_mem_layout_init(void)
+{
+#ifdef KM_HIGH_GVA
+   machine.guest_high_gva = 1;
+#else
+   machine.guest_high_gva = (machine.guest_max_physmem > GUEST_MAX_PHYSMEM_DEFAULT);
+#endif
+   if (machine.guest_high_gva != 0) {
+      machine.guest_mem_top_va = GUEST_HIGH_MEM_TOP_VA;
+      machine.guest_private_va = GUEST_HIGH_PRIVATE_MEM_START_VA;
+      machine.guest_private_pa = machine.guest_max_physmem - MIB;
+   } else {
+      machine.guest_mem_top_va = GUEST_LOW_MEM_TOP_VA;
+      machine.guest_private_va = GUEST_LOW_PRIVATE_MEM_START_VA;
+      machine.guest_private_pa = GUEST_LOW_PRIVATE_MEM_START_GPA;
+   }
+   machine.guest_mid_physmem = machine.guest_max_physmem >> 1;
+   machine.mid_mem_idx = MEM_IDX(machine.guest_mid_physmem - 1);
+   // Place for the last 2MB of PA. We do not allocate it to make memregs mirrored
+   machine.last_mem_idx = (machine.mid_mem_idx << 1) + 1;
+}
+
 /*
  * Returns true if gva is in vdso
  */
@@ -273,6 +318,27 @@ static inline km_kma_t km_gva_to_kma(km_gva_t gva)
    return km_gva_to_kma_nocheck(gva);
 }
 
+/*
+ * Translates guest range [gva, gva + len) to km address. Returns NULL unless the whole range is
+ * valid and contiguous in km space. Guest memory slots are contiguous in km space (see above), so
+ * the only discontinuities are the holes between zones which are never valid anyway.
+ */
+static inline km_kma_t km_gva_to_kma_range(km_gva_t gva, size_t len)
+{
+   char* start = km_gva_to_kma(gva);
+   if (start == NULL || len == 0) {
+      return start;
+   }
+   if (gva + len < gva) {
+      return NULL;
+   }
+   char* end = km_gva_to_kma(gva + len - 1);
+   if (end == NULL || end - start != len - 1) {
+      return NULL;
+   }
+   return start;
+}
+
 // if prot_write passed to mprotect, adjusted to prot_read and prot_write to allow for proper mimic
 // of linux working of memory permissions (prot_write implies prot_read)
 static inline int protection_adjust(int prot)
@@ -300,8 +366,12 @@ int km_guest_mprotect(km_gva_t addr, size_t size, int prot);
 int km_guest_madvise(km_gva_t addr, size_t size, int advise);
 int km_guest_msync(km_gva_t addr, size_t size, int flag);
 int km_is_gva_accessable(km_gva_t addr, size_t size, int prot);
+km_kma_t km_gva_range_to_kma(km_vcpu_t* vcpu, km_gva_t gva, size_t len, int prot);
 int km_monitor_pages_in_guest(km_gva_t gva, size_t size, int protection, char* tag);
 void km_mmap_set_recovery_mode(int mode);
 void km_mmap_set_filename(km_gva_t base, km_gva_t limit, char* filename);
+size_t km_guest_mmap_size(void);
+uint64_t km_guest_mmap_gen(void);
+uint64_t km_guest_mmap_walk(void (*fn)(km_mmap_reg_t* reg, void* arg), void* arg);
 
 #endif /* #ifndef __KM_MEM_H__ */
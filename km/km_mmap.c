@@ -31,6 +31,7 @@
 #include "km.h"
 #include "km_coredump.h"
 #include "km_filesys.h"
+#include "km_io_uring.h"
 #include "km_mem.h"
 
 typedef enum { MMAP_ALLOC_GUEST = 0x0, MMAP_ALLOC_MONITOR } mmap_allocation_type_e;
@@ -45,6 +46,26 @@ static inline void mmaps_unlock(void)
    km_mutex_unlock(&machine.mmaps.mutex);
 }
 
+// Unlock after the busy list may have changed, so the next km_guest_mmap_walk() sees a new gen
+static inline void mmaps_unlock_changed(void)
+{
+   __atomic_add_fetch(&machine.mmaps.gen, 1, __ATOMIC_RELEASE);
+   mmaps_unlock();
+}
+
+/*
+ * Busy mmaps as a sorted array of spans, neighbors with the same protection merged, for binary
+ * search in km_mmap_span_find(). Rebuilt on the first lookup after the busy list changed.
+ * Protected by mmaps lock.
+ */
+static struct {
+   km_gva_span_t* span;
+   int cnt;
+   int size;
+   uint64_t gen;   // machine.mmaps.gen the array was built at
+   int valid;
+} mmaps_idx;
+
 void km_guest_mmap_init(void)
 {
    TAILQ_INIT(&machine.mmaps.free);
@@ -68,6 +89,8 @@ void km_guest_mmap_fini(void)
 {
    km_clean_list(&machine.mmaps.busy);
    km_clean_list(&machine.mmaps.free);
+   free(mmaps_idx.span);
+   mmaps_idx = (typeof(mmaps_idx)){};
 }
 
 // on ubuntu and older kernels, this is not defined. We need symbol to check (and reject) flags
@@ -645,7 +668,13 @@ static km_gva_t km_guest_mmap_nolock(
    }
    char* filename = km_guestfd_name(NULL, fd);
    if (filename != NULL) {
-      reg->filename = realpath(filename, NULL);
+      /*
+       * memfd and deleted files have no path to resolve, keep the name as is. The region has
+       * to be marked file backed either way, or km_reg_make_clean() would drop its pages.
+       */
+      if ((reg->filename = realpath(filename, NULL)) == NULL) {
+         reg->filename = strdup(filename);
+      }
       reg->offset = offset;
    }
    km_mmap_concat(reg, &machine.mmaps.busy);
@@ -683,7 +712,7 @@ static km_gva_t km_guest_mmap_impl(km_gva_t gva,
    size = roundup(size, KM_PAGE_SIZE);
    mmaps_lock();
    ret = km_guest_mmap_nolock(gva, size, prot, flags, fd, offset, allocation_type);
-   mmaps_unlock();
+   mmaps_unlock_changed();
    km_infox(KM_TRACE_MMAP, "== mmap guest ret=0x%lx 0x%lx 0x%lx", ret, ret + size, size);
    return ret;
 }
@@ -693,6 +722,9 @@ static km_gva_t km_guest_mmap_impl(km_gva_t gva,
  */
 km_gva_t km_guest_mmap(km_gva_t gva, size_t size, int prot, int flags, int fd, off_t offset)
 {
+   if ((flags & MAP_ANONYMOUS) == 0 && km_io_uring_mmap_emulated(fd, offset) != 0) {
+      return km_io_uring_mmap(gva, size, prot, flags, fd, offset);
+   }
    return (km_guest_mmap_impl(gva, size, prot, flags, fd, offset, MMAP_ALLOC_GUEST));
 }
 
@@ -752,6 +784,7 @@ int km_monitor_pages_in_guest(km_gva_t gva, size_t size, int protection, char* t
    reg->filename = tagcopy;
    reg->offset = 0;
    km_mmap_insert_busy(reg);
+   machine.mmaps.gen++;
    return 0;
 }
 
@@ -787,7 +820,7 @@ int km_guest_munmap(km_vcpu_t* vcpu, km_gva_t addr, size_t size)
    }
    mmaps_lock();
    ret = km_guest_munmap_nolock(addr, size);
-   mmaps_unlock();
+   mmaps_unlock_changed();
    km_infox(KM_TRACE_MMAP, "== munmap ret=%d", ret);
    return ret;
 }
@@ -798,7 +831,7 @@ void km_delayed_munmap(km_vcpu_t* vcpu)
       mmaps_lock();
       int rc = km_guest_munmap_nolock(vcpu->mapself_base, vcpu->mapself_size);
       km_assert(rc == 0);
-      mmaps_unlock();
+      mmaps_unlock_changed();
       vcpu->mapself_base = 0;
       vcpu->mapself_size = 0;
    }
@@ -820,7 +853,7 @@ int km_guest_mprotect(km_gva_t addr, size_t size, int prot)
    }
    mmaps_lock();
    int ret = km_guest_mprotect_nolock(addr, size, prot);
-   mmaps_unlock();
+   mmaps_unlock_changed();
    return ret;
 }
 
@@ -965,7 +998,7 @@ km_guest_mremap(km_gva_t old_addr, size_t old_size, size_t size, int flags, ...
 
    mmaps_lock();
    ret = km_guest_mremap_nolock(old_addr, old_size, size, flags);
-   mmaps_unlock();
+   mmaps_unlock_changed();
    km_infox(KM_TRACE_MMAP, "mremap: ret=0x%lx", ret);
    return ret;
 }
@@ -997,6 +1030,128 @@ km_is_payload_gva_accessable(km_payload_t* payload, km_gva_t gva, size_t size, i
    return 0;
 }
 
+static int km_mmap_idx_build(void)
+{
+   km_mmap_reg_t* reg;
+   int cnt = 0;
+
+   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
+      cnt++;
+   }
+   if (cnt > mmaps_idx.size) {
+      km_gva_span_t* span = realloc(mmaps_idx.span, cnt * 2 * sizeof(km_gva_span_t));
+      if (span == NULL) {
+         return -ENOMEM;
+      }
+      mmaps_idx.span = span;
+      mmaps_idx.size = cnt * 2;
+   }
+   mmaps_idx.cnt = 0;
+   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
+      int prot = protection_adjust(reg->protection);
+      if (mmaps_idx.cnt > 0) {
+         km_gva_span_t* last = &mmaps_idx.span[mmaps_idx.cnt - 1];
+         if (last->end == reg->start && last->prot == prot) {
+            last->end += reg->size;
+            continue;
+         }
+      }
+      mmaps_idx.span[mmaps_idx.cnt++] =
+          (km_gva_span_t){.start = reg->start, .end = reg->start + reg->size, .prot = prot};
+   }
+   mmaps_idx.gen = machine.mmaps.gen;
+   mmaps_idx.valid = 1;
+   return 0;
+}
+
+/*
+ * Same check as km_mmap_span_find() below, by walking busy mmaps list. Used when there is no
+ * memory for the index. Called with mmaps lock held.
+ */
+static int km_mmap_list_covers_nolock(km_gva_t gva, size_t len, int prot)
+{
+   km_mmap_reg_t* reg;
+   km_gva_t cur = gva;
+
+   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
+      if (reg->start + reg->size <= cur) {
+         continue;
+      }
+      if (reg->start > cur || (protection_adjust(reg->protection) & prot) != prot) {
+         break;
+      }
+      if ((cur = reg->start + reg->size) >= gva + len) {
+         return 0;
+      }
+   }
+   return -EFAULT;
+}
+
+/*
+ * Checks that busy mmaps cover [gva, gva + len) with at least 'prot'. If one span covers it all,
+ * it's returned in 'hit' for the caller to cache. Returns 0 if the range is ok, -EFAULT if not.
+ */
+static int km_mmap_span_find(km_gva_t gva, size_t len, int prot, km_gva_span_t* hit)
+{
+   int ret = -EFAULT;
+
+   mmaps_lock();
+   if ((mmaps_idx.valid == 0 || mmaps_idx.gen != machine.mmaps.gen) && km_mmap_idx_build() != 0) {
+      ret = km_mmap_list_covers_nolock(gva, len, prot);   // no memory for the index, walk the list
+      mmaps_unlock();
+      return ret;
+   }
+   int lo = 0, hi = mmaps_idx.cnt - 1, i = -1;
+   while (lo <= hi) {   // last span starting at or below gva
+      int mid = (lo + hi) / 2;
+      if (mmaps_idx.span[mid].start <= gva) {
+         i = mid;
+         lo = mid + 1;
+      } else {
+         hi = mid - 1;
+      }
+   }
+   if (i >= 0 && gva + len <= mmaps_idx.span[i].end && (mmaps_idx.span[i].prot & prot) == prot) {
+      *hit = mmaps_idx.span[i];
+      hit->gen = mmaps_idx.gen;
+      ret = 0;
+   } else if (i >= 0) {   // may still be covered by contiguous spans with enough protection
+      for (km_gva_t cur = gva; i < mmaps_idx.cnt; i++) {
+         km_gva_span_t* s = &mmaps_idx.span[i];
+         if (s->start > cur || s->end <= cur || (s->prot & prot) != prot) {
+            break;
+         }
+         if ((cur = s->end) >= gva + len) {
+            ret = 0;
+            break;
+         }
+      }
+   }
+   mmaps_unlock();
+   return ret;
+}
+
+/*
+ * Translates guest range [gva, gva + len) to km address if all of it is mapped with at least
+ * 'prot' protection, returns NULL otherwise. Payload and brk memory is checked for layout only,
+ * mmaps for protection as well. The last mmap span found is cached in vcpu, so repeated I/O on the
+ * same buffers doesn't take mmaps lock until mmaps change.
+ */
+km_kma_t km_gva_range_to_kma(km_vcpu_t* vcpu, km_gva_t gva, size_t len, int prot)
+{
+   km_kma_t kma = km_gva_to_kma_range(gva, len);
+
+   if (kma == NULL || len == 0 || gva < machine.tbrk || gva >= GUEST_MEM_TOP_VA) {
+      return kma;
+   }
+   km_gva_span_t* last = &vcpu->last_span;
+   if (last->gen == km_guest_mmap_gen() && last->start <= gva && gva + len <= last->end &&
+       (last->prot & prot) == prot) {
+      return kma;
+   }
+   return km_mmap_span_find(gva, len, prot, last) == 0 ? kma : NULL;
+}
+
 /*
  * Determine is a GVA range is accessable at a particular
  * protection level.
@@ -1022,28 +1177,8 @@ int km_is_gva_accessable(km_gva_t gva, size_t size, int prot)
    }
 
    // Must be in mmap memory.
-   km_mmap_reg_t* reg = NULL;
-   int ret = 1;
-   mmaps_lock();
-   if ((reg = km_find_reg_nolock(gva)) == NULL) {
-      ret = 0;
-      goto done;
-   }
-   /*
-    * The entire requested range must be described by a single region.
-    * This is just laziness. Don't feel like checking against multiple
-    * regions until there is a compelling reason.
-    */
-   if (gva + size > reg->start + reg->size) {
-      km_errx(2, "range spanned mmap region gva:0x%lx size:0x%lx", gva, size);
-   }
-   if ((reg->protection & prot) != prot) {
-      ret = 0;
-      goto done;
-   }
-done:
-   mmaps_unlock();
-   return ret;
+   km_gva_span_t hit;
+   return km_mmap_span_find(gva, size, prot, &hit) == 0;
 }
 
 /*
@@ -1068,5 +1203,42 @@ void km_mmap_set_filename(km_gva_t base, km_gva_t limit, char* filename)
    }
    if (reg->filename == NULL) {
       reg->filename = strdup(filename);
+      machine.mmaps.gen++;
+   }
+}
+
+// Total size of guest mmaps (including PROT_NONE ones), for VmSize in /proc/self/stat and status
+size_t km_guest_mmap_size(void)
+{
+   km_mmap_reg_t* reg;
+   size_t size = 0;
+
+   mmaps_lock();
+   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
+      size += reg->size;
+   }
+   mmaps_unlock();
+   return size;
+}
+
+uint64_t km_guest_mmap_gen(void)
+{
+   return __atomic_load_n(&machine.mmaps.gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Calls 'fn' for each busy region in address order, with mmaps lock held so 'fn' must not call back
+ * into mmap functions. Returns the generation of the busy list that was walked.
+ */
+uint64_t km_guest_mmap_walk(void (*fn)(km_mmap_reg_t* reg, void* arg), void* arg)
+{
+   km_mmap_reg_t* reg;
+
+   mmaps_lock();
+   uint64_t gen = machine.mmaps.gen;
+   TAILQ_FOREACH (reg, &machine.mmaps.busy, link) {
+      fn(reg, arg);
    }
+   mmaps_unlock();
+   return gen;
 }
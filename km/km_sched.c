@@ -0,0 +1,675 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host CPU placement of km threads.
+ *
+ * --cpuset limits km to a set of host CPUs. It is applied to the main thread before any other
+ * thread is created, so all km threads inherit it. With --pin-vcpus each vcpu thread is also put on
+ * a single CPU of the set, round robin by vcpu id, when it starts a payload thread. Otherwise a new
+ * payload thread inherits the affinity of the thread that created it, like in Linux.
+ *
+ * --pin-km-threads puts the km threads that don't run the payload (the main thread once the payload
+ * started, timer, management and vcpu pool threads) on their own CPUs of the set, to keep them off
+ * the vcpus' CPUs. Payload threads started from those get the whole set.
+ *
+ * The payload sees fewer CPUs than that when there is a CPU bandwidth limit (CFS quota, cgroup
+ * cpu.max) or --cpus, the smaller of the two wins. Those are the first km_cpus_count CPUs of the
+ * set, km_cpus, with their host ids. CPUID topology, sched_getaffinity(),
+ * /sys/devices/system/cpu/online and /proc/cpuinfo all show just them, so runtimes that size their
+ * thread pools by CPU count don't oversize them on big hosts.
+ *
+ * Payload threads run on their vcpu threads, so payload sched_setaffinity() and sched_getaffinity()
+ * act on the vcpu thread. What the payload sets is what the host scheduler uses. Same for the
+ * scheduling policy, nice value and io priority. These are set with real syscalls on the vcpu
+ * thread's host tid, so the host does the permission checks (CAP_SYS_NICE, RLIMIT_RTPRIO,
+ * RLIMIT_NICE) for km like it would for a native process.
+ *
+ * vcpu threads are reused, a new payload thread would get whatever the last one left. So like
+ * clone() does on Linux the creating thread's policy, nice value and io priority are recorded in
+ * the vcpu, and the creating thread sets them on the parked vcpu thread before waking it up. Some
+ * of that may take privileges the creating thread doesn't have, like lowering the nice value or
+ * leaving SCHED_IDLE. Then the parked thread is retired and a new one created, which gets them
+ * from the creating thread the way a new thread does.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "km.h"
+#include "km_mem.h"
+#include "km_sched.h"
+#include "km_syscall.h"
+
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1   // linux/ioprio.h
+#endif
+
+int km_pin_vcpus = 0;        // --pin-vcpus
+static cpu_set_t km_cpuset;   // host CPUs km may use
+static int km_cpuset_given;   // --cpuset was there
+static cpu_set_t km_thread_cpus;            // --pin-km-threads
+static int km_thread_cpus_given;
+static __thread int km_sched_is_km_thread;   // km_sched_km_thread() was called on this thread
+static int km_cpus_given;     // --cpus
+static cpu_set_t km_cpus;     // CPUs the payload sees
+static int km_cpus_count;
+/*
+ * Bumped whenever the payload changes scheduling of any of its threads. A vcpu's sched_* are known
+ * to be what its thread has while its sched_gen is the current one, see km_sched_vcpu_inherit().
+ * Changes made from outside, like renice on the host, aren't seen.
+ */
+static uint64_t km_sched_gen = 1;
+
+// Parse a CPU list, like 0-3,8,10-11
+static int km_sched_parse_list(const char* list, cpu_set_t* set)
+{
+   const char* p = list;
+   char* ep;
+
+   CPU_ZERO(set);
+   do {
+      long first = strtol(p, &ep, 10);
+      long last = first;
+
+      if (ep == p) {
+         return -1;
+      }
+      if (*ep == '-') {
+         p = ep + 1;
+         last = strtol(p, &ep, 10);
+         if (ep == p) {
+            return -1;
+         }
+      }
+      if (first < 0 || last < first || last >= CPU_SETSIZE) {
+         return -1;
+      }
+      for (long cpu = first; cpu <= last; cpu++) {
+         CPU_SET(cpu, set);
+      }
+      p = ep + 1;
+   } while (*ep == ',');
+   if (*ep != '\0') {
+      return -1;
+   }
+   return 0;
+}
+
+// Parse --cpuset
+int km_sched_parse_cpuset(const char* list)
+{
+   if (km_sched_parse_list(list, &km_cpuset) < 0) {
+      return -1;
+   }
+   km_cpuset_given = 1;
+   return 0;
+}
+
+// Parse --pin-km-threads
+int km_sched_parse_km_threads(const char* list)
+{
+   if (km_sched_parse_list(list, &km_thread_cpus) < 0) {
+      return -1;
+   }
+   km_thread_cpus_given = 1;
+   return 0;
+}
+
+// Parse --cpus
+int km_sched_parse_cpus(const char* count)
+{
+   char* ep;
+
+   km_cpus_given = strtol(count, &ep, 10);
+   if (*count == '\0' || *ep != '\0' || km_cpus_given <= 0 || km_cpus_given > CPU_SETSIZE) {
+      return -1;
+   }
+   return 0;
+}
+
+// CPUs worth of quota in cgroup 'dir', 0 for no limit
+static int km_sched_quota_cpus(const char* dir, int v2)
+{
+   char name[PATH_MAX + 64];
+   long quota = -1;
+   long period = 0;
+   FILE* f;
+
+   if (v2 != 0) {
+      // "max 100000" or "<quota> <period>"
+      snprintf(name, sizeof(name), "%s/cpu.max", dir);
+      if ((f = fopen(name, "r")) != NULL) {
+         if (fscanf(f, "%ld %ld", &quota, &period) != 2) {
+            quota = -1;
+         }
+         fclose(f);
+      }
+   } else {
+      snprintf(name, sizeof(name), "%s/cpu.cfs_quota_us", dir);
+      if ((f = fopen(name, "r")) != NULL) {
+         if (fscanf(f, "%ld", &quota) != 1) {
+            quota = -1;
+         }
+         fclose(f);
+      }
+      snprintf(name, sizeof(name), "%s/cpu.cfs_period_us", dir);
+      if ((f = fopen(name, "r")) != NULL) {
+         if (fscanf(f, "%ld", &period) != 1) {
+            period = 0;
+         }
+         fclose(f);
+      }
+   }
+   if (quota <= 0 || period <= 0) {
+      return 0;
+   }
+   return MIN((quota + period - 1) / period, CPU_SETSIZE);
+}
+
+/*
+ * CPUs the cgroup CPU bandwidth limit allows km, 0 for no limit. The smallest quota of our cgroup
+ * and its parents, cgroup v2 or the v1 cpu controller. Without a cgroup namespace the path in
+ * /proc/self/cgroup may not be under /sys/fs/cgroup, then the parents we can see still count.
+ */
+static int km_sched_cgroup_cpus(void)
+{
+   char line[PATH_MAX];
+   char dir[PATH_MAX + 32];
+   int cpus = 0;
+   FILE* f;
+
+   if ((f = fopen("/proc/self/cgroup", "r")) == NULL) {
+      return 0;
+   }
+   // hierarchy-ID:controller-list:cgroup-path
+   while (fgets(line, sizeof(line), f) != NULL) {
+      char* controllers = strchr(line, ':');
+      char* path;
+      char* save;
+      int v2;
+
+      if (controllers == NULL || (path = strchr(++controllers, ':')) == NULL) {
+         continue;
+      }
+      *path++ = '\0';
+      path[strcspn(path, "\n")] = '\0';
+      if ((v2 = (*controllers == '\0')) == 0) {
+         char* c;
+         for (c = strtok_r(controllers, ",", &save); c != NULL; c = strtok_r(NULL, ",", &save)) {
+            if (strcmp(c, "cpu") == 0) {
+               break;
+            }
+         }
+         if (c == NULL) {
+            continue;
+         }
+      }
+      const char* root = v2 != 0 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/cpu";
+      size_t root_len = strlen(root);
+      snprintf(dir, sizeof(dir), "%s%s", root, strcmp(path, "/") == 0 ? "" : path);
+      while (1) {
+         int n = km_sched_quota_cpus(dir, v2);
+         if (n > 0 && (cpus == 0 || n < cpus)) {
+            cpus = n;
+         }
+         if (strlen(dir) <= root_len) {
+            break;
+         }
+         *strrchr(dir, '/') = '\0';
+      }
+   }
+   fclose(f);
+   return cpus;
+}
+
+// Called before km creates any threads
+void km_sched_init(void)
+{
+   int quota_cpus;
+
+   if (km_cpuset_given != 0 && sched_setaffinity(0, sizeof(km_cpuset), &km_cpuset) < 0) {
+      km_err(1, "Failed to run on --cpuset CPUs");
+   }
+   // The host may have taken some away, the cgroup cpuset for one
+   if (sched_getaffinity(0, sizeof(km_cpuset), &km_cpuset) < 0) {
+      km_err(1, "sched_getaffinity");
+   }
+   km_cpus_count = CPU_COUNT(&km_cpuset);
+   if ((quota_cpus = km_sched_cgroup_cpus()) > 0) {
+      km_cpus_count = MIN(km_cpus_count, quota_cpus);
+   }
+   if (km_cpus_given > 0) {
+      km_cpus_count = MIN(km_cpus_count, km_cpus_given);
+   }
+   if (km_thread_cpus_given != 0) {
+      CPU_AND(&km_thread_cpus, &km_thread_cpus, &km_cpuset);
+      if (CPU_COUNT(&km_thread_cpus) == 0) {
+         km_errx(1, "--pin-km-threads CPUs are not in the cpuset");
+      }
+   }
+   CPU_ZERO(&km_cpus);
+   for (int cpu = 0, n = 0; n < km_cpus_count; cpu++) {
+      if (CPU_ISSET(cpu, &km_cpuset)) {
+         CPU_SET(cpu, &km_cpus);
+         n++;
+      }
+   }
+   km_infox(KM_TRACE_SCHED,
+            "%d CPUs, cgroup quota %d, payload sees %d, pin vcpus %d, km threads on %d CPUs",
+            CPU_COUNT(&km_cpuset),
+            quota_cpus,
+            km_cpus_count,
+            km_pin_vcpus,
+            km_thread_cpus_given != 0 ? CPU_COUNT(&km_thread_cpus) : 0);
+}
+
+// Called on a km thread that doesn't run payload threads, see --pin-km-threads above
+void km_sched_km_thread(void)
+{
+   km_sched_is_km_thread = 1;
+   if (km_thread_cpus_given != 0 &&
+       sched_setaffinity(0, sizeof(km_thread_cpus), &km_thread_cpus) < 0) {
+      km_warn("Failed to pin km thread to --pin-km-threads CPUs");
+   }
+}
+
+// Number of CPUs the payload sees
+int km_sched_cpu_count(void)
+{
+   return km_cpus_count;
+}
+
+// Does the payload see host CPU 'cpu'
+int km_sched_cpu_visible(int cpu)
+{
+   return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &km_cpus);
+}
+
+static int km_sched_nth_cpu(int n)
+{
+   n %= km_cpus_count;
+   for (int cpu = 0;; cpu++) {
+      if (CPU_ISSET(cpu, &km_cpus) && n-- == 0) {
+         return cpu;
+      }
+   }
+}
+
+// What the payload gets to see of a host affinity mask
+static void km_sched_visible(cpu_set_t* set)
+{
+   CPU_AND(set, set, &km_cpus);
+   if (CPU_COUNT(set) == 0) {
+      *set = km_cpus;
+   }
+}
+
+/*
+ * vcpu is about to run a new payload thread. Called on the thread that created the payload thread,
+ * or on the km main thread for the first one.
+ */
+void km_sched_vcpu_start(km_vcpu_t* vcpu)
+{
+   cpu_set_t set;
+   int rc;
+
+   if (vcpu->vcpu_thread == 0) {
+      return;
+   }
+   if (km_pin_vcpus != 0) {
+      CPU_ZERO(&set);
+      CPU_SET(km_sched_nth_cpu(vcpu->vcpu_id), &set);
+   } else if (km_sched_is_km_thread != 0) {
+      set = km_cpuset;   // not the --pin-km-threads CPUs
+   } else if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+      return;
+   }
+   if ((rc = pthread_setaffinity_np(vcpu->vcpu_thread, sizeof(set), &set)) != 0) {
+      km_infox(KM_TRACE_SCHED, "vcpu %d: pthread_setaffinity_np error %d", vcpu->vcpu_id, rc);
+   }
+}
+
+// Payload thread for pid, 0 is the calling thread and the process pid is the main thread
+static km_vcpu_t* km_sched_target(km_vcpu_t* vcpu, pid_t pid)
+{
+   if (pid == 0) {
+      return vcpu;
+   }
+   if (pid == machine.pid) {
+      pid = 1;
+   }
+   return km_vcpu_fetch_by_tid(pid);
+}
+
+/*
+ * Host tid for a payload pid. Only our own threads, same as for affinity. A vcpu thread that was
+ * just created may not have got to record its tid in km_vcpu_run() yet, it will in a moment.
+ */
+static pid_t km_sched_host_tid(km_vcpu_t* vcpu, pid_t pid)
+{
+   km_vcpu_t* target;
+   pid_t tid;
+
+   if ((target = km_sched_target(vcpu, pid)) == NULL || target->vcpu_thread == 0) {
+      return -ESRCH;
+   }
+   while ((tid = __atomic_load_n(&target->vcpu_tid, __ATOMIC_ACQUIRE)) == 0) {
+      sched_yield();
+   }
+   return tid;
+}
+
+/*
+ * Creating a payload thread on vcpu. Called on the creating thread before the vcpu thread is let
+ * go, record what the new thread inherits. creator is the vcpu of the creating thread, or NULL for
+ * a km thread. Its sched_* are used instead of asking the host while km_sched_gen hasn't moved.
+ */
+void km_sched_vcpu_inherit(km_vcpu_t* vcpu, km_vcpu_t* creator)
+{
+   uint64_t gen = __atomic_load_n(&km_sched_gen, __ATOMIC_ACQUIRE);
+   struct sched_param param = {};
+
+   if (creator != NULL && creator->sched_gen == gen) {
+      vcpu->sched_policy = creator->sched_policy;
+      vcpu->sched_priority = creator->sched_priority;
+      vcpu->sched_nice = creator->sched_nice;
+      vcpu->sched_ioprio = creator->sched_ioprio;
+      vcpu->sched_gen = gen;
+      return;
+   }
+   vcpu->sched_policy = sched_getscheduler(0);
+   sched_getparam(0, &param);
+   vcpu->sched_priority = param.sched_priority;
+   vcpu->sched_nice = 20 - __syscall_2(SYS_getpriority, PRIO_PROCESS, 0);
+   vcpu->sched_ioprio = __syscall_2(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+   if (vcpu->sched_policy < 0 || vcpu->sched_ioprio < 0) {
+      vcpu->sched_gen = 0;
+      return;
+   }
+   vcpu->sched_gen = gen;   // a new thread is created with that
+   if ((vcpu->sched_policy & SCHED_RESET_ON_FORK) != 0) {
+      vcpu->sched_policy &= ~SCHED_RESET_ON_FORK;
+      if (vcpu->sched_policy == SCHED_FIFO || vcpu->sched_policy == SCHED_RR) {
+         vcpu->sched_policy = SCHED_OTHER;
+         vcpu->sched_priority = 0;
+      }
+      if (vcpu->sched_nice < 0) {
+         vcpu->sched_nice = 0;
+      }
+   } else if (creator != NULL) {
+      // that is what the creating thread has itself
+      creator->sched_policy = vcpu->sched_policy;
+      creator->sched_priority = vcpu->sched_priority;
+      creator->sched_nice = vcpu->sched_nice;
+      creator->sched_ioprio = vcpu->sched_ioprio;
+      creator->sched_gen = gen;
+   }
+}
+
+/*
+ * Reusing the parked thread of vcpu for a new payload thread. Called on the creating thread, in
+ * place of km_sched_vcpu_inherit(), set what the new thread inherits on the parked thread. Each one
+ * is tried on its own, none if the parked thread is known to have them already. Returns 0, or -1
+ * if any of them didn't take, the thread shouldn't be reused then.
+ */
+int km_sched_vcpu_reset(km_vcpu_t* vcpu, km_vcpu_t* creator)
+{
+   uint64_t gen = __atomic_load_n(&km_sched_gen, __ATOMIC_ACQUIRE);
+   int policy = vcpu->sched_policy;
+   int priority = vcpu->sched_priority;
+   int nice = vcpu->sched_nice;
+   int ioprio = vcpu->sched_ioprio;
+   int known = vcpu->sched_gen == gen;   // the parked thread has the above
+   struct sched_param param;
+   uint64_t told;
+   pid_t tid;
+   int rc = 0;
+
+   km_sched_vcpu_inherit(vcpu, creator);
+   if (vcpu->sched_policy < 0) {
+      return 0;   // km_sched_vcpu_inherit() couldn't tell
+   }
+   told = vcpu->sched_gen;   // 0 if ioprio couldn't be told
+   vcpu->sched_gen = 0;      // until the parked thread has them
+   if (told != 0 && known != 0 && policy == vcpu->sched_policy &&
+       priority == vcpu->sched_priority && nice == vcpu->sched_nice &&
+       ioprio == vcpu->sched_ioprio) {
+      vcpu->sched_gen = gen;
+      return 0;
+   }
+   // a pool thread may not have got that far yet
+   while ((tid = __atomic_load_n(&vcpu->vcpu_tid, __ATOMIC_ACQUIRE)) == 0) {
+      sched_yield();
+   }
+   param.sched_priority = vcpu->sched_priority;
+   if (sched_setscheduler(tid, vcpu->sched_policy, &param) < 0) {
+      rc = -1;
+   }
+   if (setpriority(PRIO_PROCESS, tid, vcpu->sched_nice) < 0) {
+      rc = -1;
+   }
+   if (vcpu->sched_ioprio >= 0 &&
+       __syscall_3(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, vcpu->sched_ioprio) != 0) {
+      rc = -1;
+   }
+   if (rc != 0) {
+      km_infox(KM_TRACE_SCHED,
+               "vcpu %d: can't reset to policy %d nice %d ioprio 0x%x",
+               vcpu->vcpu_id,
+               vcpu->sched_policy,
+               vcpu->sched_nice,
+               vcpu->sched_ioprio);
+   } else if (told != 0) {
+      vcpu->sched_gen = gen;
+   }
+   return rc;
+}
+
+// rc of a payload syscall, a setter if set. Bump km_sched_gen if it did something.
+static uint64_t km_sched_changed(int set, uint64_t rc)
+{
+   if (set != 0 && (int64_t)rc >= 0) {
+      __atomic_add_fetch(&km_sched_gen, 1, __ATOMIC_RELEASE);
+   }
+   return rc;
+}
+
+/*
+ * sched_setscheduler(), sched_getscheduler(), sched_setparam(), sched_getparam() and
+ * sched_rr_get_interval(), all take pid first. a2 and a3 are already host addresses.
+ */
+uint64_t km_sched_pid_syscall(km_vcpu_t* vcpu, int hc, pid_t pid, uint64_t a2, uint64_t a3)
+{
+   pid_t tid;
+
+   if (pid < 0) {
+      return -EINVAL;
+   }
+   if ((tid = km_sched_host_tid(vcpu, pid)) < 0) {
+      return tid;
+   }
+   return km_sched_changed(hc == SYS_sched_setscheduler || hc == SYS_sched_setparam,
+                           __syscall_3(hc, tid, a2, a3));
+}
+
+/*
+ * getpriority(), setpriority(), ioprio_get() and ioprio_set(). For a process, which is a thread on
+ * Linux, who is a payload pid. Process groups and users are the host's, pass them on.
+ */
+uint64_t km_sched_prio_syscall(km_vcpu_t* vcpu, int hc, int which, int who, uint64_t a3)
+{
+   int process = IOPRIO_WHO_PROCESS;
+
+   if (hc == SYS_getpriority || hc == SYS_setpriority) {
+      process = PRIO_PROCESS;
+   }
+   if (which == process && (who = km_sched_host_tid(vcpu, who)) < 0) {
+      return who;
+   }
+   return km_sched_changed(hc == SYS_setpriority || hc == SYS_ioprio_set,
+                           __syscall_3(hc, which, who, a3));
+}
+
+uint64_t km_sched_getaffinity(km_vcpu_t* vcpu, pid_t pid, size_t size, km_gva_t mask)
+{
+   km_vcpu_t* target;
+   cpu_set_t set;
+   void* kma;
+   int len;
+   int rc;
+
+   if ((target = km_sched_target(vcpu, pid)) == NULL) {
+      return -ESRCH;
+   }
+   // The host checks size and tells how many bytes of mask it has
+   if ((len = __syscall_3(SYS_sched_getaffinity, 0, MIN(size, sizeof(set)), (uintptr_t)&set)) < 0) {
+      return len;
+   }
+   if ((kma = km_gva_range_to_kma(vcpu, mask, len, PROT_WRITE)) == NULL) {
+      return -EFAULT;
+   }
+   if ((rc = pthread_getaffinity_np(target->vcpu_thread, sizeof(set), &set)) != 0) {
+      return -rc;
+   }
+   km_sched_visible(&set);
+   memcpy(kma, &set, len);
+   return len;
+}
+
+uint64_t km_sched_setaffinity(km_vcpu_t* vcpu, pid_t pid, size_t size, km_gva_t mask)
+{
+   km_vcpu_t* target;
+   cpu_set_t set;
+   void* kma;
+   int rc;
+
+   if ((target = km_sched_target(vcpu, pid)) == NULL) {
+      return -ESRCH;
+   }
+   size = MIN(size, sizeof(set));
+   if ((kma = km_gva_range_to_kma(vcpu, mask, size, PROT_READ)) == NULL) {
+      return -EFAULT;
+   }
+   CPU_ZERO(&set);
+   memcpy(&set, kma, size);
+   CPU_AND(&set, &set, &km_cpus);
+   if (CPU_COUNT(&set) == 0) {
+      return -EINVAL;
+   }
+   if ((rc = pthread_setaffinity_np(target->vcpu_thread, sizeof(set), &set)) != 0) {
+      return -rc;
+   }
+   km_infox(KM_TRACE_SCHED, "vcpu %d: %d CPUs", target->vcpu_id, CPU_COUNT(&set));
+   return 0;
+}
+
+static size_t km_sched_append(char* buf, size_t size, size_t len, const char* fmt, ...)
+{
+   va_list ap;
+
+   if (len >= size) {
+      return len;
+   }
+   va_start(ap, fmt);
+   len += vsnprintf(buf + len, size - len, fmt, ap);
+   va_end(ap);
+   return len;
+}
+
+// CPU list like 0-3,8
+static size_t km_sched_append_list(char* buf, size_t size, size_t len, const cpu_set_t* set)
+{
+   const char* sep = "";
+
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, set) == 0) {
+         continue;
+      }
+      int last = cpu;
+      while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+         last++;
+      }
+      if (last == cpu) {
+         len = km_sched_append(buf, size, len, "%s%d", sep, cpu);
+      } else {
+         len = km_sched_append(buf, size, len, "%s%d-%d", sep, cpu, last);
+      }
+      sep = ",";
+      cpu = last;
+   }
+   return len;
+}
+
+// The CPUs the payload sees as a line for /sys/devices/system/cpu/online, returns the length
+int km_sched_cpu_list(char* buf, size_t size)
+{
+   return km_sched_append(buf, size, km_sched_append_list(buf, size, 0, &km_cpus), "\n");
+}
+
+/*
+ * Cpus_allowed: and Cpus_allowed_list: lines of /proc/self/status, which are about the payload main
+ * thread. host_line is the line for km, it tells how wide the mask is. Returns the length, or 0 to
+ * keep host_line.
+ */
+int km_sched_status_line(char* buf, size_t size, const char* host_line)
+{
+   km_vcpu_t* vcpu = km_vcpu_fetch_by_tid(1);
+   cpu_set_t set;
+   size_t len = 0;
+
+   if (vcpu == NULL || vcpu->vcpu_thread == 0 ||
+       pthread_getaffinity_np(vcpu->vcpu_thread, sizeof(set), &set) != 0) {
+      return 0;
+   }
+   km_sched_visible(&set);
+   if (strncmp(host_line, "Cpus_allowed:", 13) == 0) {
+      // comma separated 32 bit words, most significant first
+      const char* mask = host_line + 13 + strspn(host_line + 13, "\t ");
+      int width = strcspn(mask, ",\n");
+      int words = 1;
+
+      for (const char* c = mask; *c != '\n' && *c != '\0'; c++) {
+         words += (*c == ',');
+      }
+      len = km_sched_append(buf, size, len, "Cpus_allowed:\t");
+      for (int w = words - 1; w >= 0; w--) {
+         uint32_t bits = 0;
+         for (int b = 0; b < 32 && w * 32 + b < CPU_SETSIZE; b++) {
+            bits |= CPU_ISSET(w * 32 + b, &set) ? 1U << b : 0;
+         }
+         if (w == words - 1) {
+            len = km_sched_append(buf, size, len, "%0*x", width, bits);
+         } else {
+            len = km_sched_append(buf, size, len, ",%08x", bits);
+         }
+      }
+   } else if (strncmp(host_line, "Cpus_allowed_list:", 18) == 0) {
+      len = km_sched_append(buf, size, len, "Cpus_allowed_list:\t");
+      len = km_sched_append_list(buf, size, len, &set);
+   } else {
+      return 0;
+   }
+   return km_sched_append(buf, size, len, "\n");
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KM_SCHED_H__
+#define __KM_SCHED_H__
+
+#include "km.h"
+
+extern int km_pin_vcpus;
+
+int km_sched_parse_cpuset(const char* list);
+int km_sched_parse_cpus(const char* count);
+int km_sched_parse_km_threads(const char* list);
+void km_sched_init(void);
+void km_sched_km_thread(void);
+int km_sched_cpu_count(void);
+int km_sched_cpu_visible(int cpu);
+int km_sched_cpu_list(char* buf, size_t size);
+void km_sched_vcpu_start(km_vcpu_t* vcpu);
+void km_sched_vcpu_inherit(km_vcpu_t* vcpu, km_vcpu_t* creator);
+int km_sched_vcpu_reset(km_vcpu_t* vcpu, km_vcpu_t* creator);
+uint64_t km_sched_pid_syscall(km_vcpu_t* vcpu, int hc, pid_t pid, uint64_t a2, uint64_t a3);
+uint64_t km_sched_prio_syscall(km_vcpu_t* vcpu, int hc, int which, int who, uint64_t a3);
+// int sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t *mask);
+uint64_t km_sched_getaffinity(km_vcpu_t* vcpu, pid_t pid, size_t size, km_gva_t mask);
+// int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask);
+uint64_t km_sched_setaffinity(km_vcpu_t* vcpu, pid_t pid, size_t size, km_gva_t mask);
+int km_sched_status_line(char* buf, size_t size, const char* host_line);
+
+#endif /* !defined(__KM_SCHED_H__) */
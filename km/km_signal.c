@@ -18,6 +18,10 @@
  * Signal-related wrappers for KM threads/KVM vcpu runs.
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -36,6 +40,7 @@
 #include "km_coredump.h"
 #include "km_filesys.h"
 #include "km_fork.h"
+#include "km_gdb.h"
 #include "km_guest.h"
 #include "km_hcalls.h"
 #include "km_kkm.h"
@@ -151,6 +156,8 @@ void km_signal_fini(void)
 {
 }
 
+static void km_signalfd_notify_nolock(int signo);
+
 static inline void enqueue_signal_nolock(km_signal_list_t* slist, siginfo_t* info)
 {
    km_signal_t* sig;
@@ -161,6 +168,7 @@ static inline void enqueue_signal_nolock(km_signal_list_t* slist, siginfo_t* inf
    TAILQ_REMOVE(&machine.sigfree.head, sig, link);
    sig->info = *info;
    TAILQ_INSERT_TAIL(&slist->head, sig, link);
+   km_signalfd_notify_nolock(info->si_signo);
 }
 
 static inline void enqueue_signal(km_signal_list_t* slist, siginfo_t* info)
@@ -250,10 +258,22 @@ static int km_dequeue_signal_nolock(km_vcpu_t* vcpu, siginfo_t* info)
    return 0;
 }
 
+static int km_signal_ready_nolock(km_vcpu_t* vcpu);
+
+/*
+ * Called by the vcpu thread before going back to the guest, so this also retires the kick that
+ * brought us here. Anything posted from now on kicks again. If there is more than the one signal
+ * we return, come straight back from the next KVM_RUN to deliver it too, the handler frames nest.
+ */
 int km_dequeue_signal(km_vcpu_t* vcpu, siginfo_t* info)
 {
    km_signal_lock();
+   vcpu->kick_pending = 0;
    int rv = km_dequeue_signal_nolock(vcpu, info);
+   if (rv != 0 && km_signal_ready_nolock(vcpu) != 0) {
+      vcpu->kick_pending = 1;
+      vcpu->cpu_run->immediate_exit = 1;
+   }
    km_signal_unlock();
    return rv;
 }
@@ -303,43 +323,66 @@ int km_signal_ready(km_vcpu_t* vcpu)
 
 /*
  * Determine whether this signal already pending.
+ * The caller must hold km_signal_lock()
  */
-static inline int signal_pending(km_vcpu_t* vcpu, siginfo_t* info)
+static inline int signal_pending_nolock(km_vcpu_t* vcpu, siginfo_t* info)
 {
    km_signal_t* sig;
 
-   km_signal_lock();
    if (vcpu != NULL) {
       TAILQ_FOREACH (sig, &vcpu->sigpending.head, link) {
          if (sig->info.si_signo == info->si_signo) {
-            km_signal_unlock();
             return 1;
          }
       }
    }
    TAILQ_FOREACH (sig, &machine.sigpending.head, link) {
       if (sig->info.si_signo == info->si_signo) {
-         km_signal_unlock();
          return 1;
       }
    }
-   km_signal_unlock();
    return 0;
 }
 
+/*
+ * Is there a signal from POSIX timer 'timerid' still queued? Timer expirations while it is are
+ * counted as overruns.
+ */
+int km_signal_timer_queued(int timerid)
+{
+   km_signal_t* sig;
+   km_vcpu_t* vcpu;
+   int ret = 0;
+
+   km_signal_lock();
+   TAILQ_FOREACH (sig, &machine.sigpending.head, link) {
+      if (sig->info.si_code == SI_TIMER && sig->info.si_timerid == timerid) {
+         ret = 1;
+      }
+   }
+   for (int i = 0; ret == 0 && i < KVM_MAX_VCPUS && (vcpu = machine.vm_vcpus[i]) != NULL; i++) {
+      TAILQ_FOREACH (sig, &vcpu->sigpending.head, link) {
+         if (sig->info.si_code == SI_TIMER && sig->info.si_timerid == timerid) {
+            ret = 1;
+         }
+      }
+   }
+   km_signal_unlock();
+   return ret;
+}
+
 /*
  * Look for a vcpu blocked in sigsuspend() that is waiting for the passed signal. Enqueue the
  * signal on the first found thread's pending queue and wake that thread.
+ * The caller must hold km_signal_lock()
  * Returns:
  *   0 - no thread was woken
  *   1 - we found a thread to take the signal and woke the thread
  */
-int km_wakeup_suspended_thread(siginfo_t* info)
+static int km_wakeup_suspended_thread_nolock(siginfo_t* info)
 {
    km_vcpu_t* vcpu;
-   int wake_count = 0;
 
-   km_signal_lock();
    TAILQ_FOREACH (vcpu, &km_signal_wait_queue, signal_link) {
       if (km_sigismember(&vcpu->sigmask, info->si_signo) ==
           0) {   // this signal is not blocked on this vcpu
@@ -350,68 +393,108 @@ int km_wakeup_suspended_thread(siginfo_t* info)
          TAILQ_REMOVE(&km_signal_wait_queue, vcpu, signal_link);
          enqueue_signal_nolock(&vcpu->sigpending, info);
          km_cond_signal(&vcpu->signal_wait_cv);
-         wake_count++;
-         break;
+         return 1;
       }
    }
-   km_signal_unlock();
-
-   return wake_count;
+   return 0;
 }
 
-static int km_can_interrupt(km_vcpu_t* vcpu, void* data)
+/*
+ * Pick the vcpu to take process directed signal signo, or NULL if no kick is needed. Only vcpus
+ * not blocking signo count. If one of them is running guest code with a kick on the way already it
+ * will take the signal. Next is one blocked in epoll_pwait(), which we can interrupt without a KVM
+ * exit. Then one running guest code, as a vcpu in any other hypercall could be blocked there for
+ * good. Interrupting such hypercall would get the payload EINTR where Linux restarts, so if that's
+ * all there is, the signal waits for one of them to come back.
+ * The caller must hold km_signal_lock()
+ */
+static km_vcpu_t* km_signal_target_nolock(int signo)
 {
-   int signo = *(int*)data;
-   if (signo >= 0 && km_sigismember(&vcpu->sigmask, signo) == 0 && vcpu->state == HYPERCALL &&
-       vcpu->hypercall == SYS_epoll_pwait) {
-      km_pkill(vcpu, KM_SIGVCPUSTOP);
-      km_infox(KM_TRACE_SIGNALS, "interrupting vcpu %d to deliver signal %d", vcpu->vcpu_id, signo);
-      *(int*)data = -1;   // we only want to interrupt one payload thread
+   km_vcpu_t* vcpu;
+   km_vcpu_t* in_guest = NULL;
+
+   for (int i = 0; i < KVM_MAX_VCPUS && (vcpu = machine.vm_vcpus[i]) != NULL; i++) {
+      if (vcpu->state == PARKED_IDLE || km_sigismember(&vcpu->sigmask, signo) != 0) {
+         continue;
+      }
+      if (vcpu->kick_pending != 0 && vcpu->state == IN_GUEST) {
+         return NULL;
+      }
+      if (vcpu->state == HYPERCALL && vcpu->hypercall == SYS_epoll_pwait) {
+         return vcpu;
+      }
+      if (vcpu->state == IN_GUEST && in_guest == NULL) {
+         in_guest = vcpu;
+      }
    }
-   return 0;
+   return in_guest;
 }
 
 /*
- * Find a thread that is not blocking signo and is in a hypercall that can be interrupted.
- * If we find a candidate, then interrupt the system call.
+ * Get vcpu to look at its pending signals, unless a kick is on the way already. immediate_exit
+ * covers KM_SIGVCPUSTOP arriving before the vcpu thread gets into KVM_RUN. A vcpu posting to
+ * itself is in KM and checks before going back to the guest.
+ * Only a vcpu in the guest is sure to see a pending kick. One in a hypercall may have taken it
+ * just before blocking in the host, so it is kicked again.
+ * The caller must hold km_signal_lock()
  */
-static void km_interrupt_thread(int signo)
+static void km_signal_kick_nolock(km_vcpu_t* vcpu)
 {
-   km_vcpu_apply_all(km_can_interrupt, (void*)&signo);
+   if ((vcpu->kick_pending != 0 && vcpu->state == IN_GUEST) ||
+       pthread_equal(vcpu->vcpu_thread, pthread_self()) != 0) {
+      return;
+   }
+   vcpu->kick_pending = 1;
+   vcpu->cpu_run->immediate_exit = 1;
+   km_pkill(vcpu, KM_SIGVCPUSTOP);
+   km_infox(KM_TRACE_SIGNALS, "kicked vcpu %d", vcpu->vcpu_id);
 }
 
+/*
+ * Queue a signal for vcpu, or for the process if vcpu is NULL, and kick a vcpu that can take it.
+ * All of it is done in one go under km_signal_lock().
+ */
 void km_post_signal(km_vcpu_t* vcpu, siginfo_t* info)
 {
+   km_vcpu_t* target = vcpu;
+
+   km_signal_lock();
    /*
     * non-RT signals are consolidated in while pending.
     */
-   if (info->si_signo < SIGRTMIN && signal_pending(vcpu, info)) {
+   if (info->si_signo < SIGRTMIN && signal_pending_nolock(vcpu, info) != 0) {
+      km_signal_unlock();
       km_infox(KM_TRACE_VCPU, "discarding already pending signal %d", info->si_signo);
       return;
    }
    // See if this signal can wake a thread in sigsuspend().
-   if (km_wakeup_suspended_thread(info) > 0) {
+   if (km_wakeup_suspended_thread_nolock(info) > 0) {
+      km_signal_unlock();
       return;
    }
-   if (vcpu == 0) {
+   if (vcpu == NULL) {
       km_infox(KM_TRACE_VCPU,
                "enqueuing signal %d, si_code 0x%x, si_status 0x%x to VM",
                info->si_signo,
                info->si_code,
                info->si_status);
-      enqueue_signal(&machine.sigpending, info);
-      km_interrupt_thread(info->si_signo);
-      return;
+      enqueue_signal_nolock(&machine.sigpending, info);
+      target = km_signal_target_nolock(info->si_signo);
+   } else {
+      km_infox(KM_TRACE_VCPU,
+               "enqueuing signal %d to vcpu %d, sigmask 0x%lx",
+               info->si_signo,
+               vcpu->vcpu_id,
+               vcpu->sigmask);
+      enqueue_signal_nolock(&vcpu->sigpending, info);
+      if (km_sigismember(&vcpu->sigmask, info->si_signo) != 0) {
+         target = NULL;
+      }
    }
-   km_infox(KM_TRACE_VCPU,
-            "enqueuing signal %d to vcpu %d, sigmask 0x%lx",
-            info->si_signo,
-            vcpu->vcpu_id,
-            vcpu->sigmask);
-   enqueue_signal(&vcpu->sigpending, info);
-   if (km_sigismember(&vcpu->sigmask, info->si_signo) == 0) {
-      km_pkill(vcpu, KM_SIGVCPUSTOP);
+   if (target != NULL) {
+      km_signal_kick_nolock(target);
    }
+   km_signal_unlock();
 }
 
 /*
@@ -424,16 +507,47 @@ typedef struct km_signal_frame {
    siginfo_t info;                // Passed to guest signal handler
    uint64_t rflags;               // saved rflags
    struct km_hc_args* hc_argsp;   // gva of the args to the hypercall that may be in progress
+   km_gva_t fpstate;              // FP state saved by the guest, 0 if saved by KM
    /*
     * Followed by monitor dependent state.
     * For KVM this depends on the value of KVM_CAP_XSAVE.
     *   struct kvm_xsave if XSAVE is enabled
     *   struct kvm_fpu otherwise
     * For KKM this is km_signal_kkm_frame_t.
+    * When the guest saves FP state this is the 64 byte aligned XSAVE area at fpstate instead.
     */
 } km_signal_frame_t;
 
 #define RED_ZONE (128)
+#define XSAVE_ALIGN (64)
+#define XSAVE_HEADER_OFFSET (512)
+#define XSAVE_HEADER_SIZE (64)
+#define SIGRESTORE_SCRATCH (4 * sizeof(uint64_t))   // see __km_sigrestore and __km_rt_sigreturn
+
+// km_guest.asmh has these for __km_rt_sigreturn
+static_assert(offsetof(km_signal_frame_t, ucontext.uc_mcontext.gregs[REG_R8]) == 48,
+              "sf_r8 in km_guest.asmh");
+static_assert(offsetof(km_signal_frame_t, ucontext.uc_mcontext.gregs[REG_RIP]) == 176,
+              "sf_rip in km_guest.asmh");
+static_assert(offsetof(km_signal_frame_t, rflags) == 1104, "sf_rflags in km_guest.asmh");
+static_assert(offsetof(km_signal_frame_t, fpstate) == 1120, "sf_fpstate in km_guest.asmh");
+
+static uint8_t* const km_sigentry[] = {
+    [KM_GUEST_XSAVE] = &__km_sigentry_xsave,
+    [KM_GUEST_XSAVEC] = &__km_sigentry_xsavec,
+};
+
+/*
+ * Does the guest save and restore FP state for signal handlers itself? That saves KVM_GET_XSAVE and
+ * KVM_SET_XSAVE on every signal. Not with gdb attached, so it sees the handler called directly.
+ */
+static inline int km_signal_guest_fp(void)
+{
+   if (machine.vm_type != VM_TYPE_KVM || km_gdb_client_is_attached() != 0) {
+      return 0;
+   }
+   return machine.vmtype_u.kvm.guest_xsave;
+}
 
 static inline void save_signal_context(km_vcpu_t* vcpu, km_signal_frame_t* frame)
 {
@@ -460,6 +574,14 @@ static inline void save_signal_context(km_vcpu_t* vcpu, km_signal_frame_t* frame
    memcpy(&frame->ucontext.uc_sigmask, &vcpu->sigmask, sizeof(vcpu->sigmask));
    frame->hc_argsp = km_hcargs[HC_ARGS_INDEX(vcpu->vcpu_id)];
 
+   if (frame->fpstate != 0) {
+      // XRSTOR wants XCOMP_BV and the reserved part of the header zeroed, XSAVE doesn't do that
+      char* xsave = km_gva_to_kma_nocheck(frame->fpstate);
+      memset(xsave + XSAVE_HEADER_OFFSET, 0, XSAVE_HEADER_SIZE);
+      uc->uc_mcontext.fpregs = (fpregset_t)frame->fpstate;   // legacy area is the fxsave image
+      return;
+   }
+   uc->uc_mcontext.fpregs = NULL;
    void* fp_frame = (frame + 1);
    if (km_vmdriver_save_fpstate(vcpu, fp_frame, km_vmdriver_fp_format(vcpu), 0) < 0) {
       // TODO: SIGFPE?
@@ -467,6 +589,13 @@ static inline void save_signal_context(km_vcpu_t* vcpu, km_signal_frame_t* frame
    }
 }
 
+// The part of the signal context that lives in KM, the guest may restore the registers itself
+static inline void restore_signal_state(km_vcpu_t* vcpu, km_signal_frame_t* frame)
+{
+   memcpy(&vcpu->sigmask, &frame->ucontext.uc_sigmask, sizeof(vcpu->sigmask));
+   km_hcargs[HC_ARGS_INDEX(vcpu->vcpu_id)] = frame->hc_argsp;
+}
+
 static inline void restore_signal_context(km_vcpu_t* vcpu, km_signal_frame_t* frame)
 {
    ucontext_t* uc = &frame->ucontext;
@@ -489,9 +618,11 @@ static inline void restore_signal_context(km_vcpu_t* vcpu, km_signal_frame_t* fr
    vcpu->regs.rip = uc->uc_mcontext.gregs[REG_RIP];
 
    vcpu->regs.rflags = frame->rflags;
-   memcpy(&vcpu->sigmask, &frame->ucontext.uc_sigmask, sizeof(vcpu->sigmask));
-   km_hcargs[HC_ARGS_INDEX(vcpu->vcpu_id)] = frame->hc_argsp;
+   restore_signal_state(vcpu, frame);
 
+   if (frame->fpstate != 0) {
+      return;   // __km_sigrestore does it
+   }
    void* fp_frame = (frame + 1);
    if (km_vmdriver_restore_fpstate(vcpu, fp_frame, km_vmdriver_fp_format(vcpu)) < 0) {
       // TODO: SIGFPE?
@@ -522,11 +653,17 @@ static inline void do_guest_handler(km_vcpu_t* vcpu, siginfo_t* info, km_sigacti
    }
    // Calculate size of saved floating point state (depends on VM driver)
    size_t fstate_size = km_vmdriver_fpstate_size();
+   int guest_fp = km_signal_guest_fp();
+   if (guest_fp != 0) {
+      fstate_size += XSAVE_ALIGN + SIGRESTORE_SCRATCH;
+   }
    // Align stack to 16 bytes per X86_64 ABI.
    sframe_gva = rounddown(sframe_gva - (sizeof(km_signal_frame_t) + fstate_size), 16) - 8;
    km_signal_frame_t* frame = km_gva_to_kma_nocheck(sframe_gva);
 
    frame->info = *info;
+   frame->fpstate =
+       guest_fp != 0 ? roundup(sframe_gva + sizeof(km_signal_frame_t), XSAVE_ALIGN) : 0;
    save_signal_context(vcpu, frame);
    if ((act->sa_flags & SA_RESTORER) != 0) {
       frame->return_addr = act->restorer;
@@ -544,6 +681,13 @@ static inline void do_guest_handler(km_vcpu_t* vcpu, siginfo_t* info, km_sigacti
    vcpu->regs.rdi = info->si_signo;
    vcpu->regs.rsi = sframe_gva + offsetof(km_signal_frame_t, info);
    vcpu->regs.rdx = sframe_gva + offsetof(km_signal_frame_t, ucontext);
+   if (frame->fpstate != 0) {
+      // see __km_sigentry_* in km_guest_asmcode.s
+      vcpu->regs.rip = km_guest_kma_to_gva(km_sigentry[guest_fp]);
+      vcpu->regs.rax = act->handler;
+      vcpu->regs.rbx = frame->fpstate;
+      vcpu->regs.r11 = vcpu->regs.rdx;
+   }
 
    km_write_registers(vcpu);
 
@@ -646,8 +790,62 @@ void km_deliver_signal_from_gdb(km_vcpu_t* vcpu, siginfo_t* info)
    }
 }
 
-void km_rt_sigreturn(km_vcpu_t* vcpu)
+/*
+ * FP state was saved by the guest, so return through __km_sigrestore to have the guest restore it.
+ * The registers it needs for that go on the stack we are returning to, right below the red zone.
+ * Returns -1 if that stack isn't there.
+ */
+static int km_signal_guest_fp_return(km_vcpu_t* vcpu, km_gva_t fpstate)
+{
+   km_gva_t sp = vcpu->regs.rsp - RED_ZONE - SIGRESTORE_SCRATCH;
+   uint64_t saved[] = {vcpu->regs.rbx, vcpu->regs.rdx, vcpu->regs.rax, vcpu->regs.rip};
+
+   for (int i = 0; i < sizeof(saved) / sizeof(saved[0]); i++) {
+      uint64_t* kma = km_gva_to_kma(sp + i * sizeof(uint64_t));
+      if (kma == NULL) {
+         return -1;
+      }
+      *kma = saved[i];
+   }
+   vcpu->regs.rsp = sp;
+   vcpu->regs.rip = km_guest_kma_to_gva(&__km_sigrestore);
+   vcpu->regs.rbx = fpstate;
+   vcpu->regs.rax = vcpu->regs.rdx = 0xffffffff;
+   return 0;
+}
+
+/*
+ * Frames with FP state saved by the guest come here through __km_rt_sigreturn, which passes the
+ * frame right above the hypercall args in arg1 and restores the registers from the frame after
+ * the hypercall. Returns the frame gva in that case, 0 otherwise.
+ */
+static km_gva_t km_signal_guest_frame(km_vcpu_t* vcpu, km_hc_args_t* arg)
+{
+   km_gva_t hc_args = (km_gva_t)km_hcargs[HC_ARGS_INDEX(vcpu->vcpu_id)];
+   km_signal_frame_t* frame;
+
+   // KKM syscall entry puts more on the stack, and never has guest saved FP state anyway
+   if (machine.vm_type != VM_TYPE_KVM ||
+       arg->arg1 != hc_args + sizeof(km_hc_args_t) - sizeof(km_gva_t) ||
+       (frame = km_gva_to_kma(arg->arg1)) == NULL || frame->fpstate == 0) {
+      return 0;
+   }
+   return arg->arg1;
+}
+
+void km_rt_sigreturn(km_vcpu_t* vcpu, km_hc_args_t* arg)
 {
+   km_gva_t frame_gva = km_signal_guest_frame(vcpu, arg);
+   if (frame_gva != 0) {
+      km_signal_frame_t* frame = km_gva_to_kma_nocheck(frame_gva);
+      if (km_on_altstack(vcpu, frame_gva) == 1 &&
+          km_on_altstack(vcpu, frame->ucontext.uc_mcontext.gregs[REG_RSP]) == 0) {
+         vcpu->sigaltstack.ss_flags = 0;
+      }
+      restore_signal_state(vcpu, frame);
+      km_infox(KM_TRACE_SIGNALS, "Return in guest: frame 0x%lx", frame_gva);
+      return;
+   }
    km_read_registers(vcpu);
    /*
     * The guest's signal restorer makes a syscall which goes into the KM syscall handler.
@@ -665,6 +863,11 @@ void km_rt_sigreturn(km_vcpu_t* vcpu)
       vcpu->sigaltstack.ss_flags = 0;
    }
    restore_signal_context(vcpu, frame);
+   if (frame->fpstate != 0 && km_signal_guest_fp_return(vcpu, frame->fpstate) != 0) {
+      siginfo_t info = {.si_signo = SIGSEGV, .si_code = SI_KERNEL};
+      km_warnx("bad signal frame, RSP 0x%llx", vcpu->regs.rsp);
+      km_post_signal(vcpu, &info);
+   }
    km_write_registers(vcpu);
    km_info(KM_TRACE_SIGNALS, "Return: RIP 0x%0llx RSP 0x%0llx", vcpu->regs.rip, vcpu->regs.rsp);
 }
@@ -987,6 +1190,244 @@ km_rt_sigtimedwait(km_vcpu_t* vcpu, km_sigset_t* set, siginfo_t* info, struct ti
    return rv;
 }
 
+/*
+ * signalfd.
+ *
+ * Guest signals are queued by km and never reach the host, so a guest signalfd is backed by a host
+ * eventfd that is only used for readiness, so poll/select/epoll on the guest fd work as is. The
+ * eventfd is bumped when a signal in the signalfd mask gets queued, and reset when read() takes
+ * the last one of those from km queues. Guest fd and host eventfd have the same number.
+ * dup() of a signalfd gets its own entry, sharing the mask with the original.
+ */
+typedef struct km_signalfd_mask {
+   int refcnt;   // signalfd entries sharing the mask
+   km_sigset_t mask;
+} km_signalfd_mask_t;
+
+typedef struct km_signalfd {
+   TAILQ_ENTRY(km_signalfd) link;
+   int fd;
+   km_signalfd_mask_t* shared;
+} km_signalfd_t;
+
+static TAILQ_HEAD(km_signalfd_list, km_signalfd)
+    km_signalfds = TAILQ_HEAD_INITIALIZER(km_signalfds);
+
+static void km_signalfd_notify_nolock(int signo)
+{
+   km_signalfd_t* sfd;
+   uint64_t one = 1;
+
+   // dups bump the same host eventfd more than once, which is harmless
+   TAILQ_FOREACH (sfd, &km_signalfds, link) {
+      if (km_sigismember(&sfd->shared->mask, signo) != 0 && write(sfd->fd, &one, sizeof(one)) < 0) {
+         km_warn("signalfd %d notify", sfd->fd);
+      }
+   }
+}
+
+static km_signalfd_t* km_signalfd_find_nolock(int fd)
+{
+   km_signalfd_t* sfd;
+
+   TAILQ_FOREACH (sfd, &km_signalfds, link) {
+      if (sfd->fd == fd) {
+         return sfd;
+      }
+   }
+   return NULL;
+}
+
+static int km_signalfd_pending_nolock(km_signal_list_t* slist, km_sigset_t mask)
+{
+   km_signal_t* sig;
+
+   TAILQ_FOREACH (sig, &slist->head, link) {
+      if (km_sigismember(&mask, sig->info.si_signo) != 0) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Like dequeue_signal() but takes signals in mask, blocked or not.
+static int km_signalfd_dequeue_nolock(km_signal_list_t* slist, km_sigset_t mask, siginfo_t* info)
+{
+   km_signal_t* chosen = NULL;
+   km_signal_t* sig;
+
+   TAILQ_FOREACH (sig, &slist->head, link) {
+      if (km_sigismember(&mask, sig->info.si_signo) != 0 &&
+          (chosen == NULL || sigpri(sig->info.si_signo) > sigpri(chosen->info.si_signo))) {
+         chosen = sig;
+      }
+   }
+   if (chosen == NULL) {
+      return 0;
+   }
+   TAILQ_REMOVE(&slist->head, chosen, link);
+   *info = chosen->info;
+   TAILQ_INSERT_TAIL(&machine.sigfree.head, chosen, link);
+   return 1;
+}
+
+static void km_signalfd_siginfo(struct signalfd_siginfo* ssi, siginfo_t* info)
+{
+   *ssi = (struct signalfd_siginfo){
+       .ssi_signo = info->si_signo,
+       .ssi_errno = info->si_errno,
+       .ssi_code = info->si_code,
+   };
+   if (km_sigismember(&perror_signals, info->si_signo) != 0) {
+      ssi->ssi_addr = (uintptr_t)info->si_addr;
+   } else {
+      ssi->ssi_pid = info->si_pid;
+      ssi->ssi_uid = info->si_uid;
+      ssi->ssi_status = info->si_status;
+      ssi->ssi_int = info->si_value.sival_int;
+      ssi->ssi_ptr = (uintptr_t)info->si_value.sival_ptr;
+   }
+}
+
+/*
+ * Sets the mask of signalfd fd, fd is added to the list if it is new. SIGKILL and SIGSTOP are
+ * silently dropped from the mask like Linux does.
+ */
+int km_signalfd_setmask(km_vcpu_t* vcpu, int fd, km_sigset_t mask)
+{
+   km_signalfd_t* sfd;
+
+   km_sigdelset(&mask, SIGKILL);
+   km_sigdelset(&mask, SIGSTOP);
+   km_signal_lock();
+   if ((sfd = km_signalfd_find_nolock(fd)) == NULL) {
+      if ((sfd = calloc(1, sizeof(km_signalfd_t))) == NULL ||
+          (sfd->shared = calloc(1, sizeof(km_signalfd_mask_t))) == NULL) {
+         free(sfd);
+         km_signal_unlock();
+         return -ENOMEM;
+      }
+      sfd->fd = fd;
+      sfd->shared->refcnt = 1;
+      TAILQ_INSERT_TAIL(&km_signalfds, sfd, link);
+   }
+   sfd->shared->mask = mask;
+   // signals that are already pending make it readable right away
+   if (km_signalfd_pending_nolock(&machine.sigpending, mask) != 0 ||
+       (vcpu != NULL && km_signalfd_pending_nolock(&vcpu->sigpending, mask) != 0)) {
+      uint64_t one = 1;
+      if (write(fd, &one, sizeof(one)) < 0) {
+         km_warn("signalfd %d notify", fd);
+      }
+   }
+   km_signal_unlock();
+   return 0;
+}
+
+// Returns the mask of signalfd fd, 0 if fd isn't a signalfd.
+km_sigset_t km_signalfd_getmask(int fd)
+{
+   km_sigset_t mask = 0;
+
+   km_signal_lock();
+   km_signalfd_t* sfd = km_signalfd_find_nolock(fd);
+   if (sfd != NULL) {
+      mask = sfd->shared->mask;
+   }
+   km_signal_unlock();
+   return mask;
+}
+
+void km_signalfd_close(int fd)
+{
+   km_signal_lock();
+   km_signalfd_t* sfd = km_signalfd_find_nolock(fd);
+   if (sfd != NULL) {
+      TAILQ_REMOVE(&km_signalfds, sfd, link);
+      if (--sfd->shared->refcnt == 0) {
+         free(sfd->shared);
+      }
+      free(sfd);
+   }
+   km_signal_unlock();
+}
+
+// Guest fd 'newfd' is a dup of signalfd 'fd', share the mask.
+int km_signalfd_dup(int fd, int newfd)
+{
+   km_signalfd_t* sfd;
+   km_signalfd_t* nsfd;
+
+   if ((nsfd = calloc(1, sizeof(km_signalfd_t))) == NULL) {
+      return -ENOMEM;
+   }
+   km_signal_lock();
+   if ((sfd = km_signalfd_find_nolock(fd)) == NULL) {
+      km_signal_unlock();
+      free(nsfd);
+      return -EBADF;
+   }
+   nsfd->fd = newfd;
+   nsfd->shared = sfd->shared;
+   nsfd->shared->refcnt++;
+   TAILQ_INSERT_TAIL(&km_signalfds, nsfd, link);
+   km_signal_unlock();
+   return 0;
+}
+
+/*
+ * read() on signalfd. Takes as many pending signals in the signalfd mask as fit in buf, first the
+ * ones sent to this thread then the process wide ones. Blocks (on the host eventfd) if there are
+ * none, unless fd is O_NONBLOCK.
+ */
+uint64_t km_signalfd_read(km_vcpu_t* vcpu, int fd, struct signalfd_siginfo* buf, size_t count)
+{
+   size_t max = count / sizeof(struct signalfd_siginfo);
+   size_t got = 0;
+
+   if (max == 0) {
+      return -EINVAL;
+   }
+   while (got == 0) {
+      siginfo_t info;
+      uint64_t cnt;
+
+      km_signal_lock();
+      km_signalfd_t* sfd = km_signalfd_find_nolock(fd);
+      if (sfd == NULL) {
+         km_signal_unlock();
+         return -EINVAL;
+      }
+      while (got < max) {
+         if (km_signalfd_dequeue_nolock(&vcpu->sigpending, sfd->shared->mask, &info) == 0 &&
+             km_signalfd_dequeue_nolock(&machine.sigpending, sfd->shared->mask, &info) == 0) {
+            break;
+         }
+         km_signalfd_siginfo(&buf[got++], &info);
+      }
+      if (km_signalfd_pending_nolock(&vcpu->sigpending, sfd->shared->mask) == 0 &&
+          km_signalfd_pending_nolock(&machine.sigpending, sfd->shared->mask) == 0) {
+         struct pollfd pfd = {.fd = fd, .events = POLLIN};
+         if (poll(&pfd, 1, 0) == 1 && read(fd, &cnt, sizeof(cnt)) < 0) {
+            km_warn("signalfd %d reset", fd);
+         }
+      }
+      km_signal_unlock();
+      if (got != 0) {
+         break;
+      }
+      if ((fcntl(fd, F_GETFL) & O_NONBLOCK) != 0) {
+         return -EAGAIN;
+      }
+      // Wait for a signal to show up. Signals to deliver to this thread interrupt the wait.
+      struct pollfd pfd = {.fd = fd, .events = POLLIN};
+      if (poll(&pfd, 1, -1) < 0 && (errno != EINTR || km_signal_ready(vcpu) != 0)) {
+         return -errno;
+      }
+   }
+   return got * sizeof(struct signalfd_siginfo);
+}
+
 /*
  * Dump in elf format
  */
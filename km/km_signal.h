@@ -28,6 +28,7 @@ void km_deliver_signal(km_vcpu_t* vcpu, siginfo_t* info);
 void km_deliver_next_signal(km_vcpu_t* vcpu);
 int km_dequeue_signal(km_vcpu_t* vcpu, siginfo_t* info);
 int km_signal_ready(km_vcpu_t*);
+int km_signal_timer_queued(int timerid);
 void km_deliver_signal_from_gdb(km_vcpu_t* vcpu, siginfo_t* info);
 
 uint64_t
@@ -35,7 +36,7 @@ km_rt_sigprocmask(km_vcpu_t* vcpu, int how, km_sigset_t* set, km_sigset_t* oldse
 uint64_t
 km_rt_sigaction(km_vcpu_t* vcpu, int signo, km_sigaction_t* act, km_sigaction_t* oldact, size_t sigsetsize);
 uint64_t km_sigaltstack(km_vcpu_t* vcpu, km_stack_t* new, km_stack_t* old);
-void km_rt_sigreturn(km_vcpu_t* vcpu);
+void km_rt_sigreturn(km_vcpu_t* vcpu, km_hc_args_t* arg);
 uint64_t km_kill(km_vcpu_t* vcpu, pid_t pid, int signo);
 uint64_t km_tkill(km_vcpu_t* vcpu, pid_t tid, int signo);
 uint64_t km_rt_sigpending(km_vcpu_t* vcpu, km_sigset_t* set, size_t sigsetsize);
@@ -46,6 +47,11 @@ void km_install_sighandler(int signum, sa_action_t hander_func);
 uint64_t km_rt_sigsuspend(km_vcpu_t* vcpu, km_sigset_t* mask, size_t masksize);
 uint64_t km_rt_sigtimedwait(
     km_vcpu_t* vcpu, km_sigset_t* set, siginfo_t* info, struct timespec* timeout, size_t setlen);
+int km_signalfd_setmask(km_vcpu_t* vcpu, int fd, km_sigset_t mask);
+km_sigset_t km_signalfd_getmask(int fd);
+void km_signalfd_close(int fd);
+int km_signalfd_dup(int fd, int newfd);
+uint64_t km_signalfd_read(km_vcpu_t* vcpu, int fd, struct signalfd_siginfo* buf, size_t count);
 
 static inline int km_sigindex(int signo)
 {
@@ -38,6 +38,7 @@
 #include "km_mem.h"
 #include "km_signal.h"
 #include "km_snapshot.h"
+#include "km_timer.h"
 
 // TODO: Need to figure out where the snapshot default should go.
 static char* snapshot_path = "./kmsnap";
@@ -266,7 +267,7 @@ static int km_ss_recover_vcpu_info(char* ptr, size_t length)
     * This is a compile time check to remind developers to check
     * for snapshot implications when km_vcpu_t changes.
     */
-   static_assert(sizeof(km_vcpu_t) == 960,
+   static_assert(sizeof(km_vcpu_t) == 1040,
                  "sizeof(km_vcpu_t) changed. Check for snapshot implications");
 
    if (length < sizeof(km_nt_vcpu_t)) {
@@ -414,6 +415,18 @@ static inline int km_ss_recover_km_monitor(char* notebuf, size_t notesize)
                current_vmtype[machine.vm_type]);
       return -1;
    }
+   // Memory in the snapshot is laid out for its physical memory size, see km_mem_layout_init()
+   if (mon->guest_max_physmem != machine.guest_max_physmem ||
+       mon->guest_high_gva != machine.guest_high_gva) {
+      km_warnx("snapshot guest physical memory 0x%lx (%s layout) and current 0x%lx (%s layout) do "
+               "not agree, resume with -P %d",
+               mon->guest_max_physmem,
+               mon->guest_high_gva != 0 ? "high" : "low",
+               machine.guest_max_physmem,
+               machine.guest_high_gva != 0 ? "high" : "low",
+               63 - __builtin_clzl(mon->guest_max_physmem));
+      return -1;
+   }
    km_infox(KM_TRACE_SNAPSHOT, "Recover brk");
    if (km_mem_brk(mon->brk) != mon->brk) {
       km_err(2, "brk recover failure");
@@ -486,6 +499,9 @@ int km_snapshot_restore(km_elf_t* e)
    if (km_snapshot_notes_apply(notebuf, notesize, NT_KM_SIGHAND, km_sig_snapshot_recover) < 0) {
       km_errx(2, "recover signal handlers failed");
    }
+   if (km_snapshot_notes_apply(notebuf, notesize, NT_KM_TIMER, km_timer_snapshot_recover) < 0) {
+      km_errx(2, "recover timers failed");
+   }
    if (km_fs_recover(notebuf, notesize) < 0) {
       km_errx(2, "recover open files failed");
    }
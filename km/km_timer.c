@@ -0,0 +1,725 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Guest POSIX timers (timer_create() and friends) and interval timers (setitimer(), alarm()).
+ *
+ * The timers belong to km, nothing is armed in the host process on behalf of the guest. A single
+ * timer thread sleeps until the earliest armed timer is due and posts the guest signal with
+ * km_post_signal(). Armed timers are kept in a binary heap ordered by the CLOCK_MONOTONIC time the
+ * timer thread should look at them next. For wall clock timers that is the expiration. CPU time
+ * can run faster than wall time, so for CPU time clocks it is an estimate, and the timer thread
+ * reads the timer clock and requeues the timer if it isn't due yet.
+ *
+ * Like in Linux, expirations while the previous signal from a timer is still queued are counted as
+ * overruns rather than queued.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "km.h"
+#include "km_coredump.h"
+#include "km_sched.h"
+#include "km_signal.h"
+#include "km_timer.h"
+
+#define KM_MAX_TIMERS 256   // timer_create() timers per process
+#define NSEC_PER_SEC (1000 * 1000 * 1000UL)
+#define KM_TIMER_MAX_SEC (1UL << 32)            // longer than that is forever
+#define KM_TIMER_RETRY (10 * 1000 * 1000UL)   // recheck in 10ms when the timer clock can't be read
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+// negative clock ids are CPU time clocks of a process or thread, see clock_getcpuclockid(3)
+#define CPUCLOCK_PERTHREAD_MASK 4
+#define CPUCLOCK_CLOCK_MASK 3
+#define CPUCLOCK_FD 3
+
+typedef struct km_timer {
+   int in_use;
+   int heap_idx;         // position in km_timers.heap, -1 if not armed
+   int id;               // timer id, or ITIMER_*
+   int code;             // si_code, SI_TIMER, or SI_KERNEL for interval timers
+   clockid_t clockid;    // CLOCK_REALTIME, CLOCK_MONOTONIC, CLOCK_BOOTTIME or a CPU time clock
+   pid_t clock_tid;      // thread for CLOCK_THREAD_CPUTIME_ID
+   int notify;           // SIGEV_SIGNAL, SIGEV_NONE or SIGEV_THREAD_ID
+   int signo;            //
+   pid_t tid;            // SIGEV_THREAD_ID target
+   uint64_t value;       // sigev_value
+   uint64_t expires;     // next expiration, nsec on the timer clock, 0 if disarmed
+   uint64_t interval;    // nsec, 0 for one shot
+   uint64_t wake;        // CLOCK_MONOTONIC nsec when the timer thread looks at it next
+   int overrun;          // expirations since the last signal was queued
+   int last_overrun;     // overrun of the last signal, for timer_getoverrun()
+} km_timer_t;
+
+static struct {
+   pthread_mutex_t mutex;   // protects all of the below
+   pthread_cond_t cv;       // wakes up the timer thread, uses CLOCK_MONOTONIC
+   pthread_t thread;        // timer thread, 0 until a timer is armed
+   int stop;                // tells the timer thread to exit
+   int nheap;
+   km_timer_t* heap[KM_MAX_TIMERS + 3];
+   km_timer_t itimers[3];   // ITIMER_REAL, ITIMER_VIRTUAL, ITIMER_PROF
+   km_timer_t timers[KM_MAX_TIMERS];
+} km_timers = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const struct {
+   int signo;
+   clockid_t clockid;
+} km_itimer_kind[] = {
+    [ITIMER_REAL] = {SIGALRM, CLOCK_MONOTONIC},
+    [ITIMER_VIRTUAL] = {SIGVTALRM, CLOCK_PROCESS_CPUTIME_ID},   // user time only in Linux
+    [ITIMER_PROF] = {SIGPROF, CLOCK_PROCESS_CPUTIME_ID},
+};
+
+static inline uint64_t ts_to_nsec(const struct timespec* ts)
+{
+   if (ts->tv_sec >= KM_TIMER_MAX_SEC) {
+      return KM_TIMER_MAX_SEC * NSEC_PER_SEC;
+   }
+   return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline struct timespec nsec_to_ts(uint64_t nsec)
+{
+   return (struct timespec){.tv_sec = nsec / NSEC_PER_SEC, .tv_nsec = nsec % NSEC_PER_SEC};
+}
+
+static inline uint64_t clock_nsec(clockid_t clock)
+{
+   struct timespec ts;
+
+   clock_gettime(clock, &ts);
+   return ts_to_nsec(&ts);
+}
+
+// Current time on the timer clock. Returns -1 if the clock can't be read, i.e. the thread is gone.
+static int km_timer_now(km_timer_t* t, uint64_t* now)
+{
+   clockid_t clock = t->clockid;
+   struct timespec ts;
+
+   if (t->clock_tid != 0) {
+      km_vcpu_t* vcpu = km_vcpu_fetch_by_tid(t->clock_tid);
+      if (vcpu == NULL || vcpu->vcpu_thread == 0 ||
+          pthread_getcpuclockid(vcpu->vcpu_thread, &clock) != 0) {
+         return -1;
+      }
+   }
+   if (clock_gettime(clock, &ts) != 0) {
+      return -1;
+   }
+   *now = ts_to_nsec(&ts);
+   return 0;
+}
+
+// Time to the next expiration, 0 if disarmed
+static uint64_t km_timer_remain(km_timer_t* t)
+{
+   uint64_t now;
+
+   if (t->expires == 0) {
+      return 0;
+   }
+   if (km_timer_now(t, &now) != 0) {
+      return t->expires;
+   }
+   return t->expires > now ? t->expires - now : 1;   // due, the timer thread is about to get to it
+}
+
+static inline void heap_set(int i, km_timer_t* t)
+{
+   km_timers.heap[i] = t;
+   t->heap_idx = i;
+}
+
+static void heap_up(int i)
+{
+   km_timer_t* t = km_timers.heap[i];
+
+   while (i > 0 && km_timers.heap[(i - 1) / 2]->wake > t->wake) {
+      heap_set(i, km_timers.heap[(i - 1) / 2]);
+      i = (i - 1) / 2;
+   }
+   heap_set(i, t);
+}
+
+static void heap_down(int i)
+{
+   km_timer_t* t = km_timers.heap[i];
+
+   for (int child; (child = 2 * i + 1) < km_timers.nheap; i = child) {
+      if (child + 1 < km_timers.nheap &&
+          km_timers.heap[child + 1]->wake < km_timers.heap[child]->wake) {
+         child++;
+      }
+      if (km_timers.heap[child]->wake >= t->wake) {
+         break;
+      }
+      heap_set(i, km_timers.heap[child]);
+   }
+   heap_set(i, t);
+}
+
+static void heap_remove(km_timer_t* t)
+{
+   int i = t->heap_idx;
+
+   if (i < 0) {
+      return;
+   }
+   t->heap_idx = -1;
+   if (i != --km_timers.nheap) {
+      km_timer_t* last = km_timers.heap[km_timers.nheap];
+      heap_set(i, last);
+      heap_down(i);
+      heap_up(last->heap_idx);
+   }
+}
+
+/*
+ * Put armed timer on the heap. 'now' is the time on the timer clock. When several threads run CPU
+ * time goes faster than wall time, so CPU time timers are looked at sooner, and requeued if they
+ * aren't due yet.
+ */
+static void km_timer_queue(km_timer_t* t, uint64_t now)
+{
+   uint64_t delta = t->expires > now ? t->expires - now : 0;
+
+   if (t->clockid == CLOCK_PROCESS_CPUTIME_ID && machine.vm_vcpu_run_cnt > 1) {
+      delta /= machine.vm_vcpu_run_cnt;
+   }
+   heap_remove(t);
+   t->wake = clock_nsec(CLOCK_MONOTONIC) + delta;
+   heap_set(km_timers.nheap++, t);
+   heap_up(t->heap_idx);
+   if (t->heap_idx == 0) {
+      km_cond_signal(&km_timers.cv);
+   }
+}
+
+static inline int add_overrun(int overrun, uint64_t count)
+{
+   return count >= INT32_MAX - overrun ? INT32_MAX : overrun + count;   // DELAYTIMER_MAX
+}
+
+// Post timer signal, or count overruns if the previous one is still queued.
+static void km_timer_notify(km_timer_t* t, uint64_t expirations)
+{
+   km_vcpu_t* vcpu = NULL;
+
+   if (t->notify == SIGEV_NONE) {
+      return;
+   }
+   if (t->notify == SIGEV_THREAD_ID && (vcpu = km_vcpu_fetch_by_tid(t->tid)) == NULL) {
+      km_infox(KM_TRACE_SIGNALS, "timer %d: thread %d is gone", t->id, t->tid);
+      return;
+   }
+   if (t->code == SI_TIMER && km_signal_timer_queued(t->id) != 0) {
+      t->overrun = add_overrun(t->overrun, expirations);
+      return;
+   }
+   siginfo_t info = {.si_signo = t->signo, .si_code = t->code};
+   if (t->code == SI_TIMER) {
+      info.si_timerid = t->id;
+      info.si_overrun = t->last_overrun = add_overrun(t->overrun, expirations - 1);
+      info.si_value.sival_ptr = (void*)t->value;
+      t->overrun = 0;
+   }
+   km_post_signal(vcpu, &info);
+}
+
+static void* km_timer_thread(void* unused)
+{
+   km_sched_km_thread();
+   km_mutex_lock(&km_timers.mutex);
+   while (km_timers.stop == 0) {
+      if (km_timers.nheap == 0) {
+         km_cond_wait(&km_timers.cv, &km_timers.mutex);
+         continue;
+      }
+      km_timer_t* t = km_timers.heap[0];
+      uint64_t mono = clock_nsec(CLOCK_MONOTONIC);
+      uint64_t now;
+
+      if (t->wake > mono) {
+         struct timespec abstime = nsec_to_ts(t->wake);
+         km_cond_timedwait(&km_timers.cv, &km_timers.mutex, &abstime);
+         continue;
+      }
+      if (km_timer_now(t, &now) != 0) {
+         heap_remove(t);
+         t->wake = mono + KM_TIMER_RETRY;
+         heap_set(km_timers.nheap++, t);
+         heap_up(t->heap_idx);
+         continue;
+      }
+      if (now < t->expires) {   // CPU time or wall clock is behind
+         km_timer_queue(t, now);
+         continue;
+      }
+      heap_remove(t);
+      uint64_t expirations = 1;
+      if (t->interval != 0) {
+         uint64_t missed = (now - t->expires) / t->interval;
+         expirations += missed;
+         t->expires += (missed + 1) * t->interval;
+         km_timer_queue(t, now);
+      } else {
+         t->expires = 0;
+      }
+      km_timer_notify(t, expirations);
+   }
+   km_mutex_unlock(&km_timers.mutex);
+   return NULL;
+}
+
+// Start the timer thread on the first armed timer. Called with the mutex held.
+static int km_timer_thread_start(void)
+{
+   pthread_condattr_t attr;
+   sigset_t all, old;
+   int rc;
+
+   if (km_timers.thread != 0) {
+      return 0;
+   }
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&km_timers.cv, &attr);
+   pthread_condattr_destroy(&attr);
+   km_timers.stop = 0;
+   // guest signals are posted by the timer thread, host ones shouldn't go there
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   if ((rc = pthread_create(&km_timers.thread, NULL, km_timer_thread, NULL)) != 0) {
+      km_timers.thread = 0;
+   } else {
+      km_setname_np(km_timers.thread, "timer");
+   }
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   return rc;
+}
+
+/*
+ * Arm timer to go off 'value' nsec from now, or at 'value' if 'abs'. Zero 'value' disarms the
+ * timer. Called with the mutex held.
+ */
+static int km_timer_arm(km_timer_t* t, uint64_t value, uint64_t interval, int abs)
+{
+   uint64_t now;
+
+   heap_remove(t);
+   t->interval = interval;
+   t->overrun = 0;
+   t->expires = 0;
+   if (value == 0) {
+      return 0;
+   }
+   if (km_timer_now(t, &now) != 0) {
+      return -EINVAL;
+   }
+   if (km_timer_thread_start() != 0) {
+      return -EAGAIN;
+   }
+   t->expires = abs != 0 ? value : now + value;
+   km_timer_queue(t, now);
+   return 0;
+}
+
+/*
+ * Check timer_create() clockid and figure the clock to use. Negative ids are CPU time clocks of a
+ * process or a thread, as returned by clock_getcpuclockid(3) and pthread_getcpuclockid(3).
+ */
+static int km_timer_clock(km_vcpu_t* vcpu, clockid_t clockid, clockid_t* clock, pid_t* tid)
+{
+   *clock = clockid;
+   *tid = 0;
+   switch (clockid) {
+      case CLOCK_REALTIME:
+      case CLOCK_MONOTONIC:
+      case CLOCK_BOOTTIME:
+      case CLOCK_PROCESS_CPUTIME_ID:
+         return 0;
+      case CLOCK_THREAD_CPUTIME_ID:
+         *tid = km_vcpu_get_tid(vcpu);
+         return 0;
+      case CLOCK_REALTIME_ALARM:
+      case CLOCK_BOOTTIME_ALARM:
+         return -EPERM;   // needs CAP_WAKE_ALARM
+   }
+   if (clockid >= 0 || (clockid & CPUCLOCK_CLOCK_MASK) == CPUCLOCK_FD) {
+      return -EINVAL;
+   }
+   pid_t id = ~(clockid >> 3);
+   if ((clockid & CPUCLOCK_PERTHREAD_MASK) != 0) {
+      *tid = id == 0 ? km_vcpu_get_tid(vcpu) : id;
+      *clock = CLOCK_THREAD_CPUTIME_ID;
+      return km_vcpu_fetch_by_tid(*tid) != NULL ? 0 : -EINVAL;
+   }
+   *clock = CLOCK_PROCESS_CPUTIME_ID;
+   return id == 0 || id == machine.pid ? 0 : -EINVAL;
+}
+
+uint64_t km_timer_create(km_vcpu_t* vcpu, clockid_t clockid, km_sigevent_t* sevp, int* timerid)
+{
+   km_sigevent_t sev = {.sigev_signo = SIGALRM, .sigev_notify = SIGEV_SIGNAL};
+   clockid_t clock;
+   pid_t clock_tid;
+   int rc;
+
+   if ((rc = km_timer_clock(vcpu, clockid, &clock, &clock_tid)) != 0) {
+      return rc;
+   }
+   if (sevp != NULL) {
+      sev = *sevp;
+      switch (sev.sigev_notify) {
+         case SIGEV_THREAD_ID:
+            if (km_vcpu_fetch_by_tid(sev.sigev_tid) == NULL) {
+               return -EINVAL;
+            }
+            // fall through
+         case SIGEV_SIGNAL:
+         case SIGEV_THREAD:
+            if (sev.sigev_signo <= 0 || sev.sigev_signo >= _NSIG) {
+               return -EINVAL;
+            }
+            break;
+         case SIGEV_NONE:
+            break;
+         default:
+            return -EINVAL;
+      }
+   }
+   // libc runs the SIGEV_THREAD thread, to the kernel it is SIGEV_SIGNAL
+   if (sev.sigev_notify == SIGEV_THREAD) {
+      sev.sigev_notify = SIGEV_SIGNAL;
+   }
+   km_mutex_lock(&km_timers.mutex);
+   for (int i = 0; i < KM_MAX_TIMERS; i++) {
+      km_timer_t* t = &km_timers.timers[i];
+      if (t->in_use == 0) {
+         *t = (km_timer_t){.in_use = 1,
+                           .heap_idx = -1,
+                           .id = i,
+                           .code = SI_TIMER,
+                           .clockid = clock,
+                           .clock_tid = clock_tid,
+                           .notify = sev.sigev_notify,
+                           .signo = sev.sigev_signo,
+                           .tid = sev.sigev_tid,
+                           .value = sevp != NULL ? sev.sigev_value : i};
+         km_mutex_unlock(&km_timers.mutex);
+         *timerid = i;
+         km_infox(KM_TRACE_SIGNALS, "timer %d clock %d signo %d", i, clockid, sev.sigev_signo);
+         return 0;
+      }
+   }
+   km_mutex_unlock(&km_timers.mutex);
+   return -EAGAIN;
+}
+
+// Called with the mutex held
+static km_timer_t* km_timer_lookup(int timerid)
+{
+   if (timerid < 0 || timerid >= KM_MAX_TIMERS || km_timers.timers[timerid].in_use == 0) {
+      return NULL;
+   }
+   return &km_timers.timers[timerid];
+}
+
+static inline int ts_valid(const struct timespec* ts)
+{
+   return ts->tv_sec >= 0 && ts->tv_nsec >= 0 && ts->tv_nsec < NSEC_PER_SEC;
+}
+
+uint64_t km_timer_settime(int timerid, int flags, struct itimerspec* new, struct itimerspec* old)
+{
+   km_timer_t* t;
+   int rc;
+
+   if (ts_valid(&new->it_value) == 0 || ts_valid(&new->it_interval) == 0) {
+      return -EINVAL;
+   }
+   km_mutex_lock(&km_timers.mutex);
+   if ((t = km_timer_lookup(timerid)) == NULL) {
+      km_mutex_unlock(&km_timers.mutex);
+      return -EINVAL;
+   }
+   if (old != NULL) {
+      old->it_value = nsec_to_ts(km_timer_remain(t));
+      old->it_interval = nsec_to_ts(t->interval);
+   }
+   rc = km_timer_arm(t,
+                     ts_to_nsec(&new->it_value),
+                     ts_to_nsec(&new->it_interval),
+                     (flags & TIMER_ABSTIME) != 0);
+   km_mutex_unlock(&km_timers.mutex);
+   return rc;
+}
+
+uint64_t km_timer_gettime(int timerid, struct itimerspec* curr_value)
+{
+   km_timer_t* t;
+
+   km_mutex_lock(&km_timers.mutex);
+   if ((t = km_timer_lookup(timerid)) == NULL) {
+      km_mutex_unlock(&km_timers.mutex);
+      return -EINVAL;
+   }
+   curr_value->it_value = nsec_to_ts(km_timer_remain(t));
+   curr_value->it_interval = nsec_to_ts(t->interval);
+   km_mutex_unlock(&km_timers.mutex);
+   return 0;
+}
+
+uint64_t km_timer_getoverrun(int timerid)
+{
+   km_timer_t* t;
+   int overrun;
+
+   km_mutex_lock(&km_timers.mutex);
+   if ((t = km_timer_lookup(timerid)) == NULL) {
+      km_mutex_unlock(&km_timers.mutex);
+      return -EINVAL;
+   }
+   overrun = t->last_overrun;
+   km_mutex_unlock(&km_timers.mutex);
+   return overrun;
+}
+
+uint64_t km_timer_delete(int timerid)
+{
+   km_timer_t* t;
+
+   km_mutex_lock(&km_timers.mutex);
+   if ((t = km_timer_lookup(timerid)) == NULL) {
+      km_mutex_unlock(&km_timers.mutex);
+      return -EINVAL;
+   }
+   heap_remove(t);
+   t->in_use = 0;
+   km_mutex_unlock(&km_timers.mutex);
+   return 0;
+}
+
+// Called with the mutex held
+static km_timer_t* km_itimer(int which)
+{
+   km_timer_t* t = &km_timers.itimers[which];
+
+   if (t->in_use == 0) {
+      *t = (km_timer_t){.in_use = 1,
+                        .heap_idx = -1,
+                        .id = which,
+                        .code = SI_KERNEL,
+                        .clockid = km_itimer_kind[which].clockid,
+                        .notify = SIGEV_SIGNAL,
+                        .signo = km_itimer_kind[which].signo};
+   }
+   return t;
+}
+
+static inline int tv_valid(const struct timeval* tv)
+{
+   return tv->tv_sec >= 0 && tv->tv_usec >= 0 && tv->tv_usec < 1000 * 1000;
+}
+
+static inline uint64_t tv_to_nsec(const struct timeval* tv)
+{
+   struct timespec ts = {.tv_sec = tv->tv_sec, .tv_nsec = tv->tv_usec * 1000};
+   return ts_to_nsec(&ts);
+}
+
+// Round up, so armed timer never shows as 0
+static inline struct timeval nsec_to_tv(uint64_t nsec)
+{
+   uint64_t usec = (nsec + 999) / 1000;
+   return (struct timeval){.tv_sec = usec / (1000 * 1000), .tv_usec = usec % (1000 * 1000)};
+}
+
+static void km_itimer_get(km_timer_t* t, struct itimerval* curr_value)
+{
+   curr_value->it_value = nsec_to_tv(km_timer_remain(t));
+   curr_value->it_interval = nsec_to_tv(t->interval);
+}
+
+uint64_t km_setitimer(int which, struct itimerval* new, struct itimerval* old)
+{
+   km_timer_t* t;
+   int rc;
+
+   if (which < ITIMER_REAL || which > ITIMER_PROF || tv_valid(&new->it_value) == 0 ||
+       tv_valid(&new->it_interval) == 0) {
+      return -EINVAL;
+   }
+   km_mutex_lock(&km_timers.mutex);
+   t = km_itimer(which);
+   if (old != NULL) {
+      km_itimer_get(t, old);
+   }
+   rc = km_timer_arm(t, tv_to_nsec(&new->it_value), tv_to_nsec(&new->it_interval), 0);
+   km_mutex_unlock(&km_timers.mutex);
+   return rc;
+}
+
+uint64_t km_getitimer(int which, struct itimerval* curr_value)
+{
+   if (which < ITIMER_REAL || which > ITIMER_PROF) {
+      return -EINVAL;
+   }
+   km_mutex_lock(&km_timers.mutex);
+   km_itimer_get(km_itimer(which), curr_value);
+   km_mutex_unlock(&km_timers.mutex);
+   return 0;
+}
+
+uint64_t km_alarm(unsigned int seconds)
+{
+   struct itimerval new = {.it_value.tv_sec = seconds};
+   struct itimerval old;
+   unsigned int ret;
+
+   km_setitimer(ITIMER_REAL, &new, &old);
+   // Round to the nearest second, but don't say 0 if the alarm was armed. Same as Linux.
+   ret = old.it_value.tv_sec;
+   if ((ret == 0 && old.it_value.tv_usec != 0) || old.it_value.tv_usec >= 500 * 1000) {
+      ret++;
+   }
+   return ret;
+}
+
+void km_timer_fini(void)
+{
+   km_mutex_lock(&km_timers.mutex);
+   if (km_timers.thread == 0) {
+      km_mutex_unlock(&km_timers.mutex);
+      return;
+   }
+   km_timers.stop = 1;
+   km_cond_signal(&km_timers.cv);
+   km_mutex_unlock(&km_timers.mutex);
+   pthread_join(km_timers.thread, NULL);
+   km_timers.thread = 0;
+}
+
+// Timers aren't inherited by the child, and there is no timer thread there
+void km_timer_fork_reset(void)
+{
+   memset(&km_timers, 0, sizeof(km_timers));
+   km_timers.mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+size_t km_timer_core_notes_length(void)
+{
+   size_t ret = 0;
+
+   km_mutex_lock(&km_timers.mutex);
+   for (int i = 0; i < KM_MAX_TIMERS + 3; i++) {
+      km_timer_t* t = i < 3 ? &km_timers.itimers[i] : &km_timers.timers[i - 3];
+      if (t->in_use != 0) {
+         ret += km_note_header_size(KM_NT_NAME) + sizeof(km_nt_timer_t);
+      }
+   }
+   km_mutex_unlock(&km_timers.mutex);
+   return ret;
+}
+
+size_t km_timer_core_notes_write(char* buf, size_t length)
+{
+   char* cur = buf;
+   size_t remain = length;
+
+   km_mutex_lock(&km_timers.mutex);
+   for (int i = 0; i < KM_MAX_TIMERS + 3; i++) {
+      km_timer_t* t = i < 3 ? &km_timers.itimers[i] : &km_timers.timers[i - 3];
+      if (t->in_use == 0) {
+         continue;
+      }
+      cur += km_add_note_header(cur, remain, KM_NT_NAME, NT_KM_TIMER, sizeof(km_nt_timer_t));
+      km_nt_timer_t* nt = (km_nt_timer_t*)cur;
+      *nt = (km_nt_timer_t){.size = sizeof(km_nt_timer_t),
+                            .id = t->id,
+                            .itimer = i < 3,
+                            .clockid = t->clockid,
+                            .clock_tid = t->clock_tid,
+                            .notify = t->notify,
+                            .signo = t->signo,
+                            .tid = t->tid,
+                            .value = t->value,
+                            .remain = km_timer_remain(t),
+                            .interval = t->interval};
+      cur += sizeof(km_nt_timer_t);
+      remain = length - (cur - buf);
+   }
+   km_mutex_unlock(&km_timers.mutex);
+   return cur - buf;
+}
+
+int km_timer_snapshot_recover(char* buf, size_t length)
+{
+   km_nt_timer_t* nt = (km_nt_timer_t*)buf;
+   km_timer_t* t;
+   uint64_t now;
+
+   if (nt->size != sizeof(km_nt_timer_t)) {
+      km_warnx("km_nt_timer_t size mismatch - old snapshot?");
+      return -1;
+   }
+   if (nt->id >= (nt->itimer != 0 ? ITIMER_PROF + 1 : KM_MAX_TIMERS)) {
+      km_warnx("bad timer id %d", nt->id);
+      return -1;
+   }
+   km_infox(KM_TRACE_COREDUMP, "timer %d itimer %d remain %ld", nt->id, nt->itimer, nt->remain);
+   km_mutex_lock(&km_timers.mutex);
+   t = nt->itimer != 0 ? &km_timers.itimers[nt->id] : &km_timers.timers[nt->id];
+   *t = (km_timer_t){.in_use = 1,
+                     .heap_idx = -1,
+                     .id = nt->id,
+                     .code = nt->itimer != 0 ? SI_KERNEL : SI_TIMER,
+                     .clockid = nt->clockid,
+                     .clock_tid = nt->clock_tid,
+                     .notify = nt->notify,
+                     .signo = nt->signo,
+                     .tid = nt->tid,
+                     .value = nt->value,
+                     .interval = nt->interval};
+   if (nt->remain != 0) {
+      // CPU time clocks start over in the new process, vcpu threads don't even exist yet
+      if (km_timer_now(t, &now) != 0) {
+         now = 0;
+      }
+      if (km_timer_thread_start() != 0) {
+         km_mutex_unlock(&km_timers.mutex);
+         km_warnx("cannot start timer thread");
+         return -1;
+      }
+      t->expires = now + nt->remain;
+      km_timer_queue(t, now);
+   }
+   km_mutex_unlock(&km_timers.mutex);
+   return 0;
+}
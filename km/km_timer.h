@@ -0,0 +1,59 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KM_TIMER_H__
+#define __KM_TIMER_H__
+
+#include <sys/time.h>
+#include <time.h>
+#include "km.h"
+
+/*
+ * struct sigevent as the kernel sees it. Libc versions disagree on how to spell the thread id.
+ */
+typedef struct km_sigevent {
+   uint64_t sigev_value;
+   int sigev_signo;
+   int sigev_notify;
+   int sigev_tid;   // SIGEV_THREAD_ID target
+   int pad[11];
+} km_sigevent_t;
+
+// int timer_create(clockid_t clockid, struct sigevent* sevp, timer_t* timerid);
+uint64_t km_timer_create(km_vcpu_t* vcpu, clockid_t clockid, km_sigevent_t* sevp, int* timerid);
+// int timer_settime(timer_t timerid, int flags, const struct itimerspec* new,
+//                   struct itimerspec* old);
+uint64_t km_timer_settime(int timerid, int flags, struct itimerspec* new, struct itimerspec* old);
+// int timer_gettime(timer_t timerid, struct itimerspec* curr_value);
+uint64_t km_timer_gettime(int timerid, struct itimerspec* curr_value);
+// int timer_getoverrun(timer_t timerid);
+uint64_t km_timer_getoverrun(int timerid);
+// int timer_delete(timer_t timerid);
+uint64_t km_timer_delete(int timerid);
+// int setitimer(int which, const struct itimerval* new_value, struct itimerval* old_value);
+uint64_t km_setitimer(int which, struct itimerval* new, struct itimerval* old);
+// int getitimer(int which, struct itimerval* curr_value);
+uint64_t km_getitimer(int which, struct itimerval* curr_value);
+// unsigned int alarm(unsigned int seconds);
+uint64_t km_alarm(unsigned int seconds);
+
+void km_timer_fini(void);
+void km_timer_fork_reset(void);
+size_t km_timer_core_notes_length(void);
+size_t km_timer_core_notes_write(char* buf, size_t length);
+int km_timer_snapshot_recover(char* buf, size_t length);
+
+#endif /* !defined(__KM_TIMER_H__) */
@@ -38,18 +38,18 @@ static char km_log_file_name[128];
 // To avoid having /tmp cluttered with empty km log files, we open the log on demand.
 static inline void km_trace_open_log_on_demand(void)
 {
-   extern const int KM_LOGGING;
+   extern int km_fs_logging_fd(void);
    if (km_log_file == NULL && km_log_file_name[0] != 0) {
       int fd;
       int fd1 = open(km_log_file_name, O_CREAT | O_WRONLY, 0644);
       if (fd1 >= 0) {
-         fd = dup2(fd1, KM_LOGGING);
+         fd = dup2(fd1, km_fs_logging_fd());
          close(fd1);
          km_log_file = fdopen(fd, "w");
          if (km_log_file != NULL) {
             setlinebuf(km_log_file);
          } else {
-            close(KM_LOGGING);
+            close(km_fs_logging_fd());
          }
       }
       // Only try "open on demand" once.
@@ -23,6 +23,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #include "km.h"
 
@@ -33,6 +34,7 @@
 #include "km_guest.h"
 #include "km_hcalls.h"
 #include "km_mem.h"
+#include "km_sched.h"
 #include "km_signal.h"
 
 int vcpu_dump = 0;
@@ -480,6 +482,7 @@ static void km_vcpu_one_kvm_run(km_vcpu_t* vcpu)
    km_infox(KM_TRACE_VCPU, "about to ioctl( KVM_RUN )");
    rc = ioctl(vcpu->kvm_vcpu_fd, KVM_RUN, NULL);
    vcpu->state = HYPERCALL;
+   vcpu->cpu_run->immediate_exit = 0;   // pending signals are checked before the next KVM_RUN
    km_infox(KM_TRACE_VCPU,
             "ioctl( KVM_RUN ) returned %d KVM_RUN exit %d (%s)",
             rc,
@@ -592,6 +595,10 @@ void* km_vcpu_run(km_vcpu_t* vcpu)
    int hc_ret = 0;
 
    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+   __atomic_store_n(&vcpu->vcpu_tid, syscall(SYS_gettid), __ATOMIC_RELEASE);
+   km_lock_vcpu_thr(vcpu);
+   km_vcpu_thread_wait(vcpu);   // vcpu from the pool, wait for km_run_vcpu_thread()
+   km_unlock_vcpu_thr(vcpu);
    char thread_name[16];   // see 'man pthread_getname_np'
    sprintf(thread_name, "vcpu-%d", vcpu->vcpu_id);
    km_setname_np(vcpu->vcpu_thread, thread_name);
@@ -820,6 +827,7 @@ void* km_vcpu_run(km_vcpu_t* vcpu)
 /*
  * Signal handler. Used when we want VCPU to stop. For vcpu->state == IN_GUEST the signal causes
  * KVM_RUN exit with -EINTR. It also interrupts some system calls, which we mark with HCALL_INT.
+ * If the signal lands just before KVM_RUN, immediate_exit makes KVM_RUN return -EINTR right away.
  *
  * Calling km_info() and km_infox() from this function seems to occasionally cause a mutex
  * deadlock in the regular expression code called from km_info*().
@@ -831,6 +839,7 @@ static void km_vcpu_pause_sighandler(int signum, siginfo_t* info, void* ucontext
       if (vcpu->state == HYPERCALL) {
          vcpu->state = HCALL_INT;
       }
+      vcpu->cpu_run->immediate_exit = 1;
    }
 }
 
@@ -864,7 +873,7 @@ void km_signal_passthru(int signo, siginfo_t* sinfo, void* ucontext)
 
 static int km_start_single_vcpu(km_vcpu_t* vcpu, void* unused)
 {
-   return km_run_vcpu_thread(vcpu);
+   return km_run_vcpu_thread(vcpu, NULL);
 }
 
 void km_start_all_vcpus(void)
@@ -872,6 +881,7 @@ void km_start_all_vcpus(void)
    if (km_vcpu_apply_all(km_start_single_vcpu, NULL) != 0) {
       km_err(2, "Failed to start guest");
    }
+   km_vcpu_pool_start();
 }
 
 void km_start_vcpus()
@@ -21,6 +21,7 @@
 
 #include "km.h"
 #include "km_coredump.h"
+#include "km_filesys.h"
 #include "km_kkm.h"
 
 int km_vmdriver_get_identity(void)
@@ -33,19 +34,48 @@ int km_vmdriver_cpu_supported(void)
    return ioctl(machine.kvm_fd, KKM_CPU_SUPPORTED, NULL);
 }
 
+/*
+ * Best instruction for the guest to save FP state with on signal handler entry.
+ * CPUID.(EAX=0DH,ECX=1):EAX bit 1 is XSAVEC. Not XSAVEOPT, its modified optimization skips
+ * components unchanged since the last XRSTOR from the same address, which a signal frame reused at
+ * the same stack address can hit with stale contents.
+ */
+static int km_vmdriver_guest_xsave(void)
+{
+   for (int i = 0; i < machine.cpuid->nent; i++) {
+      struct kvm_cpuid_entry2* entry = &machine.cpuid->entries[i];
+      if (entry->function == 0xD && entry->index == 1) {
+         if ((entry->eax & (1 << 1)) != 0) {
+            return KM_GUEST_XSAVEC;
+         }
+      }
+   }
+   return KM_GUEST_XSAVE;
+}
+
 void km_vmdriver_machine_init(void)
 {
+   int max_vcpus = KM_DEFAULT_VCPUS;
+   int rc;
+
    switch (machine.vm_type) {
       case VM_TYPE_KVM:
          // does kvm support xsave?
          if (ioctl(machine.mach_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) == 1) {
             machine.vmtype_u.kvm.xsave = 1;
+            machine.vmtype_u.kvm.guest_xsave = km_vmdriver_guest_xsave();
+         }
+         // 288 on old kernels, 1024 or more on new ones
+         if ((rc = ioctl(machine.mach_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS)) > 0) {
+            max_vcpus = rc;
          }
          break;
       case VM_TYPE_KKM:
          // Anything for KKM?
          break;
    }
+   machine.vm_max_vcpus = MIN(MIN(max_vcpus, KVM_MAX_VCPUS), km_fs_max_vcpus());
+   km_infox(KM_TRACE_KVM, "max vcpus %d, driver allows %d", machine.vm_max_vcpus, max_vcpus);
 }
 
 /*
@@ -31,6 +31,7 @@
 
 km_payload_t km_guest;
 km_payload_t km_dynlinker;
+int km_share_text = 0;   // map read-only segments straight from the file (--share-text)
 
 /*
  * Setup mmap for described by ELF file Phdr.
@@ -86,9 +87,21 @@ static void load_extent(int fd, const Elf64_Phdr* phdr, km_gva_t base)
    Elf64_Xword p_filesz = phdr->p_filesz;
    km_kma_t addr = km_gva_to_kma_nocheck(phdr->p_paddr) + base;
    uint64_t extra = addr - (km_kma_t)rounddown((uint64_t)addr, KM_PAGE_SIZE);
+   int pr = prot_elf_to_mmap(phdr->p_flags);
+   if (km_share_text != 0 && (phdr->p_flags & PF_W) == 0 && p_filesz > 0 && p_memsz == p_filesz) {
+      /*
+       * Read-only segment with nothing to zero. Map it from the file with the final protection and
+       * never write to it, so the pages stay in the page cache and are shared by all km instances
+       * running the same file. Like Linux, the tail of the last page shows the file content.
+       */
+      off_t offset = phdr->p_offset - extra;
+      if (mmap(addr - extra, p_filesz + extra, pr, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+         km_err(2, "error mmap elf");
+      }
+      return;
+   }
    map_program_section(fd, addr - extra, p_filesz + extra, phdr->p_offset - extra);
    memset(addr + p_filesz, 0, p_memsz - p_filesz);
-   int pr = prot_elf_to_mmap(phdr->p_flags);
    if (mprotect(addr - extra, p_memsz + extra, protection_adjust(pr)) < 0) {
       km_err(2, "failed to set guest memory protection");
    }
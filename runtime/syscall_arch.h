@@ -19,6 +19,28 @@
 #define __SYSCALL_LL_E(x) (x)
 #define __SYSCALL_LL_O(x) (x)
 
+/*
+ * futex goes through the SYSCALL instruction instead of straight to the hypercall, to get the
+ * guest side spin and wake short cuts in __km_syscall_handler (see __km_futex in
+ * km/km_guest_asmcode.s). The handler pushes on our stack, so step over the red zone first.
+ * Cancellable futex waits (__syscall_cp) still go to the hypercall.
+ */
+static __inline long __km_syscall_insn(long n, long a1, long a2, long a3, long a4, long a5, long a6)
+{
+   register long r10 __asm__("r10") = a4;
+   register long r8 __asm__("r8") = a5;
+   register long r9 __asm__("r9") = a6;
+   long ret;
+
+   __asm__ __volatile__("sub $128, %%rsp;"
+                        "syscall;"
+                        "add $128, %%rsp"
+                        : "=a"(ret)
+                        : "a"(n), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8), "r"(r9)
+                        : "rcx", "r11", "memory");
+   return ret;
+}
+
 static __inline long __syscall0(long n)
 {
    km_hc_args_t arg;
@@ -80,6 +102,9 @@ static __inline long __syscall3(long n, long a1, long a2, long a3)
 {
    km_hc_args_t arg;
 
+   if (n == SYS_futex) {
+      return __km_syscall_insn(n, a1, a2, a3, 0, 0, 0);
+   }
    arg.arg1 = a1;
    arg.arg2 = a2;
    arg.arg3 = a3;
@@ -101,6 +126,9 @@ static __inline long __syscall4(long n, long a1, long a2, long a3, long a4)
 {
    km_hc_args_t arg;
 
+   if (n == SYS_futex) {
+      return __km_syscall_insn(n, a1, a2, a3, a4, 0, 0);
+   }
    arg.arg1 = a1;
    arg.arg2 = a2;
    arg.arg3 = a3;
@@ -123,6 +151,9 @@ static __inline long __syscall5(long n, long a1, long a2, long a3, long a4, long
 {
    km_hc_args_t arg;
 
+   if (n == SYS_futex) {
+      return __km_syscall_insn(n, a1, a2, a3, a4, a5, 0);
+   }
    arg.arg1 = a1;
    arg.arg2 = a2;
    arg.arg3 = a3;
@@ -146,6 +177,9 @@ static __inline long __syscall6(long n, long a1, long a2, long a3, long a4, long
 {
    km_hc_args_t arg;
 
+   if (n == SYS_futex) {
+      return __km_syscall_insn(n, a1, a2, a3, a4, a5, a6);
+   }
    arg.arg1 = a1;
    arg.arg2 = a2;
    arg.arg3 = a3;
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per thread CPU affinity: sched_setaffinity() sticks, is per thread, is inherited by new threads,
+ * and shows in Cpus_allowed_list of /proc/self/status. Prints how many CPUs the payload has.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "greatest/greatest.h"
+
+static cpu_set_t all;   // what we start with
+static int first_cpu;
+
+static int status_cpus_list(char* buf, size_t size)
+{
+   FILE* f = fopen("/proc/self/status", "r");
+   char line[4096];
+   int rc = -1;
+
+   if (f == NULL) {
+      return -1;
+   }
+   while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "Cpus_allowed_list:", 18) == 0) {
+         snprintf(buf, size, "%s", line + 18 + strspn(line + 18, "\t "));
+         buf[strcspn(buf, "\n")] = '\0';
+         rc = 0;
+      }
+   }
+   fclose(f);
+   return rc;
+}
+
+TEST getaffinity_test()
+{
+   cpu_set_t set;
+
+   CPU_ZERO(&all);
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(all), &all));
+   ASSERT(CPU_COUNT(&all) > 0);
+   printf("payload CPUs: %d\n", CPU_COUNT(&all));
+   for (first_cpu = 0; CPU_ISSET(first_cpu, &all) == 0; first_cpu++) {
+   }
+   ASSERT_EQ(0, sched_getaffinity(getpid(), sizeof(set), &set));
+   ASSERT(CPU_EQUAL(&set, &all));
+   ASSERT_EQ(-1, sched_getaffinity(0, 1, &set));   // too small for the host
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, sched_getaffinity(12345, sizeof(set), &set));
+   ASSERT_EQ(ESRCH, errno);
+   PASS();
+}
+
+static void* child(void* arg)
+{
+   cpu_set_t* set = arg;
+
+   sched_getaffinity(0, sizeof(*set), set);
+   return NULL;
+}
+
+TEST setaffinity_test()
+{
+   cpu_set_t one, set, child_set;
+   pthread_t tid;
+   char list[64], want[64];
+
+   CPU_ZERO(&one);
+   CPU_SET(first_cpu, &one);
+   ASSERT_EQ(0, sched_setaffinity(0, sizeof(one), &one));
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(set), &set));
+   ASSERT(CPU_EQUAL(&set, &one));
+
+   // new threads get ours
+   CPU_ZERO(&child_set);
+   ASSERT_EQ(0, pthread_create(&tid, NULL, child, &child_set));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT(CPU_EQUAL(&child_set, &one));
+
+   ASSERT_EQ(0, status_cpus_list(list, sizeof(list)));
+   snprintf(want, sizeof(want), "%d", first_cpu);
+   ASSERT_STR_EQ(want, list);
+
+   CPU_ZERO(&set);
+   ASSERT_EQ(-1, sched_setaffinity(0, sizeof(set), &set));
+   ASSERT_EQ(EINVAL, errno);
+
+   ASSERT_EQ(0, sched_setaffinity(0, sizeof(all), &all));
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(set), &set));
+   ASSERT(CPU_EQUAL(&set, &all));
+   PASS();
+}
+
+static pthread_barrier_t barrier;
+
+static void* other(void* arg)
+{
+   cpu_set_t* set = arg;
+
+   pthread_barrier_wait(&barrier);   // main changed its affinity
+   sched_getaffinity(0, sizeof(*set), set);
+   pthread_barrier_wait(&barrier);
+   return NULL;
+}
+
+// Affinity is per thread, and can be set for another thread by tid
+TEST per_thread_test()
+{
+   cpu_set_t one, set, other_set;
+   pthread_t tid;
+
+   CPU_ZERO(&one);
+   CPU_SET(first_cpu, &one);
+   ASSERT_EQ(0, pthread_barrier_init(&barrier, NULL, 2));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, other, &other_set));
+   ASSERT_EQ(0, sched_setaffinity(0, sizeof(one), &one));
+   pthread_barrier_wait(&barrier);
+   pthread_barrier_wait(&barrier);
+   ASSERT(CPU_EQUAL(&other_set, &all));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(0, sched_setaffinity(syscall(SYS_gettid), sizeof(all), &all));
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(set), &set));
+   ASSERT(CPU_EQUAL(&set, &all));
+   pthread_barrier_destroy(&barrier);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   RUN_TEST(getaffinity_test);
+   RUN_TEST(setaffinity_test);
+   RUN_TEST(per_thread_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
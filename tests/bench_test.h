@@ -0,0 +1,65 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Timing and command line helpers for tests that also measure something. Such a test takes its
+ * sizes as numbers after the GREATEST options, like 'writev_test -- 1000'.
+ */
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NSEC_PER_SEC (1000 * 1000 * 1000ULL)
+
+static inline uint64_t ts_nsec(struct timespec* ts)
+{
+   return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline uint64_t now_nsec(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts_nsec(&ts);
+}
+
+// n-th number after '--', or dflt if there isn't one. Call after GREATEST_MAIN_BEGIN().
+static inline long bench_arg(int argc, char** argv, int n, long dflt)
+{
+   extern int optind;
+
+   return optind + n < argc ? atol(argv[optind + n]) : dflt;
+}
+
+// Exit with usage if bad, fmt tells what goes after '--'
+static inline __attribute__((format(printf, 3, 4))) void
+bench_usage(int bad, char** argv, const char* fmt, ...)
+{
+   va_list ap;
+
+   if (bad == 0) {
+      return;
+   }
+   fprintf(stderr, "usage: %s [GREATEST options] [-- ", argv[0]);
+   va_start(ap, fmt);
+   vfprintf(stderr, fmt, ap);
+   va_end(ap);
+   fprintf(stderr, "]\n");
+   exit(1);
+}
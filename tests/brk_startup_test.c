@@ -0,0 +1,106 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure the time to set up a large heap at startup, the way JVM -Xms or big allocator arenas do
+ * it: one large brk() move, and one large mmap() which moves tbrk down. Each move crosses many
+ * memregs. Memory is touched every 2MB to make sure the guest page tables are complete.
+ *
+ * Usage: brk_startup_test [GREATEST options] [-- <heap size in GB> [loops]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+#include "syscall.h"
+
+#define GIB (1ul << 30)
+#define MIB (1ul << 20)
+
+static size_t heap_size = 8 * GIB;
+static int loops = 8;
+
+static void* SYS_break(void const* addr)
+{
+   return (void*)syscall(SYS_brk, addr);
+}
+
+static inline void touch(char* start, size_t size)
+{
+   for (char* p = start; p < start + size; p += 2 * MIB) {
+      *(volatile char*)p = 1;
+   }
+}
+
+TEST brk_grow_test()
+{
+   struct timespec start, end;
+   uint64_t total = 0;
+   void* brk = SYS_break(0);
+
+   for (int i = 0; i < loops; i++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      void* new_brk = SYS_break(brk + heap_size);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      ASSERT_EQ_FMT(brk + heap_size, new_brk, "%p");
+      total += ts_nsec(&end) - ts_nsec(&start);
+      touch(brk, heap_size);
+      ASSERT_EQ_FMT(brk, SYS_break(brk), "%p");
+   }
+   printf("brk %ld GB: %ld usec per grow\n", heap_size / GIB, total / loops / 1000);
+   PASS();
+}
+
+TEST tbrk_grow_test()
+{
+   struct timespec start, end;
+   uint64_t total = 0;
+
+   for (int i = 0; i < loops; i++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      char* p = mmap(0, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      ASSERT_NEQ_FMT(MAP_FAILED, (void*)p, "%p");
+      total += ts_nsec(&end) - ts_nsec(&start);
+      touch(p, heap_size);
+      ASSERT_EQ(0, munmap(p, heap_size));
+   }
+   printf("tbrk %ld GB: %ld usec per grow\n", heap_size / GIB, total / loops / 1000);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   heap_size = bench_arg(argc, argv, 1, heap_size / GIB) * GIB;
+   loops = bench_arg(argc, argv, 2, loops);
+   bench_usage(heap_size == 0 || loops <= 0, argv, "<heap size (GB)> [loops]");
+
+   RUN_TEST(brk_grow_test);
+   RUN_TEST(tbrk_grow_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
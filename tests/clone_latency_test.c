@@ -0,0 +1,135 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Clone latency of a burst of thread creation, the way thread pools start up. Each thread records
+ * when it started running and waits until the whole burst is up. Prints percentiles of the
+ * pthread_create() call and of the time until the new thread runs. The first burst gets brand new
+ * vcpus (or ones from km --vcpu-pool), the second one reuses vcpus parked by the first.
+ *
+ * Usage: clone_latency_test [GREATEST options] [-- <threads per burst>]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int nthreads = 64;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static int release;
+
+static void* burst_thread(void* arg)
+{
+   *(uint64_t*)arg = now_nsec();
+   pthread_mutex_lock(&mtx);
+   while (release == 0) {
+      pthread_cond_wait(&cv, &mtx);
+   }
+   pthread_mutex_unlock(&mtx);
+   return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+   uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+   return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char* what, uint64_t* v, int cnt)
+{
+   qsort(v, cnt, sizeof(uint64_t), cmp_u64);
+   printf("%s: p50 %ld p90 %ld p99 %ld max %ld ns\n",
+          what,
+          (long)v[cnt / 2],
+          (long)v[cnt * 90 / 100],
+          (long)v[cnt * 99 / 100],
+          (long)v[cnt - 1]);
+}
+
+// Start 'nthreads' threads back to back, then let them all exit
+static int burst(const char* name)
+{
+   pthread_t* tids = calloc(nthreads, sizeof(pthread_t));
+   uint64_t* before = calloc(nthreads, sizeof(uint64_t));
+   uint64_t* call = calloc(nthreads, sizeof(uint64_t));
+   uint64_t* running = calloc(nthreads, sizeof(uint64_t));
+   char what[64];
+   int rc = -1;
+   int i;
+
+   if (tids == NULL || before == NULL || call == NULL || running == NULL) {
+      goto out;
+   }
+   release = 0;
+   for (i = 0; i < nthreads; i++) {
+      before[i] = now_nsec();
+      if (pthread_create(&tids[i], NULL, burst_thread, &running[i]) != 0) {
+         break;
+      }
+      call[i] = now_nsec() - before[i];
+   }
+   pthread_mutex_lock(&mtx);
+   release = 1;
+   pthread_cond_broadcast(&cv);
+   pthread_mutex_unlock(&mtx);
+   for (int j = 0; j < i; j++) {
+      pthread_join(tids[j], NULL);
+      running[j] -= before[j];
+   }
+   if (i == nthreads) {
+      snprintf(what, sizeof(what), "%s pthread_create", name);
+      print_percentiles(what, call, nthreads);
+      snprintf(what, sizeof(what), "%s thread running", name);
+      print_percentiles(what, running, nthreads);
+      rc = 0;
+   }
+out:
+   free(tids);
+   free(before);
+   free(call);
+   free(running);
+   return rc;
+}
+
+TEST clone_latency_test()
+{
+   ASSERT_EQ(0, burst("first burst"));
+   ASSERT_EQ(0, burst("second burst"));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nthreads = bench_arg(argc, argv, 1, nthreads);
+   bench_usage(nthreads <= 0, argv, "<threads per burst>");
+
+   RUN_TEST(clone_latency_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The CPU count a payload sees has to be the same every way it looks: sched_getaffinity(),
+ * sysconf(), /sys/devices/system/cpu/online, /proc/cpuinfo and CPUID topology.
+ *
+ * Usage: cpu_topology_test [GREATEST options] [-- <expected CPUs>]
+ */
+
+#define _GNU_SOURCE
+#include <cpuid.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "greatest/greatest.h"
+
+static int expected;   // 0 for whatever affinity says
+static cpu_set_t cpus;
+static int ncpus;
+
+TEST affinity_test()
+{
+   CPU_ZERO(&cpus);
+   ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpus), &cpus));
+   ncpus = CPU_COUNT(&cpus);
+   ASSERT(ncpus > 0);
+   if (expected != 0) {
+      ASSERT_EQ(expected, ncpus);
+   }
+   ASSERT_EQ(ncpus, sysconf(_SC_NPROCESSORS_ONLN));
+   printf("%d CPUs\n", ncpus);
+   PASS();
+}
+
+TEST sys_online_test()
+{
+   FILE* f;
+   char list[4096];
+   cpu_set_t online;
+   char* p = list;
+
+   ASSERT((f = fopen("/sys/devices/system/cpu/online", "r")) != NULL);
+   ASSERT(fgets(list, sizeof(list), f) != NULL);
+   fclose(f);
+   CPU_ZERO(&online);
+   do {
+      char* ep;
+      int first = strtol(p, &ep, 10);
+      int last = first;
+
+      if (*ep == '-') {
+         last = strtol(ep + 1, &ep, 10);
+      }
+      for (int cpu = first; cpu <= last; cpu++) {
+         CPU_SET(cpu, &online);
+      }
+      p = ep + 1;
+   } while (p[-1] == ',');
+   ASSERT(CPU_EQUAL(&online, &cpus));
+   PASS();
+}
+
+TEST cpuinfo_test()
+{
+   FILE* f;
+   char line[1024];
+   int processors = 0;
+
+   ASSERT((f = fopen("/proc/cpuinfo", "r")) != NULL);
+   while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "processor", 9) == 0) {
+         processors++;
+         ASSERT(CPU_ISSET(atoi(strchr(line, ':') + 1), &cpus));
+      } else if (strncmp(line, "siblings", 8) == 0 || strncmp(line, "cpu cores", 9) == 0) {
+         ASSERT_EQ(ncpus, atoi(strchr(line, ':') + 1));
+      }
+   }
+   fclose(f);
+   ASSERT_EQ(ncpus, processors);
+   PASS();
+}
+
+// Processors in the package per CPUID leaf 0xB, 0 if there is no leaf 0xB
+static int cpuid_package_cpus(void)
+{
+   unsigned int eax, ebx, ecx, edx;
+   int cpus = 0;
+
+   if (__get_cpuid_max(0, NULL) < 0xB) {
+      return 0;
+   }
+   for (int level = 0; level < 8; level++) {
+      __cpuid_count(0xB, level, eax, ebx, ecx, edx);
+      if (((ecx >> 8) & 0xff) == 0) {
+         break;
+      }
+      cpus = ebx & 0xffff;
+   }
+   return cpus;
+}
+
+TEST cpuid_test()
+{
+   unsigned int eax, ebx, ecx, edx;
+   int package_cpus;
+
+   __cpuid(1, eax, ebx, ecx, edx);
+   ASSERT(((ebx >> 16) & 0xff) >= ncpus || ncpus > 255);
+   if ((package_cpus = cpuid_package_cpus()) != 0) {
+      ASSERT_EQ(ncpus, package_cpus);
+   }
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   extern int optind;
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   if (optind + 1 < argc) {
+      expected = atoi(argv[optind + 1]);
+   }
+   if (expected < 0) {
+      fprintf(stderr, "usage: %s [GREATEST options] [-- <expected CPUs>]\n", argv[0]);
+      exit(1);
+   }
+
+   RUN_TEST(affinity_test);
+   RUN_TEST(sys_online_test);
+   RUN_TEST(cpuinfo_test);
+   RUN_TEST(cpuid_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
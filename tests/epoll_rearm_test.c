@@ -0,0 +1,174 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * epoll_ctl bookkeeping with many registered fds, and cost of an event loop re-arming all of its
+ * EPOLLONESHOT fds on every iteration. The fds are eventfds which are always readable, so each
+ * epoll_wait returns every fd once.
+ *
+ * Usage: epoll_rearm_test [GREATEST options] [-- <fds> [iterations]]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int nfds = 20000;
+static int iterations = 20;
+static int* fds;
+static struct epoll_event* events;
+
+// Get all ready events, checking every fd is reported at most once. Returns number of events.
+static int collect(int epfd, char* seen)
+{
+   int rc = epoll_wait(epfd, events, nfds, 0);
+
+   memset(seen, 0, nfds);
+   for (int i = 0; i < rc; i++) {
+      uint64_t idx = events[i].data.u64;
+      if (idx >= nfds || seen[idx] != 0) {
+         return -1;
+      }
+      seen[idx] = 1;
+   }
+   return rc;
+}
+
+TEST epoll_ctl_test()
+{
+   int epfd = epoll_create1(EPOLL_CLOEXEC);
+   char* seen = malloc(nfds);
+   struct epoll_event ev;
+
+   ASSERT_NEQ(-1, epfd);
+   ASSERT_NEQ(NULL, seen);
+   for (int i = 0; i < nfds; i++) {
+      ev = (struct epoll_event){.events = EPOLLIN, .data.u64 = i};
+      ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev));
+   }
+   ASSERT_EQ(-1, epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev));
+   ASSERT_EQ(EEXIST, errno);
+   ASSERT_EQ(nfds, collect(epfd, seen));
+
+   // remove every other one, the rest should still be there
+   for (int i = 0; i < nfds; i += 2) {
+      ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], NULL));
+   }
+   ASSERT_EQ(-1, epoll_ctl(epfd, EPOLL_CTL_DEL, fds[0], NULL));
+   ASSERT_EQ(ENOENT, errno);
+   ASSERT_EQ(-1, epoll_ctl(epfd, EPOLL_CTL_MOD, fds[0], &ev));
+   ASSERT_EQ(ENOENT, errno);
+   ASSERT_EQ(nfds / 2, collect(epfd, seen));
+   for (int i = 1; i < nfds; i += 2) {
+      ASSERT_EQ(1, seen[i]);
+   }
+
+   // put them back, and change data on the others
+   for (int i = 0; i < nfds; i++) {
+      ev = (struct epoll_event){.events = EPOLLIN, .data.u64 = i};
+      ASSERT_EQ(0, epoll_ctl(epfd, i % 2 == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fds[i], &ev));
+   }
+   ASSERT_EQ(nfds, collect(epfd, seen));
+
+   close(epfd);
+   free(seen);
+   PASS();
+}
+
+TEST rearm_test()
+{
+   int epfd = epoll_create1(EPOLL_CLOEXEC);
+   char* seen = malloc(nfds);
+   struct timespec start, end;
+   struct epoll_event ev;
+
+   ASSERT_NEQ(-1, epfd);
+   ASSERT_NEQ(NULL, seen);
+   for (int i = 0; i < nfds; i++) {
+      ev = (struct epoll_event){.events = EPOLLIN | EPOLLONESHOT, .data.u64 = i};
+      ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev));
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int iter = 0; iter < iterations; iter++) {
+      ASSERT_EQ(nfds, collect(epfd, seen));
+      // oneshot, nothing comes back until re-armed
+      ASSERT_EQ(0, epoll_wait(epfd, events, nfds, 0));
+      for (int i = 0; i < nfds; i++) {
+         ev = (struct epoll_event){.events = EPOLLIN | EPOLLONESHOT, .data.u64 = i};
+         ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_MOD, fds[i], &ev));
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   uint64_t nsec = ts_nsec(&end) - ts_nsec(&start);
+   printf("%d fds, %d iterations: rearm %ld ns/fd\n",
+          nfds,
+          iterations,
+          (long)(nsec / ((uint64_t)nfds * iterations)));
+   close(epfd);
+   free(seen);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   struct rlimit lim;
+
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nfds = bench_arg(argc, argv, 1, nfds);
+   iterations = bench_arg(argc, argv, 2, iterations);
+   bench_usage(nfds <= 0 || iterations <= 0, argv, "<fds> [iterations]");
+   if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+      if (nfds > (long)lim.rlim_max - 16) {
+         nfds = lim.rlim_max - 16;
+         printf("RLIMIT_NOFILE hard limit %ld, only %d fds\n", (long)lim.rlim_max, nfds);
+      }
+      lim.rlim_cur = lim.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &lim);
+   }
+   if ((fds = calloc(nfds, sizeof(int))) == NULL ||
+       (events = calloc(nfds, sizeof(struct epoll_event))) == NULL) {
+      perror("calloc");
+      exit(1);
+   }
+   for (int i = 0; i < nfds; i++) {
+      if ((fds[i] = eventfd(1, EFD_CLOEXEC)) < 0) {
+         perror("eventfd");
+         exit(1);
+      }
+   }
+
+   RUN_TEST(epoll_ctl_test);
+   RUN_TEST(rearm_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
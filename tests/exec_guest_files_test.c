@@ -17,12 +17,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -37,6 +39,7 @@
  * state in the exec target is what is expected, we depending on tracing being enabled
  * and then examine the trace to verify that km file state in the exec target is correct.
  * The needed traces are produced by the km function km_exec_fdtrace()
+ * The signalfd is checked in the target too, it has to still report the signal in its mask.
  */
 
 void usage(void)
@@ -52,6 +55,7 @@ int main(int argc, char* argv[])
    int socketpairfd[2] = {123, 456};
    int pipefd[2] = {789, 012};
    int epollfd;
+   int sigfd;
    int rc;
 
    if (argc < 2) {
@@ -149,9 +153,19 @@ int main(int argc, char* argv[])
       event.data.fd = socketpairfd[0];
       rc = epoll_ctl(epollfd, EPOLL_CTL_ADD, socketpairfd[0], &event);
 
+      // create a signalfd for SIGUSR1
+      sigset_t mask;
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGUSR1);
+      sigfd = signalfd(-1, &mask, 0);
+      if (sigfd < 0) {
+         fprintf(stderr, "signalfd failed, %s\n", strerror(errno));
+         return 1;
+      }
+
       fprintf(stderr,
               "plainfilefd %d, sockfd %d, sockfd2 %d, socketpairfd[0] %d, socketpairfd[1] %d, "
-              "pipefd[0] %d, pipefd[1] %d, epollfd %d\n",
+              "pipefd[0] %d, pipefd[1] %d, epollfd %d, sigfd %d\n",
               plainfilefd,
               sockfd,
               sockfd2,
@@ -159,7 +173,8 @@ int main(int argc, char* argv[])
               socketpairfd[1],
               pipefd[0],
               pipefd[1],
-              epollfd);
+              epollfd,
+              sigfd);
 
       // exec to this program again with the fd's we opened as arguments
       char me[PATH_MAX];
@@ -182,7 +197,8 @@ int main(int argc, char* argv[])
       asprintf(&argv[8], "%d", pipefd[0]);
       asprintf(&argv[9], "%d", pipefd[1]);
       asprintf(&argv[10], "%d", epollfd);
-      argv[11] = NULL;
+      asprintf(&argv[11], "%d", sigfd);
+      argv[12] = NULL;
       rc = execve(me, argv, env);
       // If execve returned, something failed.
       fprintf(stderr, "execve to %s failed, %s\n", me, strerror(errno));
@@ -197,10 +213,11 @@ int main(int argc, char* argv[])
       pipefd[0] = atoi(argv[8]);
       pipefd[1] = atoi(argv[9]);
       epollfd = atoi(argv[10]);
+      sigfd = atoi(argv[11]);
 
       fprintf(stderr,
               "plainfilefd %d, sockfd %d, sockfd2 %d, socketpairfd[0] %d, socketpairfd[1] %d, "
-              "pipefd[0] %d, pipefd[1] %d, epollfd %d\n",
+              "pipefd[0] %d, pipefd[1] %d, epollfd %d, sigfd %d\n",
               plainfilefd,
               sockfd,
               sockfd2,
@@ -208,7 +225,20 @@ int main(int argc, char* argv[])
               socketpairfd[1],
               pipefd[0],
               pipefd[1],
-              epollfd);
+              epollfd,
+              sigfd);
+
+      // the signalfd mask came across exec
+      sigset_t mask;
+      struct signalfd_siginfo ssi;
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGUSR1);
+      sigprocmask(SIG_BLOCK, &mask, NULL);
+      raise(SIGUSR1);
+      if (read(sigfd, &ssi, sizeof(ssi)) != sizeof(ssi) || ssi.ssi_signo != SIGUSR1) {
+         fprintf(stderr, "signalfd %d lost across exec, %s\n", sigfd, strerror(errno));
+         return 1;
+      }
 
       rc = close(plainfilefd);
       if (rc < 0) {
@@ -242,6 +272,10 @@ int main(int argc, char* argv[])
       if (rc < 0) {
          fprintf(stderr, "Couldn't close epollfd, %s\n", strerror(errno));
       }
+      rc = close(sigfd);
+      if (rc < 0) {
+         fprintf(stderr, "Couldn't close sigfd, %s\n", strerror(errno));
+      }
 
       rc = unlink(argv[2]);
       if (rc < 0) {
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Futex semantics the guest side of futex() has to keep (wake with nobody waiting, wait on a
+ * changed word, wakeups after requeue), then lock contention cost with 2 to 64 threads hammering
+ * a pthread mutex. fastpath_test is for km --hcall-stats to check futex hypercalls were skipped.
+ *
+ * Usage: futex_contention_test [GREATEST options] [-- <iterations per thread>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int iterations = 100000;
+
+static long futex(int* uaddr, int op, int val, void* timeout, int* uaddr2, int val3)
+{
+   return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
+
+static int word;
+
+static void* waiter(void* arg)
+{
+   while (__atomic_load_n(&word, __ATOMIC_SEQ_CST) == 0) {
+      futex(&word, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+   }
+   return NULL;
+}
+
+TEST semantics_test()
+{
+   pthread_t tid;
+
+   word = 0;
+   ASSERT_EQ(0, futex(&word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+   ASSERT_EQ(0, futex(&word, FUTEX_WAKE, 1, NULL, NULL, 0));
+   ASSERT_EQ(-1, futex(&word, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0));
+   ASSERT_EQ(EAGAIN, errno);
+   ASSERT_EQ(-1, futex((int*)8, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0));   // unmapped
+   ASSERT_EQ(EFAULT, errno);
+
+   ASSERT_EQ(0, pthread_create(&tid, NULL, waiter, NULL));
+   usleep(100000);   // let it go to sleep
+   __atomic_store_n(&word, 1, __ATOMIC_SEQ_CST);
+   ASSERT_EQ(1, futex(&word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   PASS();
+}
+
+/*
+ * Wakes with nobody waiting and waits on a changed word, which the guest side of futex() handles
+ * without a hypercall. Run under km --hcall-stats the futex count shows whether it did.
+ */
+TEST fastpath_test()
+{
+   word = 0;
+   for (int i = 0; i < iterations; i++) {
+      ASSERT_EQ(0, futex(&word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+      ASSERT_EQ(-1, futex(&word, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0));
+      ASSERT_EQ(EAGAIN, errno);
+   }
+   PASS();
+}
+
+static int cv_word, mutex_word, woken;
+
+static void* requeue_waiter(void* arg)
+{
+   while (__atomic_load_n(&cv_word, __ATOMIC_SEQ_CST) == 0) {
+      futex(&cv_word, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+   }
+   // on the mutex word now
+   while (__atomic_load_n(&mutex_word, __ATOMIC_SEQ_CST) == 0) {
+      futex(&mutex_word, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+   }
+   __atomic_add_fetch(&woken, 1, __ATOMIC_SEQ_CST);
+   return NULL;
+}
+
+// Waiters moved to another futex by requeue must still get woken from there
+TEST requeue_test()
+{
+   pthread_t tid[4];
+   long moved;
+
+   cv_word = mutex_word = woken = 0;
+   for (int i = 0; i < 4; i++) {
+      ASSERT_EQ(0, pthread_create(&tid[i], NULL, requeue_waiter, NULL));
+   }
+   usleep(100000);
+   mutex_word = 0;
+   __atomic_store_n(&cv_word, 1, __ATOMIC_SEQ_CST);
+   moved = futex(&cv_word, FUTEX_CMP_REQUEUE_PRIVATE, 0, (void*)(long)INT32_MAX, &mutex_word, 1);
+   ASSERT(moved >= 0 && moved <= 4);
+   __atomic_store_n(&mutex_word, 1, __ATOMIC_SEQ_CST);
+   futex(&mutex_word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+   futex(&cv_word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+   for (int i = 0; i < 4; i++) {
+      ASSERT_EQ(0, pthread_join(tid[i], NULL));
+   }
+   ASSERT_EQ(4, woken);
+   PASS();
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint64_t counter;
+
+static void* contender(void* arg)
+{
+   for (int i = 0; i < iterations; i++) {
+      pthread_mutex_lock(&lock);
+      counter++;
+      pthread_mutex_unlock(&lock);
+   }
+   return NULL;
+}
+
+TEST contention_bench_test()
+{
+   static const int nthreads[] = {2, 4, 8, 16, 32, 64};
+   pthread_t tid[64];
+
+   for (int n = 0; n < sizeof(nthreads) / sizeof(nthreads[0]); n++) {
+      uint64_t start = now_nsec();
+
+      counter = 0;
+      for (int i = 0; i < nthreads[n]; i++) {
+         ASSERT_EQ(0, pthread_create(&tid[i], NULL, contender, NULL));
+      }
+      for (int i = 0; i < nthreads[n]; i++) {
+         ASSERT_EQ(0, pthread_join(tid[i], NULL));
+      }
+      ASSERT_EQ((uint64_t)nthreads[n] * iterations, counter);
+      printf("%2d threads: %ld ns per lock/unlock\n",
+             nthreads[n],
+             (long)((now_nsec() - start) / counter));
+   }
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   iterations = bench_arg(argc, argv, 1, iterations);
+   bench_usage(iterations <= 0, argv, "<iterations per thread>");
+
+   RUN_TEST(semantics_test);
+   RUN_TEST(fastpath_test);
+   RUN_TEST(requeue_test);
+   RUN_TEST(contention_bench_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
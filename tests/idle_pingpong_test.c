@@ -0,0 +1,157 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Ping-pong between two threads, each one going idle while the other has the ball. Once through a
+ * futex word, once through eventfds and epoll_wait(). The round trip time is mostly wakeup
+ * latency, run it under km --idle=latency, balanced and power to compare.
+ *
+ * Usage: idle_pingpong_test [GREATEST options] [-- <round trips>]
+ */
+
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int round_trips = 100000;
+
+static int turn;   // whose turn it is, 0 or 1
+
+static void futex_play(int me)
+{
+   for (int i = 0; i < round_trips; i++) {
+      int v;
+
+      while ((v = __atomic_load_n(&turn, __ATOMIC_ACQUIRE)) != me) {
+         syscall(SYS_futex, &turn, FUTEX_WAIT_PRIVATE, v, NULL, NULL, 0);
+      }
+      __atomic_store_n(&turn, 1 - me, __ATOMIC_RELEASE);
+      syscall(SYS_futex, &turn, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+   }
+}
+
+static void* futex_pong(void* arg)
+{
+   futex_play(1);
+   return NULL;
+}
+
+TEST futex_test()
+{
+   pthread_t tid;
+   uint64_t start;
+
+   turn = 0;
+   ASSERT_EQ(0, pthread_create(&tid, NULL, futex_pong, NULL));
+   start = now_nsec();
+   futex_play(0);
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   printf("futex ping-pong: %ld ns per round trip\n", (long)((now_nsec() - start) / round_trips));
+   PASS();
+}
+
+static int efd[2];   // efd[me] is written to give me the ball
+
+static int give(int fd)
+{
+   uint64_t val = 1;
+
+   return write(fd, &val, sizeof(val)) == sizeof(val) ? 0 : -1;
+}
+
+static int take(int epfd, int fd)
+{
+   struct epoll_event ev;
+   uint64_t val;
+
+   if (epoll_wait(epfd, &ev, 1, -1) != 1 || read(fd, &val, sizeof(val)) != sizeof(val)) {
+      return -1;
+   }
+   return 0;
+}
+
+static int epoll_play(int me)
+{
+   struct epoll_event ev = {.events = EPOLLIN};
+   int epfd;
+   int rc = 0;
+
+   if ((epfd = epoll_create1(0)) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, efd[me], &ev) < 0) {
+      return -1;
+   }
+   if (me == 0) {
+      rc = give(efd[1]);
+   }
+   for (int i = 0; i < round_trips && rc == 0; i++) {
+      rc = take(epfd, efd[me]);
+      if (rc == 0 && (me == 1 || i + 1 < round_trips)) {
+         rc = give(efd[1 - me]);
+      }
+   }
+   close(epfd);
+   return rc;
+}
+
+static void* epoll_pong(void* arg)
+{
+   return (void*)(long)epoll_play(1);
+}
+
+TEST epoll_test()
+{
+   pthread_t tid;
+   uint64_t start;
+   void* rc;
+
+   ASSERT((efd[0] = eventfd(0, 0)) >= 0);
+   ASSERT((efd[1] = eventfd(0, 0)) >= 0);
+   ASSERT_EQ(0, pthread_create(&tid, NULL, epoll_pong, NULL));
+   start = now_nsec();
+   ASSERT_EQ(0, epoll_play(0));
+   ASSERT_EQ(0, pthread_join(tid, &rc));
+   ASSERT_EQ(NULL, rc);
+   printf("epoll ping-pong: %ld ns per round trip\n", (long)((now_nsec() - start) / round_trips));
+   close(efd[0]);
+   close(efd[1]);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   round_trips = bench_arg(argc, argv, 1, round_trips);
+   bench_usage(round_trips <= 0, argv, "<round trips>");
+
+   RUN_TEST(futex_test);
+   RUN_TEST(epoll_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
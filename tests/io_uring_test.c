@@ -0,0 +1,406 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * io_uring through raw syscalls (no liburing): read/write/readv/writev, timeouts, per-SQE errors,
+ * rings in a fork child, registered buffers and probe, and a batch of reads submitted with one
+ * io_uring_enter() vs the same reads done with pread().
+ *
+ * Usage: io_uring_test [GREATEST options] [-- <number of reads>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+#include "mmap_test.h"   // for KM_PAYLOAD definition
+
+#define ENTRIES 64
+#define BLOCK 4096
+
+static int nios = 10000;
+
+typedef struct ring {
+   int fd;
+   struct io_uring_params p;
+   char* sq;
+   char* cq;
+   struct io_uring_sqe* sqes;
+   size_t sq_size;
+   size_t cq_size;
+} ring_t;
+
+#define SQ(r, f) ((unsigned*)((r)->sq + (r)->p.sq_off.f))
+#define CQ(r, f) ((unsigned*)((r)->cq + (r)->p.cq_off.f))
+
+static int ring_init(ring_t* r, unsigned entries)
+{
+   memset(r, 0, sizeof(*r));
+   if ((r->fd = syscall(SYS_io_uring_setup, entries, &r->p)) < 0) {
+      return -1;
+   }
+   r->sq_size = r->p.sq_off.array + r->p.sq_entries * sizeof(unsigned);
+   r->cq_size = r->p.cq_off.cqes + r->p.cq_entries * sizeof(struct io_uring_cqe);
+   r->sq = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+   r->cq = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+   r->sqes = mmap(NULL,
+                  r->p.sq_entries * sizeof(struct io_uring_sqe),
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED,
+                  r->fd,
+                  IORING_OFF_SQES);
+   if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+      return -1;
+   }
+   return 0;
+}
+
+static void ring_fini(ring_t* r)
+{
+   munmap(r->sqes, r->p.sq_entries * sizeof(struct io_uring_sqe));
+   munmap(r->cq, r->cq_size);
+   munmap(r->sq, r->sq_size);
+   close(r->fd);
+}
+
+// Next free SQE, zeroed and queued. NULL if the SQ ring is full.
+static struct io_uring_sqe* ring_get_sqe(ring_t* r)
+{
+   unsigned head = __atomic_load_n(SQ(r, head), __ATOMIC_ACQUIRE);
+   unsigned tail = *SQ(r, tail);
+   unsigned idx = tail & *SQ(r, ring_mask);
+
+   if (tail - head >= *SQ(r, ring_entries)) {
+      return NULL;
+   }
+   memset(&r->sqes[idx], 0, sizeof(struct io_uring_sqe));
+   SQ(r, array)[idx] = idx;
+   __atomic_store_n(SQ(r, tail), tail + 1, __ATOMIC_RELEASE);
+   return &r->sqes[idx];
+}
+
+static struct io_uring_sqe*
+ring_prep(ring_t* r, int op, int fd, void* addr, unsigned len, off_t off, uint64_t user_data)
+{
+   struct io_uring_sqe* sqe = ring_get_sqe(r);
+   if (sqe != NULL) {
+      sqe->opcode = op;
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t)addr;
+      sqe->len = len;
+      sqe->off = off;
+      sqe->user_data = user_data;
+   }
+   return sqe;
+}
+
+static int ring_enter(ring_t* r, unsigned to_submit, unsigned min_complete)
+{
+   return syscall(SYS_io_uring_enter,
+                  r->fd,
+                  to_submit,
+                  min_complete,
+                  min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                  NULL,
+                  0);
+}
+
+// Reap one CQE, waiting for it if needed. Returns 0 or -1.
+static int ring_wait_cqe(ring_t* r, struct io_uring_cqe* cqe)
+{
+   unsigned head = *CQ(r, head);
+
+   if (head == __atomic_load_n(CQ(r, tail), __ATOMIC_ACQUIRE) && ring_enter(r, 0, 1) < 0) {
+      return -1;
+   }
+   if (head == __atomic_load_n(CQ(r, tail), __ATOMIC_ACQUIRE)) {
+      return -1;
+   }
+   *cqe = ((struct io_uring_cqe*)(r->cq + r->p.cq_off.cqes))[head & *CQ(r, ring_mask)];
+   __atomic_store_n(CQ(r, head), head + 1, __ATOMIC_RELEASE);
+   return 0;
+}
+
+static int tmpfile_fd(void)
+{
+   char fname[] = "/tmp/io_uring_testXXXXXX";
+   int fd = mkstemp(fname);
+   if (fd >= 0) {
+      unlink(fname);
+   }
+   return fd;
+}
+
+TEST read_write_test()
+{
+   static const char msg[] = "through the ring";
+   char buf[64] = {};
+   char a[8] = {}, b[sizeof(msg) - 8] = {};
+   struct iovec iov[2] = {{a, sizeof(a)}, {b, sizeof(b)}};
+   struct io_uring_cqe cqe;
+   ring_t r;
+   int fd = tmpfile_fd();
+
+   ASSERT_NEQ(-1, fd);
+   ASSERT_EQ(0, ring_init(&r, 8));
+   ASSERT_EQ(FD_CLOEXEC, fcntl(r.fd, F_GETFD));
+
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_NOP, -1, NULL, 0, 0, 1));
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_WRITE, fd, (void*)msg, sizeof(msg), 0, 2));
+   ASSERT_EQ(2, ring_enter(&r, 2, 2));
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(1, cqe.user_data);
+   ASSERT_EQ(0, cqe.res);
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(2, cqe.user_data);
+   ASSERT_EQ(sizeof(msg), cqe.res);
+
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_READ, fd, buf, sizeof(buf), 0, 3));
+   ASSERT_EQ(1, ring_enter(&r, 1, 1));
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(sizeof(msg), cqe.res);
+   ASSERT_STR_EQ(msg, buf);
+
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_READV, fd, iov, 2, 0, 4));
+   ASSERT_EQ(1, ring_enter(&r, 1, 1));
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(sizeof(msg), cqe.res);
+   ASSERT_EQ(0, memcmp(msg, a, sizeof(a)));
+   ASSERT_STR_EQ(msg + sizeof(a), b);
+
+   // write it back doubled up with writev, then read past the first copy
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_WRITEV, fd, iov, 2, sizeof(msg), 5));
+   ASSERT_EQ(1, ring_enter(&r, 1, 1));
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(sizeof(msg), cqe.res);
+   ASSERT_EQ(sizeof(msg), pread(fd, buf, sizeof(buf), sizeof(msg)));
+   ASSERT_STR_EQ(msg, buf);
+
+   // timeout with no completions to wait for
+   struct __kernel_timespec ts = {.tv_nsec = 1000 * 1000};
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_TIMEOUT, -1, &ts, 1, 0, 6));
+   ASSERT_EQ(1, ring_enter(&r, 1, 1));
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(6, cqe.user_data);
+   ASSERT_EQ(-ETIME, cqe.res);
+
+   ring_fini(&r);
+   close(fd);
+   PASS();
+}
+
+TEST errors_test()
+{
+   struct io_uring_cqe cqe;
+   char buf[16];
+   ring_t r;
+   int fd = tmpfile_fd();
+
+   ASSERT_NEQ(-1, fd);
+   ASSERT_EQ(0, ring_init(&r, 8));
+
+   // failures are per SQE, in the CQE
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_READ, 1234, buf, sizeof(buf), 0, 1));
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_WRITE, fd, (void*)8, sizeof(buf), 0, 2));
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_NOP, -1, NULL, 0, 0, 3));
+   ASSERT_EQ(3, ring_enter(&r, 3, 3));
+   int res[4] = {};
+   for (int i = 0; i < 3; i++) {   // completion order isn't submission order
+      ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+      ASSERT(cqe.user_data >= 1 && cqe.user_data <= 3);
+      res[cqe.user_data] = cqe.res;
+   }
+   ASSERT_EQ(-EBADF, res[1]);
+   ASSERT_EQ(-EFAULT, res[2]);
+   ASSERT_EQ(0, res[3]);
+
+   // ops that would open fds behind km's back are refused
+   if (KM_PAYLOAD() == 1) {
+      struct io_uring_sqe* sqe =
+          ring_prep(&r, IORING_OP_OPENAT, AT_FDCWD, "/dev/null", O_RDONLY, 0, 4);
+      ASSERT_NEQ(NULL, sqe);
+      ASSERT_EQ(1, ring_enter(&r, 1, 1));
+      ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+      ASSERT_EQ(4, cqe.user_data);
+      ASSERT_EQ(-EINVAL, cqe.res);
+   }
+
+   ASSERT_EQ(-1, syscall(SYS_io_uring_enter, fd, 0, 0, 0, NULL, 0));
+   ASSERT_EQ(EOPNOTSUPP, errno);
+   ASSERT_EQ(-1, syscall(SYS_io_uring_setup, 8, (void*)8));
+   ASSERT_EQ(EFAULT, errno);
+   ring_fini(&r);
+   close(fd);
+   PASS();
+}
+
+// Parent and child would both submit to the shared host ring, under km the child can't
+TEST fork_test()
+{
+   struct io_uring_cqe cqe;
+   ring_t r;
+   int status;
+
+   if (KM_PAYLOAD() == 0) {
+      SKIP();
+   }
+   ASSERT_EQ(0, ring_init(&r, 8));
+   pid_t pid = fork();
+   ASSERT_NEQ(-1, pid);
+   if (pid == 0) {
+      exit(syscall(SYS_io_uring_enter, r.fd, 0, 0, 0, NULL, 0) == -1 && errno == EBADFD ? 0 : 1);
+   }
+   ASSERT_EQ(pid, waitpid(pid, &status, 0));
+   ASSERT(WIFEXITED(status));
+   ASSERT_EQ(0, WEXITSTATUS(status));
+
+   // the parent's ring is untouched
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_NOP, -1, NULL, 0, 0, 5));
+   ASSERT_EQ(1, ring_enter(&r, 1, 1));
+   ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+   ASSERT_EQ(5, cqe.user_data);
+   ring_fini(&r);
+   PASS();
+}
+
+TEST registered_test()
+{
+   static char fixed[2][BLOCK];
+   struct iovec iov[2] = {{fixed[0], BLOCK}, {fixed[1], BLOCK}};
+   struct io_uring_cqe cqe;
+   ring_t r;
+   int fd = tmpfile_fd();
+
+   ASSERT_NEQ(-1, fd);
+   ASSERT_EQ(0, ring_init(&r, 8));
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov, 2));
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_FILES, &fd, 1));
+
+   // write from one registered buffer through the registered file, then read into the other
+   memset(fixed[1], 'f', BLOCK);
+   struct io_uring_sqe* sqe = ring_prep(&r, IORING_OP_WRITE_FIXED, 0, fixed[1], BLOCK, 0, 1);
+   ASSERT_NEQ(NULL, sqe);
+   sqe->buf_index = 1;
+   sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+   ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_READ_FIXED, fd, fixed[0], BLOCK, 0, 2));
+   ASSERT_EQ(2, ring_enter(&r, 2, 2));
+   for (int i = 1; i <= 2; i++) {
+      ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+      ASSERT_EQ(i, cqe.user_data);
+      ASSERT_EQ(BLOCK, cqe.res);
+   }
+   ASSERT_EQ(0, memcmp(fixed[1], fixed[0], BLOCK));
+
+   struct io_uring_probe* probe =
+       calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+   ASSERT_NEQ(NULL, probe);
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, 256));
+   ASSERT(probe->ops_len > IORING_OP_READ);
+   ASSERT((probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0);
+   if (KM_PAYLOAD() == 1) {
+      ASSERT_EQ(0, probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+   }
+   free(probe);
+
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_UNREGISTER_FILES, NULL, 0));
+   ASSERT_EQ(0, syscall(SYS_io_uring_register, r.fd, IORING_UNREGISTER_BUFFERS, NULL, 0));
+   ring_fini(&r);
+   close(fd);
+   PASS();
+}
+
+TEST batch_test()
+{
+   static char buf[ENTRIES][BLOCK];
+   struct timespec start, end;
+   struct io_uring_cqe cqe;
+   ring_t r;
+   int fd = tmpfile_fd();
+
+   ASSERT_NEQ(-1, fd);
+   for (int i = 0; i < ENTRIES; i++) {
+      memset(buf[i], i, BLOCK);
+      ASSERT_EQ(BLOCK, pwrite(fd, buf[i], BLOCK, i * BLOCK));
+   }
+   ASSERT_EQ(0, ring_init(&r, ENTRIES));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < nios; i++) {
+      ASSERT_EQ(BLOCK, pread(fd, buf[i % ENTRIES], BLOCK, (i % ENTRIES) * BLOCK));
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   uint64_t plain = ts_nsec(&end) - ts_nsec(&start);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int done = 0; done < nios;) {
+      int n = nios - done < ENTRIES ? nios - done : ENTRIES;
+      for (int i = 0; i < n; i++) {
+         ASSERT_NEQ(NULL, ring_prep(&r, IORING_OP_READ, fd, buf[i], BLOCK, i * BLOCK, i));
+      }
+      ASSERT_EQ(n, ring_enter(&r, n, n));
+      for (int i = 0; i < n; i++) {
+         ASSERT_EQ(0, ring_wait_cqe(&r, &cqe));
+         ASSERT_EQ(BLOCK, cqe.res);
+      }
+      done += n;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   uint64_t batched = ts_nsec(&end) - ts_nsec(&start);
+   for (int i = 0; i < ENTRIES; i++) {
+      ASSERT_EQ((char)i, buf[i][BLOCK - 1]);
+   }
+
+   printf("%d reads with pread: %ld ns/read\n", nios, (long)(plain / nios));
+   printf("%d reads with io_uring, %d per enter: %ld ns/read\n",
+          nios,
+          ENTRIES,
+          (long)(batched / nios));
+   ring_fini(&r);
+   close(fd);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nios = bench_arg(argc, argv, 1, nios);
+   bench_usage(nios <= 0, argv, "<number of reads>");
+
+   RUN_TEST(read_write_test);
+   RUN_TEST(errors_test);
+   RUN_TEST(fork_test);
+   RUN_TEST(registered_test);
+   RUN_TEST(batch_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -34,7 +34,8 @@ not_needed_generic='mem_brk mem_test vdso'
 fi
 # TODO: gdb_delete_breakpoint and gdb_server_race are caused by race described in https://github.com/kontainapp/km/issues/821.
 # Disable them for now to improve signal/noise ratio
-todo_generic='gdb_delete_breakpoint gdb_server_race clock_gettime'
+# thread_scale needs guest threads multiplexed on vcpus, each thread takes a vcpu for now
+todo_generic='gdb_delete_breakpoint gdb_server_race clock_gettime thread_scale'
 
 not_needed_static='gdb_sharedlib dlopen'
 todo_static=''
@@ -264,6 +265,32 @@ fi
    assert [ $status -eq $expected_status ]
 }
 
+@test "mem_brk_startup($test_type): large brk/tbrk moves at startup (brk_startup_test$ext)" {
+   run km_with_timeout --overcommit-memory brk_startup_test$ext -- 8
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "mem_share_text($test_type): read-only segments shared between instances (share_text_test$ext)" {
+   run km_with_timeout share_text_test$ext -- private
+   assert_success
+   assert_line --partial "read-only segments: Pss"
+
+   run km_with_timeout --share-text share_text_test$ext -- shared
+   assert_success
+
+   # Pss of the shared segments is split between instances running at the same time, each checks
+   # its text Pss is below its Rss
+   pids=""
+   for i in 1 2 3 4 ; do
+      km_with_timeout --share-text share_text_test$ext -- shared 2 &
+      pids="$pids $!"
+   done
+   for pid in $pids ; do
+      wait $pid
+   done
+}
+
 @test "hc_basic($test_type): basic run and print hello world (hello_test$ext)" {
    args="more_flags to_check: -f and check --args !"
    run ./hello_test.fedora $args
@@ -686,6 +713,17 @@ fi
    assert_failure
 }
 
+@test "brk_map_large_test($test_type): brk and map over 512GB, multiple PML4 entries (brk_map_test$ext)" {
+   # 40 bits is just over one PML4 entry per zone, 42 is max supported
+   for bits in 40 41 42 ; do
+      if [ $(bus_width) -lt $bits ] ; then break ; fi
+      run km_with_timeout -P $bits --overcommit-memory brk_map_test$ext -- $bits
+      check_optional_mem_size_failure
+   done
+   run km_with_timeout -P 43 hello_test$ext # over GUEST_MAX_PHYSMEM_SUPPORTED
+   assert_failure
+}
+
 @test "cli($test_type): test 'km -v' and other small tests" {
    run km_with_timeout -v
    assert_success
@@ -949,6 +987,157 @@ fi
    assert_success
 }
 
+@test "udp_mmsg($test_type): sendmmsg/recvmmsg and UDP packet rate (udp_mmsg_test$ext)" {
+   run km_with_timeout udp_mmsg_test$ext -- 200000 32
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "splice($test_type): splice/tee/vmsplice and proxy throughput (splice_test$ext)" {
+   run km_with_timeout splice_test$ext -- 256
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "many_conn($test_type): guest fd table beyond 1024, RLIMIT_NOFILE and EMFILE (many_conn_test$ext)" {
+   run km_with_timeout many_conn_test$ext -- 100000
+   assert_success
+   assert_line --partial "skip: 0"
+   # every one of them was connected
+   assert_line --partial "100000 connections: open"
+}
+
+@test "epoll_rearm($test_type): epoll_ctl with many fds and EPOLLONESHOT re-arm (epoll_rearm_test$ext)" {
+   run km_with_timeout epoll_rearm_test$ext -- 20000 20
+   assert_success
+   assert_line --partial "skip: 0"
+   # the payload fd limit didn't cut the fd count
+   refute_line --partial "RLIMIT_NOFILE hard limit"
+}
+
+@test "timerfd_signalfd($test_type): timerfd, signalfd and epoll event loop (timerfd_signalfd_test$ext)" {
+   run km_with_timeout timerfd_signalfd_test$ext
+   assert_success
+}
+
+@test "memfd_fallocate($test_type): memfd shared mappings, fallocate and sequential scan (memfd_fallocate_test$ext)" {
+   run km_with_timeout memfd_fallocate_test$ext -- 64
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "io_uring($test_type): io_uring ring, per-SQE errors and batched reads (io_uring_test$ext)" {
+   run km_with_timeout io_uring_test$ext -- 20000
+   assert_success
+   # fork_test only runs in a payload
+   assert_line --partial "skip: 0"
+}
+
+@test "poll($test_type): ppoll, epoll_pwait2 and poll over 1k and 10k fds (poll_test$ext)" {
+   run km_with_timeout poll_test$ext -- 1000
+   assert_success
+   assert_line --partial "skip: 0"
+   # 10k fds fit in the payload fd table
+   refute_line --partial "skipped, RLIMIT_NOFILE"
+}
+
+@test "proc_stat($test_type): /proc/self/stat, status, maps, statm and smaps_rollup (proc_stat_test$ext)" {
+   run km_with_timeout proc_stat_test$ext -- 1000
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "writev($test_type): I/O buffer range checks, IOV_MAX iovecs and writev throughput (writev_test$ext)" {
+   run km_with_timeout writev_test$ext -- 1000
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "thread_scale($test_type): create 10k live threads (thread_scale_test$ext)" {
+   run km_with_timeout --timeout 60s thread_scale_test$ext -- 10000
+   assert_success
+   assert_line --partial "skip: 0"
+   assert_line --partial "threads: 10000 of 10000 created"
+}
+
+@test "clone_latency($test_type): thread burst clone latency with and without vcpu pool (clone_latency_test$ext)" {
+   run km_with_timeout clone_latency_test$ext -- 64
+   assert_success
+   assert_line --partial "skip: 0"
+   run km_with_timeout --vcpu-pool=64 clone_latency_test$ext -- 64
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "posix_timer($test_type): timer_create, overruns, setitimer and timer signal latency (posix_timer_test$ext)" {
+   run km_with_timeout posix_timer_test$ext -- 1000
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "signal_latency($test_type): FP state across signal handlers and signal round trip latency (signal_latency_test$ext)" {
+   run km_with_timeout signal_latency_test$ext -- 1000
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "futex_contention($test_type): guest futex fast path and lock contention (futex_contention_test$ext)" {
+   run km_with_timeout futex_contention_test$ext -- 10000
+   assert_success
+   assert_line --partial "skip: 0"
+   # 2 * 10000 futex calls with nothing to wait for or wake, almost none should get to KM
+   run km_with_timeout --hcall-stats futex_contention_test$ext -t fastpath_test -- 10000
+   assert_success
+   futex_hcalls=$(echo "$output" | sed -n 's/.*futex(202) called[[:space:]]*\([0-9]*\) times.*/\1/p')
+   [ "${futex_hcalls:-0}" -lt 100 ]
+}
+
+@test "signal_storm($test_type): process and thread directed signal storms (signal_storm_test$ext)" {
+   run km_with_timeout signal_storm_test$ext -- 10000
+   assert_success
+   assert_line --partial "skip: 0"
+}
+
+@test "affinity($test_type): per thread CPU affinity (affinity_test$ext)" {
+   run km_with_timeout affinity_test$ext
+   assert_success
+
+   cpus_line=$(echo "$output" | grep "payload CPUs:")
+
+   run km_with_timeout --cpuset=0 --pin-vcpus affinity_test$ext
+   assert_success
+
+   # km threads on their own CPU don't take any away from the payload
+   run km_with_timeout --pin-km-threads=0 affinity_test$ext
+   assert_success
+   assert_line "$cpus_line"
+}
+
+@test "sched_policy($test_type): per thread policy, nice and io priority (sched_policy_test$ext)" {
+   run km_with_timeout sched_policy_test$ext
+   assert_success
+}
+
+@test "idle_pingpong($test_type): wakeup latency under idle policies (idle_pingpong_test$ext)" {
+   for policy in latency balanced power; do
+      run km_with_timeout --idle=$policy idle_pingpong_test$ext -- 10000
+      assert_success
+      assert_line --partial "skip: 0"
+   done
+
+   run km_with_timeout --idle=power --idle-poll-ns=20000 idle_pingpong_test$ext -- 1000
+   assert_success
+}
+
+@test "cpu_topology($test_type): CPU count seen by the payload (cpu_topology_test$ext)" {
+   run km_with_timeout cpu_topology_test$ext
+   assert_success
+
+   run km_with_timeout --cpus=1 cpu_topology_test$ext -- 1
+   assert_success
+   assert_line --partial "1 CPUs"
+}
+
 @test "dl_iterate_phdr($test_type): AUXV and dl_iterate_phdr (dl_iterate_phdr_test$ext)" {
    run km_with_timeout dl_iterate_phdr_test$ext -v
    assert_success
@@ -1197,6 +1386,13 @@ fi
    assert_failure
    assert_output --partial "cannot set payload arguments when resuming a snapshot"
    assert [ ! -f ${CORE} ]
+
+   # over 512GB of guest physical memory the layout is different, resume with it fails
+   if [ "${USE_VIRT}" = 'kvm' ] && [ $(bus_width) -ge 40 ] ; then
+      run km_with_timeout -P 40 ${SNAP}
+      assert_failure
+      assert_output --partial "do not agree, resume with -P"
+   fi
    rm -f ${SNAP} ${KMLOG} ${SNAP_OUTPUT} ${SNAP_INPUT}
 }
 
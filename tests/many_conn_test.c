@@ -0,0 +1,158 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Guest fd table size: RLIMIT_NOFILE handling, EMFILE past the soft limit, and a server holding
+ * many connections open at once. Connections are AF_UNIX stream sockets so the number is not
+ * limited by local port range, each one takes two fds (client and accepted). Fails if the hard
+ * RLIMIT_NOFILE is too low for the number of connections asked for.
+ *
+ * Usage: many_conn_test [GREATEST options] [-- <connections>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static long connections = 100000;
+
+TEST rlimit_test()
+{
+   struct rlimit lim, saved;
+
+   ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &saved));
+   ASSERT(saved.rlim_cur <= saved.rlim_max);
+
+   lim = (struct rlimit){.rlim_cur = saved.rlim_max + 1, .rlim_max = saved.rlim_max};
+   ASSERT_EQ(-1, setrlimit(RLIMIT_NOFILE, &lim));
+   ASSERT_EQ(EINVAL, errno);
+   lim = (struct rlimit){.rlim_cur = saved.rlim_max, .rlim_max = saved.rlim_max + 1};
+   ASSERT_EQ(-1, setrlimit(RLIMIT_NOFILE, &lim));
+   ASSERT_EQ(EPERM, errno);
+
+   lim = (struct rlimit){.rlim_cur = 64, .rlim_max = saved.rlim_max};
+   ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &lim));
+   ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &lim));
+   ASSERT_EQ_FMT(64L, (long)lim.rlim_cur, "%ld");
+
+   // fill up the table, then make sure pipe() doesn't leave half of it behind
+   int fds[64];
+   int n = 0;
+   while (n < 64 && (fds[n] = dup(0)) >= 0) {
+      ASSERT(fds[n] < 64);
+      n++;
+   }
+   ASSERT(n < 64);
+   ASSERT_EQ(EMFILE, errno);
+   close(fds[--n]);
+   int p[2];
+   ASSERT_EQ(-1, pipe(p));
+   ASSERT_EQ(EMFILE, errno);
+   ASSERT_NEQ(-1, fds[n] = dup(0));
+   n++;
+   while (n > 0) {
+      close(fds[--n]);
+   }
+
+   lim = (struct rlimit){.rlim_cur = saved.rlim_max, .rlim_max = saved.rlim_max};
+   ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &lim));
+   PASS();
+}
+
+TEST many_connections_test()
+{
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1;
+   struct timespec start, mid, end;
+   struct rlimit lim;
+
+   ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &lim));
+   if (connections > ((long)lim.rlim_max - 32) / 2) {
+      FAILm("RLIMIT_NOFILE hard limit is too low for that many connections");
+   }
+   lim.rlim_cur = lim.rlim_max;
+   ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &lim));
+
+   int* fds = calloc(connections * 2, sizeof(int));
+   ASSERT_NEQ(NULL, fds);
+
+   // abstract socket name, "\0many_conn_<pid>"
+   addrlen += snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "many_conn_%d", getpid());
+   int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+   ASSERT_NEQ(-1, lfd);
+   ASSERT_EQ(0, bind(lfd, (struct sockaddr*)&addr, addrlen));
+   ASSERT_EQ(0, listen(lfd, 128));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long i = 0; i < connections; i++) {
+      int c = socket(AF_UNIX, SOCK_STREAM, 0);
+      ASSERT_NEQ_FMT(-1, c, "%d");
+      ASSERT_EQ(0, connect(c, (struct sockaddr*)&addr, addrlen));
+      int s = accept(lfd, NULL, NULL);
+      ASSERT_NEQ_FMT(-1, s, "%d");
+      fds[i * 2] = c;
+      fds[i * 2 + 1] = s;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &mid);
+
+   // make sure the highest ones actually work
+   char c = 'k';
+   ASSERT_EQ(1, write(fds[connections * 2 - 2], &c, 1));
+   c = 0;
+   ASSERT_EQ(1, read(fds[connections * 2 - 1], &c, 1));
+   ASSERT_EQ('k', c);
+
+   for (long i = 0; i < connections * 2; i++) {
+      close(fds[i]);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   close(lfd);
+   free(fds);
+
+   printf("%ld connections: open %ld usec/conn, close %ld usec/conn\n",
+          connections,
+          (long)((ts_nsec(&mid) - ts_nsec(&start)) / 1000 / connections),
+          (long)((ts_nsec(&end) - ts_nsec(&mid)) / 1000 / connections));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   connections = bench_arg(argc, argv, 1, connections);
+   bench_usage(connections <= 0, argv, "<connections>");
+
+   RUN_TEST(rlimit_test);
+   RUN_TEST(many_connections_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * memfd_create with dual (RW + RX style) MAP_SHARED mappings, fallocate, sync_file_range, and a
+ * sequential scan of a file with and without fadvise/readahead hints. The file is dropped from
+ * page cache with POSIX_FADV_DONTNEED before each scan.
+ *
+ * Usage: memfd_fallocate_test [GREATEST options] [-- <MB to scan>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+#define MIB (1ul << 20)
+#define CHUNK (128 * 1024)
+
+static size_t total = 64 * MIB;
+
+TEST memfd_test()
+{
+   static const char msg[] = "written through the other mapping";
+   size_t size = 4 * getpagesize();
+   char name[64];
+   int fd = memfd_create("km_memfd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+   ASSERT_NEQ(-1, fd);
+   ASSERT_EQ(FD_CLOEXEC, fcntl(fd, F_GETFD));
+   snprintf(name, sizeof(name), "/proc/self/fd/%d", fd);
+   char link[64] = {};
+   ASSERT_NEQ(-1, readlink(name, link, sizeof(link) - 1));
+   ASSERT_STR_EQ("/memfd:km_memfd (deleted)", link);
+   ASSERT_EQ(0, ftruncate(fd, size));
+
+   // two views of the same pages, like a JIT writing code through one and running the other
+   char* rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   ASSERT_NEQ(MAP_FAILED, rw);
+   char* ro = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+   ASSERT_NEQ(MAP_FAILED, ro);
+   ASSERT_NEQ(rw, ro);
+   strcpy(rw + size - sizeof(msg), msg);
+   ASSERT_STR_EQ(msg, ro + size - sizeof(msg));
+   // flipping protection must not lose the contents
+   ASSERT_EQ(0, mprotect(ro, size, PROT_READ | PROT_EXEC));
+   ASSERT_EQ(0, mprotect(rw, size, PROT_READ));
+   ASSERT_STR_EQ(msg, ro + size - sizeof(msg));
+   ASSERT_STR_EQ(msg, rw + size - sizeof(msg));
+   char buf[sizeof(msg)];
+   ASSERT_EQ(sizeof(msg), pread(fd, buf, sizeof(buf), size - sizeof(msg)));
+   ASSERT_STR_EQ(msg, buf);
+
+   // private copy keeps its own writes across mprotect
+   char* priv = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   ASSERT_NEQ(MAP_FAILED, priv);
+   priv[0] = 'p';
+   ASSERT_EQ(0, mprotect(priv, size, PROT_READ));
+   ASSERT_EQ('p', priv[0]);
+   ASSERT_EQ(0, ro[0]);
+
+   // seals
+   ASSERT_EQ(0, munmap(rw, size));
+   ASSERT_EQ(0, munmap(priv, size));
+   ASSERT_EQ(0, munmap(ro, size));
+   ASSERT_EQ(0, fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK));
+   ASSERT_EQ(-1, ftruncate(fd, 0));
+   ASSERT_EQ(EPERM, errno);
+
+   ASSERT_EQ(-1, memfd_create("bad", ~0u));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, syscall(SYS_memfd_create, (void*)-1, 0));
+   ASSERT_EQ(EFAULT, errno);
+   close(fd);
+   PASS();
+}
+
+TEST fallocate_test()
+{
+   char fname[] = "/tmp/fallocate_testXXXXXX";
+   struct stat st;
+   int fd = mkstemp(fname);
+
+   ASSERT_NEQ(-1, fd);
+   unlink(fname);
+   ASSERT_EQ(0, fallocate(fd, 0, 0, MIB));
+   ASSERT_EQ(0, fstat(fd, &st));
+   ASSERT_EQ(MIB, st.st_size);
+   ASSERT(st.st_blocks * 512 >= MIB);
+   ASSERT_EQ(0, fallocate(fd, FALLOC_FL_KEEP_SIZE, MIB, MIB));
+   ASSERT_EQ(0, fstat(fd, &st));
+   ASSERT_EQ(MIB, st.st_size);
+
+   static char buf[MIB / 2];
+   memset(buf, 'k', sizeof(buf));
+   ASSERT_EQ(sizeof(buf), pwrite(fd, buf, sizeof(buf), 0));
+   ASSERT_EQ(0,
+             sync_file_range(fd, 0, sizeof(buf), SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER));
+   ASSERT_EQ(0, posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
+   ASSERT_EQ(0, readahead(fd, 0, MIB));
+
+   ASSERT_EQ(-1, fallocate(fd, 0, 0, 0));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, fallocate(-1, 0, 0, MIB));
+   ASSERT_EQ(EBADF, errno);
+   ASSERT_EQ(EBADF, posix_fadvise(-1, 0, 0, POSIX_FADV_NORMAL));
+   ASSERT_EQ(EINVAL, posix_fadvise(fd, 0, 0, 1234));
+   ASSERT_EQ(-1, readahead(-1, 0, MIB));
+   ASSERT_EQ(EBADF, errno);
+   ASSERT_EQ(-1, sync_file_range(fd, 0, MIB, ~0u));
+   ASSERT_EQ(EINVAL, errno);
+   close(fd);
+   PASS();
+}
+
+/*
+ * Read the whole file sequentially in CHUNK pieces, with the cache dropped first. With 'hint' set,
+ * tell the kernel up front and keep readahead one window ahead of the reads.
+ * Returns nsec or 0 on error.
+ */
+static uint64_t scan(int fd, int hint)
+{
+   static char buf[CHUNK];
+   struct timespec start, end;
+
+   if (fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+      return 0;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   if (hint != 0 && (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0 ||
+                     readahead(fd, 0, 16 * CHUNK) != 0)) {
+      return 0;
+   }
+   for (size_t off = 0; off < total; off += CHUNK) {
+      if (hint != 0 && off % (16 * CHUNK) == 0) {
+         readahead(fd, off + 16 * CHUNK, 16 * CHUNK);
+      }
+      if (pread(fd, buf, CHUNK, off) != CHUNK || buf[0] != (char)(off / CHUNK)) {
+         return 0;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+   return ts_nsec(&end) - ts_nsec(&start);
+}
+
+TEST sequential_scan_test()
+{
+   static char buf[CHUNK];
+   char fname[] = "/tmp/seqscan_testXXXXXX";
+   int fd = mkstemp(fname);
+
+   ASSERT_NEQ(-1, fd);
+   unlink(fname);
+   ASSERT_EQ(0, fallocate(fd, 0, 0, total));
+   for (size_t off = 0; off < total; off += CHUNK) {
+      memset(buf, (char)(off / CHUNK), sizeof(buf));
+      ASSERT_EQ(CHUNK, pwrite(fd, buf, CHUNK, off));
+   }
+
+   uint64_t plain = scan(fd, 0);
+   ASSERT_NEQ(0, plain);
+   uint64_t hinted = scan(fd, 1);
+   ASSERT_NEQ(0, hinted);
+   printf("sequential scan: %ld MB/s\n", (long)(total * NSEC_PER_SEC / MIB / plain));
+   printf("sequential scan with fadvise/readahead: %ld MB/s\n",
+          (long)(total * NSEC_PER_SEC / MIB / hinted));
+   close(fd);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   total = bench_arg(argc, argv, 1, total / MIB) * MIB;
+   bench_usage(total == 0, argv, "<MB to scan>");
+
+   RUN_TEST(memfd_test);
+   RUN_TEST(fallocate_test);
+   RUN_TEST(sequential_scan_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
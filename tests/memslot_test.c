@@ -53,29 +53,61 @@ static inline int check_fail(char* expr, char* file, int line, int idx)
    return 1;
 }
 
-int main(int argc, char** argv)
+/*
+ * Check the VA layout for the current machine.guest_max_physmem: zones and private area don't
+ * overlap, and memreg indexes stay out of the reserved slots.
+ */
+static int check_layout(void)
 {
-   int size_in_gb = 512;   // ph. mem size
    int err_count = 0;
+   int idx = -1;
+   uint64_t zone_end = GUEST_MEM_TOP_VA + GUEST_MEM_START_VA;
 
-   if (argc == 2) {
-      size_in_gb = atoi(argv[1]);
-      printf("ok\n");
+   printf("%s layout, top VA 0x%lx, VA offset 0x%lx, private VA 0x%lx PA 0x%lx\n",
+          machine.guest_high_gva ? "high" : "low",
+          GUEST_MEM_TOP_VA,
+          GUEST_VA_OFFSET,
+          GUEST_PRIVATE_MEM_START_VA,
+          GUEST_PRIVATE_MEM_START_GPA);
+   int high = (machine.guest_max_physmem > GUEST_MAX_PHYSMEM_DEFAULT);
+   err_count += CHECK(machine.guest_high_gva == high, idx);
+   err_count += CHECK(machine.last_mem_idx < KM_RSRV_VDSOSLOT, idx);
+   err_count += CHECK(zone_end - GUEST_VA_OFFSET == machine.guest_max_physmem, idx);
+   err_count += CHECK(GUEST_VA_OFFSET % GIB == 0, idx);
+   err_count += CHECK(GUEST_PRIVATE_MEM_START_VA % (512 * GIB) == 0, idx);
+   err_count += CHECK(GUEST_PRIVATE_MEM_START_VA >= machine.guest_max_physmem, idx);
+   err_count += CHECK(GUEST_PRIVATE_MEM_START_VA >= zone_end ||
+                          GUEST_PRIVATE_MEM_START_VA + 512 * GIB <= GUEST_VA_OFFSET,
+                      idx);
+   if (machine.guest_high_gva) {
+      // private area PA is in the last (never allocated) 2MB of PA
+      err_count += CHECK(GUEST_PRIVATE_MEM_START_GPA >= machine.guest_max_physmem - 2 * MIB, idx);
+      err_count += CHECK(GUEST_PRIVATE_MEM_START_GPA < machine.guest_max_physmem, idx);
    }
-   machine.guest_max_physmem = size_in_gb * GIB;
+   // the first and last byte of each zone
+   idx = gva_to_memreg_idx(GUEST_MEM_START_VA);
+   err_count += CHECK(idx == 1, idx);
+   idx = gva_to_memreg_idx(GUEST_MEM_TOP_VA - 1);
+   err_count += CHECK(idx == machine.last_mem_idx - 1, idx);
+   err_count +=
+       CHECK(gva_to_gpa(GUEST_MEM_TOP_VA - 1) == machine.guest_max_physmem - 2 * MIB - 1, idx);
+   return err_count;
+}
+
+static int check_memslots(uint64_t size_in_gb)
+{
+   int err_count = 0;
 
-   // TODO: get from km_mem_init
+   machine.guest_max_physmem = size_in_gb * GIB;
+   km_mem_layout_init();
    machine.brk = GUEST_MEM_START_VA - 1;   // last allocated byte
    machine.tbrk = GUEST_MEM_TOP_VA;
-   machine.guest_mid_physmem = machine.guest_max_physmem >> 1;
-   machine.mid_mem_idx = MEM_IDX(machine.guest_mid_physmem - 1);
-   // Place for the last 2MB of PA. We do not allocate it to make memregs mirrored
-   machine.last_mem_idx = (machine.mid_mem_idx << 1) + 1;
 
    printf("Modelling %s memory PA, alloc mirror at %s\n",
           out_sz(machine.guest_max_physmem),
           out_sz(machine.guest_mid_physmem));
    printf("last_slot %d, mid %d\n", machine.last_mem_idx, machine.mid_mem_idx);
+   err_count += check_layout();
    printf(
        "   start(hex)      START          SIZE         clz  clz-r  idx memreg-base  memreg-size  "
        "memreg-top\n");
@@ -110,3 +142,19 @@ int main(int argc, char** argv)
    }
    return err_count;
 }
+
+int main(int argc, char** argv)
+{
+   // ph. mem sizes, on both sides of the single PML4 entry boundary, and max supported
+   uint64_t sizes_in_gb[] = {2, 64, 256, 512, 1024, 2048, GUEST_MAX_PHYSMEM_SUPPORTED / GIB};
+   int err_count = 0;
+
+   if (argc == 2) {
+      printf("ok\n");
+      return check_memslots(atoi(argv[1]));
+   }
+   for (int i = 0; i < sizeof(sizes_in_gb) / sizeof(sizes_in_gb[0]); i++) {
+      err_count += check_memslots(sizes_in_gb[i]);
+   }
+   return err_count;
+}
@@ -39,7 +39,7 @@
 
 TEST munmap_monitor_maps_test(void)
 {
-   void* gdtaddr = (void*)GUEST_MEM_TOP_VA - KM_PAGE_SIZE;
+   void* gdtaddr = (void*)GUEST_LOW_MEM_TOP_VA - KM_PAGE_SIZE;   // default layout
    void* idtaddr = gdtaddr - KM_PAGE_SIZE;
    int ret;
 
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * poll/ppoll and epoll_pwait2: timeouts, signal masks, closed and out of range fds. Then the cost
+ * of a poll() call over 1k and 10k fds that returns right away.
+ *
+ * Usage: poll_test [GREATEST options] [-- <calls per size>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int ncalls = 1000;
+
+TEST ppoll_test()
+{
+   struct timespec tmo = {.tv_nsec = 10 * 1000 * 1000};
+   struct timespec start, end;
+   sigset_t mask;
+   int p[2];
+
+   ASSERT_EQ(0, pipe(p));
+   struct pollfd pfd[4] = {
+       {.fd = p[0], .events = POLLIN},
+       {.fd = -1, .events = POLLIN},   // ignored
+       {.fd = p[1], .events = POLLOUT},
+       {.fd = p[0], .events = POLLIN},
+   };
+
+   // nothing to read, the timeout runs out and the remaining time is written back
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGUSR1);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ASSERT_EQ(0, syscall(SYS_ppoll, pfd, 1, &tmo, &mask, 8));
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   ASSERT(ts_nsec(&end) - ts_nsec(&start) >= 10 * 1000 * 1000);
+   ASSERT_EQ(0, tmo.tv_sec);
+   ASSERT_EQ(0, tmo.tv_nsec);
+
+   ASSERT_EQ(1, write(p[1], "x", 1));
+   ASSERT_EQ(3, ppoll(pfd, 4, NULL, &mask));
+   ASSERT_EQ(POLLIN, pfd[0].revents);
+   ASSERT_EQ(0, pfd[1].revents);
+   ASSERT_EQ(POLLOUT, pfd[2].revents);
+   ASSERT_EQ(POLLIN, pfd[3].revents);
+
+   // closed fds and fds past the limit are POLLNVAL, not an error
+   close(p[1]);
+   pfd[2].fd = p[1];
+   pfd[3].fd = 100000;
+   ASSERT_EQ(3, poll(pfd, 4, -1));
+   ASSERT_EQ(POLLIN | POLLHUP, pfd[0].revents);
+   ASSERT_EQ(POLLNVAL, pfd[2].revents);
+   ASSERT_EQ(POLLNVAL, pfd[3].revents);
+
+   ASSERT_EQ(-1, syscall(SYS_ppoll, pfd, 1, NULL, &mask, 1));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, syscall(SYS_ppoll, pfd, 1, (void*)8, NULL, 8));
+   ASSERT_EQ(EFAULT, errno);
+   close(p[0]);
+   PASS();
+}
+
+TEST epoll_pwait2_test()
+{
+   struct timespec tmo = {.tv_nsec = 10 * 1000 * 1000};
+   struct epoll_event ev = {.events = EPOLLIN};
+   sigset_t mask;
+   int p[2];
+   int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+   ASSERT_NEQ(-1, epfd);
+   ASSERT_EQ(0, pipe(p));
+   ev.data.fd = p[0];
+   ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_ADD, p[0], &ev));
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGUSR1);
+
+   memset(&ev, 0, sizeof(ev));
+   ASSERT_EQ(0, syscall(SYS_epoll_pwait2, epfd, &ev, 1, &tmo, &mask, 8));
+   ASSERT_EQ(1, write(p[1], "x", 1));
+   ASSERT_EQ(1, syscall(SYS_epoll_pwait2, epfd, &ev, 1, NULL, NULL, 8));
+   ASSERT_EQ(p[0], ev.data.fd);
+   ASSERT_EQ(1, syscall(SYS_epoll_pwait, epfd, &ev, 1, -1, &mask, 8));
+
+   ASSERT_EQ(-1, syscall(SYS_epoll_pwait2, epfd, &ev, 1, &tmo, &mask, 1));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, syscall(SYS_epoll_pwait2, epfd, &ev, 1, (void*)8, NULL, 8));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(-1, syscall(SYS_epoll_pwait2, p[0], &ev, 1, NULL, NULL, 8));
+   ASSERT_EQ(EINVAL, errno);
+   close(p[0]);
+   close(p[1]);
+   close(epfd);
+   PASS();
+}
+
+/*
+ * poll() 'nfds' entries, all on the read end of an empty pipe except the first one, which is the
+ * write end and is always ready. Returns nsec per call or 0 on error.
+ */
+static uint64_t poll_cost(int nfds)
+{
+   struct pollfd* pfd = calloc(nfds, sizeof(struct pollfd));
+   struct timespec start, end;
+   int p[2];
+
+   if (pfd == NULL || pipe(p) != 0) {
+      return 0;
+   }
+   for (int i = 0; i < nfds; i++) {
+      pfd[i].fd = p[0];
+      pfd[i].events = POLLIN;
+   }
+   pfd[0].fd = p[1];
+   pfd[0].events = POLLOUT;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < ncalls; i++) {
+      if (poll(pfd, nfds, -1) != 1) {
+         return 0;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   close(p[0]);
+   close(p[1]);
+   free(pfd);
+   return (ts_nsec(&end) - ts_nsec(&start)) / ncalls;
+}
+
+TEST poll_bench_test()
+{
+   struct rlimit lim;
+
+   // poll() takes up to RLIMIT_NOFILE entries
+   ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &lim));
+   lim.rlim_cur = lim.rlim_max;
+   ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &lim));
+   for (int nfds = 1000; nfds <= 10000; nfds *= 10) {
+      if (nfds > lim.rlim_cur) {
+         printf("poll %d fds: skipped, RLIMIT_NOFILE is %ld\n", nfds, lim.rlim_cur);
+         continue;
+      }
+      uint64_t nsec = poll_cost(nfds);
+      ASSERT_NEQ(0, nsec);
+      printf("poll %d fds: %ld ns/call\n", nfds, (long)nsec);
+   }
+   struct pollfd pfd = {.fd = -1};
+   ASSERT_EQ(-1, poll(&pfd, lim.rlim_cur + 1, 0));
+   ASSERT_EQ(EINVAL, errno);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   ncalls = bench_arg(argc, argv, 1, ncalls);
+   bench_usage(ncalls <= 0, argv, "<calls per size>");
+
+   RUN_TEST(ppoll_test);
+   RUN_TEST(epoll_pwait2_test);
+   RUN_TEST(poll_bench_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
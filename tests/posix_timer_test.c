@@ -0,0 +1,395 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * POSIX timers and interval timers: several timers with their own signals and values, a timer
+ * aimed at one thread with SIGEV_THREAD_ID, overruns while the signal is blocked, timer_gettime()
+ * and timer_delete(), setitimer() and alarm(), timers in a forked child, and bad arguments. Then
+ * the latency of a periodic timer signal, from the expiration to sigtimedwait() returning.
+ *
+ * Usage: posix_timer_test [GREATEST options] [-- <expirations>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid   // older glibc
+#endif
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+
+#define MSEC (1000 * 1000)
+
+static int nexpirations = 1000;
+
+// Wait up to a second for 'signo'
+static int wait_signal(int signo, siginfo_t* info)
+{
+   struct timespec timeout = {.tv_sec = 1};
+   sigset_t set;
+
+   sigemptyset(&set);
+   sigaddset(&set, signo);
+   return sigtimedwait(&set, info, &timeout);
+}
+
+static int create_timer(clockid_t clock, int signo, int value, timer_t* timerid)
+{
+   struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL, .sigev_signo = signo};
+
+   sev.sigev_value.sival_int = value;
+   return timer_create(clock, &sev, timerid);
+}
+
+static int arm_timer(timer_t timerid, uint64_t value, uint64_t interval)
+{
+   struct itimerspec its = {
+       .it_value = {.tv_sec = value / NSEC_PER_SEC, .tv_nsec = value % NSEC_PER_SEC},
+       .it_interval = {.tv_sec = interval / NSEC_PER_SEC, .tv_nsec = interval % NSEC_PER_SEC}};
+   return timer_settime(timerid, 0, &its, NULL);
+}
+
+TEST multiple_test()
+{
+   const struct {
+      clockid_t clock;
+      int signo;
+      uint64_t value;
+   } t[] = {
+       {CLOCK_MONOTONIC, SIGUSR1, 30 * MSEC},
+       {CLOCK_REALTIME, SIGUSR2, 10 * MSEC},
+       {CLOCK_BOOTTIME, SIGRTMIN, 20 * MSEC},
+   };
+   timer_t timerid[3];
+   siginfo_t info;
+
+   for (int i = 0; i < 3; i++) {
+      ASSERT_EQ(0, create_timer(t[i].clock, t[i].signo, 100 + i, &timerid[i]));
+   }
+   for (int i = 0; i < 3; i++) {
+      ASSERT_EQ(0, arm_timer(timerid[i], t[i].value, 0));
+   }
+   for (int i = 0; i < 3; i++) {
+      ASSERT_EQ(t[i].signo, wait_signal(t[i].signo, &info));
+      ASSERT_EQ(SI_TIMER, info.si_code);
+      ASSERT_EQ(100 + i, info.si_value.sival_int);
+      ASSERT_EQ(0, info.si_overrun);
+   }
+   for (int i = 0; i < 3; i++) {
+      ASSERT_EQ(0, timer_delete(timerid[i]));
+   }
+   PASS();
+}
+
+static pid_t target_tid;
+static int target_signo;
+static pthread_barrier_t barrier;
+
+static void* target_thread(void* arg)
+{
+   siginfo_t info;
+
+   target_tid = syscall(SYS_gettid);
+   pthread_barrier_wait(&barrier);
+   target_signo = wait_signal(SIGRTMIN + 1, &info);
+   return NULL;
+}
+
+TEST thread_id_test()
+{
+   struct sigevent sev = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGRTMIN + 1};
+   struct timespec timeout = {.tv_nsec = 50 * MSEC};
+   timer_t timerid;
+   pthread_t tid;
+   sigset_t set;
+
+   ASSERT_EQ(0, pthread_barrier_init(&barrier, NULL, 2));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, target_thread, NULL));
+   pthread_barrier_wait(&barrier);
+   sev.sigev_notify_thread_id = target_tid;
+   ASSERT_EQ(0, timer_create(CLOCK_MONOTONIC, &sev, &timerid));
+   ASSERT_EQ(0, arm_timer(timerid, 10 * MSEC, 0));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(SIGRTMIN + 1, target_signo);
+   // went to the thread, not here
+   sigemptyset(&set);
+   sigaddset(&set, SIGRTMIN + 1);
+   ASSERT_EQ(-1, sigtimedwait(&set, NULL, &timeout));
+   ASSERT_EQ(0, timer_delete(timerid));
+
+   sev.sigev_notify_thread_id = 1000000;
+   ASSERT_EQ(-1, timer_create(CLOCK_MONOTONIC, &sev, &timerid));
+   ASSERT_EQ(EINVAL, errno);
+   pthread_barrier_destroy(&barrier);
+   PASS();
+}
+
+TEST overrun_test()
+{
+   struct timespec sleep = {.tv_nsec = 50 * MSEC};
+   timer_t timerid;
+   siginfo_t info;
+
+   // signal stays queued while we sleep, expirations pile up as overruns
+   ASSERT_EQ(0, create_timer(CLOCK_MONOTONIC, SIGRTMIN + 2, 0, &timerid));
+   ASSERT_EQ(0, arm_timer(timerid, MSEC, MSEC));
+   nanosleep(&sleep, NULL);
+   ASSERT_EQ(SIGRTMIN + 2, wait_signal(SIGRTMIN + 2, &info));
+   ASSERT(info.si_overrun > 10);
+   ASSERT_EQ(info.si_overrun, timer_getoverrun(timerid));
+   ASSERT_EQ(0, timer_delete(timerid));
+   PASS();
+}
+
+TEST gettime_test()
+{
+   struct itimerspec its = {.it_value.tv_sec = 10, .it_interval.tv_sec = 5};
+   struct itimerspec cur;
+   timer_t timerid;
+
+   ASSERT_EQ(0, create_timer(CLOCK_MONOTONIC, SIGUSR1, 0, &timerid));
+   ASSERT_EQ(0, timer_gettime(timerid, &cur));
+   ASSERT_EQ(0, cur.it_value.tv_sec);
+   ASSERT_EQ(0, cur.it_value.tv_nsec);
+
+   ASSERT_EQ(0, timer_settime(timerid, 0, &its, NULL));
+   ASSERT_EQ(0, timer_gettime(timerid, &cur));
+   ASSERT_EQ(9, cur.it_value.tv_sec);
+   ASSERT_EQ(5, cur.it_interval.tv_sec);
+
+   // absolute time in the past goes off right away
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   its = (struct itimerspec){.it_value = now};
+   ASSERT_EQ(0, timer_settime(timerid, TIMER_ABSTIME, &its, &cur));
+   ASSERT_EQ(9, cur.it_value.tv_sec);
+   siginfo_t info;
+   ASSERT_EQ(SIGUSR1, wait_signal(SIGUSR1, &info));
+
+   ASSERT_EQ(0, timer_delete(timerid));
+   ASSERT_EQ(-1, timer_gettime(timerid, &cur));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, timer_delete(timerid));
+   ASSERT_EQ(EINVAL, errno);
+   PASS();
+}
+
+TEST cputime_test()
+{
+   timer_t timerid;
+   siginfo_t info;
+   clockid_t clock;
+
+   ASSERT_EQ(0, pthread_getcpuclockid(pthread_self(), &clock));
+   ASSERT_EQ(0, create_timer(clock, SIGUSR2, 0, &timerid));
+   ASSERT_EQ(0, arm_timer(timerid, 20 * MSEC, 0));
+   // burn CPU until it goes off
+   struct timespec start, now;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   do {
+      sigset_t set;
+      sigpending(&set);
+      if (sigismember(&set, SIGUSR2)) {
+         break;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+   } while (ts_nsec(&now) - ts_nsec(&start) < 2 * NSEC_PER_SEC);
+   ASSERT_EQ(SIGUSR2, wait_signal(SIGUSR2, &info));
+   ASSERT_EQ(0, timer_delete(timerid));
+   PASS();
+}
+
+TEST itimer_test()
+{
+   struct itimerval itv = {.it_value.tv_usec = 20 * 1000};
+   struct itimerval cur;
+   siginfo_t info;
+
+   ASSERT_EQ(0, setitimer(ITIMER_REAL, &itv, NULL));
+   ASSERT_EQ(0, getitimer(ITIMER_REAL, &cur));
+   ASSERT(cur.it_value.tv_usec > 0 && cur.it_value.tv_usec <= 20 * 1000);
+   ASSERT_EQ(SIGALRM, wait_signal(SIGALRM, &info));
+   ASSERT_EQ(SI_KERNEL, info.si_code);
+   ASSERT_EQ(0, getitimer(ITIMER_REAL, &cur));
+   ASSERT_EQ(0, cur.it_value.tv_sec);
+   ASSERT_EQ(0, cur.it_value.tv_usec);
+
+   ASSERT_EQ(0, alarm(10));
+   ASSERT_EQ(10, alarm(0));
+
+   itv.it_value.tv_usec = 1000 * 1000;
+   ASSERT_EQ(-1, setitimer(ITIMER_REAL, &itv, NULL));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, getitimer(17, &cur));
+   ASSERT_EQ(EINVAL, errno);
+   PASS();
+}
+
+// The child doesn't get the parent's timers, and its own go off
+static int fork_child(void)
+{
+   struct itimerval cur;
+   timer_t timerid;
+   siginfo_t info;
+
+   if (getitimer(ITIMER_REAL, &cur) != 0 || cur.it_value.tv_sec != 0 || cur.it_value.tv_usec != 0) {
+      return 1;
+   }
+   if (create_timer(CLOCK_MONOTONIC, SIGUSR1, 7, &timerid) != 0 ||
+       arm_timer(timerid, 20 * MSEC, 0) != 0) {
+      return 2;
+   }
+   if (wait_signal(SIGUSR1, &info) != SIGUSR1 || info.si_code != SI_TIMER ||
+       info.si_value.sival_int != 7) {
+      return 3;
+   }
+   return timer_delete(timerid) == 0 ? 0 : 4;
+}
+
+TEST fork_test()
+{
+   struct itimerval itv = {.it_value.tv_sec = 10};
+   struct itimerval zero = {};
+   timer_t timerid;
+   pid_t pid;
+   int status;
+
+   // the timer thread is running in the parent when it forks
+   ASSERT_EQ(0, setitimer(ITIMER_REAL, &itv, NULL));
+   ASSERT_EQ(0, create_timer(CLOCK_MONOTONIC, SIGUSR2, 1, &timerid));
+   ASSERT_EQ(0, arm_timer(timerid, 10 * NSEC_PER_SEC, 0));
+   if ((pid = fork()) == 0) {
+      exit(fork_child());
+   }
+   ASSERT(pid > 0);
+   ASSERT_EQ(pid, waitpid(pid, &status, 0));
+   ASSERT(WIFEXITED(status));
+   ASSERT_EQ(0, WEXITSTATUS(status));
+   ASSERT_EQ(0, timer_delete(timerid));
+   ASSERT_EQ(0, setitimer(ITIMER_REAL, &zero, NULL));
+   PASS();
+}
+
+TEST einval_test()
+{
+   struct itimerspec its = {.it_value.tv_nsec = NSEC_PER_SEC};
+   timer_t timerid;
+
+   ASSERT_EQ(-1, timer_create(17, NULL, &timerid));
+   ASSERT_EQ(EINVAL, errno);
+   struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL, .sigev_signo = 100};
+   ASSERT_EQ(-1, timer_create(CLOCK_MONOTONIC, &sev, &timerid));
+   ASSERT_EQ(EINVAL, errno);
+
+   ASSERT_EQ(0, timer_create(CLOCK_MONOTONIC, NULL, &timerid));
+   ASSERT_EQ(-1, timer_settime(timerid, 0, &its, NULL));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(0, timer_delete(timerid));
+   PASS();
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+   uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+   return x < y ? -1 : x > y;
+}
+
+// Periodic 1ms timer, how late is sigtimedwait() compared to when the timer was due
+TEST latency_test()
+{
+   uint64_t* late = calloc(nexpirations, sizeof(uint64_t));
+   struct itimerspec its = {.it_interval.tv_nsec = MSEC};
+   struct timespec now;
+   timer_t timerid;
+   siginfo_t info;
+   uint64_t due;
+   int overruns = 0;
+
+   ASSERT_NEQ(NULL, late);
+   ASSERT_EQ(0, create_timer(CLOCK_MONOTONIC, SIGRTMIN + 3, 0, &timerid));
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   due = ts_nsec(&now) + MSEC;
+   its.it_value = (struct timespec){.tv_sec = due / NSEC_PER_SEC, .tv_nsec = due % NSEC_PER_SEC};
+   ASSERT_EQ(0, timer_settime(timerid, TIMER_ABSTIME, &its, NULL));
+   for (int i = 0; i < nexpirations; i++) {
+      ASSERT_EQ(SIGRTMIN + 3, wait_signal(SIGRTMIN + 3, &info));
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      due += info.si_overrun * MSEC;
+      overruns += info.si_overrun;
+      late[i] = ts_nsec(&now) - due;
+      due += MSEC;
+   }
+   ASSERT_EQ(0, timer_delete(timerid));
+   qsort(late, nexpirations, sizeof(uint64_t), cmp_u64);
+   printf("timer signal latency: p50 %ld p90 %ld p99 %ld max %ld ns, %d overruns\n",
+          (long)late[nexpirations / 2],
+          (long)late[nexpirations * 90 / 100],
+          (long)late[nexpirations * 99 / 100],
+          (long)late[nexpirations - 1],
+          overruns);
+   free(late);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   sigset_t set;
+
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nexpirations = bench_arg(argc, argv, 1, nexpirations);
+   bench_usage(nexpirations <= 0, argv, "<expirations>");
+   // timer signals are picked up with sigtimedwait(), in all threads
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   sigaddset(&set, SIGUSR2);
+   sigaddset(&set, SIGALRM);
+   for (int i = 0; i < 4; i++) {
+      sigaddset(&set, SIGRTMIN + i);
+   }
+   sigprocmask(SIG_BLOCK, &set, NULL);
+
+   RUN_TEST(multiple_test);
+   RUN_TEST(thread_id_test);
+   RUN_TEST(overrun_test);
+   RUN_TEST(gettime_test);
+   RUN_TEST(cputime_test);
+   RUN_TEST(itimer_test);
+   RUN_TEST(fork_test);
+   RUN_TEST(einval_test);
+   RUN_TEST(latency_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * /proc/self/stat and /proc/self/status as the payload sees them: pid, comm, thread count, reads
+ * in small pieces and after lseek, and the /proc/<pid> spelling. /proc/self/maps, statm and
+ * smaps_rollup follow mmap, munmap and page faults. Then the cost of open+read+close of
+ * /proc/self/stat and /proc/self/maps next to a plain open+close that goes through the same path
+ * matcher.
+ *
+ * Usage: proc_stat_test [GREATEST options] [-- <iterations>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+#include "mmap_test.h"
+
+static int iterations = 10000;
+static char* progname;
+
+static ssize_t read_file(const char* name, char* buf, size_t bufsz)
+{
+   int fd = open(name, O_RDONLY);
+   ssize_t total = 0, rc;
+
+   if (fd < 0) {
+      return -1;
+   }
+   while ((rc = read(fd, buf + total, bufsz - 1 - total)) > 0) {
+      total += rc;
+   }
+   close(fd);
+   buf[total] = 0;
+   return rc < 0 ? -1 : total;
+}
+
+// Returns the value of the 'n'th (1 based) field of /proc/.../stat text, counted past comm.
+static long stat_field(const char* buf, int n)
+{
+   const char* p = strrchr(buf, ')');
+   long val = -1;
+
+   if (p == NULL || n < 3) {
+      return -1;
+   }
+   p += 2;   // ") "
+   for (int i = 3; i < n; i++) {
+      if ((p = strchr(p, ' ')) == NULL) {
+         return -1;
+      }
+      p++;
+   }
+   sscanf(p, "%ld", &val);
+   return val;
+}
+
+TEST stat_test()
+{
+   char buf[4096], piece[4096], name[64];
+   char comm[16];
+   ssize_t len;
+
+   len = read_file("/proc/self/stat", buf, sizeof(buf));
+   ASSERT(len > 0);
+   ASSERT_EQ('\n', buf[len - 1]);
+   ASSERT_EQ(getpid(), atoi(buf));
+   snprintf(comm, sizeof(comm), "%s", basename(progname));
+   ASSERT_EQ(0, strncmp(strchr(buf, '(') + 1, comm, strlen(comm)));
+   ASSERT_EQ(')', strchr(buf, '(')[1 + strlen(comm)]);
+   ASSERT_EQ(getppid(), stat_field(buf, 4));
+   if (KM_PAYLOAD()) {
+      ASSERT_EQ(1, stat_field(buf, 20));
+   }
+   ASSERT(stat_field(buf, 23) > 0);   // vsize
+
+   // same text in 7 byte pieces, and again after rewinding
+   int fd = open("/proc/self/stat", O_RDONLY);
+   ASSERT(fd >= 0);
+   ssize_t total = 0, rc;
+   while ((rc = read(fd, piece + total, 7)) > 0) {
+      total += rc;
+   }
+   ASSERT_EQ(0, rc);
+   ASSERT_EQ(len, total);
+   ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+   ASSERT_EQ(7, read(fd, piece, 7));
+   ASSERT_EQ(0, memcmp(piece, buf, 7));
+   close(fd);
+
+   snprintf(name, sizeof(name), "/proc/%d/stat", getpid());
+   len = read_file(name, piece, sizeof(piece));
+   ASSERT(len > 0);
+   ASSERT_EQ(getpid(), atoi(piece));
+   ASSERT_EQ(0, strncmp(strchr(piece, '(') + 1, comm, strlen(comm)));
+   PASS();
+}
+
+TEST status_test()
+{
+   char buf[8192], name[64], comm[16];
+   char* p;
+
+   ASSERT(read_file("/proc/self/status", buf, sizeof(buf)) > 0);
+   snprintf(comm, sizeof(comm), "%s", basename(progname));
+   snprintf(name, sizeof(name), "Name:\t%s\n", comm);
+   ASSERT_EQ(0, strncmp(buf, name, strlen(name)));
+   ASSERT((p = strstr(buf, "\nPPid:\t")) != NULL);
+   ASSERT_EQ(getppid(), atoi(p + 7));
+   ASSERT((p = strstr(buf, "\nVmSize:")) != NULL);
+   ASSERT(atol(p + 8) > 0);
+   if (KM_PAYLOAD()) {
+      ASSERT((p = strstr(buf, "\nThreads:\t")) != NULL);
+      ASSERT_EQ(1, atoi(p + 10));
+   }
+   PASS();
+}
+
+// Returns the /proc/self/maps line covering 'addr' in 'line', or -1 if there is none
+static int maps_find(void* addr, char* line, size_t linesz)
+{
+   static char buf[256 * 1024];
+   unsigned long start, end;
+
+   if (read_file("/proc/self/maps", buf, sizeof(buf)) <= 0) {
+      return -1;
+   }
+   for (char* p = buf; *p != 0; p = strchr(p, '\n') + 1) {
+      if (sscanf(p, "%lx-%lx", &start, &end) == 2 && start <= (unsigned long)addr &&
+          (unsigned long)addr < end) {
+         snprintf(line, linesz, "%.*s", (int)(strchr(p, '\n') - p), p);
+         return 0;
+      }
+   }
+   return -1;
+}
+
+static long statm_resident(void)
+{
+   char buf[256];
+   long size, resident;
+
+   if (read_file("/proc/self/statm", buf, sizeof(buf)) <= 0 ||
+       sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+      return -1;
+   }
+   return resident;
+}
+
+TEST maps_test()
+{
+   static const size_t sz = 4 << 20;
+   char line[512], buf[4096];
+
+   // our own code is in an r-xp line with the program file name
+   ASSERT_EQ(0, maps_find((void*)maps_find, line, sizeof(line)));
+   ASSERT_EQ(0, strncmp(strchr(line, ' '), " r-xp ", 6));
+   ASSERT(strstr(line, basename(progname)) != NULL);
+
+   char* m = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   ASSERT_NEQ(MAP_FAILED, m);
+   ASSERT_EQ(0, maps_find(m + sz / 2, line, sizeof(line)));
+   ASSERT_EQ(0, strncmp(strchr(line, ' '), " rw-p 00000000 00:00 0", 22));
+   long before = statm_resident();
+   ASSERT(before > 0);
+   memset(m, 1, sz);
+   ASSERT(statm_resident() >= before + (sz >> 12) * 3 / 4);
+
+   ASSERT_EQ(0, mprotect(m, 4096, PROT_READ));
+   ASSERT_EQ(0, maps_find(m, line, sizeof(line)));
+   ASSERT_EQ(0, strncmp(strchr(line, ' '), " r--p ", 6));
+   ASSERT_EQ(0, munmap(m, sz));
+   ASSERT_EQ(-1, maps_find(m + sz / 2, line, sizeof(line)));
+
+   ASSERT(read_file("/proc/self/smaps_rollup", buf, sizeof(buf)) > 0);
+   ASSERT(strstr(buf, " [rollup]\n") != NULL);
+   char* rss = strstr(buf, "\nRss:");
+   ASSERT(rss != NULL);
+   ASSERT(atol(rss + 5) > 0);
+   PASS();
+}
+
+TEST proc_bench_test()
+{
+   struct timespec start, end;
+   char buf[4096];
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < iterations; i++) {
+      ASSERT(read_file("/proc/self/stat", buf, sizeof(buf)) > 0);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   printf("/proc/self/stat: %ld ns/open+read\n",
+          (long)((ts_nsec(&end) - ts_nsec(&start)) / iterations));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < iterations; i++) {
+      ASSERT(read_file("/proc/self/maps", buf, sizeof(buf)) > 0);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   printf("/proc/self/maps: %ld ns/open+read\n",
+          (long)((ts_nsec(&end) - ts_nsec(&start)) / iterations));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < iterations; i++) {
+      int fd = open("/dev/null", O_RDONLY);
+      ASSERT(fd >= 0);
+      close(fd);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   printf("/dev/null: %ld ns/open\n", (long)((ts_nsec(&end) - ts_nsec(&start)) / iterations));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   progname = argv[0];
+   iterations = bench_arg(argc, argv, 1, iterations);
+   bench_usage(iterations <= 0, argv, "<iterations>");
+
+   RUN_TEST(stat_test);
+   RUN_TEST(status_test);
+   RUN_TEST(maps_test);
+   RUN_TEST(proc_bench_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Scheduling policy, nice value and io priority are per thread, can be set for another thread by
+ * tid, and are inherited by new threads. Real time policies need privileges, we take either
+ * success or EPERM.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "greatest/greatest.h"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << 13) | (data))
+
+static pthread_barrier_t barrier;
+static pid_t other_tid;
+static int other_nice, other_policy;
+
+static void* other(void* arg)
+{
+   other_tid = syscall(SYS_gettid);
+   pthread_barrier_wait(&barrier);   // main looks at us
+   pthread_barrier_wait(&barrier);
+   errno = 0;
+   other_nice = getpriority(PRIO_PROCESS, 0);
+   other_policy = sched_getscheduler(0);
+   return NULL;
+}
+
+static void* self_batch(void* arg)
+{
+   struct sched_param param = {.sched_priority = 0};
+
+   sched_setscheduler(0, SCHED_BATCH, &param);
+   return NULL;
+}
+
+static void* self_nicest(void* arg)
+{
+   setpriority(PRIO_PROCESS, 0, 19);
+   return NULL;
+}
+
+static void* get_state(void* arg)
+{
+   other_nice = getpriority(PRIO_PROCESS, 0);
+   other_policy = sched_getscheduler(0);
+   return NULL;
+}
+
+TEST nice_test()
+{
+   pthread_t tid;
+   int nice;
+
+   errno = 0;
+   nice = getpriority(PRIO_PROCESS, 0);
+   ASSERT_EQ(0, errno);
+   ASSERT_EQ(nice, getpriority(PRIO_PROCESS, getpid()));
+   if (nice >= 18) {
+      SKIPm("already too nice");
+   }
+
+   // only the thread we name
+   ASSERT_EQ(0, pthread_barrier_init(&barrier, NULL, 2));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, other, NULL));
+   pthread_barrier_wait(&barrier);
+   ASSERT_EQ(0, setpriority(PRIO_PROCESS, other_tid, nice + 2));
+   ASSERT_EQ(nice + 2, getpriority(PRIO_PROCESS, other_tid));
+   ASSERT_EQ(nice, getpriority(PRIO_PROCESS, 0));
+   pthread_barrier_wait(&barrier);
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(nice + 2, other_nice);
+   pthread_barrier_destroy(&barrier);
+
+   ASSERT_EQ(-1, setpriority(PRIO_PROCESS, 12345, nice));
+   ASSERT_EQ(ESRCH, errno);
+
+   // new threads get ours
+   ASSERT_EQ(0, setpriority(PRIO_PROCESS, 0, nice + 1));
+   ASSERT_EQ(nice + 1, getpriority(PRIO_PROCESS, 0));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, get_state, NULL));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(nice + 1, other_nice);
+
+   // a thread that is gone doesn't leave its nice value to the next one, even if going back from
+   // it takes privileges
+   ASSERT_EQ(0, pthread_create(&tid, NULL, self_nicest, NULL));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, get_state, NULL));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(nice + 1, other_nice);
+
+   // going back down may need privileges
+   if (setpriority(PRIO_PROCESS, 0, nice) < 0) {
+      ASSERT(errno == EACCES || errno == EPERM);
+   }
+   PASS();
+}
+
+TEST scheduler_test()
+{
+   struct sched_param param = {.sched_priority = 0};
+   struct timespec ts;
+   pthread_t tid;
+
+   ASSERT_EQ(SCHED_OTHER, sched_getscheduler(0));
+   ASSERT_EQ(0, sched_getparam(0, &param));
+   ASSERT_EQ(0, param.sched_priority);
+   ASSERT_EQ(99, sched_get_priority_max(SCHED_FIFO));
+   ASSERT_EQ(1, sched_get_priority_min(SCHED_FIFO));
+   ASSERT_EQ(0, sched_rr_get_interval(0, &ts));
+
+   ASSERT_EQ(-1, sched_getscheduler(12345));
+   ASSERT_EQ(ESRCH, errno);
+   ASSERT_EQ(-1, sched_getscheduler(-1));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, sched_setscheduler(0, SCHED_OTHER + 100, &param));
+   ASSERT_EQ(EINVAL, errno);
+
+   // another thread by tid
+   ASSERT_EQ(0, pthread_barrier_init(&barrier, NULL, 2));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, other, NULL));
+   pthread_barrier_wait(&barrier);
+   ASSERT_EQ(0, sched_setscheduler(other_tid, SCHED_BATCH, &param));
+   ASSERT_EQ(SCHED_BATCH, sched_getscheduler(other_tid));
+   ASSERT_EQ(SCHED_OTHER, sched_getscheduler(0));
+   pthread_barrier_wait(&barrier);
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(SCHED_BATCH, other_policy);
+   pthread_barrier_destroy(&barrier);
+
+   // a thread that is gone doesn't leave its policy to the next one
+   ASSERT_EQ(0, pthread_create(&tid, NULL, self_batch, NULL));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, get_state, NULL));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(SCHED_OTHER, other_policy);
+
+   // but a live creator does
+   ASSERT_EQ(0, sched_setscheduler(0, SCHED_BATCH, &param));
+   ASSERT_EQ(0, pthread_create(&tid, NULL, get_state, NULL));
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   ASSERT_EQ(SCHED_BATCH, other_policy);
+   ASSERT_EQ(0, sched_setscheduler(0, SCHED_OTHER, &param));
+
+   param.sched_priority = 1;
+   if (sched_setscheduler(0, SCHED_FIFO, &param) == 0) {
+      ASSERT_EQ(SCHED_FIFO, sched_getscheduler(0));
+      ASSERT_EQ(0, sched_getparam(0, &param));
+      ASSERT_EQ(1, param.sched_priority);
+      param.sched_priority = 0;
+      ASSERT_EQ(0, sched_setscheduler(0, SCHED_OTHER, &param));
+   } else {
+      ASSERT_EQ(EPERM, errno);
+      ASSERT_EQ(SCHED_OTHER, sched_getscheduler(0));
+   }
+   PASS();
+}
+
+TEST ioprio_test()
+{
+   int ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 6);
+   int was;
+
+   ASSERT((was = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0)) >= 0);
+   ASSERT_EQ(0, syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio));
+   ASSERT_EQ(ioprio, syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0));
+   ASSERT_EQ(ioprio, syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, getpid()));
+   ASSERT_EQ(-1, syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 12345));
+   ASSERT_EQ(ESRCH, errno);
+   ASSERT_EQ(0, syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, was));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   RUN_TEST(nice_test);
+   RUN_TEST(scheduler_test);
+   RUN_TEST(ioprio_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Report memory used by the read-only segments of this payload, as seen by the host in km
+ * /proc/self/smaps (guest /proc/self is km's one). With 'km --share-text' these segments are
+ * mapped straight from the payload file and should have no private dirty pages. Pss shows how
+ * much of them is charged to this instance when several instances run at once. Given seconds to
+ * sleep, other instances are expected to run alongside: it sleeps that long before and after
+ * measuring, and the text segment has to be shared with them, Pss below Rss.
+ *
+ * Usage: share_text_test [GREATEST options] [-- shared|private [seconds to sleep]]
+ */
+
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "greatest/greatest.h"
+
+static int expect_shared = 0;
+static int sleep_sec = 0;
+static char* payload_name;
+
+TEST share_text_test()
+{
+   char line[512];
+   int in_ro_payload = 0;
+   int in_text = 0;
+   long pss = 0, private_dirty = 0, val;
+   long text_rss = 0, text_pss = 0;
+   FILE* f = fopen("/proc/self/smaps", "r");
+
+   ASSERT_NEQ(NULL, f);
+   while (fgets(line, sizeof(line), f) != NULL) {
+      char perms[8];
+      char path[256] = "";
+
+      // mapping header: "start-end perms offset dev inode [path]"
+      if (sscanf(line, "%*x-%*x %7s %*x %*s %*u %255s", perms, path) >= 1) {
+         in_ro_payload = perms[1] == '-' && strcmp(basename(path), payload_name) == 0;
+         in_text = in_ro_payload != 0 && perms[2] == 'x';
+         continue;
+      }
+      if (in_ro_payload == 0) {
+         continue;
+      }
+      if (sscanf(line, "Rss: %ld kB", &val) == 1) {
+         text_rss += in_text != 0 ? val : 0;
+      } else if (sscanf(line, "Pss: %ld kB", &val) == 1) {
+         pss += val;
+         text_pss += in_text != 0 ? val : 0;
+      } else if (sscanf(line, "Private_Dirty: %ld kB", &val) == 1) {
+         private_dirty += val;
+      }
+   }
+   fclose(f);
+   printf("%s read-only segments: Pss %ld kB Private_Dirty %ld kB, text Rss %ld kB Pss %ld kB\n",
+          payload_name,
+          pss,
+          private_dirty,
+          text_rss,
+          text_pss);
+   ASSERT_NEQ(0, pss);
+   if (expect_shared != 0) {
+      ASSERT_EQ_FMT(0L, private_dirty, "%ld");
+      if (sleep_sec != 0) {
+         ASSERT_NEQ(0, text_rss);
+         ASSERTm("text segment is not shared with the other instances", text_pss < text_rss);
+      }
+   }
+   sleep(sleep_sec);   // still mapped while the others measure
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   extern int optind;
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   payload_name = basename(strdup(argv[0]));
+   if (optind + 1 < argc) {
+      expect_shared = strcmp(argv[optind + 1], "shared") == 0;
+   }
+   if (optind + 2 < argc) {
+      sleep_sec = atoi(argv[optind + 2]);
+   }
+   sleep(sleep_sec);
+
+   RUN_TEST(share_text_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
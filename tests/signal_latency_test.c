@@ -0,0 +1,260 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Signal handler round trip. All 16 XMM registers survive a handler (and a nested one) that
+ * clobbers them, and the handler sees them in ucontext fpregs. Changes the handler makes to the
+ * general registers in ucontext take effect. Then the cost of a signal sent to self, and the
+ * latency of one sent to a thread spinning in user code, as with safepoints and preemption signals.
+ *
+ * Usage: signal_latency_test [GREATEST options] [-- <signals>]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int nsignals = 10000;
+
+static uint64_t xmm_in[16][2], xmm_out[16][2];
+static volatile int fpregs_ok, nested_calls;
+
+static void clobber_xmm(void)
+{
+   asm volatile("pcmpeqd %%xmm0, %%xmm0\n\t"
+                "pcmpeqd %%xmm7, %%xmm7\n\t"
+                "pcmpeqd %%xmm8, %%xmm8\n\t"
+                "pcmpeqd %%xmm15, %%xmm15\n\t"
+                "xorps %%xmm1, %%xmm1\n\t"
+                "xorps %%xmm9, %%xmm9" ::
+                    : "xmm0", "xmm1", "xmm7", "xmm8", "xmm9", "xmm15");
+}
+
+static void fp_handler(int signo, siginfo_t* info, void* ucv)
+{
+   ucontext_t* uc = ucv;
+
+   // what was interrupted is in fpregs, if the kernel (or km) gives us that
+   if (signo == SIGUSR1 && uc->uc_mcontext.fpregs != NULL) {
+      fpregs_ok = memcmp(uc->uc_mcontext.fpregs->_xmm, xmm_in, sizeof(xmm_in)) == 0;
+   }
+   clobber_xmm();
+   if (signo == SIGUSR1) {
+      raise(SIGUSR2);   // nested, clobbers again
+   } else {
+      nested_calls++;
+   }
+   clobber_xmm();
+}
+
+// Load all XMM registers, send ourselves 'signo' with a raw syscall, then save the XMM registers
+static void signal_with_xmm(int signo)
+{
+   asm volatile("movdqu 0x00(%1), %%xmm0\n\t"
+                "movdqu 0x10(%1), %%xmm1\n\t"
+                "movdqu 0x20(%1), %%xmm2\n\t"
+                "movdqu 0x30(%1), %%xmm3\n\t"
+                "movdqu 0x40(%1), %%xmm4\n\t"
+                "movdqu 0x50(%1), %%xmm5\n\t"
+                "movdqu 0x60(%1), %%xmm6\n\t"
+                "movdqu 0x70(%1), %%xmm7\n\t"
+                "movdqu 0x80(%1), %%xmm8\n\t"
+                "movdqu 0x90(%1), %%xmm9\n\t"
+                "movdqu 0xa0(%1), %%xmm10\n\t"
+                "movdqu 0xb0(%1), %%xmm11\n\t"
+                "movdqu 0xc0(%1), %%xmm12\n\t"
+                "movdqu 0xd0(%1), %%xmm13\n\t"
+                "movdqu 0xe0(%1), %%xmm14\n\t"
+                "movdqu 0xf0(%1), %%xmm15\n\t"
+                "syscall\n\t"
+                "movdqu %%xmm0, 0x00(%2)\n\t"
+                "movdqu %%xmm1, 0x10(%2)\n\t"
+                "movdqu %%xmm2, 0x20(%2)\n\t"
+                "movdqu %%xmm3, 0x30(%2)\n\t"
+                "movdqu %%xmm4, 0x40(%2)\n\t"
+                "movdqu %%xmm5, 0x50(%2)\n\t"
+                "movdqu %%xmm6, 0x60(%2)\n\t"
+                "movdqu %%xmm7, 0x70(%2)\n\t"
+                "movdqu %%xmm8, 0x80(%2)\n\t"
+                "movdqu %%xmm9, 0x90(%2)\n\t"
+                "movdqu %%xmm10, 0xa0(%2)\n\t"
+                "movdqu %%xmm11, 0xb0(%2)\n\t"
+                "movdqu %%xmm12, 0xc0(%2)\n\t"
+                "movdqu %%xmm13, 0xd0(%2)\n\t"
+                "movdqu %%xmm14, 0xe0(%2)\n\t"
+                "movdqu %%xmm15, 0xf0(%2)"
+                :
+                : "a"(SYS_tgkill), "r"(xmm_in), "r"(xmm_out), "D"(getpid()),
+                  "S"(syscall(SYS_gettid)), "d"(signo)
+                : "rcx", "r11", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+                  "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14",
+                  "xmm15");
+}
+
+TEST fp_restore_test()
+{
+   struct sigaction sa = {.sa_sigaction = fp_handler, .sa_flags = SA_SIGINFO};
+
+   ASSERT_EQ(0, sigaction(SIGUSR1, &sa, NULL));
+   ASSERT_EQ(0, sigaction(SIGUSR2, &sa, NULL));
+   for (int i = 0; i < 16; i++) {
+      xmm_in[i][0] = 0x0123456789abcdefULL * (i + 1);
+      xmm_in[i][1] = 0xfedcba9876543210ULL ^ i;
+   }
+   signal_with_xmm(SIGUSR1);
+   ASSERT_EQ(1, nested_calls);
+   ASSERT_EQ(0, memcmp(xmm_in, xmm_out, sizeof(xmm_in)));
+   ASSERT_EQ(1, fpregs_ok);
+   signal(SIGUSR1, SIG_DFL);
+   signal(SIGUSR2, SIG_DFL);
+   PASS();
+}
+
+#define GREGS_MAGIC 0x5ca1ab1e0ddba11UL
+
+static void gregs_handler(int signo, siginfo_t* info, void* ucv)
+{
+   ucontext_t* uc = ucv;
+
+   uc->uc_mcontext.gregs[REG_R12] = GREGS_MAGIC;
+}
+
+// Changes the handler makes to the general registers in the ucontext take effect on return
+TEST gregs_restore_test()
+{
+   struct sigaction sa = {.sa_sigaction = gregs_handler, .sa_flags = SA_SIGINFO};
+   register uint64_t r12 asm("r12") = 0;
+
+   ASSERT_EQ(0, sigaction(SIGUSR1, &sa, NULL));
+   asm volatile("syscall"
+                : "+r"(r12)
+                : "a"(SYS_tgkill), "D"(getpid()), "S"(syscall(SYS_gettid)), "d"(SIGUSR1)
+                : "rcx", "r11", "memory");
+   ASSERT_EQ_FMT(GREGS_MAGIC, r12, "0x%lx");
+   signal(SIGUSR1, SIG_DFL);
+   PASS();
+}
+
+static volatile uint64_t handled;
+
+static void count_handler(int signo)
+{
+   handled++;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+   uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+   return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char* what, uint64_t* v, int cnt)
+{
+   qsort(v, cnt, sizeof(uint64_t), cmp_u64);
+   printf("%s: p50 %ld p90 %ld p99 %ld max %ld ns\n",
+          what,
+          (long)v[cnt / 2],
+          (long)v[cnt * 90 / 100],
+          (long)v[cnt * 99 / 100],
+          (long)v[cnt - 1]);
+}
+
+// raise() and back, the handler runs when the syscall returns
+TEST self_bench_test()
+{
+   uint64_t* lat = calloc(nsignals, sizeof(uint64_t));
+
+   ASSERT_NEQ(NULL, lat);
+   signal(SIGUSR1, count_handler);
+   handled = 0;
+   for (int i = 0; i < nsignals; i++) {
+      uint64_t start = now_nsec();
+      raise(SIGUSR1);
+      lat[i] = now_nsec() - start;
+   }
+   ASSERT_EQ(nsignals, handled);
+   print_percentiles("signal to self round trip", lat, nsignals);
+   signal(SIGUSR1, SIG_DFL);
+   free(lat);
+   PASS();
+}
+
+static volatile int spin_stop;
+
+static void* spin_thread(void* arg)
+{
+   while (spin_stop == 0) {
+      asm volatile("pause");
+   }
+   return NULL;
+}
+
+// pthread_kill() a thread spinning in user code, until its handler has run
+TEST thread_bench_test()
+{
+   uint64_t* lat = calloc(nsignals, sizeof(uint64_t));
+   pthread_t tid;
+
+   ASSERT_NEQ(NULL, lat);
+   signal(SIGUSR1, count_handler);
+   handled = 0;
+   spin_stop = 0;
+   ASSERT_EQ(0, pthread_create(&tid, NULL, spin_thread, NULL));
+   for (int i = 0; i < nsignals; i++) {
+      uint64_t start = now_nsec();
+      ASSERT_EQ(0, pthread_kill(tid, SIGUSR1));
+      while (handled <= i) {
+         sched_yield();
+      }
+      lat[i] = now_nsec() - start;
+   }
+   spin_stop = 1;
+   ASSERT_EQ(0, pthread_join(tid, NULL));
+   print_percentiles("signal to spinning thread", lat, nsignals);
+   signal(SIGUSR1, SIG_DFL);
+   free(lat);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nsignals = bench_arg(argc, argv, 1, nsignals);
+   bench_usage(nsignals <= 0, argv, "<signals>");
+
+   RUN_TEST(fp_restore_test);
+   RUN_TEST(gregs_restore_test);
+   RUN_TEST(self_bench_test);
+   RUN_TEST(thread_bench_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
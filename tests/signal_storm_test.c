@@ -0,0 +1,196 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Signal storms. A process directed signal has to reach a thread spinning in user code when all
+ * others block it. Then the cost of kill() to the process and of pthread_kill() to one thread,
+ * sent back to back while worker threads spin, and how the process directed ones spread over the
+ * workers. Signals coalesce while pending, the last one of a storm must still get handled.
+ *
+ * Usage: signal_storm_test [GREATEST options] [-- <signals>]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+#define NWORKERS 4
+
+static int nsignals = 100000;
+
+static volatile uint64_t handled;
+static __thread uint64_t handled_here;
+
+static void count_handler(int signo)
+{
+   __atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+   handled_here++;
+}
+
+// Wait up to 5 seconds for handled to go past 'was'
+static int handled_after(uint64_t was)
+{
+   struct timespec _1ms = {0, 1000000};
+
+   for (int i = 0; i < 5000; i++) {
+      if (__atomic_load_n(&handled, __ATOMIC_SEQ_CST) > was) {
+         return 1;
+      }
+      nanosleep(&_1ms, NULL);
+   }
+   return 0;
+}
+
+static volatile int stop;
+static uint64_t worker_handled[NWORKERS];
+
+static void* worker(void* arg)
+{
+   sigset_t set;
+
+   handled_here = 0;
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+   while (stop == 0) {
+      asm volatile("pause");
+   }
+   worker_handled[(long)arg] = handled_here;
+   return NULL;
+}
+
+static int start_workers(pthread_t* tid, int cnt)
+{
+   sigset_t set;
+
+   // Only the workers take SIGUSR1
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &set, NULL);
+   signal(SIGUSR1, count_handler);
+   handled = 0;
+   stop = 0;
+   for (long i = 0; i < cnt; i++) {
+      if (pthread_create(&tid[i], NULL, worker, (void*)i) != 0) {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+static int stop_workers(pthread_t* tid, int cnt)
+{
+   sigset_t set;
+
+   stop = 1;
+   for (int i = 0; i < cnt; i++) {
+      if (pthread_join(tid[i], NULL) != 0) {
+         return -1;
+      }
+   }
+   signal(SIGUSR1, SIG_DFL);
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+   return 0;
+}
+
+// Nobody but a thread in user code can take the signal
+TEST spinner_only_test()
+{
+   pthread_t tid;
+
+   ASSERT_EQ(0, start_workers(&tid, 1));
+   ASSERT_EQ(0, kill(getpid(), SIGUSR1));
+   ASSERT_EQ(1, handled_after(0));
+   ASSERT_EQ(0, stop_workers(&tid, 1));
+   PASS();
+}
+
+TEST process_storm_test()
+{
+   pthread_t tid[NWORKERS];
+   uint64_t start, elapsed;
+
+   ASSERT_EQ(0, start_workers(tid, NWORKERS));
+   start = now_nsec();
+   for (int i = 0; i < nsignals; i++) {
+      ASSERT_EQ(0, kill(getpid(), SIGUSR1));
+   }
+   elapsed = now_nsec() - start;
+   ASSERT_EQ(1, handled_after(0));
+   uint64_t was = handled;
+   ASSERT_EQ(0, kill(getpid(), SIGUSR1));
+   ASSERT_EQ(1, handled_after(was));
+   ASSERT_EQ(0, stop_workers(tid, NWORKERS));
+   printf("kill() storm: %ld ns per signal, %ld of %d handled, per worker",
+          (long)(elapsed / nsignals),
+          (long)handled,
+          nsignals + 1);
+   for (int i = 0; i < NWORKERS; i++) {
+      printf(" %ld", (long)worker_handled[i]);
+   }
+   printf("\n");
+   PASS();
+}
+
+TEST thread_storm_test()
+{
+   pthread_t tid[NWORKERS];
+   uint64_t start, elapsed;
+
+   ASSERT_EQ(0, start_workers(tid, NWORKERS));
+   start = now_nsec();
+   for (int i = 0; i < nsignals; i++) {
+      ASSERT_EQ(0, pthread_kill(tid[i % NWORKERS], SIGUSR1));
+   }
+   elapsed = now_nsec() - start;
+   ASSERT_EQ(1, handled_after(0));
+   uint64_t was = handled;
+   ASSERT_EQ(0, pthread_kill(tid[0], SIGUSR1));
+   ASSERT_EQ(1, handled_after(was));
+   ASSERT_EQ(0, stop_workers(tid, NWORKERS));
+   printf("pthread_kill() storm: %ld ns per signal, %ld of %d handled\n",
+          (long)(elapsed / nsignals),
+          (long)handled,
+          nsignals + 1);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nsignals = bench_arg(argc, argv, 1, nsignals);
+   bench_usage(nsignals <= 0, argv, "<signals>");
+
+   RUN_TEST(spinner_only_test);
+   RUN_TEST(process_storm_test);
+   RUN_TEST(thread_storm_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * splice/tee/vmsplice, and throughput of a proxy forwarding between two stream sockets with
+ * read/write vs. splice through a pipe.
+ *
+ * Usage: splice_test [GREATEST options] [-- <MB to forward>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+#define MIB (1ul << 20)
+#define CHUNK (64 * 1024)
+
+static size_t total = 256 * MIB;
+
+TEST splice_tee_vmsplice_test()
+{
+   static const char msg[] = "spliced through a pipe";
+   char buf[64];
+   int p1[2], p2[2];
+   char fname[] = "/tmp/splice_testXXXXXX";
+   int fd = mkstemp(fname);
+
+   ASSERT_NEQ(-1, fd);
+   unlink(fname);
+   ASSERT_EQ(0, pipe(p1));
+   ASSERT_EQ(0, pipe(p2));
+
+   struct iovec iov[2] = {{.iov_base = (void*)msg, .iov_len = 8},
+                          {.iov_base = (void*)msg + 8, .iov_len = sizeof(msg) - 8}};
+   ASSERT_EQ(sizeof(msg), vmsplice(p1[1], iov, 2, 0));
+   ASSERT_EQ(sizeof(msg), tee(p1[0], p2[1], sizeof(msg), 0));
+   ASSERT_EQ(sizeof(msg), splice(p1[0], NULL, fd, NULL, sizeof(msg), 0));
+   ASSERT_EQ(sizeof(msg), pread(fd, buf, sizeof(buf), 0));
+   ASSERT_STR_EQ(msg, buf);
+
+   // read the tee'd copy back to guest memory with vmsplice
+   memset(buf, 0, sizeof(buf));
+   struct iovec riov = {.iov_base = buf, .iov_len = sizeof(buf)};
+   ASSERT_EQ(sizeof(msg), vmsplice(p2[0], &riov, 1, 0));
+   ASSERT_STR_EQ(msg, buf);
+
+   // file back into the pipe at an offset
+   loff_t off = 8;
+   ASSERT_EQ(sizeof(msg) - 8, splice(fd, &off, p1[1], NULL, sizeof(msg), 0));
+   ASSERT_EQ(sizeof(msg), off);
+   ASSERT_EQ(sizeof(msg) - 8, read(p1[0], buf, sizeof(buf)));
+   ASSERT_STR_EQ(msg + 8, buf);
+
+   // wrong pipe ends, offsets on pipes, no pipe at all, bad fds and addresses
+   ASSERT_EQ(-1, splice(fd, NULL, p1[0], NULL, 1, 0));
+   ASSERT_EQ(EBADF, errno);
+   ASSERT_EQ(-1, splice(p1[1], NULL, fd, NULL, 1, 0));
+   ASSERT_EQ(EBADF, errno);
+   off = 0;
+   ASSERT_EQ(-1, splice(fd, NULL, p1[1], &off, 1, 0));
+   ASSERT_EQ(ESPIPE, errno);
+   ASSERT_EQ(-1, splice(fd, NULL, fd, NULL, 1, 0));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, tee(p1[1], p2[1], 1, 0));
+   ASSERT_EQ(EBADF, errno);
+   ASSERT_EQ(-1, splice(-1, NULL, p1[1], NULL, 1, 0));
+   ASSERT_EQ(EBADF, errno);
+   ASSERT_EQ(-1, splice(fd, (void*)-1, p1[1], NULL, 1, 0));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(-1, vmsplice(p1[1], (void*)-1, 1, 0));
+   ASSERT_EQ(EFAULT, errno);
+
+   close(p1[0]);
+   close(p1[1]);
+   close(p2[0]);
+   close(p2[1]);
+   close(fd);
+   PASS();
+}
+
+static void* producer(void* arg)
+{
+   static char buf[CHUNK];
+   int fd = (intptr_t)arg;
+
+   memset(buf, 'k', sizeof(buf));
+   for (size_t done = 0; done < total;) {
+      ssize_t rc = write(fd, buf, MIN(sizeof(buf), total - done));
+      if (rc <= 0) {
+         break;
+      }
+      done += rc;
+   }
+   return NULL;
+}
+
+static void* consumer(void* arg)
+{
+   static char buf[CHUNK];
+   int fd = (intptr_t)arg;
+   size_t done = 0;
+   ssize_t rc;
+
+   while (done < total && (rc = read(fd, buf, sizeof(buf))) > 0) {
+      done += rc;
+   }
+   return (void*)done;
+}
+
+/*
+ * producer -> src[0] ... src[1] -> proxy -> dst[0] ... dst[1] -> consumer
+ * Returns nsec it took to forward 'total' bytes, 0 on error.
+ */
+static uint64_t proxy_run(int use_splice)
+{
+   static char buf[CHUNK];
+   int src[2], dst[2], p[2];
+   pthread_t prod, cons;
+   struct timespec start, end;
+   size_t done = 0;
+   void* received;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, src) != 0 ||
+       socketpair(AF_UNIX, SOCK_STREAM, 0, dst) != 0 || pipe(p) != 0) {
+      return 0;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   pthread_create(&prod, NULL, producer, (void*)(intptr_t)src[0]);
+   pthread_create(&cons, NULL, consumer, (void*)(intptr_t)dst[1]);
+   while (done < total) {
+      ssize_t rc;
+
+      if (use_splice != 0) {
+         if ((rc = splice(src[1], NULL, p[1], NULL, CHUNK, SPLICE_F_MOVE)) <= 0) {
+            break;
+         }
+         for (ssize_t out = 0, n; out < rc; out += n) {
+            if ((n = splice(p[0], NULL, dst[0], NULL, rc - out, SPLICE_F_MOVE)) <= 0) {
+               return 0;
+            }
+         }
+      } else {
+         if ((rc = read(src[1], buf, sizeof(buf))) <= 0) {
+            break;
+         }
+         for (ssize_t out = 0, n; out < rc; out += n) {
+            if ((n = write(dst[0], buf + out, rc - out)) <= 0) {
+               return 0;
+            }
+         }
+      }
+      done += rc;
+   }
+   pthread_join(prod, NULL);
+   pthread_join(cons, &received);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   for (int i = 0; i < 2; i++) {
+      close(src[i]);
+      close(dst[i]);
+      close(p[i]);
+   }
+   return (size_t)received == total ? ts_nsec(&end) - ts_nsec(&start) : 0;
+}
+
+TEST proxy_throughput_test()
+{
+   uint64_t rw = proxy_run(0);
+   ASSERT_NEQ(0, rw);
+   uint64_t sp = proxy_run(1);
+   ASSERT_NEQ(0, sp);
+   printf("proxy read/write: %ld MB/s\n", (long)(total * NSEC_PER_SEC / MIB / rw));
+   printf("proxy splice: %ld MB/s\n", (long)(total * NSEC_PER_SEC / MIB / sp));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   total = bench_arg(argc, argv, 1, total / MIB) * MIB;
+   bench_usage(total == 0, argv, "<MB to forward>");
+
+   RUN_TEST(splice_tee_vmsplice_test);
+   RUN_TEST(proxy_throughput_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Thread creation scalability. Start <threads> threads that all stay alive until the last one is
+ * created, timing the creation. All of them have to start. Under km each live thread takes a vcpu,
+ * so this fails past the vcpu limit of the host KVM until guest threads are multiplexed on vcpus.
+ * Then the cost of create+join of one thread at a time, which reuses parked vcpus.
+ *
+ * Usage: thread_scale_test [GREATEST options] [-- <threads>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+static int nthreads = 10000;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static int release;
+
+static void* wait_thread(void* arg)
+{
+   pthread_mutex_lock(&mtx);
+   while (release == 0) {
+      pthread_cond_wait(&cv, &mtx);
+   }
+   pthread_mutex_unlock(&mtx);
+   return arg;
+}
+
+static void* noop_thread(void* arg)
+{
+   return arg;
+}
+
+TEST create_many_test()
+{
+   pthread_t* tids = calloc(nthreads, sizeof(pthread_t));
+   struct timespec start, end;
+   pthread_attr_t attr;
+   int created, rc = 0;
+
+   ASSERT_NEQ(NULL, tids);
+   pthread_attr_init(&attr);
+   pthread_attr_setstacksize(&attr, 64 * 1024);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (created = 0; created < nthreads; created++) {
+      if ((rc = pthread_create(&tids[created], &attr, wait_thread, NULL)) != 0) {
+         break;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   pthread_attr_destroy(&attr);
+
+   pthread_mutex_lock(&mtx);
+   release = 1;
+   pthread_cond_broadcast(&cv);
+   pthread_mutex_unlock(&mtx);
+   for (int i = 0; i < created; i++) {
+      ASSERT_EQ(0, pthread_join(tids[i], NULL));
+   }
+   free(tids);
+
+   ASSERT(created > 0);
+   printf("threads: %d of %d created, %ld ns/thread%s\n",
+          created,
+          nthreads,
+          (long)((ts_nsec(&end) - ts_nsec(&start)) / created),
+          rc != 0 ? ", stopped by EAGAIN" : "");
+   ASSERT_EQ_FMT(0, rc, "%d");
+   ASSERT_EQ_FMT(nthreads, created, "%d");
+   PASS();
+}
+
+TEST create_join_test()
+{
+   struct timespec start, end;
+   pthread_t tid;
+   int count = nthreads < 1000 ? nthreads : 1000;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < count; i++) {
+      ASSERT_EQ(0, pthread_create(&tid, NULL, noop_thread, NULL));
+      ASSERT_EQ(0, pthread_join(tid, NULL));
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   printf("thread create+join: %ld ns\n", (long)((ts_nsec(&end) - ts_nsec(&start)) / count));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   nthreads = bench_arg(argc, argv, 1, nthreads);
+   bench_usage(nthreads <= 0, argv, "<threads>");
+
+   RUN_TEST(create_many_test);
+   RUN_TEST(create_join_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * timerfd and signalfd, on their own, dup'ed and as event sources in epoll.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "greatest/greatest.h"
+
+TEST timerfd_test()
+{
+   struct itimerspec its = {.it_value = {.tv_nsec = 10 * 1000 * 1000},
+                            .it_interval = {.tv_nsec = 10 * 1000 * 1000}};
+   struct itimerspec cur;
+   uint64_t ticks;
+   int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+   ASSERT_NEQ(-1, fd);
+   ASSERT_EQ(-1, read(fd, &ticks, sizeof(ticks)));
+   ASSERT_EQ(EAGAIN, errno);
+   ASSERT_EQ(0, timerfd_gettime(fd, &cur));
+   ASSERT_EQ(0, cur.it_value.tv_sec + cur.it_value.tv_nsec);
+
+   ASSERT_EQ(0, timerfd_settime(fd, 0, &its, NULL));
+   ASSERT_EQ(0, timerfd_gettime(fd, &cur));
+   ASSERT_EQ(its.it_interval.tv_nsec, cur.it_interval.tv_nsec);
+
+   struct pollfd pfd = {.fd = fd, .events = POLLIN};
+   ASSERT_EQ(1, poll(&pfd, 1, 1000));
+   usleep(30 * 1000);
+   ASSERT_EQ(sizeof(ticks), read(fd, &ticks, sizeof(ticks)));
+   ASSERT(ticks >= 2);
+
+   // disarm
+   struct itimerspec old;
+   memset(&its, 0, sizeof(its));
+   ASSERT_EQ(0, timerfd_settime(fd, 0, &its, &old));
+   ASSERT_EQ(10 * 1000 * 1000, old.it_interval.tv_nsec);
+   ASSERT_EQ(0, poll(&pfd, 1, 30));
+
+   ASSERT_EQ(-1, timerfd_settime(fd, 0, (void*)-1, NULL));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(-1, timerfd_gettime(-1, &cur));
+   ASSERT_EQ(EBADF, errno);
+   close(fd);
+   PASS();
+}
+
+TEST signalfd_test()
+{
+   struct signalfd_siginfo ssi[4];
+   sigset_t mask, oldmask;
+   int fd;
+
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGUSR1);
+   ASSERT_EQ(0, sigprocmask(SIG_BLOCK, &mask, &oldmask));
+   ASSERT_NEQ(-1, fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+   ASSERT_EQ(-1, read(fd, ssi, sizeof(ssi)));
+   ASSERT_EQ(EAGAIN, errno);
+   ASSERT_EQ(-1, read(fd, ssi, sizeof(ssi[0]) - 1));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, write(fd, ssi, sizeof(ssi[0])));
+   ASSERT_EQ(EINVAL, errno);
+
+   struct pollfd pfd = {.fd = fd, .events = POLLIN};
+   ASSERT_EQ(0, poll(&pfd, 1, 0));
+   ASSERT_EQ(0, kill(getpid(), SIGUSR1));
+   ASSERT_EQ(1, poll(&pfd, 1, 1000));
+   ASSERT_EQ(sizeof(ssi[0]), read(fd, ssi, sizeof(ssi)));
+   ASSERT_EQ(SIGUSR1, ssi[0].ssi_signo);
+   ASSERT_EQ(SI_USER, ssi[0].ssi_code);
+   // consumed, not readable any more and not delivered when unblocked
+   ASSERT_EQ(0, poll(&pfd, 1, 0));
+
+   // add SIGUSR2 to the mask, it was already pending
+   sigaddset(&mask, SIGUSR2);
+   ASSERT_EQ(0, sigprocmask(SIG_BLOCK, &mask, NULL));
+   ASSERT_EQ(0, raise(SIGUSR2));
+   ASSERT_EQ(fd, signalfd(fd, &mask, 0));
+   ASSERT_EQ(1, poll(&pfd, 1, 1000));
+   ASSERT_EQ(sizeof(ssi[0]), read(fd, ssi, sizeof(ssi)));
+   ASSERT_EQ(SIGUSR2, ssi[0].ssi_signo);
+
+   ASSERT_EQ(-1, signalfd(0, &mask, 0));
+   ASSERT_EQ(EINVAL, errno);
+   close(fd);
+   ASSERT_EQ(0, sigprocmask(SIG_SETMASK, &oldmask, NULL));
+   PASS();
+}
+
+// dups share the timer and the signalfd mask, and keep working when the original is closed
+TEST dup_test()
+{
+   struct itimerspec its = {.it_value = {.tv_sec = 10}, .it_interval = {.tv_sec = 5}};
+   struct itimerspec cur;
+   struct signalfd_siginfo ssi;
+   sigset_t mask, oldmask;
+   int tfd, sfd, sfd2, sfd3;
+
+   ASSERT_NEQ(-1, tfd = timerfd_create(CLOCK_MONOTONIC, 0));
+   ASSERT_EQ(0, timerfd_settime(tfd, 0, &its, NULL));
+   ASSERT_EQ(100, dup3(tfd, 100, O_CLOEXEC));
+   close(tfd);
+   ASSERT_EQ(0, timerfd_gettime(100, &cur));
+   ASSERT_EQ(5, cur.it_interval.tv_sec);
+   close(100);
+
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGUSR1);
+   ASSERT_EQ(0, sigprocmask(SIG_BLOCK, &mask, &oldmask));
+   ASSERT_NEQ(-1, sfd = signalfd(-1, &mask, SFD_NONBLOCK));
+   ASSERT_NEQ(-1, sfd2 = dup(sfd));
+   ASSERT_NEQ(-1, sfd3 = fcntl(sfd, F_DUPFD, 50));
+   ASSERT_EQ(101, dup2(sfd, 101));
+   close(sfd);
+
+   ASSERT_EQ(0, kill(getpid(), SIGUSR1));
+   struct pollfd pfd = {.fd = sfd3, .events = POLLIN};
+   ASSERT_EQ(1, poll(&pfd, 1, 1000));
+   ASSERT_EQ(sizeof(ssi), read(101, &ssi, sizeof(ssi)));
+   ASSERT_EQ(SIGUSR1, ssi.ssi_signo);
+
+   // new mask set through one dup applies to the others
+   sigaddset(&mask, SIGUSR2);
+   ASSERT_EQ(0, sigprocmask(SIG_BLOCK, &mask, NULL));
+   ASSERT_EQ(sfd2, signalfd(sfd2, &mask, 0));
+   ASSERT_EQ(0, raise(SIGUSR2));
+   ASSERT_EQ(sizeof(ssi), read(sfd3, &ssi, sizeof(ssi)));
+   ASSERT_EQ(SIGUSR2, ssi.ssi_signo);
+   ASSERT_EQ(-1, read(101, &ssi, sizeof(ssi)));
+   ASSERT_EQ(EAGAIN, errno);
+
+   close(sfd2);
+   close(sfd3);
+   close(101);
+   ASSERT_EQ(0, sigprocmask(SIG_SETMASK, &oldmask, NULL));
+   PASS();
+}
+
+static void* sender(void* arg)
+{
+   usleep(20 * 1000);
+   kill(getpid(), SIGUSR1);
+   return NULL;
+}
+
+TEST blocking_read_test()
+{
+   struct signalfd_siginfo ssi;
+   sigset_t mask, oldmask;
+   pthread_t thr;
+   int fd;
+
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGUSR1);
+   ASSERT_EQ(0, pthread_sigmask(SIG_BLOCK, &mask, &oldmask));
+   ASSERT_NEQ(-1, fd = signalfd(-1, &mask, SFD_CLOEXEC));
+   ASSERT_EQ(0, pthread_create(&thr, NULL, sender, NULL));
+   ASSERT_EQ(sizeof(ssi), read(fd, &ssi, sizeof(ssi)));
+   ASSERT_EQ(SIGUSR1, ssi.ssi_signo);
+   pthread_join(thr, NULL);
+   close(fd);
+   ASSERT_EQ(0, pthread_sigmask(SIG_SETMASK, &oldmask, NULL));
+   PASS();
+}
+
+// event loop: one epoll fd waiting on a timer and on signals
+TEST epoll_loop_test()
+{
+   struct itimerspec its = {.it_value = {.tv_nsec = 5 * 1000 * 1000},
+                            .it_interval = {.tv_nsec = 5 * 1000 * 1000}};
+   struct epoll_event ev;
+   sigset_t mask, oldmask;
+   int timer_events = 0, signal_events = 0;
+
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGUSR1);
+   ASSERT_EQ(0, sigprocmask(SIG_BLOCK, &mask, &oldmask));
+   int epfd = epoll_create1(EPOLL_CLOEXEC);
+   int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+   ASSERT(epfd >= 0 && tfd >= 0 && sfd >= 0);
+   ev = (struct epoll_event){.events = EPOLLIN, .data.fd = tfd};
+   ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev));
+   ev = (struct epoll_event){.events = EPOLLIN, .data.fd = sfd};
+   ASSERT_EQ(0, epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev));
+   ASSERT_EQ(0, timerfd_settime(tfd, 0, &its, NULL));
+
+   while (timer_events < 10) {
+      int rc = epoll_wait(epfd, &ev, 1, 1000);
+      ASSERT_EQ(1, rc);
+      if (ev.data.fd == tfd) {
+         uint64_t ticks;
+         ASSERT_EQ(sizeof(ticks), read(tfd, &ticks, sizeof(ticks)));
+         if (++timer_events % 3 == 0) {
+            kill(getpid(), SIGUSR1);
+         }
+      } else {
+         struct signalfd_siginfo ssi;
+         ASSERT_EQ(sfd, ev.data.fd);
+         ASSERT_EQ(sizeof(ssi), read(sfd, &ssi, sizeof(ssi)));
+         ASSERT_EQ(SIGUSR1, ssi.ssi_signo);
+         signal_events++;
+      }
+   }
+   ASSERT_EQ(3, signal_events);
+   close(tfd);
+   close(sfd);
+   close(epfd);
+   ASSERT_EQ(0, sigprocmask(SIG_SETMASK, &oldmask, NULL));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   RUN_TEST(timerfd_test);
+   RUN_TEST(signalfd_test);
+   RUN_TEST(dup_test);
+   RUN_TEST(blocking_read_test);
+   RUN_TEST(epoll_loop_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * sendmmsg/recvmmsg on UDP loopback sockets, and UDP packet rate with one message per syscall vs.
+ * batches.
+ *
+ * Usage: udp_mmsg_test [GREATEST options] [-- <packets> [batch size]]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+
+#define PKT_SIZE 64
+#define MAX_BATCH 256
+
+static long packets = 200000;
+static int batch = 32;
+static int rx_fd, tx_fd;
+
+static int udp_socket(struct sockaddr_in* addr)
+{
+   socklen_t len = sizeof(*addr);
+   int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+   memset(addr, 0, sizeof(*addr));
+   addr->sin_family = AF_INET;
+   addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (fd < 0 || bind(fd, (struct sockaddr*)addr, sizeof(*addr)) != 0 ||
+       getsockname(fd, (struct sockaddr*)addr, &len) != 0) {
+      return -1;
+   }
+   return fd;
+}
+
+TEST mmsg_test()
+{
+   enum { NMSG = 8 };
+   char hdr[NMSG][8], body[NMSG][16], rbuf[NMSG][32];
+   struct iovec tx_iov[NMSG][2], rx_iov[NMSG];
+   struct mmsghdr tx[NMSG], rx[NMSG];
+   struct sockaddr_in from[NMSG];
+
+   memset(tx, 0, sizeof(tx));
+   memset(rx, 0, sizeof(rx));
+   for (int i = 0; i < NMSG; i++) {
+      snprintf(hdr[i], sizeof(hdr[i]), "msg%d:", i);
+      snprintf(body[i], sizeof(body[i]), "payload %d", i * 11);
+      tx_iov[i][0] = (struct iovec){.iov_base = hdr[i], .iov_len = strlen(hdr[i])};
+      tx_iov[i][1] = (struct iovec){.iov_base = body[i], .iov_len = strlen(body[i]) + 1};
+      tx[i].msg_hdr.msg_iov = tx_iov[i];
+      tx[i].msg_hdr.msg_iovlen = 2;
+      rx_iov[i] = (struct iovec){.iov_base = rbuf[i], .iov_len = sizeof(rbuf[i])};
+      rx[i].msg_hdr.msg_iov = &rx_iov[i];
+      rx[i].msg_hdr.msg_iovlen = 1;
+      rx[i].msg_hdr.msg_name = &from[i];
+      rx[i].msg_hdr.msg_namelen = sizeof(from[i]);
+   }
+   ASSERT_EQ(NMSG, sendmmsg(tx_fd, tx, NMSG, 0));
+   for (int i = 0; i < NMSG; i++) {
+      ASSERT_EQ(tx_iov[i][0].iov_len + tx_iov[i][1].iov_len, tx[i].msg_len);
+   }
+
+   int got = 0;
+   while (got < NMSG) {
+      int rc = recvmmsg(rx_fd, rx + got, NMSG - got, MSG_WAITFORONE, NULL);
+      ASSERT_NEQ_FMT(-1, rc, "%d");
+      got += rc;
+   }
+   for (int i = 0; i < NMSG; i++) {
+      char expected[32];
+      snprintf(expected, sizeof(expected), "%s%s", hdr[i], body[i]);
+      ASSERT_EQ(strlen(expected) + 1, rx[i].msg_len);
+      ASSERT_STR_EQ(expected, rbuf[i]);
+      ASSERT_EQ(sizeof(from[i]), rx[i].msg_hdr.msg_namelen);
+   }
+
+   // nothing left, don't block
+   ASSERT_EQ(-1, recvmmsg(rx_fd, rx, NMSG, MSG_DONTWAIT, NULL));
+   ASSERT_EQ(EAGAIN, errno);
+   ASSERT_EQ(-1, sendmmsg(tx_fd, (void*)-1, NMSG, 0));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(-1, sendmmsg(-1, tx, NMSG, 0));
+   ASSERT_EQ(EBADF, errno);
+
+   // what is left of the timeout comes back
+   struct timespec timeout = {.tv_sec = 1};
+   ASSERT_EQ(1, sendmmsg(tx_fd, tx, 1, 0));
+   ASSERT_EQ(1, recvmmsg(rx_fd, rx, NMSG, MSG_WAITFORONE, &timeout));
+   ASSERT_EQ(0, timeout.tv_sec);
+   ASSERT(timeout.tv_nsec > 0);
+   PASS();
+}
+
+TEST packet_rate_test()
+{
+   static char buf[MAX_BATCH][PKT_SIZE];
+   static struct iovec iov[MAX_BATCH];
+   static struct mmsghdr msgs[MAX_BATCH];
+   struct timespec start, end;
+
+   memset(msgs, 0, sizeof(msgs));
+   for (int i = 0; i < batch; i++) {
+      iov[i] = (struct iovec){.iov_base = buf[i], .iov_len = PKT_SIZE};
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   // one message per syscall. Batches are received before sending more so nothing is dropped.
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long n = 0; n < packets; n += batch) {
+      for (int i = 0; i < batch; i++) {
+         ASSERT_EQ(PKT_SIZE, sendmsg(tx_fd, &msgs[i].msg_hdr, 0));
+      }
+      for (int i = 0; i < batch; i++) {
+         ASSERT_EQ(PKT_SIZE, recvmsg(rx_fd, &msgs[i].msg_hdr, 0));
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   uint64_t single = ts_nsec(&end) - ts_nsec(&start);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (long n = 0; n < packets; n += batch) {
+      ASSERT_EQ(batch, sendmmsg(tx_fd, msgs, batch, 0));
+      for (int got = 0; got < batch;) {
+         int rc = recvmmsg(rx_fd, msgs + got, batch - got, MSG_WAITFORONE, NULL);
+         ASSERT_NEQ_FMT(-1, rc, "%d");
+         got += rc;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   uint64_t batched = ts_nsec(&end) - ts_nsec(&start);
+
+   printf("sendmsg/recvmsg: %ld pps\n", (long)(packets * NSEC_PER_SEC / single));
+   printf("sendmmsg/recvmmsg batch %d: %ld pps\n", batch, (long)(packets * NSEC_PER_SEC / batched));
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   struct sockaddr_in rx_addr, tx_addr;
+
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   packets = bench_arg(argc, argv, 1, packets);
+   batch = bench_arg(argc, argv, 2, batch);
+   bench_usage(packets <= 0 || batch <= 0 || batch > MAX_BATCH,
+               argv,
+               "<packets> [batch (<= %d)]",
+               MAX_BATCH);
+   if ((rx_fd = udp_socket(&rx_addr)) < 0 || (tx_fd = udp_socket(&tx_addr)) < 0 ||
+       connect(tx_fd, (struct sockaddr*)&rx_addr, sizeof(rx_addr)) != 0) {
+      perror("udp socket setup");
+      exit(1);
+   }
+
+   RUN_TEST(mmsg_test);
+   RUN_TEST(packet_rate_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright 2022 Kontain Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * readv/writev/preadv/pwritev with up to IOV_MAX iovecs, bad counts and unmapped buffers. read,
+ * write, send and recv on buffers that span mmaps, run into unmapped memory or lack protection.
+ * Then writev throughput to /dev/null with 16 and IOV_MAX iovecs per call, and the cost of a small
+ * write from .bss and from an mmap buffer.
+ *
+ * Usage: writev_test [GREATEST options] [-- <calls per size>]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "bench_test.h"
+#include "greatest/greatest.h"
+#include "mmap_test.h"
+
+static int ncalls = 10000;
+static struct iovec iov[IOV_MAX + 1];
+static char data[IOV_MAX * 64];
+
+TEST rwv_test()
+{
+   char tmpl[] = "/tmp/writev_testXXXXXX";
+   char back[IOV_MAX * 64];
+   int fd = mkstemp(tmpl);
+
+   ASSERT(fd >= 0);
+   unlink(tmpl);
+   for (int i = 0; i < sizeof(data); i++) {
+      data[i] = i * 7;
+   }
+   // IOV_MAX iovecs of 64 bytes, read back with half as many of 128
+   for (int i = 0; i < IOV_MAX; i++) {
+      iov[i] = (struct iovec){.iov_base = data + i * 64, .iov_len = 64};
+   }
+   ASSERT_EQ(sizeof(data), writev(fd, iov, IOV_MAX));
+   for (int i = 0; i < IOV_MAX / 2; i++) {
+      iov[i] = (struct iovec){.iov_base = back + i * 128, .iov_len = 128};
+   }
+   ASSERT_EQ(sizeof(back), preadv(fd, iov, IOV_MAX / 2, 0));
+   ASSERT_EQ(0, memcmp(data, back, sizeof(data)));
+
+   iov[0] = (struct iovec){.iov_base = data, .iov_len = 100};
+   iov[1] = (struct iovec){.iov_base = NULL, .iov_len = 0};   // empty ones aren't looked at
+   iov[2] = (struct iovec){.iov_base = data + 100, .iov_len = 28};
+   ASSERT_EQ(128, pwritev(fd, iov, 3, 4096));
+   ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+   iov[0] = (struct iovec){.iov_base = back, .iov_len = sizeof(back)};
+   ASSERT_EQ(sizeof(back), readv(fd, iov, 1));
+   ASSERT_EQ(0, memcmp(data, back, sizeof(data)));
+
+   // counts
+   ASSERT_EQ(0, writev(fd, NULL, 0));
+   ASSERT_EQ(-1, writev(fd, iov, IOV_MAX + 1));
+   ASSERT_EQ(EINVAL, errno);
+   ASSERT_EQ(-1, syscall(SYS_writev, fd, iov, -1));
+   ASSERT_EQ(EINVAL, errno);
+
+   // iovec array and buffers that aren't mapped
+   char* m = mmap(NULL, 2 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   ASSERT_NEQ(MAP_FAILED, m);
+   ASSERT_EQ(0, munmap(m + 4096, 4096));
+   iov[0] = (struct iovec){.iov_base = m + 4096, .iov_len = 10};
+   ASSERT_EQ(-1, writev(fd, iov, 1));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(-1, readv(fd, (struct iovec*)(m + 4096), 1));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(0, munmap(m, 4096));
+   close(fd);
+   PASS();
+}
+
+TEST range_test()
+{
+   static const size_t pg = 4096;
+   int p[2];
+
+   ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, p));
+   char* m = mmap(NULL, 3 * pg, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   ASSERT_NEQ(MAP_FAILED, m);
+   memset(m, 'a', 3 * pg);
+
+   // spans two mmap regions with different protection, both good enough
+   ASSERT_EQ(0, mprotect(m + pg, pg, PROT_READ | PROT_WRITE | PROT_EXEC));
+   ASSERT_EQ(2 * pg, write(p[0], m, 2 * pg));
+   ASSERT_EQ(2 * pg, recv(p[1], m + pg / 2, 2 * pg, MSG_WAITALL));
+
+   // read into memory that isn't writable
+   ASSERT_EQ(0, mprotect(m + 2 * pg, pg, PROT_READ));
+   ASSERT_EQ(pg, send(p[0], m, pg, 0));
+   ASSERT_EQ(-1, read(p[1], m + 2 * pg, pg));
+   ASSERT_EQ(EFAULT, errno);
+   ASSERT_EQ(pg, read(p[1], m, pg));
+
+   // runs off the end of the mapping. Linux copies what it can, km refuses upfront.
+   ASSERT_EQ(0, munmap(m + 2 * pg, pg));
+   if (KM_PAYLOAD()) {
+      ASSERT_EQ(-1, write(p[0], m + pg, 2 * pg));
+      ASSERT_EQ(EFAULT, errno);
+      ASSERT_EQ(-1, sendto(p[0], m + 2 * pg - 1, 2, 0, NULL, 0));
+      ASSERT_EQ(EFAULT, errno);
+   }
+   ASSERT_EQ(0, munmap(m, 2 * pg));
+   close(p[0]);
+   close(p[1]);
+   PASS();
+}
+
+// writev() 'cnt' iovecs of 'len' bytes each to /dev/null. Returns nsec per call or 0 on error.
+static uint64_t writev_cost(int fd, int cnt, size_t len)
+{
+   struct timespec start, end;
+
+   for (int i = 0; i < cnt; i++) {
+      iov[i] = (struct iovec){.iov_base = data + (i * len) % sizeof(data), .iov_len = len};
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < ncalls; i++) {
+      if (writev(fd, iov, cnt) != cnt * len) {
+         return 0;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   return (ts_nsec(&end) - ts_nsec(&start)) / ncalls;
+}
+
+TEST writev_bench_test()
+{
+   static const int counts[] = {16, IOV_MAX};
+   int fd = open("/dev/null", O_WRONLY);
+
+   ASSERT(fd >= 0);
+   for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      int cnt = counts[i];
+      uint64_t nsec = writev_cost(fd, cnt, 64);
+      ASSERT_NEQ(0, nsec);
+      printf("writev %d iovecs: %ld ns/call, %ld MB/s\n",
+             cnt,
+             (long)nsec,
+             (long)(cnt * 64 * 1000 / nsec));
+   }
+
+   // write() of 64 bytes from payload .bss and from an mmap
+   char* m = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   ASSERT_NEQ(MAP_FAILED, m);
+   char* bufs[] = {data, m};
+   for (int i = 0; i < 2; i++) {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int j = 0; j < ncalls; j++) {
+         ASSERT_EQ(64, write(fd, bufs[i], 64));
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      printf("write 64 bytes from %s: %ld ns/call\n",
+             i == 0 ? "bss" : "mmap",
+             (long)((ts_nsec(&end) - ts_nsec(&start)) / ncalls));
+   }
+   munmap(m, 4096);
+   close(fd);
+   PASS();
+}
+
+GREATEST_MAIN_DEFS();
+int main(int argc, char** argv)
+{
+   GREATEST_MAIN_BEGIN();
+   greatest_set_verbosity(1);
+
+   ncalls = bench_arg(argc, argv, 1, ncalls);
+   bench_usage(ncalls <= 0, argv, "<calls per size>");
+
+   RUN_TEST(rwv_test);
+   RUN_TEST(range_test);
+   RUN_TEST(writev_bench_test);
+
+   GREATEST_PRINT_REPORT();
+   exit(greatest_info.failed);   // return count of errors (or 0 if all is good)
+}